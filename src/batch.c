@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include "omp.h"
+
+#define MIN(a,b)  (((a)<(b)) ? (a):(b))
+
+/*
+ *  ----------------
+ *  Batched openings of many small images of the same size, such as
+ *  thumbnails. One 128x128 image is too small for the passes: every pass
+ *  starts the thread team for 16K pixels, and a row of 128 pixels barely
+ *  fills the vector units. So the images of a batch are interleaved, pixel
+ *  (row, column) of image k at (row * width + column) * lanes + k, and the
+ *  disc plan runs once on the whole batch through laneMorphology, where the
+ *  images are the lanes of the inner loops. The results are deinterleaved
+ *  back into the images.
+ */
+
+/*
+ * Function:  interleave
+ * --------------------
+ *  copies the pixels of lanes images into (or, with back set, out of) the
+ *  interleaved buffer
+ */
+
+static void interleave(Image **images, int lanes, Pixel *buffer, int back, int threads){
+  int rows = images[0]->height, width = images[0]->width, row, col, k;
+  Pixel *line, *rowOf[MAX_BATCH_LANES];
+  #pragma omp parallel for num_threads(threads) default(none) private(row, col, k, line, rowOf) shared(images, lanes, buffer, back, rows, width) schedule(static)
+  for(row = 0; row < rows; row++){
+    line = buffer + (size_t) row * width * lanes;
+    for(k = 0; k < lanes; k++) rowOf[k] = images[k]->data + (size_t) row * width;
+    // the interleaved side is walked in order, the images are lanes streams
+    for(col = 0; col < width; col++, line += lanes){
+      if( back ){
+        for(k = 0; k < lanes; k++) rowOf[k][col] = line[k];
+      }else{
+        for(k = 0; k < lanes; k++) line[k] = rowOf[k][col];
+      }
+    }
+  }
+}
+
+/*
+ * Function:  batchMorphology
+ * --------------------
+ *  opens or closes images in batches of lanes interleaved images, fewer when
+ *  the memory budget of the context is too small for lanes of them
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int batchMorphology(SedContext *ctx, Image **images, int count, int radius, int lanes, int closing){
+  int first, n, i, status;
+  size_t size, batch;
+  DiscPlan *plan;
+  Pixel *buffer;
+
+  if( lanes == 0 ) lanes = BATCH_LANES;
+  if( count < 0 || lanes < 1 || lanes > MAX_BATCH_LANES ) return SED_ERROR_ARGUMENT;
+  if( count == 0 ) return SED_OK;
+  for(i = 0; i < count; i++)
+    if( images[i]->channels != 1 || images[i]->width != images[0]->width || images[i]->height != images[0]->height )
+      return SED_ERROR_ARGUMENT;
+  status = getDiscPlan(ctx, radius, &plan);
+  if( status != SED_OK || plan->count == 0 ) return status;
+  size = (size_t) images[0]->width * images[0]->height;
+  lanes = budgetLanes(ctx, size, count, lanes);
+  if( lanes == 0 ) return SED_ERROR_MEMORY;
+  if( imageSize(images[0]->width, images[0]->height, MIN(lanes, count), &batch) != SED_OK ) return SED_ERROR_ARGUMENT;
+  // the interleaved images and the workspace of laneMorphology, reused by every batch
+  buffer = contextAlloc(ctx, 4 * batch);
+  if( buffer == NULL ) return SED_ERROR_MEMORY;
+
+  TRACE_BEGIN(span);
+  for(first = 0; status == SED_OK && first < count; first += n){
+    n = MIN(lanes, count - first);
+    interleave(images + first, n, buffer, 0, ctx->threads);
+    status = laneMorphology(ctx, buffer, images[0]->width, images[0]->height, n, plan->parts, plan->count, 1, closing,
+                            buffer + size * n);
+    if( status == SED_OK )
+      status = laneMorphology(ctx, buffer, images[0]->width, images[0]->height, n, plan->parts, plan->count, 1,
+                              !closing, buffer + size * n);
+    if( status == SED_OK ) interleave(images + first, n, buffer, 1, ctx->threads);
+  }
+  TRACE_END(span, closing ? "batch closing" : "batch opening", size * count);
+  contextFree(ctx, buffer);
+  return status;
+}
+
+/*
+ * Function:  batchOpening
+ * --------------------
+ *  opens single channel images of the same size with the disc, lanes of them
+ *  at a time
+ *
+ *  ctx: the context
+ *  images: the images, modified in place
+ *  count: the amount of images
+ *  radius: the radius of the disc
+ *  lanes: images per batch, 1 .. MAX_BATCH_LANES, 0 for BATCH_LANES
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the images differ in size or
+ *  have several channels, or another error code
+ */
+
+int batchOpening(SedContext *ctx, Image **images, int count, int radius, int lanes){
+  return batchMorphology(ctx, images, count, radius, lanes, 0);
+}
+
+/*
+ * Function:  batchClosing
+ * --------------------
+ *  closes images in batches, see batchOpening
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int batchClosing(SedContext *ctx, Image **images, int count, int radius, int lanes){
+  return batchMorphology(ctx, images, count, radius, lanes, 1);
+}
@@ -0,0 +1,11 @@
+#ifndef BATCH
+#define BATCH
+
+#include "image.h"
+
+#define BATCH_LANES 32      /* images per interleaved batch by default */
+#define MAX_BATCH_LANES 64
+
+int batchOpening(struct SedContext*, Image**, int, int, int);
+int batchClosing(struct SedContext*, Image**, int, int, int);
+#endif
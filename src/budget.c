@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "context.h"
+#include "taskgraph.h"
+#include "tile.h"
+#include "trace.h"
+
+#define MAX(a,b)  (((a)>(b)) ? (a):(b))
+#define MIN(a,b)  (((a)<(b)) ? (a):(b))
+
+/*
+ *  ----------------
+ *  Memory budgeted execution. A disc opening of the whole image needs the
+ *  image, the two stage buffers of the task graph and the tile scratch of
+ *  every thread, three times the image and more. With ctx->memoryBudget set
+ *  (in bytes, the image and BUDGET_RESERVE for the program itself included),
+ *  planBudget checks whether that fits and otherwise derives:
+ *    threads     the team of the graph, so that the tile scratch of the
+ *                threads takes at most a quarter of the spare memory
+ *    strip rows  the most rows whose strip, with 2 * reach halo rows above
+ *                and below, fits in the rest, in multiples of GRAPH_TILE
+ *  stripMorphology then runs the strips from top to bottom in place. The
+ *  halo rows above a strip were already overwritten by the previous one, so
+ *  their input is kept in a carry buffer. The halo rows hold the pixels the
+ *  two stages read across the edge of the strip, so the result is the same
+ *  as for the whole image.
+ */
+
+/*
+ * Function:  parseMemorySize
+ * --------------------
+ *  parses a byte count with an optional K, M or G suffix (powers of 1024)
+ *
+ *  returns: SED_OK or SED_ERROR_ARGUMENT when malformed
+ */
+
+int parseMemorySize(char *text, size_t *bytes){
+  char *end;
+  double value = strtod(text, &end), scale = 1;
+  if( end == text || value < 0 ) return SED_ERROR_ARGUMENT;
+  if( *end == 'K' || *end == 'k' ) scale = 1024;
+  else if( *end == 'M' || *end == 'm' ) scale = 1024.0 * 1024;
+  else if( *end == 'G' || *end == 'g' ) scale = 1024.0 * 1024 * 1024;
+  if( scale > 1 ) end++;
+  if( *end != '\0' && strcmp(end, "B") != 0 && (scale == 1 || strcmp(end, "iB") != 0) ) return SED_ERROR_ARGUMENT;
+  *bytes = (size_t) (value * scale);
+  return SED_OK;
+}
+
+/*
+ * Function:  rowBytes
+ * --------------------
+ *  returns: the memory a row of a strip costs: its copy, the two stage
+ *  buffers of the graph and its share of the graph nodes
+ */
+
+static size_t rowBytes(int width, int count){
+  size_t across = (width + GRAPH_TILE - 1) / GRAPH_TILE;
+  return 3 * (size_t) width + (2 * count * across * GRAPH_NODE_BYTES + GRAPH_TILE - 1) / GRAPH_TILE;
+}
+
+/*
+ * Function:  planBudget
+ * --------------------
+ *  fits a disc opening or closing of an image in the memory budget of the
+ *  context
+ *
+ *  ctx: the context, memoryBudget 0 means unlimited
+ *  width: the width of the image
+ *  height: the height of the image
+ *  disc: the plan of the disc
+ *  plan: filled with the threads and strips
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY when not even a strip of a single
+ *  row fits
+ */
+
+int planBudget(SedContext *ctx, int width, int height, DiscPlan *disc, BudgetPlan *plan){
+  size_t size = (size_t) width * height, tile = layerTileScratch(GRAPH_TILE, disc->parts, disc->count);
+  size_t perRow = rowBytes(width, disc->count), carry, spare;
+  long rows;
+
+  plan->threads = ctx->threads;
+  plan->stripRows = height;
+  plan->strips = 1;
+  plan->halo = 2 * discPlanReach(disc);
+  plan->peak = BUDGET_RESERVE + size + perRow * height + ctx->threads * tile;
+  if( ctx->memoryBudget == 0 || plan->peak <= ctx->memoryBudget ) return SED_OK;
+
+  carry = (size_t) plan->halo * width;
+  if( ctx->memoryBudget <= BUDGET_RESERVE + size + carry + tile ) return SED_ERROR_MEMORY;
+  spare = ctx->memoryBudget - BUDGET_RESERVE - size - carry;
+  plan->threads = MAX(1, MIN(ctx->threads, (int) (spare / 4 / MAX(tile, 1))));
+  rows = (long) ((spare - plan->threads * tile) / perRow) - 2 * plan->halo;
+  if( rows < 1 ) return SED_ERROR_MEMORY;
+  if( rows > GRAPH_TILE ) rows = rows / GRAPH_TILE * GRAPH_TILE;
+  plan->stripRows = (int) MIN(rows, height);
+  plan->strips = (height + plan->stripRows - 1) / plan->stripRows;
+  plan->peak = BUDGET_RESERVE + size + carry + perRow * (size_t) MIN(plan->stripRows + 2 * plan->halo, height)
+               + plan->threads * tile;
+  return SED_OK;
+}
+
+/*
+ * Function:  stripMorphology
+ * --------------------
+ *  opens or closes an image in place, strip by strip, as planned by
+ *  planBudget
+ *
+ *  ctx: the context
+ *  im: the single channel image
+ *  disc: the plan of the disc
+ *  closing: 1 for the closing, 0 for the opening
+ *  plan: from planBudget
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+int stripMorphology(SedContext *ctx, Image *im, DiscPlan *disc, int closing, BudgetPlan *plan){
+  int width = im->width, height = im->height, halo = plan->halo, threads = ctx->threads;
+  int first, rows, top, bottom, keep, status = SED_OK;
+  size_t row = (size_t) width;
+  Pixel *strip, *carry;
+  Image view;
+
+  strip = contextAlloc(ctx, (size_t) MIN(plan->stripRows + 2 * halo, height) * row);
+  carry = contextAlloc(ctx, MAX((size_t) halo * row, 1));
+  if( strip == NULL || carry == NULL ){
+    contextFree(ctx, strip);
+    contextFree(ctx, carry);
+    return SED_ERROR_MEMORY;
+  }
+  TRACE_BEGIN(span);
+  ctx->threads = plan->threads;
+  view = imageView(strip, width, height, 1);
+  for(first = 0; status == SED_OK && first < height; first += rows){
+    rows = MIN(plan->stripRows, height - first);
+    top = MIN(halo, first);
+    bottom = MIN(halo, height - first - rows);
+    // carry row i is input row first - halo + i
+    memcpy(strip, carry + (size_t) (halo - top) * row, (size_t) top * row);
+    memcpy(strip + (size_t) top * row, im->data + (size_t) first * row, (size_t) (rows + bottom) * row);
+    keep = MIN(halo, top + rows);
+    memcpy(carry + (size_t) (halo - keep) * row, strip + (size_t) (top + rows - keep) * row, (size_t) keep * row);
+    view.height = top + rows + bottom;
+    if( isSmallImage(ctx, (size_t) width * view.height) )
+      status = serialMorphology(ctx, &view, disc->parts, disc->count, closing);
+    else
+      status = graphMorphology(ctx, &view, disc->parts, disc->count, closing, NULL);
+    memcpy(im->data + (size_t) first * row, strip + (size_t) top * row, (size_t) rows * row);
+  }
+  ctx->threads = threads;
+  TRACE_END(span, "budgeted strips", (size_t) width * height);
+  contextFree(ctx, strip);
+  contextFree(ctx, carry);
+  return status;
+}
+
+/*
+ * Function:  budgetLanes
+ * --------------------
+ *  returns: the images per batch that fit in the memory budget next to the
+ *  count images of size pixels themselves, at most lanes, or 0 when not even
+ *  one fits. A batch of n images takes 4 * n * size bytes of buffers.
+ */
+
+int budgetLanes(SedContext *ctx, size_t size, int count, int lanes){
+  size_t images = BUDGET_RESERVE + size * count;
+  if( ctx->memoryBudget == 0 ) return lanes;
+  if( ctx->memoryBudget <= images ) return 0;
+  return (int) MIN((size_t) lanes, (ctx->memoryBudget - images) / (4 * size));
+}
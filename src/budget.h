@@ -0,0 +1,31 @@
+#ifndef BUDGET
+#define BUDGET
+
+#include <stddef.h>
+#include "image.h"
+
+#define GRAPH_NODE_BYTES 64  /* the dependency arrays per node of a task graph, rounded up */
+#define BUDGET_RESERVE ((size_t) 4 << 20)  /* the program, its libraries and thread stacks */
+
+/*
+ * How a disc opening or closing fits in ctx->memoryBudget, see budget.c:
+ * the image is processed in strips of stripRows rows, each read with halo
+ * extra rows above and below, by a team of threads threads. peak is the
+ * predicted memory, the image included.
+ */
+typedef struct BudgetPlan {
+  int threads;
+  int stripRows;
+  int strips;
+  int halo;
+  size_t peak;
+} BudgetPlan;
+
+struct SedContext;
+struct DiscPlan;
+
+int parseMemorySize(char*, size_t*);
+int planBudget(struct SedContext*, int, int, struct DiscPlan*, BudgetPlan*);
+int stripMorphology(struct SedContext*, Image*, struct DiscPlan*, int, BudgetPlan*);
+int budgetLanes(struct SedContext*, size_t, int, int);
+#endif
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "context.h"
+#include "taskgraph.h"
+#include "trace.h"
+#include "omp.h"
+
+/*
+ * Function:  createContext
+ * --------------------
+ *  allocates a new context that uses malloc/free (alloc and release are NULL
+ *  until setAllocator installs other functions) and the default cost model
+ *
+ *  threads: the amount of threads for the parallel kernels, 0 uses the
+ *    OpenMP default
+ *
+ *  returns: a pointer to the new context or NULL when out of memory
+ */
+
+SedContext *createContext(int threads){
+  SedContext *ctx = calloc(1, sizeof(struct SedContext));
+  if( ctx == NULL ) return NULL;
+  if( setThreads(ctx, threads) != SED_OK ){
+    free(ctx);
+    return NULL;
+  }
+  ctx->model = defaultCostModel();
+  return ctx;
+}
+
+/*
+ * Function:  freeContext
+ * --------------------
+ *  frees the scratch arenas, the cached plans and the context itself
+ *
+ *  ctx: the context to be freed
+ */
+
+void freeContext(SedContext *ctx){
+  int i;
+  if( ctx == NULL ) return;
+  for(i = 0; i < ctx->scratchCount; i++)
+    contextFree(ctx, ctx->scratch[i].data);
+  for(i = 0; i < ctx->planCount; i++)
+    free(ctx->plans[i].parts);
+  free(ctx->scratch);
+  free(ctx->plans);
+  free(ctx->placement.cpus);
+  free(ctx);
+}
+
+/*
+ * Function:  setThreads
+ * --------------------
+ *  sets the amount of threads the kernels use, sizes the scratch arenas and
+ *  pins the threads again when the context has an affinity
+ *
+ *  ctx: the context
+ *  threads: the amount of threads, 0 uses the OpenMP default
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+int setThreads(SedContext *ctx, int threads){
+  Scratch *scratch;
+  if( threads <= 0 ) threads = omp_get_max_threads();
+  if( threads > ctx->scratchCount ){
+    scratch = realloc(ctx->scratch, threads * sizeof(Scratch));
+    if( scratch == NULL ) return SED_ERROR_MEMORY;
+    memset(scratch + ctx->scratchCount, 0, (threads - ctx->scratchCount) * sizeof(Scratch));
+    ctx->scratch = scratch;
+    ctx->scratchCount = threads;
+  }
+  ctx->threads = threads;
+  return applyAffinity(ctx);
+}
+
+/*
+ * Function:  setAllocator
+ * --------------------
+ *  replaces the allocator used for pixel data and scratch buffers. It is
+ *  called from several OpenMP threads at once, so it has to be thread safe.
+ *  Set it before any image is read or allocated with this context.
+ *
+ *  ctx: the context
+ *  alloc: returns a block of at least the requested size or NULL
+ *  release: frees a block returned by alloc
+ *  user: passed to both functions unchanged
+ *
+ *  Passing NULL for alloc and release goes back to malloc/free.
+ */
+
+void setAllocator(SedContext *ctx, SedAllocFunction alloc, SedFreeFunction release, void *user){
+  ctx->alloc = alloc;
+  ctx->release = release;
+  ctx->allocUser = user;
+}
+
+void *contextAlloc(SedContext *ctx, size_t size){
+  if( ctx->alloc == NULL ) return malloc(size);
+  return ctx->alloc(size, ctx->allocUser);
+}
+
+void *contextCalloc(SedContext *ctx, size_t count, size_t size){
+  void *ptr;
+  if( size != 0 && count > ((size_t) -1) / size ) return NULL;
+  ptr = contextAlloc(ctx, count * size);
+  if( ptr != NULL ) memset(ptr, 0, count * size);
+  return ptr;
+}
+
+void contextFree(SedContext *ctx, void *ptr){
+  if( ptr == NULL ) return;
+  if( ctx->release == NULL ) free(ptr);
+  else ctx->release(ptr, ctx->allocUser);
+}
+
+/*
+ * Function:  scratchBuffer
+ * --------------------
+ *  returns the scratch arena of a thread, grown to at least size bytes. The
+ *  contents are not preserved when it grows. Every thread may only ask for
+ *  its own arena.
+ *
+ *  ctx: the context
+ *  thread: the OpenMP thread number
+ *  size: the amount of bytes needed
+ *
+ *  returns: the scratch buffer or NULL when out of memory
+ */
+
+Pixel *scratchBuffer(SedContext *ctx, int thread, size_t size){
+  Scratch *s;
+  if( thread < 0 || thread >= ctx->scratchCount ) return NULL;
+  s = &ctx->scratch[thread];
+  if( s->size < size ){
+    contextFree(ctx, s->data);
+    s->data = contextAlloc(ctx, size);
+    s->size = s->data != NULL ? size : 0;
+  }
+  return s->data;
+}
+
+/*
+ * Function:  scratchBytes
+ * --------------------
+ *  returns: the bytes the scratch arenas of all threads hold
+ */
+
+size_t scratchBytes(SedContext *ctx){
+  size_t bytes = 0;
+  int i;
+  for(i = 0; i < ctx->scratchCount; i++) bytes += ctx->scratch[i].size;
+  return bytes;
+}
+
+/*
+ * Function:  isSmallImage
+ * --------------------
+ *  returns: whether an image of the given pixels is at most model.smallImage,
+ *  where starting a team costs more than the pass itself. Only small images
+ *  run serialMorphology: it keeps two copies of the image in the scratch
+ *  arena of thread 0, which never shrinks.
+ */
+
+int isSmallImage(SedContext *ctx, size_t pixels){
+  return (double) pixels <= ctx->model.smallImage;
+}
+
+/*
+ * Function:  teamSize
+ * --------------------
+ *  returns: the threads a pass over an image of the given pixels should use,
+ *  1 for small images (see isSmallImage)
+ */
+
+int teamSize(SedContext *ctx, size_t pixels){
+  return isSmallImage(ctx, pixels) ? 1 : ctx->threads;
+}
+
+/*
+ * Function:  getDiscPlan
+ * --------------------
+ *  returns the decomposition of the disc SE with the given radius, computing
+ *  and caching it in the context on first use
+ *
+ *  ctx: the context
+ *  radius: the radius of the disc
+ *  plan: set to the cached plan
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int getDiscPlan(SedContext *ctx, int radius, DiscPlan **plan){
+  DiscPlan *plans;
+  Image *SE;
+  Queue *qp;
+  Partition *p;
+  int status, i = 0;
+
+  if( radius < 1 ) return SED_ERROR_ARGUMENT;
+  if( radius >= ctx->planCount ){
+    plans = realloc(ctx->plans, (radius + 1) * sizeof(DiscPlan));
+    if( plans == NULL ) return SED_ERROR_MEMORY;
+    memset(plans + ctx->planCount, 0, (radius + 1 - ctx->planCount) * sizeof(DiscPlan));
+    ctx->plans = plans;
+    ctx->planCount = radius + 1;
+  }
+  *plan = &ctx->plans[radius];
+  if( (*plan)->parts != NULL ) return SED_OK;
+
+  SE = computeBinaryDiscSE(ctx, radius);
+  qp = newQueue();
+  if( SE == NULL || qp == NULL ){
+    freeImage(ctx, SE);
+    free(qp);
+    return SED_ERROR_MEMORY;
+  }
+  TRACE_BEGIN(span);
+  status = decompose(ctx, SE, qp);
+  TRACE_END(span, "decompose", (size_t) SE->width * SE->height);
+  if( status == SED_OK ){
+    // one spare entry so that an empty plan (radius 2, the identity) is still cached
+    (*plan)->parts = malloc((queueSize(qp) + 1) * sizeof(Partition));
+    if( (*plan)->parts == NULL ) status = SED_ERROR_MEMORY;
+  }
+  while( (p = dequeue(qp)) != NULL ){
+    if( status == SED_OK ) (*plan)->parts[i++] = *p;
+    free(p);
+  }
+  (*plan)->count = i;
+  freeImage(ctx, SE);
+  freeQueue(qp);
+  return status;
+}
+
+/*
+ * Function:  discPlanReach
+ * --------------------
+ *  returns: how many rows above and below a pixel the erosion (or dilation)
+ *  with the origin and the layers of a plan reads
+ */
+
+int discPlanReach(DiscPlan *plan){
+  int reach = 0, k, r;
+  Partition *p;
+  for(k = 0; k < plan->count; k++){
+    p = &plan->parts[k];
+    r = p->cubicFactor.height / 2;
+    if( p->sparseFactor.topOffset > r ) r = p->sparseFactor.topOffset;
+    if( p->sparseFactor.bottomOffset > r ) r = p->sparseFactor.bottomOffset;
+    if( r > reach ) reach = r;
+  }
+  return reach;
+}
+
+/*
+ * Function:  runDiscPlan
+ * --------------------
+ *  opens or closes an image with the disc of the given radius. The disc is
+ *  the origin together with the layers of its decomposition, so the erosion
+ *  (dilation) by the disc is a single partitionErosion (partitionDilation)
+ *  over all partitions of the plan. Images of up to model.smallImage pixels
+ *  run on the calling thread without a task graph, larger ones on the graph
+ *  even with a single thread. Images that do not fit in the memory budget
+ *  run in strips.
+ */
+
+static int runDiscPlan(SedContext *ctx, Image *im, int radius, int closing){
+  DiscPlan *plan;
+  GraphStats stats;
+  BudgetPlan budget;
+  int status = getDiscPlan(ctx, radius, &plan);
+  TRACE_BEGIN(span);
+  if( status == SED_OK && ctx->memoryBudget > 0 ) status = planBudget(ctx, im->width, im->height, plan, &budget);
+  if( status != SED_OK ) return status;
+  if( ctx->memoryBudget > 0 && ctx->verbose )
+    printf("memory budget %zu KiB: %d strips of %d rows, halo %d, %d threads, predicted peak %zu KiB\n",
+           ctx->memoryBudget >> 10, budget.strips, budget.stripRows, budget.halo, budget.threads, budget.peak >> 10);
+  if( ctx->memoryBudget > 0 && (budget.strips > 1 || budget.threads < ctx->threads) )
+    status = stripMorphology(ctx, im, plan, closing, &budget);
+  else if( isSmallImage(ctx, (size_t) im->width * im->height) )
+    status = serialMorphology(ctx, im, plan->parts, plan->count, closing);
+  else
+    status = graphMorphology(ctx, im, plan->parts, plan->count, closing, &stats);
+  TRACE_END(span, closing ? "disc closing" : "disc opening", (size_t) im->width * im->height);
+  return status;
+}
+
+/*
+ * Function:  discOpening
+ * --------------------
+ *  morphologically opens an image with the decomposition of a disc SE
+ *
+ *  ctx: the context
+ *  im: the image, modified in place
+ *  radius: the radius of the disc
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int discOpening(SedContext *ctx, Image *im, int radius){
+  return runDiscPlan(ctx, im, radius, 0);
+}
+
+/*
+ * Function:  discClosing
+ * --------------------
+ *  morphologically closes an image with the decomposition of a disc SE
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int discClosing(SedContext *ctx, Image *im, int radius){
+  return runDiscPlan(ctx, im, radius, 1);
+}
+
+/*
+ * Function:  errorString
+ * --------------------
+ *  returns: a description of an error code
+ */
+
+const char *errorString(int status){
+  switch( status ){
+    case SED_OK: return "success";
+    case SED_ERROR_MEMORY: return "out of memory";
+    case SED_ERROR_IO: return "reading or writing of image failed";
+    case SED_ERROR_ARGUMENT: return "invalid argument";
+    case SED_ERROR_DECOMPOSITION: return "decomposition of the structuring element failed";
+  }
+  return "unknown error";
+}
@@ -0,0 +1,70 @@
+#ifndef CONTEXT
+#define CONTEXT
+
+#include <stddef.h>
+#include "image.h"
+#include "pages.h"
+#include "placement.h"
+#include "planner.h"
+
+#define SED_OK 0
+#define SED_ERROR_MEMORY -1
+#define SED_ERROR_IO -2
+#define SED_ERROR_ARGUMENT -3
+#define SED_ERROR_DECOMPOSITION -4
+
+typedef void *(*SedAllocFunction)(size_t, void*);
+typedef void (*SedFreeFunction)(void*, void*);
+
+typedef struct Scratch {
+  Pixel *data;
+  size_t size;
+} Scratch;
+
+typedef struct DiscPlan {
+  Partition *parts;
+  int count;
+} DiscPlan;
+
+/*
+ * Everything a job needs besides its images: the thread count, the allocator
+ * for pixel and scratch buffers, one scratch arena per thread and the cache of
+ * disc decompositions, and the cost model of the engine planner with its last
+ * choice. The library has no other mutable state, so independent jobs can run
+ * concurrently from different caller threads as long as each uses its own
+ * context.
+ */
+typedef struct SedContext {
+  int threads;
+  int verbose;
+  size_t memoryBudget;      /* bytes, 0 for unlimited, see budget.c */
+  SedAllocFunction alloc;
+  SedFreeFunction release;
+  void *allocUser;
+  PageAllocator pages;
+  Placement placement;
+  Scratch *scratch;
+  int scratchCount;
+  DiscPlan *plans;
+  int planCount;
+  CostModel model;
+  EnginePlan lastPlan;
+} SedContext;
+
+SedContext *createContext(int);
+void freeContext(SedContext*);
+int setThreads(SedContext*, int);
+void setAllocator(SedContext*, SedAllocFunction, SedFreeFunction, void*);
+void *contextAlloc(SedContext*, size_t);
+void *contextCalloc(SedContext*, size_t, size_t);
+void contextFree(SedContext*, void*);
+Pixel *scratchBuffer(SedContext*, int, size_t);
+size_t scratchBytes(SedContext*);
+int isSmallImage(SedContext*, size_t);
+int teamSize(SedContext*, size_t);
+int getDiscPlan(SedContext*, int, DiscPlan**);
+int discPlanReach(DiscPlan*);
+int discOpening(SedContext*, Image*, int);
+int discClosing(SedContext*, Image*, int);
+const char *errorString(int);
+#endif
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "counters.h"
+
+/*
+ *  ----------------
+ *  Hardware performance counters of the calling thread through
+ *  perf_event_open. Only user space is counted, so perf_event_paranoid up to
+ *  2 suffices. Counters the machine does not have (virtual machines often
+ *  lack the cache and TLB events) are left out, the rest keep working.
+ */
+
+const char *counterNames[COUNTER_COUNT] = {"cycles", "instructions", "llc-misses", "dtlb-misses", "branch-misses"};
+
+static const unsigned int counterTypes[COUNTER_COUNT] = {
+  PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+};
+
+static const unsigned long long counterConfigs[COUNTER_COUNT] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* errno of the first counter that failed to open, for counterError */
+static _Thread_local int lastError;
+
+/*
+ * Function:  openCounters
+ * --------------------
+ *  opens every counter for the calling thread, on any CPU
+ *
+ *  set: filled with the file descriptors
+ *
+ *  returns: the amount of counters that could be opened
+ */
+
+int openCounters(CounterSet *set){
+  struct perf_event_attr attr;
+  int i;
+  set->available = 0;
+  lastError = 0;
+  for(i = 0; i < COUNTER_COUNT; i++){
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counterTypes[i];
+    attr.config = counterConfigs[i];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    set->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if( set->fds[i] >= 0 ) set->available++;
+    else if( lastError == 0 ) lastError = errno;
+  }
+  return set->available;
+}
+
+void closeCounters(CounterSet *set){
+  int i;
+  for(i = 0; i < COUNTER_COUNT; i++){
+    if( set->fds[i] >= 0 ) close(set->fds[i]);
+    set->fds[i] = -1;
+  }
+  set->available = 0;
+}
+
+/*
+ * Function:  readCounters
+ * --------------------
+ *  reads the current value of every counter. When the kernel multiplexes the
+ *  counters the value is scaled by enabled time / running time. Counters that
+ *  are not available read as 0.
+ *
+ *  set: the counters of the calling thread
+ *  values: COUNTER_COUNT values
+ */
+
+void readCounters(CounterSet *set, unsigned long long *values){
+  unsigned long long raw[3];
+  int i;
+  for(i = 0; i < COUNTER_COUNT; i++){
+    values[i] = 0;
+    if( set->fds[i] < 0 || read(set->fds[i], raw, sizeof(raw)) != sizeof(raw) ) continue;
+    values[i] = raw[2] > 0 && raw[2] < raw[1] ? (unsigned long long) ((double) raw[0] * raw[1] / raw[2]) : raw[0];
+  }
+}
+
+/*
+ * Function:  counterError
+ * --------------------
+ *  returns: why the last openCounters call on this thread missed counters
+ */
+
+const char *counterError(void){
+  if( lastError == EACCES || lastError == EPERM ) return "not permitted, see /proc/sys/kernel/perf_event_paranoid";
+  if( lastError == ENOENT || lastError == EOPNOTSUPP ) return "the CPU or hypervisor does not expose these events";
+  if( lastError == ENOSYS ) return "the kernel has no perf_event support";
+  return lastError != 0 ? strerror(lastError) : "no error";
+}
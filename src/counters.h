@@ -0,0 +1,23 @@
+#ifndef COUNTERS
+#define COUNTERS
+
+#define COUNTER_CYCLES 0
+#define COUNTER_INSTRUCTIONS 1
+#define COUNTER_LLC_MISSES 2
+#define COUNTER_DTLB_MISSES 3
+#define COUNTER_BRANCH_MISSES 4
+#define COUNTER_COUNT 5
+
+/* the counters of one thread, fds[i] is -1 when counter i could not be opened */
+typedef struct CounterSet {
+  int fds[COUNTER_COUNT];
+  int available;
+} CounterSet;
+
+extern const char *counterNames[COUNTER_COUNT];
+
+int openCounters(CounterSet*);
+void closeCounters(CounterSet*);
+void readCounters(CounterSet*, unsigned long long*);
+const char *counterError(void);
+#endif
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <limits.h>
+#include "context.h"
+#include "edt.h"
+#include "trace.h"
+#include "omp.h"
+
+#define MIN_PIX 0
+#define MAX_PIX 255
+#define EDT_INFINITY INT_MAX
+#define COLUMN_BLOCK 64
+
+/*
+ *  ----------------
+ *  Binary disc morphology through the exact Euclidean distance transform.
+ *  A pixel survives the erosion by a disc when the nearest background pixel
+ *  is outside of the disc, and it is set by the dilation when the nearest
+ *  foreground pixel is inside of it, so one squared EDT plus a threshold is a
+ *  whole erosion or dilation, in O(width * height) for any radius.
+ *
+ *  The EDT is separable (Meijster et al.): a pass down the columns finds the
+ *  vertical distance to the nearest site in every column, a pass along the
+ *  rows takes the lower envelope of the parabolas (x - i)^2 + g(i)^2 over
+ *  those columns. Integer arithmetic only, so the result is exactly the one of
+ *  the computeBinaryDiscSE disc, which is {dy^2 + dx^2 < (radius - 1)^2}.
+ *  Pixels outside of the image are ignored, as in the other engines.
+ */
+
+/*
+ * Function:  discThreshold
+ * --------------------
+ *  returns: the largest squared distance inside the disc of computeBinaryDiscSE,
+ *  -1 when the disc is empty
+ */
+
+static long long discThreshold(int radius){
+  return (long long) (radius - 1) * (radius - 1) - 1;
+}
+
+/*
+ * Function:  isBinary
+ * --------------------
+ *  returns: 1 when the image has one channel and only MIN_PIX and MAX_PIX pixels
+ */
+
+static int isBinary(Image *im, int threads){
+  size_t size = (size_t) im->width * im->height, i;
+  Pixel *a = im->data;
+  int other = 0;
+  if( im->channels != 1 ) return 0;
+  #pragma omp parallel for num_threads(threads) default(none) shared(a, size) reduction(||:other) schedule(static)
+  for(i = 0; i < size; i++) other = other || (a[i] != MIN_PIX && a[i] != MAX_PIX);
+  return !other;
+}
+
+/*
+ * Function:  columnDistances
+ * --------------------
+ *  computes for every pixel the vertical distance to the nearest site in its
+ *  column, EDT_INFINITY when the column has none. Every thread sweeps a block
+ *  of columns down and up again, so the rows are read contiguously.
+ *
+ *  a: the pixeldata
+ *  width: the width of the image
+ *  height: the height of the image
+ *  site: the pixel value of the sites
+ *  g: width * height distances
+ *  threads: the amount of threads
+ */
+
+static void columnDistances(Pixel *a, int width, int height, Pixel site, int *g, int threads){
+  int blocks = (width + COLUMN_BLOCK - 1) / COLUMN_BLOCK, block, row, col, first, last;
+  size_t i;
+  #pragma omp parallel num_threads(threads) default(none) private(block, row, col, first, last, i) shared(a, g, width, height, site, blocks)
+  {
+    TRACE_BEGIN(span);
+    size_t pixels = 0;
+    #pragma omp for schedule(static) nowait
+    for(block = 0; block < blocks; block++){
+      first = block * COLUMN_BLOCK;
+      last = first + COLUMN_BLOCK < width ? first + COLUMN_BLOCK : width;
+      pixels += (size_t) (last - first) * height;
+      for(col = first; col < last; col++)
+        g[col] = a[col] == site ? 0 : EDT_INFINITY;
+      for(row = 1; row < height; row++){
+        for(col = first; col < last; col++){
+          i = (size_t) row * width + col;
+          g[i] = a[i] == site ? 0 : (g[i - width] == EDT_INFINITY ? EDT_INFINITY : g[i - width] + 1);
+        }
+      }
+      for(row = height - 2; row >= 0; row--){
+        for(col = first; col < last; col++){
+          i = (size_t) row * width + col;
+          if( g[i + width] != EDT_INFINITY && g[i + width] + 1 < g[i] ) g[i] = g[i + width] + 1;
+        }
+      }
+    }
+    TRACE_END(span, "edt columns", pixels);
+  }
+}
+
+/*
+ * Function:  rowThreshold
+ * --------------------
+ *  computes the squared distance to the nearest site of every pixel of a row
+ *  from the column distances g and thresholds it. The lower envelope of the
+ *  parabolas of the columns that have a site is built left to right: s holds
+ *  the columns of the envelope and t the first pixel where each one is nearest.
+ *
+ *  g: the column distances of the row
+ *  out: the pixels of the row
+ *  width: the width of the row
+ *  threshold: the largest squared distance inside the disc
+ *  inside: the pixel value within the threshold, the other one outside of it
+ *  s: a buffer of width ints
+ *  t: a buffer of width ints
+ */
+
+static void rowThreshold(int *g, Pixel *out, int width, long long threshold, Pixel inside, int *s, int *t){
+  Pixel outside = inside == MAX_PIX ? MIN_PIX : MAX_PIX;
+  long long d, numerator, w;
+  int q = -1, u;
+  for(u = 0; u < width; u++){
+    if( g[u] == EDT_INFINITY ) continue;
+    while( q >= 0 ){
+      d = (long long) (t[q] - s[q]) * (t[q] - s[q]) + (long long) g[s[q]] * g[s[q]];
+      if( d <= (long long) (t[q] - u) * (t[q] - u) + (long long) g[u] * g[u] ) break;
+      q--;
+    }
+    if( q < 0 ){
+      q = 0;
+      s[0] = u;
+      t[0] = 0;
+    }else{
+      // the first pixel where u is nearer than s[q]
+      numerator = (long long) u * u - (long long) s[q] * s[q] + (long long) g[u] * g[u] - (long long) g[s[q]] * g[s[q]];
+      w = 1 + numerator / (2 * (long long) (u - s[q]));
+      if( w < width ){
+        q++;
+        s[q] = u;
+        t[q] = (int) w;
+      }
+    }
+  }
+  for(u = width - 1; u >= 0; u--){
+    if( q < 0 ){
+      out[u] = outside;
+      continue;
+    }
+    d = (long long) (u - s[q]) * (u - s[q]) + (long long) g[s[q]] * g[s[q]];
+    out[u] = d <= threshold ? inside : outside;
+    if( u == t[q] ) q--;
+  }
+}
+
+/*
+ * Function:  edtMorphology
+ * --------------------
+ *  erodes or dilates a binary image by the disc of the given radius
+ *
+ *  ctx: the context
+ *  im: the binary image, modified in place
+ *  radius: the radius of the disc
+ *  dilate: 1 for the dilation, 0 for the erosion
+ *  g: width * height ints of scratch
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+static int edtMorphology(SedContext *ctx, Image *im, int radius, int dilate, int *g){
+  int width = im->width, height = im->height, row, failed = 0;
+  long long threshold = discThreshold(radius);
+  Pixel *a = im->data;
+  Pixel site = dilate ? MAX_PIX : MIN_PIX;
+  // erosion: survive when the nearest background pixel is outside of the disc
+  Pixel inside = dilate ? MAX_PIX : MIN_PIX;
+  int *s;
+
+  columnDistances(a, width, height, site, g, ctx->threads);
+  #pragma omp parallel num_threads(ctx->threads) default(none) private(row, s) shared(ctx, a, g, width, height, threshold, inside) reduction(||:failed)
+  {
+    TRACE_BEGIN(span);
+    size_t pixels = 0;
+    s = (int *) scratchBuffer(ctx, omp_get_thread_num(), 2 * (size_t) width * sizeof(int));
+    failed = s == NULL;
+    #pragma omp for schedule(static) nowait
+    for(row = 0; row < height; row++){
+      if( failed ) continue;
+      pixels += width;
+      rowThreshold(&g[(size_t) row * width], &a[(size_t) row * width], width, threshold, inside, s, s + width);
+    }
+    TRACE_END(span, "edt rows", pixels);
+  }
+  return failed ? SED_ERROR_MEMORY : SED_OK;
+}
+
+/*
+ * Function:  edtRun
+ * --------------------
+ *  checks the arguments, allocates the distances and runs one or two passes
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+static int edtRun(SedContext *ctx, Image *im, int radius, int first, int second){
+  int *g, status;
+  if( radius < 1 || !isBinary(im, ctx->threads) ) return SED_ERROR_ARGUMENT;
+  g = contextAlloc(ctx, (size_t) im->width * im->height * sizeof(int));
+  if( g == NULL ) return SED_ERROR_MEMORY;
+  status = edtMorphology(ctx, im, radius, first, g);
+  if( status == SED_OK && second >= 0 ) status = edtMorphology(ctx, im, radius, second, g);
+  contextFree(ctx, g);
+  return status;
+}
+
+/*
+ * Function:  edtErosion
+ * --------------------
+ *  erodes a binary image (MIN_PIX and MAX_PIX only, see grayscaleToBinary)
+ *  by the disc of computeBinaryDiscSE
+ *
+ *  ctx: the context
+ *  im: the image, modified in place
+ *  radius: the radius of the disc
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT (not binary) or SED_ERROR_MEMORY
+ */
+
+int edtErosion(SedContext *ctx, Image *im, int radius){
+  return edtRun(ctx, im, radius, 0, -1);
+}
+
+/*
+ * Function:  edtDilation
+ * --------------------
+ *  dilates a binary image by the disc of computeBinaryDiscSE
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT (not binary) or SED_ERROR_MEMORY
+ */
+
+int edtDilation(SedContext *ctx, Image *im, int radius){
+  return edtRun(ctx, im, radius, 1, -1);
+}
+
+/*
+ * Function:  edtOpening
+ * --------------------
+ *  opens a binary image with the disc, the same result as discOpening
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT (not binary) or SED_ERROR_MEMORY
+ */
+
+int edtOpening(SedContext *ctx, Image *im, int radius){
+  return edtRun(ctx, im, radius, 0, 1);
+}
+
+/*
+ * Function:  edtClosing
+ * --------------------
+ *  closes a binary image with the disc, the same result as discClosing
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT (not binary) or SED_ERROR_MEMORY
+ */
+
+int edtClosing(SedContext *ctx, Image *im, int radius){
+  return edtRun(ctx, im, radius, 1, 0);
+}
@@ -0,0 +1,10 @@
+#ifndef EDT
+#define EDT
+
+#include "image.h"
+
+int edtErosion(struct SedContext*, Image*, int);
+int edtDilation(struct SedContext*, Image*, int);
+int edtOpening(struct SedContext*, Image*, int);
+int edtClosing(struct SedContext*, Image*, int);
+#endif
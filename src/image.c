@@ -1,4 +1,12 @@
-#include "image.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "budget.h"
+#include "context.h"
+#include "tile.h"
+#include "trace.h"
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image.h"
@@ -11,8 +19,6 @@
 #define HORIZONTAL 0
 #define VERTICAL 1
 
-#define MAX_THREAD_NUM 4
-
 #define DEFAULT_STRIDE 0
 #define DEFAULT_CHANNELS 1
 
@@ -23,7 +29,6 @@
 #define RGB_GREEN 0.587
 #define RGB_BLUE 0.114
 
-#define VERBOSE 0
 
 /*
  * Function:  createImage 
@@ -35,44 +40,157 @@
  *  height: the height of the image
  *  channels: the amount of channels for the image (specified in stbi_image_write.h, from line 78)
  * 
- *  returns: a pointer to the new Image object
+ *  returns: a pointer to the new Image object or NULL when out of memory
  */
 
 Image *createImage(Pixel *data, int width, int height, int channels){
   Image *new = malloc(sizeof(struct Image));
-  assert(new != NULL);
+  if( new == NULL ) return NULL;
   new->width = width;
   new->height = height;
   new->channels = channels;
   new->stride = DEFAULT_STRIDE;
   new->data = data;
+  new->borrowed = 0;
   return new;
 }
 
+/*
+ * Function:  imageView 
+ * --------------------
+ *  wraps pixels that belong to someone else, e.g. a band of a larger image or
+ *  a buffer of the caller, in an image that borrows them. Every transform
+ *  leaves the result in those pixels, and freeImage never frees them.
+ *
+ *  data: the pixeldata, width * height * channels pixels
+ *  width: the width of the view
+ *  height: the height of the view
+ *  channels: the amount of channels
+ * 
+ *  returns: the view, by value
+ */
+
+Image imageView(Pixel *data, int width, int height, int channels){
+  Image view;
+  view.width = width;
+  view.height = height;
+  view.channels = channels;
+  view.stride = DEFAULT_STRIDE;
+  view.data = data;
+  view.borrowed = 1;
+  return view;
+}
+
+/*
+ * Function:  exchangePixels 
+ * --------------------
+ *  hands a buffer of the size of the pixeldata to an image in exchange for
+ *  its pixels, so a pass that wrote its result into a buffer of its own
+ *  needs no copy back. A view keeps its pixels: the buffer is copied into
+ *  them and stays with the caller.
+ *
+ *  im: the image
+ *  buffer: the new pixeldata, from the allocator of the context of im
+ * 
+ *  returns: the buffer the caller owns now, the old pixels of im or buffer
+ */
+
+Pixel *exchangePixels(Image *im, Pixel *buffer){
+  Pixel *old = im->data;
+  if( im->borrowed ){
+    memcpy(im->data, buffer, (size_t) im->width * im->height * im->channels);
+    return buffer;
+  }
+  im->data = buffer;
+  return old;
+}
+
+/*
+ * Function:  replacePixels 
+ * --------------------
+ *  gives an image new pixeldata and frees what it no longer needs, see
+ *  exchangePixels
+ *
+ *  ctx: the context whose allocator owns both
+ *  im: the image
+ *  data: the new pixeldata, of the size of the image
+ */
+
+void replacePixels(SedContext *ctx, Image *im, Pixel *data){
+  contextFree(ctx, exchangePixels(im, data));
+}
+
+/*
+ * Function:  imageSize 
+ * --------------------
+ *  computes the bytes of the pixeldata of an image, the product checked
+ *  against IMAGE_MAX_BYTES before it can overflow
+ *
+ *  width: the width of the image
+ *  height: the height of the image
+ *  channels: the amount of channels (or interleaved images)
+ *  size: set to width * height * channels
+ *
+ *  returns: SED_OK or SED_ERROR_ARGUMENT when a dimension is not positive or
+ *  the image is too large
+ */
+
+int imageSize(int width, int height, int channels, size_t *size){
+  *size = 0;
+  if( width <= 0 || height <= 0 || channels <= 0 ) return SED_ERROR_ARGUMENT;
+  if( (size_t) width > IMAGE_MAX_BYTES / height / channels ) return SED_ERROR_ARGUMENT;
+  *size = (size_t) width * height * channels;
+  return SED_OK;
+}
+
 /*
  * Function:  readImage 
  * --------------------
- *  reads a new image from the file system
+ *  reads a new image from the file system, the pixel data is allocated with
+ *  the allocator of the context and placed as set by setPlacement
  *
+ *  ctx: the context
  *  str: the name of the image to be read, it has to be a .png file
+ *  im: set to a pointer to the new Image object
  *
- *  returns: a pointer to the new Image object
+ *  returns: SED_OK, SED_ERROR_IO, SED_ERROR_ARGUMENT for an image beyond
+ *  IMAGE_MAX_BYTES or SED_ERROR_MEMORY
  */
 
-Image *readImage(char *str){
+int readImage(SedContext *ctx, char *str, Image **im){
   int width, height, channels;
+  size_t size;
+  TRACE_BEGIN(span);
   Pixel *data = stbi_load(str,
               &width,
               &height,
               &channels,
               DEFAULT_STRIDE);
+  Pixel *owned;
+
+  *im = NULL;
+  if( data == NULL ) return SED_ERROR_IO;
+  if( imageSize(width, height, channels, &size) != SED_OK ){
+    stbi_image_free(data);
+    return SED_ERROR_ARGUMENT;
+  }
 
-  if( data == NULL ) {
-    fprintf(stderr, "Reading of image failed, program will now exit.\n");
-    exit(-1);
+  owned = data;
+  if( ctx->alloc != NULL || ctx->placement.firstTouch || ctx->placement.interleave ){
+    // stb allocates with malloc and touches every page from this thread, move
+    // the pixels to the allocator and placement of the context
+    owned = allocatePlaced(ctx, data, (size_t) width * channels, height);
+    stbi_image_free(data);
+    if( owned == NULL ) return SED_ERROR_MEMORY;
   }
 
-  return createImage(data, width, height, channels);
+  *im = createImage(owned, width, height, channels);
+  if( *im == NULL ){
+    contextFree(ctx, owned);
+    return SED_ERROR_MEMORY;
+  }
+  TRACE_END(span, "decode", (size_t) width * height);
+  return SED_OK;
 }
 
 /*
@@ -80,19 +198,23 @@ Image *readImage(char *str){
  * --------------------
  *  copies the pixeldata and metadata of an image to a new Image object
  *
+ *  ctx: the context
  *  im: a pointer to the image to be copied
+ *  cpy: set to a pointer to the new Image object
  *
- *  returns: a pointer to the new Image object
+ *  returns: SED_OK or SED_ERROR_MEMORY
  */
 
-Image *copyImage(Image *im){
-  unsigned int i;
-  Pixel *data = malloc(im->width * im->height * im->channels * sizeof(struct Image));
-  assert(data != NULL);
-  Image *cpy = createImage(data, im->width, im->height, im->channels);
-  for(i = 0; i < im->width * im->height * im->channels; i++) 
-    data[i] = im->data[i];
-  return cpy;
+int copyImage(SedContext *ctx, Image *im, Image **cpy){
+  Pixel *data = allocatePlaced(ctx, im->data, (size_t) im->width * im->channels, im->height);
+  *cpy = NULL;
+  if( data == NULL ) return SED_ERROR_MEMORY;
+  *cpy = createImage(data, im->width, im->height, im->channels);
+  if( *cpy == NULL ){
+    contextFree(ctx, data);
+    return SED_ERROR_MEMORY;
+  }
+  return SED_OK;
 }
 
 /*
@@ -100,19 +222,24 @@ Image *copyImage(Image *im){
  * --------------------
  *  creates a new image object containing a disc-shaped structuring element
  *
+ *  ctx: the context
  *  radius: the radius of the disc structuring element
  *
- *  returns: a pointer to the new Image object
+ *  returns: a pointer to the new Image object or NULL when out of memory
  */
 
-Image *computeBinaryDiscSE(int radius){
+Image *computeBinaryDiscSE(SedContext *ctx, int radius){
   int i, j, euclideanDistance;
   int size = radius * 2 + 1; // size in 1 dimension. Size = width = height
   int middle = size / 2;
-  Pixel *data = calloc(size*size, sizeof(Pixel));
-  assert(data != NULL);
+  Pixel *data = contextCalloc(ctx, size*size, sizeof(Pixel));
+  if( data == NULL ) return NULL;
 
   Image *SE = createImage(data, size, size, 1);
+  if( SE == NULL ){
+    contextFree(ctx, data);
+    return NULL;
+  }
   for(i = 0; i < size; i++){
     for(j = 0; j < size; j++){
       euclideanDistance = sqrt( pow(i - middle, 2) + pow(j - middle, 2));
@@ -125,30 +252,67 @@ Image *computeBinaryDiscSE(int radius){
 /*
  * Function:  writeImage 
  * --------------------
- *  writes an image to the file system
+ *  writes an image to the file system with the default output options
  *
- *  str: the name of the image to be read, it has to be a .png file
+ *  ctx: the context, its thread count is used by the PNG encoder
+ *  im: the image to be written
+ *  str: the name of the image to be written, the extension picks the format
+ *
+ *  returns: SED_OK, SED_ERROR_MEMORY or SED_ERROR_IO
+ */
+
+int writeImage(SedContext *ctx, Image *im, char *name){
+  return writeImageWithOptions(ctx, im, name, defaultWriteOptions());
+}
+
+/*
+ * Function:  writeImageWithOptions 
+ * --------------------
+ *  writes an image to the file system, as PNG (parallel encoder), stored PNG,
+ *  QOI, PNM or raw bytes. Under a memory budget the PNG encoder gets what the
+ *  budget leaves besides the image, the scratch arenas and BUDGET_RESERVE
+ *  (see planStrips in imagewrite.c). QOI still encodes the whole image in
+ *  memory.
  *
+ *  ctx: the context, its thread count is used unless opt sets one
+ *  im: the image to be written
+ *  name: the name of the file, its extension picks the format unless opt.format is set
+ *  opt: the output format and PNG settings
+ *
+ *  returns: SED_OK, SED_ERROR_MEMORY or SED_ERROR_IO
  */
 
-void writeImage(Image *im, char *name){
-  if(!stbi_write_png(name, im->width, im->height, im->channels, (Pixel *) im->data, im->stride)){
-    fprintf(stderr, "Writing of image with name: %s failed\n", name);
+int writeImageWithOptions(SedContext *ctx, Image *im, char *name, WriteOptions opt){
+  size_t used = BUDGET_RESERVE + (size_t) im->width * im->height * im->channels + scratchBytes(ctx);
+  int status;
+  TRACE_BEGIN(span);
+  if( opt.png.threads <= 0 ) opt.png.threads = ctx->threads;
+  if( ctx->memoryBudget > 0 && opt.png.memoryBudget == 0 ){
+    if( ctx->memoryBudget <= used ) return SED_ERROR_MEMORY;
+    opt.png.memoryBudget = ctx->memoryBudget - used;
+  }
+  status = writePixels(name, im->data, im->width, im->height, im->channels, opt);
+  if( status != SED_OK ){
+    if( ctx->verbose ) fprintf(stderr, "Writing of image with name: %s failed\n", name);
+    return status;
   }
-  freeImage(im);
+  TRACE_END(span, "encode", (size_t) im->width * im->height);
+  return SED_OK;
 }
 
 /*
  * Function:  freeImage 
  * --------------------
- *  frees the pixeldata and image metadata
+ *  frees the pixeldata, unless borrowed, and image metadata
  *
- *  im: a pointer to the image to be freed
+ *  ctx: the context whose allocator owns the pixeldata
+ *  im: a pointer to the image to be freed, may be NULL
  *
  */
 
-void freeImage(Image *im){
-  stbi_image_free(im->data);
+void freeImage(SedContext *ctx, Image *im){
+  if( im == NULL ) return;
+  if( !im->borrowed ) contextFree(ctx, im->data);
   free(im);
 }
 
@@ -223,7 +387,7 @@ Pixel *getData(Image *im){
  */
 
 Pixel getPixel(Image *im, int row, int column){
-  return im->data[row*im->height + column];
+  return im->data[(size_t) row * im->width + column];
 }
 
 /*
@@ -238,18 +402,90 @@ Pixel getPixel(Image *im, int row, int column){
  */
 
 void setPixel(Image *im, int row, int column, Pixel val){
-  im->data[row*im->height + column] = val;
+  im->data[(size_t) row * im->width + column] = val;
+}
+
+/*
+ * Function:  maxFilterLine
+ * --------------------
+ *  computes the running maximum (dilation) of a line of pixels with a line structuring element of
+ *  size s using the van Herk/Gil-Werman algorithm: the line, padded with s / 2
+ *  MIN_PIX pixels on both sides, is cut into blocks of s pixels, g holds
+ *  the running maximum from the start of each block and h the running maximum to
+ *  the end of each block, so every window of s pixels is the maximum of one h and
+ *  one g value. That is 3 comparisons per pixel, independent of s.
+ *
+ *  a: the first pixel of the line
+ *  n: the amount of pixels in the line
+ *  stride: the distance between two pixels of the line
+ *  g: a buffer of n + s - 1 pixels
+ *  h: a buffer of n + s - 1 pixels
+ *  s: the size of the structuring element, odd so that it is centered
+ *
+ */
+
+static void maxFilterLine(Pixel *a, int n, int stride, Pixel *g, Pixel *h, int s){
+  int l = s / 2, len = n + s - 1;
+  int i, j, end;
+  for(j = 0; j < l; j++) h[j] = MIN_PIX;
+  for(i = 0; i < n; i++) h[l + i] = a[(size_t) i * stride];
+  for(j = n + l; j < len; j++) h[j] = MIN_PIX;
+
+  for(i = 0; i < len; i += s){
+    end = MIN(i + s, len);
+    g[i] = h[i];
+    for(j = i + 1; j < end; j++)
+      g[j] = MAX(g[j - 1], h[j]);
+    for(j = end - 2; j >= i; j--)
+      h[j] = MAX(h[j + 1], h[j]);
+  }
+  for(i = 0; i < n; i++)
+    a[(size_t) i * stride] = MAX(h[i], g[i + s - 1]);
+}
+
+/*
+ * Function:  minFilterLine
+ * --------------------
+ *  the running minimum (erosion) counterpart of maxFilterLine, the padding
+ *  pixels are MAX_PIX so they never win
+ *
+ *  a: the first pixel of the line
+ *  n: the amount of pixels in the line
+ *  stride: the distance between two pixels of the line
+ *  g: a buffer of n + s - 1 pixels
+ *  h: a buffer of n + s - 1 pixels
+ *  s: the size of the structuring element, odd so that it is centered
+ *
+ */
+
+static void minFilterLine(Pixel *a, int n, int stride, Pixel *g, Pixel *h, int s){
+  int l = s / 2, len = n + s - 1;
+  int i, j, end;
+  for(j = 0; j < l; j++) h[j] = MAX_PIX;
+  for(i = 0; i < n; i++) h[l + i] = a[(size_t) i * stride];
+  for(j = n + l; j < len; j++) h[j] = MAX_PIX;
+
+  for(i = 0; i < len; i += s){
+    end = MIN(i + s, len);
+    g[i] = h[i];
+    for(j = i + 1; j < end; j++)
+      g[j] = MIN(g[j - 1], h[j]);
+    for(j = end - 2; j >= i; j--)
+      h[j] = MIN(h[j + 1], h[j]);
+  }
+  for(i = 0; i < n; i++)
+    a[(size_t) i * stride] = MIN(h[i], g[i + s - 1]);
 }
 
 /*
  * Function:  dilateHorizontal
  * --------------------
- *  computes the dilation of row/column a with a structuring element size s using the HGW algorithm
+ *  computes the dilation of row a with a structuring element size s using the HGW algorithm
  * 
  *  a: the pixeldata
  *  n: the size of the pixeldata
- *  c: the 'left' buffer
- *  d: the 'right' buffer 
+ *  c: the 'left' buffer, n + s - 1 pixels
+ *  d: the 'right' buffer, n + s - 1 pixels
  *  s: the size of the structuring element
  *
  */
@@ -260,40 +496,21 @@ void dilateHorizontal(Pixel *a,
         Pixel *d,
         int s
         ){
-  int u, i;
-  int l = s / 2;  
-  for( u = l; u < n; u += s - 1){
-
-    d[0] = a[u];
-    for(i = 1; i < s - 1; i++)
-      d[i] = MAX(d[i - 1], a[u + 1]);
-    c[s - 2] = a[u - 1];
-    for( i = 1; i < s - 1; i++){
-      if( u - i - 1 < 0){ 
-        c[s - i - 2] = MIN_PIX;
-        continue;
-      }
-      c[s - i - 2] = MAX(c[s - i - 1], a[u - i - 1]);
-    }
-    for(i = 0; i < s - 1; i++){
-      if( u - l + i >= n ) break;
-      a[u - l + i] = MAX(c[i], d[i]);
-    }
-  }
+  maxFilterLine(a, n, 1, c, d, s);
 }
 
 
 /*
  * Function:  dilateVertical
  * --------------------
- *  computes the dilation of row/column a with a structuring element size s using the HGW algorithm
+ *  computes the dilation of column a with a structuring element size s using the HGW algorithm
  * 
  *  a: the pixeldata
- *  n: the size of the pixeldata
- *  c: the 'left' buffer
- *  d: the 'right' buffer 
+ *  n: the width of the image, the distance between two pixels of the column
+ *  c: the 'left' buffer, height + s - 1 pixels
+ *  d: the 'right' buffer, height + s - 1 pixels
  *  s: the size of the structuring element
- *  height: the height of the image
+ *  height: the height of the image, the length of the column
  */
 
 void dilateVertical(Pixel *a, 
@@ -303,26 +520,7 @@ void dilateVertical(Pixel *a,
         int s,
         int height
         ){
-  int u, i;
-  int l = s / 2;  
-  for( u = l; u < n; u += s - 1){
-    d[0] = a[u * n];
-    for(i = 1; i < s - 1; i++)
-      d[i] = MAX(d[i - 1], a[ (u + 1) * n ]);
-    c[s - 2] = a[ (u - 1) * n ];
-    for( i = 1; i < s - 1; i++){
-      if( u - i - 1 < 0){ 
-        c[s - i - 2] = MIN_PIX;
-        continue;
-      }
-      c[s - i - 2] = MAX(c[s - i - 1], a[ (u - i - 1) * n ]);
-    }
-    for(i = 0; i < s - 1; i++){
-      if( u - l + i >= n ) break;
-      a[ (u - l + i) * n] = MAX(c[i], d[i]);
-    }
-  }
-
+  maxFilterLine(a, height, n, c, d, s);
 }
 
 /*
@@ -333,23 +531,22 @@ void dilateVertical(Pixel *a,
  * 
  *  a: the pixeldata
  *  n: the size of the pixeldata
+ *  b: a scratch buffer of n pixels
  *  
  */
 
-void dilate3Horizontal(Pixel *a, int n){
+void dilate3Horizontal(Pixel *a, int n, Pixel *b){
   int i;
-  Pixel *b = calloc(n, sizeof(Pixel));
-  assert( b != NULL );
+  if( n < 2 ) return;
 
-  b[0] = MIN(a[0], a[1]);
+  b[0] = MAX(a[0], a[1]);
   for(i = 1; i < n - 1; i++){
-    b[i] = MIN(MIN(a[i - 1], a[i]), a[i + 1]);
+    b[i] = MAX(MAX(a[i - 1], a[i]), a[i + 1]);
   }
-  b[n - 1] = MIN(a[n - 2], a[n - 1]);
+  b[n - 1] = MAX(a[n - 2], a[n - 1]);
 
   for(i = 0; i < n; i++)
     a[i] = b[i];
-  free(b);
 }
 
 /*
@@ -359,82 +556,92 @@ void dilate3Horizontal(Pixel *a, int n){
  *  a more complex algorithm like HGW is unnecessary in this case.
  * 
  *  a: the pixeldata
- *  n: the size of the pixeldata
- *  height: the height of the image
+ *  n: the width of the image, the distance between two pixels of the column
+ *  height: the height of the image, the length of the column
+ *  b: a scratch buffer of height pixels
  *  
  */
 
-void dilate3Vertical(Pixel *a, int n, int height){
+void dilate3Vertical(Pixel *a, int n, int height, Pixel *b){
   int i;
-  Pixel *b = calloc(n, sizeof(Pixel));
-  assert( b != NULL );
-
-  b[0] = MIN(a[0], a[n]);
-  for(i = 1; i < n - 1; i++){
-    b[i] = MIN(MIN(a[(i - 1) * n], a[i * n]), a[(i + 1) * n]);
+  if( height < 2 ) return;
+  b[0] = MAX(a[0], a[n]);
+  for(i = 1; i < height - 1; i++){
+    b[i] = MAX(MAX(a[(size_t) (i - 1) * n], a[(size_t) i * n]), a[(size_t) (i + 1) * n]);
   }
-  b[n - 1] = MIN(a[(n - 2) * n], a[(n - 1) * n]);
-  for(i = 0; i < n; i++)
-    a[i * n] = b[i];
-  free(b);
+  b[height - 1] = MAX(a[(size_t) (height - 2) * n], a[(size_t) (height - 1) * n]);
+  for(i = 0; i < height; i++)
+    a[(size_t) i * n] = b[i];
 }
 
 /*
  * Function: dilation 
  * --------------------
- *  computes the dilation of an image im
+ *  computes the dilation of an image im, the rows (or columns) are divided over
+ *  the threads of the context and every thread reuses its own scratch arena.
+ *  Small images (see teamSize) stay on the calling thread.
  * 
+ *  ctx: the context
  *  im: the image to be dilated
  *  s: the size of the structuring element in direction direction
  *  direction: in what direction to treat the pixeldata (HORIZONTAL/VERTICAL)
  *
+ *  returns: SED_OK or SED_ERROR_MEMORY
  */
 
-void dilation(Image *im,
+int dilation(SedContext *ctx,
+        Image *im,
         int s,
         int direction){
 
   int n = im->width;
   int height = im->height;
   Pixel *a = im->data;
-  int row;
-  int chunk = height / MAX_THREAD_NUM;
+  int lines = direction == HORIZONTAL ? height : n; // rows or columns
+  int len = MAX(n, height) + s - 1; // the longest padded line
+  int row, failed = 0;
   Pixel *c, *d;
-  #pragma omp parallel num_threads(MAX_THREAD_NUM) default(none) private(row, c, d) firstprivate(s, chunk, n, height, direction) shared(im, a)
+  size_t pixels;
+  int threads = teamSize(ctx, (size_t) n * height);
+  #pragma omp parallel num_threads(threads) default(none) private(row, c, d, pixels) firstprivate(s, n, height, lines, len, direction) shared(ctx, a) reduction(||:failed)
   {
-    for( row = chunk * omp_get_thread_num(); row < chunk * (omp_get_thread_num() + 1); row++){      
+    TRACE_BEGIN(span);
+    pixels = 0;
+    c = scratchBuffer(ctx, omp_get_thread_num(), 2 * (size_t) len); // left max array
+    d = c + len; // right max array
+    failed = c == NULL;
+    #pragma omp for schedule(static) nowait
+    for( row = 0; row < lines; row++){
+      if( failed ) continue;
+      pixels += direction == HORIZONTAL ? n : height;
       if( s == 3){
         if( direction == HORIZONTAL ){
-          dilate3Horizontal(&(a[row * n]), n);
+          dilate3Horizontal(&(a[(size_t) row * n]), n, c);
         }else{
-          dilate3Vertical(&(a[row]), n, height);
+          dilate3Vertical(&(a[row]), n, height, c);
         }
       }else{
-        c = calloc( (s - 1), sizeof(Pixel)); // left max array
-        assert(c != NULL);
-        d = calloc( (s - 1), sizeof(Pixel)); // right max array
-        assert(d != NULL);
         if( direction == HORIZONTAL ){
-          dilateHorizontal(&(a[row * n]), n, c, d, s);
+          dilateHorizontal(&(a[(size_t) row * n]), n, c, d, s);
         }else{
           dilateVertical(&(a[row]), n, c, d, s, height);
         }
-        free(c);
-        free(d);
       }
     }
+    TRACE_END(span, direction == HORIZONTAL ? "dilation horizontal" : "dilation vertical", pixels);
   }
+  return failed ? SED_ERROR_MEMORY : SED_OK;
 }
 
 /*
  * Function:  erodeHorizontal
  * --------------------
- *  computes the erosion of row/column a with a structuring element size s using the HGW algorithm in the horizontal direction
+ *  computes the erosion of row a with a structuring element size s using the HGW algorithm
  * 
  *  a: the pixeldata
  *  n: the size of the pixeldata
- *  c: the 'left' buffer
- *  d: the 'right' buffer 
+ *  c: the 'left' buffer, n + s - 1 pixels
+ *  d: the 'right' buffer, n + s - 1 pixels
  *  s: the size of the structuring element
  *
  */
@@ -443,42 +650,22 @@ void erodeHorizontal(Pixel *a,
         int n,
         Pixel *c,
         Pixel *d,
-        int s){
-  int u, i;
-  int l = s/2;
-  for( u = l; u < n; u += s - 1){
-
-    d[0] = a[u];
-    for(i = 1; i < s - 1; i++){
-      d[i] = MIN(d[i - 1], a[u + 1]);
-    }
-    c[s - 2] = a[u - 1];
-    for( i = 1; i < s - 1; i++){
-      if( u - i - 1 < 0){ 
-        c[s - i - 2] = MAX_PIX;
-        continue;
-      }
-      c[s - i - 2] = MIN(c[s - i - 1], a[u - i - 1]);
-    }
-    for(i = 0; i < s - 1; i++){
-      if( u - l + i >= n ) break;
-      a[u - l + i] = MIN(c[i], d[i]);
-    }
-  }
+        int s
+        ){
+  minFilterLine(a, n, 1, c, d, s);
 }
 
 /*
  * Function:  erodeVertical
  * --------------------
- *  computes the erosion of row/column a with a structuring element size s using the HGW algorithm in the vertical direction
+ *  computes the erosion of column a with a structuring element size s using the HGW algorithm
  * 
  *  a: the pixeldata
- *  n: the size of the pixeldata
- *  c: the 'left' buffer
- *  d: the 'right' buffer 
+ *  n: the width of the image, the distance between two pixels of the column
+ *  c: the 'left' buffer, height + s - 1 pixels
+ *  d: the 'right' buffer, height + s - 1 pixels
  *  s: the size of the structuring element
- *  height: the height of the image
- *
+ *  height: the height of the image, the length of the column
  */
 
 void erodeVertical(Pixel *a, 
@@ -486,28 +673,9 @@ void erodeVertical(Pixel *a,
         Pixel *c,
         Pixel *d,
         int s,
-        int height){
-  int u, i;
-  int l = s/2;
-  for( u = l; u < n; u += s - 1){
-
-    d[0] = a[u * n];
-    for(i = 1; i < s - 1; i++){
-      d[i] = MIN(d[i - 1], a[(u + 1) * n]);
-    }
-    c[s - 2] = a[(u - 1) * n];
-    for( i = 1; i < s - 1; i++){
-      if( u - i - 1 < 0){ 
-        c[s - i - 2] = MAX_PIX;
-        continue;
-      }
-      c[s - i - 2] = MIN(c[s - i - 1], a[(u - i - 1) * n]);
-    }
-    for(i = 0; i < s - 1; i++){
-      if( u - l + i >= n ) break;
-      a[(u - l + i) * n] = MIN(c[i], d[i]);
-    }
-  }
+        int height
+        ){
+  minFilterLine(a, height, n, c, d, s);
 }
 
 
@@ -518,21 +686,21 @@ void erodeVertical(Pixel *a,
  *  a more complex algorithm like HGW is unnecessary in this case.
  * 
  *  a: the pixeldata
- *  n: the size of the pixeldata
- *  height: the height of the image
+ *  n: the width of the image, the distance between two pixels of the column
+ *  height: the height of the image, the length of the column
+ *  b: a scratch buffer of height pixels
  */
 
-void erode3Vertical(Pixel *a, int n, int height){
+void erode3Vertical(Pixel *a, int n, int height, Pixel *b){
   int i;
-  Pixel *b = calloc(n, sizeof(Pixel));
-  assert( b != NULL );
+  if( height < 2 ) return;
   b[0] = MIN(a[0], a[n]);
-  for(i = 1; i < n - 1; i++){
-    b[i] = MIN(MIN(a[(i - 1) * n], a[i * n]), a[(i + 1) * n]);
+  for(i = 1; i < height - 1; i++){
+    b[i] = MIN(MIN(a[(size_t) (i - 1) * n], a[(size_t) i * n]), a[(size_t) (i + 1) * n]);
   }
-  b[n - 1] = MIN(a[(n - 2) * n], a[(n - 1) * n]);
-  for(i = 0; i < n; i++)
-    a[i * n] = b[i];
+  b[height - 1] = MIN(a[(size_t) (height - 2) * n], a[(size_t) (height - 1) * n]);
+  for(i = 0; i < height; i++)
+    a[(size_t) i * n] = b[i];
 }
 
 
@@ -544,13 +712,13 @@ void erode3Vertical(Pixel *a, int n, int height){
  * 
  *  a: the pixeldata
  *  n: the size of the pixeldata
+ *  b: a scratch buffer of n pixels
  *  
  */
 
-void erode3Horizontal(Pixel *a, int n){
+void erode3Horizontal(Pixel *a, int n, Pixel *b){
   int i;
-  Pixel *b = calloc(n, sizeof(Pixel));
-  assert( b != NULL );
+  if( n < 2 ) return;
   
   b[0] = MIN(a[0], a[1]);
   for(i = 1; i < n - 1; i++){
@@ -564,96 +732,380 @@ void erode3Horizontal(Pixel *a, int n){
 /*
  * Function: erosion 
  * --------------------
- *  computes the erosion of an image im
+ *  computes the erosion of an image im, the rows (or columns) are divided over
+ *  the threads of the context and every thread reuses its own scratch arena.
+ *  Small images (see teamSize) stay on the calling thread.
  * 
- *  im: the image to be dilated
+ *  ctx: the context
+ *  im: the image to be eroded
  *  s: the size of the structuring element in direction direction
  *  direction: in what direction to treat the pixeldata (HORIZONTAL/VERTICAL)
  *
+ *  returns: SED_OK or SED_ERROR_MEMORY
  */
 
-void erosion(Image *im,
-      int s,
-      int direction){
+int erosion(SedContext *ctx,
+        Image *im,
+        int s,
+        int direction){
 
   int n = im->width;
   int height = im->height;
-  Pixel *a = im->data; 
+  Pixel *a = im->data;
+  int lines = direction == HORIZONTAL ? height : n; // rows or columns
+  int len = MAX(n, height) + s - 1; // the longest padded line
+  int row, failed = 0;
   Pixel *c, *d;
-  int chunk = height/MAX_THREAD_NUM;
-  int row;
-  #pragma omp parallel num_threads(MAX_THREAD_NUM) default(none) private(row, c, d) firstprivate(s, chunk, n, height, direction) shared(im, a)
+  size_t pixels;
+  int threads = teamSize(ctx, (size_t) n * height);
+  #pragma omp parallel num_threads(threads) default(none) private(row, c, d, pixels) firstprivate(s, n, height, lines, len, direction) shared(ctx, a) reduction(||:failed)
   {
-    for( row = chunk * omp_get_thread_num(); row < chunk * (omp_get_thread_num() + 1); row++){      
+    TRACE_BEGIN(span);
+    pixels = 0;
+    c = scratchBuffer(ctx, omp_get_thread_num(), 2 * (size_t) len); // left max array
+    d = c + len; // right max array
+    failed = c == NULL;
+    #pragma omp for schedule(static) nowait
+    for( row = 0; row < lines; row++){
+      if( failed ) continue;
+      pixels += direction == HORIZONTAL ? n : height;
       if( s == 3){
         if( direction == HORIZONTAL ){
-          erode3Horizontal(&(a[row * n]), n); 
+          erode3Horizontal(&(a[(size_t) row * n]), n, c);
         }else{
-          erode3Vertical(&(a[row]), n, height);
+          erode3Vertical(&(a[row]), n, height, c);
         }
       }else{
-        c = calloc( (s - 1), sizeof(Pixel)); // left max array
-        assert(c != NULL);
-        d = calloc( (s - 1), sizeof(Pixel)); // right max array
-        assert(d != NULL);
         if( direction == HORIZONTAL ){
-          erodeHorizontal(&(a[row * n]), n, c, d, s);
+          erodeHorizontal(&(a[(size_t) row * n]), n, c, d, s);
         }else{
           erodeVertical(&(a[row]), n, c, d, s, height);
         }
-        free(c);
-        free(d);
       }
     }
+    TRACE_END(span, direction == HORIZONTAL ? "erosion horizontal" : "erosion vertical", pixels);
+  }
+  return failed ? SED_ERROR_MEMORY : SED_OK;
+}
+
+/*
+ * Function: combineShifted 
+ * --------------------
+ *  folds a shifted copy of src into acc: acc(row, col) becomes the minimum (or
+ *  maximum) of itself and src(row + dy, col + dx). Positions that fall outside
+ *  of the image leave acc unchanged.
+ * 
+ *  acc: the accumulated pixeldata
+ *  src: the pixeldata to be folded in
+ *  width: the width of the image
+ *  height: the height of the image
+ *  dy: the vertical shift
+ *  dx: the horizontal shift
+ *  maximum: 1 to take the maximum, 0 to take the minimum
+ *  threads: the amount of threads
+ *
+ */
+
+static void combineShifted(Pixel *acc, Pixel *src, int width, int height, int dy, int dx, int maximum, int threads){
+  int row, col, first = MAX(0, -dx), last = MIN(width, width - dx);
+  Pixel *a, *b;
+  size_t pixels;
+  #pragma omp parallel num_threads(threads) default(none) private(row, col, a, b, pixels) shared(acc, src, width, height, dy, dx, first, last, maximum)
+  {
+    TRACE_BEGIN(span);
+    pixels = 0;
+    #pragma omp for schedule(static) nowait
+    for(row = MAX(0, -dy); row < MIN(height, height - dy); row++){
+      a = acc + (size_t) row * width;
+      b = src + (size_t) (row + dy) * width + dx;
+      pixels += MAX(0, last - first);
+      // acc and src never overlap
+      if( maximum ){
+        #pragma omp simd
+        for(col = first; col < last; col++) a[col] = MAX(a[col], b[col]);
+      }else{
+        #pragma omp simd
+        for(col = first; col < last; col++) a[col] = MIN(a[col], b[col]);
+      }
+    }
+    TRACE_END(span, maximum ? "shifted maximum" : "shifted minimum", pixels);
+  }
+}
+
+/*
+ * Function: lineSize 
+ * --------------------
+ *  returns: the size of the line of a layer in a direction, at least 1
+ */
+
+static int lineSize(Partition *p, int direction){
+  return MAX(direction == VERTICAL ? p->cubicFactor.height : p->cubicFactor.width, 1);
+}
+
+/*
+ * Function: sortByLine 
+ * --------------------
+ *  orders the layers by the size of their line in a direction, smallest
+ *  first (insertion sort, a disc has a few dozen layers at most)
+ * 
+ *  order: filled with count layer numbers
+ */
+
+static void sortByLine(Partition *parts, int count, int direction, int *order){
+  int i, j, k;
+  for(i = 0; i < count; i++){
+    k = i;
+    for(j = i; j > 0 && lineSize(&parts[order[j - 1]], direction) > lineSize(&parts[k], direction); j--)
+      order[j] = order[j - 1];
+    order[j] = k;
   }
 }
 
+/*
+ * Function: sharedPrefixPasses 
+ * --------------------
+ *  counts the line passes of the shared prefix evaluation in
+ *  laneMorphology: one per distinct line size in each direction, lines
+ *  of size 1 are the source itself. Evaluating every layer on its own takes
+ *  2 * count passes.
+ * 
+ *  parts: the partitions
+ *  count: the amount of partitions
+ * 
+ *  returns: the amount of line passes, -1 when out of memory
+ */
+
+int sharedPrefixPasses(Partition *parts, int count){
+  int *order = malloc((count + 1) * sizeof(int));
+  int direction, i, s, previous, passes = 0;
+  if( order == NULL ) return -1;
+  for(direction = HORIZONTAL; direction <= VERTICAL; direction++){
+    sortByLine(parts, count, direction, order);
+    previous = 1;
+    for(i = 0; i < count; i++){
+      s = lineSize(&parts[order[i]], direction);
+      passes += s != previous;
+      previous = s;
+    }
+  }
+  free(order);
+  return passes;
+}
+
+/*
+ * Function: linePass 
+ * --------------------
+ *  one line erosion (dilation) of lanes interleaved images, see laneFilter
+ * 
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+static int linePass(SedContext *ctx, Pixel *src, Pixel *dst, int width, int height, int lanes, int s,
+                    int direction, int maximum){
+  // laneMorphology checked that an interleaved row fits in an int
+  if( direction == VERTICAL || lanes == 1 )
+    return tiledFilter(ctx, src, dst, width * lanes, height, s, direction, maximum);
+  return laneFilter(ctx, src, dst, width, height, lanes, s, maximum);
+}
+
+/*
+ * Function: sharedLines 
+ * --------------------
+ *  folds the lines of all layers in one direction into acc, shifted by the
+ *  offsets of their layers. The layers go from the shortest line to the
+ *  longest, and every line erosion (dilation) continues from the one before:
+ *  a line of size s followed by one of size d + 1 is a line of size s + d,
+ *  also where pixels outside of the image are ignored, since the lines are
+ *  intervals. Layers with the same size share one pass, and only the last
+ *  line is kept.
+ * 
+ *  ctx: the context
+ *  source: the unchanged input
+ *  acc: the accumulated result
+ *  line: two buffers of the size of the input
+ *  parts: the partitions
+ *  count: the amount of partitions
+ *  order: scratch for count layer numbers
+ *  width: the width of the images
+ *  height: the height of the images
+ *  lanes: the amount of interleaved images, 1 for a plain image
+ *  direction: HORIZONTAL or VERTICAL
+ *  maximum: 1 for the dilation, 0 for the erosion
+ * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+static int sharedLines(SedContext *ctx, Pixel *source, Pixel *acc, Pixel **line, Partition *parts, int count,
+                       int *order, int width, int height, int lanes, int direction, int maximum){
+  // the pixels of an interleaved row, laneMorphology checked that they fit in an int
+  int sign = maximum ? -1 : 1, previous = 1, i, s, status = SED_OK, rowPixels = width * lanes;
+  Pixel *current = source, *next;
+  SparseFactor o;
+
+  sortByLine(parts, count, direction, order);
+  for(i = 0; status == SED_OK && i < count; i++){
+    s = lineSize(&parts[order[i]], direction);
+    if( s != previous ){
+      next = current == line[0] ? line[1] : line[0];
+      // the sizes are odd, so the difference is even and the step stays centered
+      if( (s - previous) % 2 == 0 )
+        status = linePass(ctx, current, next, width, height, lanes, s - previous + 1, direction, maximum);
+      else
+        status = linePass(ctx, source, next, width, height, lanes, s, direction, maximum);
+      current = next;
+      previous = s;
+    }
+    if( status != SED_OK ) break;
+    // interleaved, a shift by one column is a shift by lanes pixels
+    o = parts[order[i]].sparseFactor;
+    if( direction == HORIZONTAL ){
+      combineShifted(acc, current, rowPixels, height, -sign * o.topOffset, 0, maximum, ctx->threads);
+      combineShifted(acc, current, rowPixels, height, sign * o.bottomOffset, 0, maximum, ctx->threads);
+    }else{
+      combineShifted(acc, current, rowPixels, height, 0, -sign * o.leftOffset * lanes, maximum, ctx->threads);
+      combineShifted(acc, current, rowPixels, height, 0, sign * o.rightOffset * lanes, maximum, ctx->threads);
+    }
+  }
+  return status;
+}
+
+/*
+ * Function: laneMorphology 
+ * --------------------
+ *  erodes or dilates lanes interleaved images of the same size with the union
+ *  of the layers of a decomposition, optionally together with the origin.
+ *  Pixel (row, column) of image k is at (row * width + column) * lanes + k, so
+ *  every pass handles all images at once. A partition p is the layer made of
+ *  a horizontal line of p.cubicFactor.width pixels shifted up by topOffset
+ *  and down by bottomOffset, and a vertical line of p.cubicFactor.height
+ *  pixels shifted left by leftOffset and right by rightOffset. The erosion by
+ *  such a union is the minimum of the shifted 1D erosions, and the lines of
+ *  a disc are nested, so the 1D erosions share their prefixes (see
+ *  sharedLines): a pass per distinct size and direction, mostly with lines
+ *  of 3 pixels, instead of two HGW passes per layer. The dilation uses the
+ *  reflected layers. The passes run on the tiles of tile.c.
+ * 
+ *  ctx: the context
+ *  data: the interleaved pixeldata, modified in place
+ *  width: the width of the images
+ *  height: the height of the images
+ *  lanes: the amount of images, 1 for a plain image
+ *  parts: the partitions
+ *  count: the amount of partitions
+ *  origin: 1 when the origin belongs to the structuring element
+ *  maximum: 1 for the dilation, 0 for the erosion
+ *  work: 3 * width * height * lanes pixels of workspace, or NULL to allocate
+ *  them for the call
+ * 
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the images are too large, also
+ *  when an interleaved row has more pixels than an int holds, or
+ *  SED_ERROR_MEMORY
+ */
+
+int laneMorphology(SedContext *ctx, Pixel *data, int width, int height, int lanes, Partition *parts, int count,
+                   int origin, int maximum, Pixel *work){
+  size_t size;
+  // the passes take the width * lanes pixels of an interleaved row as an int
+  int status = imageSize(width, height, lanes, &size) != SED_OK || width > INT_MAX / lanes ? SED_ERROR_ARGUMENT : SED_OK;
+  Pixel *buffer = work != NULL || status != SED_OK ? work : contextAlloc(ctx, 3 * size);
+  Pixel *line[2] = {buffer + size, buffer + 2 * size};
+  int *order = contextAlloc(ctx, (count + 1) * sizeof(int));
+
+  if( status == SED_OK && (buffer == NULL || order == NULL) ) status = SED_ERROR_MEMORY;
+  TRACE_BEGIN(span);
+  if( status == SED_OK ){
+    memcpy(buffer, data, size);
+    if( !origin ) memset(data, maximum ? MIN_PIX : MAX_PIX, size);
+    status = sharedLines(ctx, buffer, data, line, parts, count, order, width, height, lanes, HORIZONTAL, maximum);
+  }
+  if( status == SED_OK )
+    status = sharedLines(ctx, buffer, data, line, parts, count, order, width, height, lanes, VERTICAL, maximum);
+  if( status == SED_OK && ctx->verbose && count > 0 )
+    printf("shared prefix: %d line passes instead of %d\n", sharedPrefixPasses(parts, count), 2 * count);
+  if( work == NULL ) contextFree(ctx, buffer);
+  contextFree(ctx, order);
+  TRACE_END(span, maximum ? "partition dilation" : "partition erosion", size);
+  return status;
+}
+
+/*
+ * Function: partitionMorphology 
+ * --------------------
+ *  erodes or dilates an image with the union of the layers of a
+ *  decomposition, optionally together with the origin, see laneMorphology
+ * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+static int partitionMorphology(SedContext *ctx, Image *im, Partition *parts, int count, int origin, int maximum){
+  return laneMorphology(ctx, im->data, im->width, im->height, 1, parts, count, origin, maximum, NULL);
+}
+
+/*
+ * Function: partitionErosion 
+ * --------------------
+ *  erodes an image with the union of the layers of a decomposition, see
+ *  partitionMorphology. With origin set and the partitions of a disc this is
+ *  the erosion by the whole disc.
+ * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+int partitionErosion(SedContext *ctx, Image *im, Partition *parts, int count, int origin){
+  return partitionMorphology(ctx, im, parts, count, origin, 0);
+}
+
+/*
+ * Function: partitionDilation 
+ * --------------------
+ *  dilates an image with the union of the layers of a decomposition, see
+ *  partitionMorphology
+ * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+int partitionDilation(SedContext *ctx, Image *im, Partition *parts, int count, int origin){
+  return partitionMorphology(ctx, im, parts, count, origin, 1);
+}
+
 /*
  * Function: morphOpening 
  * --------------------
- *  takes an image and a structuring element size and computes the morphological opening of 
- *  that image with a structuring element of dimensions: horizontalSize * verticalSize
+ *  computes the morphological opening of an image with the layer of a single
+ *  partition (see partitionMorphology), without the origin
  * 
+ *  ctx: the context
  *  im: the image to be morph opened
  *  p: the partition consisting of a cubic and a sparse factor
  * 
+ *  returns: SED_OK or an error code
  */
 
-void morphOpening(Image *im, Partition p){
-  if( p.cubicFactor.width > 1 )
-    erosion(im, p.cubicFactor.width, HORIZONTAL);
-  if( p.cubicFactor.height > 1 )
-    erosion(im, p.cubicFactor.height, VERTICAL);
-  erodeNaive(im, p.sparseFactor);
-  if( p.cubicFactor.width > 1)
-    dilation(im, p.cubicFactor.width, HORIZONTAL);
-  if( p.cubicFactor.height > 1)
-    dilation(im, p.cubicFactor.height, VERTICAL);
-  dilateNaive(im, p.sparseFactor);
+int morphOpening(SedContext *ctx, Image *im, Partition p){
+  int status = partitionErosion(ctx, im, &p, 1, 0);
+  if( status == SED_OK )
+    status = partitionDilation(ctx, im, &p, 1, 0);
+  return status;
 }
 
 /*
  * Function: morphClosing 
  * --------------------
- *  takes an image and a structuring element size and computes the morphological opening of 
- *  that image with a structuring element of dimensions: horizontalSize * verticalSize
+ *  computes the morphological closing of an image with the layer of a single
+ *  partition (see partitionMorphology), without the origin
  * 
+ *  ctx: the context
  *  im: the image to be morph closed
  *  p: the partition consisting of a cubic and a sparse factor
  * 
+ *  returns: SED_OK or an error code
  */
 
-void morphClosing(Image *im,  Partition p){
-  if( p.cubicFactor.width > 1 )
-    dilation(im, p.cubicFactor.width, HORIZONTAL);
-  if( p.cubicFactor.height > 1 )  
-  dilation(im, p.cubicFactor.height, VERTICAL);
-  dilateNaive(im, p.sparseFactor);
-  if( p.cubicFactor.width > 1 )
-    erosion(im, p.cubicFactor.width, HORIZONTAL);
-  if( p.cubicFactor.height > 1 )
-    erosion(im, p.cubicFactor.height, VERTICAL);
-  erodeNaive(im, p.sparseFactor);
+int morphClosing(SedContext *ctx, Image *im, Partition p){
+  int status = partitionDilation(ctx, im, &p, 1, 0);
+  if( status == SED_OK )
+    status = partitionErosion(ctx, im, &p, 1, 0);
+  return status;
 }
 
 /*
@@ -666,8 +1118,8 @@ void morphClosing(Image *im,  Partition p){
  */
 
 void grayscaleToBinary(Image *im, int threshold){
-  unsigned int i = 0;
-  for(i = 0; i < im->width * im->height * im->channels; i++)  
+  size_t i, size = (size_t) im->width * im->height * im->channels;
+  for(i = 0; i < size; i++)
     im->data[i] = (im->data[i] < threshold ) ? MIN_PIX : MAX_PIX;
 }
 
@@ -681,8 +1133,8 @@ void grayscaleToBinary(Image *im, int threshold){
  */
 
 void printBinaryImage(Image *im){
-  unsigned int i = 0;
-  for( i = 0; i < im->width * im->height * im->channels; i++){
+  size_t i, size = (size_t) im->width * im->height * im->channels;
+  for( i = 0; i < size; i++){
     if( i % im->width == 0 ) printf("\n");
     if( im->data[i] == MIN_PIX ) {
       printf(".");
@@ -705,8 +1157,8 @@ void printBinaryImage(Image *im){
  */
 
 void imageUnion(Image* ims, int len){
-  unsigned int i, pix;
-  unsigned int size = ims[0].width * ims[0].height;
+  int i;
+  size_t pix, size = (size_t) ims[0].width * ims[0].height;
   for(i = 1; i < len; i++){
     for(pix = 0; pix < size; pix++) 
       ims[0].data[pix] = MAX(ims[0].data[pix], ims[i].data[pix]);
@@ -725,8 +1177,7 @@ void imageUnion(Image* ims, int len){
  */
 
 void imageBinaryUnion(Image* im1, Image *im2){
-  unsigned int pix;
-  unsigned int size = im1->width * im1->height;
+  size_t pix, size = (size_t) im1->width * im1->height;
   for(pix = 0; pix < size; pix++) 
     im1->data[pix] = MAX(im1->data[pix], im2->data[pix]);
 }
@@ -743,59 +1194,94 @@ void imageBinaryUnion(Image* im1, Image *im2){
  */
 
 void imageIntersection(Image* ims, int len){
-  unsigned int i, pix;
-  unsigned int size = ims[0].width * ims[0].height;
+  int i;
+  size_t pix, size = (size_t) ims[0].width * ims[0].height;
   for(i = 1; i < len; i++){
     for(pix = 0; pix < size; pix++) 
       ims[0].data[pix] = MIN(ims[0].data[pix], ims[i].data[pix]);
   }
 }
 
+/*
+ * Function: shrinkPixels 
+ * --------------------
+ *  
+ *  gives the memory beyond the first size bytes of the pixeldata of an owned
+ *  image back: realloc shrinks malloc blocks without moving large ones,
+ *  other allocators get a block of the new size and the pixels are copied.
+ *  So do images with firstTouch, since row r now lies where row r / 3 or r / 4 of the
+ *  color image was and the rows have to go back to the threads that own them.
+ *  When that allocation fails the image keeps its larger block.
+ * 
+ *  ctx: the context
+ *  im: a pointer to the image
+ *  size: the bytes still in use
+ */
+
+static void shrinkPixels(SedContext *ctx, Image *im, size_t size){
+  Pixel *data;
+  if( im->borrowed || im->height == 0 ) return;
+  if( ctx->alloc == NULL && !ctx->placement.firstTouch ){
+    data = realloc(im->data, size);
+    if( data != NULL ) im->data = data;
+    return;
+  }
+  data = allocatePlaced(ctx, im->data, size / im->height, im->height);
+  if( data == NULL ) return;
+  replacePixels(ctx, im, data);
+}
+
 /*
  * Function: rgbToGrayscale 
  * --------------------
  *  
- *  converts an rgb image to grayscale
+ *  converts an rgb image to grayscale in place, pixel i only reads pixels
+ *  3 * i and on, and gives the rest of the buffer back (see shrinkPixels)
  * 
+ *  ctx: the context
  *  im: a pointer to the image
  * 
+ *  returns: SED_OK
  */
 
-void rgbToGrayscale(Image *im){
-  unsigned int pixel;
-  Pixel *newData = calloc(im->width * im->height, sizeof(Pixel));
-  for(pixel = 0; pixel < im->width * im->height * im->channels; pixel += 3){
-    newData[pixel/3] = (int) (RGB_RED * im->data[pixel] 
-                              + RGB_GREEN *im->data[pixel + 1] 
-                              + RGB_BLUE * im->data[pixel + 2]);
+int rgbToGrayscale(SedContext *ctx, Image *im){
+  size_t pixel, size = (size_t) im->width * im->height * im->channels;
+  Pixel *a = im->data;
+  for(pixel = 0; pixel < size; pixel += 3){
+    a[pixel/3] = (int) (RGB_RED * a[pixel] 
+                        + RGB_GREEN * a[pixel + 1] 
+                        + RGB_BLUE * a[pixel + 2]);
   }
-  free(im->data);
   im->channels = 1;
-  im->data = newData;
+  shrinkPixels(ctx, im, size / 3);
+  return SED_OK;
 }
 
 /*
  * Function: rgbaToGrayscale 
  * --------------------
  *  
- *  converts an rgba image to grayscale
+ *  converts an rgba image to grayscale in place like rgbToGrayscale,
+ *  transparent pixels become MAX_PIX
  * 
+ *  ctx: the context
  *  im: a pointer to the image
  * 
+ *  returns: SED_OK
  */
 
-void rgbaToGrayscale(Image *im){
-  unsigned int pixel;
-  Pixel *newData = calloc(im->width * im->height, sizeof(Pixel));
-  for(pixel = 0; pixel < im->width * im->height * im->channels; pixel += 4){
-    newData[pixel/4] = (int) (RGB_RED * im->data[pixel] 
-                              + RGB_GREEN *im->data[pixel + 1] 
-                              + RGB_BLUE * im->data[pixel + 2]);
-    if(im->data[pixel+3] == 0) newData[pixel/4] = MAX_PIX;
+int rgbaToGrayscale(SedContext *ctx, Image *im){
+  size_t pixel, size = (size_t) im->width * im->height * im->channels;
+  Pixel *a = im->data, gray;
+  for(pixel = 0; pixel < size; pixel += 4){
+    gray = (int) (RGB_RED * a[pixel] 
+                  + RGB_GREEN * a[pixel + 1] 
+                  + RGB_BLUE * a[pixel + 2]);
+    a[pixel/4] = a[pixel + 3] == 0 ? MAX_PIX : gray;
   }
-  free(im->data);
   im->channels = 1;
-  im->data = newData;
+  shrinkPixels(ctx, im, size / 4);
+  return SED_OK;
 }
 
 /*
@@ -804,13 +1290,13 @@ void rgbaToGrayscale(Image *im){
  *  
  *  Allocates and initializes a new queue
  * 
- *  returns: a pointer to the new queue
+ *  returns: a pointer to the new queue or NULL when out of memory
  */
 
 Queue *newQueue(){
   Queue *new;
   new = malloc(sizeof(struct Queue));
-  assert(new != NULL);
+  if( new == NULL ) return NULL;
   new->head = NULL;
   new->tail = NULL;
   new->size = 0;
@@ -912,16 +1398,16 @@ int isEmptyQueue(Queue *qp){
  * 
  *  SE: the structuring element to be decomposed
  * 
- *  returns: a partition containing the cubic and sparse factor
+ *  returns: a partition containing the cubic and sparse factor, or NULL
  */
 
 Partition *smallestMorphOpening(Image *SE){
   Pixel *data = SE->data;
-  unsigned int pix;
+  size_t pix;
   int width = SE->width;
   int height = SE->height;
-  int seSize = width * height;
-  RunLength top, bottom, left, right;
+  size_t seSize = (size_t) width * height;
+  RunLength top = {{0, 0}, {0, 0}}, bottom = top, left = top, right = top;
 
   int foundRunlength = 0;
   for(pix = 0; pix < seSize / 2; pix++ ){ // loop horizontally over SE
@@ -979,7 +1465,7 @@ Partition *smallestMorphOpening(Image *SE){
       right.start.col = pix % height;
       break;
     }
-    if(pix <= width)
+    if(pix <= (size_t) width)
       pix = seSize - width + pix - 1;
   }
 
@@ -998,21 +1484,21 @@ Partition *smallestMorphOpening(Image *SE){
   c.height = botLen;
 
   Partition *p = malloc(sizeof(struct Partition));
-  assert( p != NULL );  
+  if( p == NULL ) return NULL;
   p->cubicFactor = c;
 
-  int yOffset, xOffset;
+  int yOffset = 0, xOffset = 0;
   //compute distance from top/bottom to middle, we know the SE is symmetrical
-  for( int i = width/2; i < seSize/2; i += width){
+  for( size_t i = width/2; i < seSize/2; i += width){
     if( data[i] == MAX_PIX){
-      yOffset = (width * height/2 - i ) / width;
+      yOffset = (int) ((seSize / 2 - i) / width);
       break;
     }
   }
   // Compute distance from left/right to middle, we know the SE is symmetrical
-  for( int i = width * height / 2 - width/2; i < seSize; i++){
+  for( size_t i = seSize / 2 - width/2; i < seSize; i++){
     if( data[i] == MAX_PIX){
-      xOffset = (width * height / 2) - i;
+      xOffset = (int) (seSize / 2) - (int) i;
       break;
     }
   }
@@ -1039,10 +1525,10 @@ Partition *smallestMorphOpening(Image *SE){
 
 void removePartition(Image *im){
   Pixel *data = im->data;
-  unsigned int pix;
+  size_t pix;
   int width = im->width;
   int height = im->height;
-  int seSize = width * height;
+  size_t seSize = (size_t) width * height;
 
   int foundRunlength = 0;
   for(pix = 0; pix < seSize / 2; pix++ ){ // loop horizontally over SE
@@ -1082,74 +1568,197 @@ void removePartition(Image *im){
       data[pix] = MIN_PIX;
       foundRunlength++;
     }
-    if(pix <= width) pix = seSize - width + pix - 1;
+    if(pix <= (size_t) width) pix = seSize - width + pix - 1;
+  }
+}
+
+/*
+ * Function: sparseInPlace 
+ * --------------------
+ *  
+ *  erodes or dilates an image in place with four points, up rows above, down
+ *  rows below, left columns to the left and right columns to the right.
+ *  Points outside of the image are ignored. Only the last up + 1 rows of the
+ *  input are kept, in a ring in the scratch arena of the calling thread, so
+ *  it needs no copy of the image: the path of dilateNaive and erodeNaive
+ *  when the image does not fit in the memory budget twice.
+ * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+static int sparseInPlace(SedContext *ctx, Image *im, int up, int down, int left, int right, int maximum){
+  int width = im->width, height = im->height, slots = up + 1, row, col, v;
+  Pixel *ring = scratchBuffer(ctx, 0, (size_t) slots * width), *a, *above, *here, *below;
+  if( ring == NULL ) return SED_ERROR_MEMORY;
+  TRACE_BEGIN(span);
+  for(row = 0; row < height; row++){
+    a = im->data + (size_t) row * width;
+    here = ring + (size_t) (row % slots) * width;
+    memcpy(here, a, width);
+    above = row - up >= 0 ? ring + (size_t) ((row - up) % slots) * width : NULL;
+    below = row + down < height ? a + (size_t) down * width : NULL;
+    for(col = 0; col < width; col++){
+      // below may be this row when down is 0, it is read before it is written
+      v = maximum ? MIN_PIX : MAX_PIX;
+      if( above != NULL ) v = maximum ? MAX(v, above[col]) : MIN(v, above[col]);
+      if( below != NULL ) v = maximum ? MAX(v, below[col]) : MIN(v, below[col]);
+      if( col - left >= 0 ) v = maximum ? MAX(v, here[col - left]) : MIN(v, here[col - left]);
+      if( col + right < width ) v = maximum ? MAX(v, here[col + right]) : MIN(v, here[col + right]);
+      a[col] = v;
+    }
+  }
+  TRACE_END(span, maximum ? "sparse dilation" : "sparse erosion", (size_t) width * height);
+  return SED_OK;
+}
+
+/*
+ * Function: tradeScratch 
+ * --------------------
+ *  
+ *  hands the result of a pass in the scratch arena of the calling thread to
+ *  a single channel image: the arena takes over the old pixels, so the next
+ *  pass has a buffer without an allocation or a copy back. Views and images
+ *  of several channels get the result copied instead.
+ * 
+ *  ctx: the context
+ *  im: the image, size bytes of pixeldata
+ *  size: the bytes of the image
+ */
+
+static void tradeScratch(SedContext *ctx, Image *im, size_t size){
+  Scratch *arena = &ctx->scratch[0];
+  Pixel *buffer = im->data;
+  if( im->borrowed || im->channels != 1 ){
+    // a view, or only the first channel worth of pixels was computed
+    memcpy(im->data, arena->data, size);
+    return;
   }
+  im->data = arena->data;
+  arena->data = buffer;
+  arena->size = size;
 }
 
 /*
  * Function: dilateNaive 
  * --------------------
  *  
- *  dilates an image with sparse factor s using a naive approach
+ *  dilates an image with the four points of sparse factor s using a naive
+ *  approach: (-topOffset, 0), (bottomOffset, 0), (0, -leftOffset) and
+ *  (0, rightOffset) as (row, column) offsets. The dilation uses the reflected points. Points outside of the
+ *  image are ignored.
  * 
+ *  Images that do not fit in the memory budget twice go through sparseInPlace.
+ *
+ *  ctx: the context
  *  im: the image to be dilated
  *  s: the sparsefactor
  * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
  */
 
-void dilateNaive(Image *im, SparseFactor s){
-  int size = im->width * im->height;
-  int width = im->width;
-  Pixel *newData = calloc(im->width * im->height, sizeof(Pixel));
-  assert(newData != NULL);
-  int i, max;
-  for(i = 0; i < size; i++ ){
-    max = MIN_PIX;
-    if( i - s.topOffset * width >= 0 )
-      max = MAX(im->data[i - s.topOffset * width], max);
-    if( i + s.bottomOffset * width < size )
-      max = MAX(im->data[i + s.bottomOffset * width], max);
-    if( i - s.leftOffset >= 0 )
-      max = MAX(im->data[i - s.leftOffset], max);
-    if( i + s.rightOffset < size )
-      max = MAX(im->data[i + s.rightOffset], max);
-    newData[i] = max;
+int dilateNaive(SedContext *ctx, Image *im, SparseFactor s){
+  int width = im->width, height = im->height;
+  int row, col, max;
+  size_t pixels;
+  Pixel *a = im->data;
+  int threads = teamSize(ctx, (size_t) width * height);
+  if( ctx->memoryBudget > 0 && BUDGET_RESERVE + 2 * (size_t) width * height > ctx->memoryBudget )
+    return sparseInPlace(ctx, im, s.bottomOffset, s.topOffset, s.rightOffset, s.leftOffset, 1);
+  // the result goes to the scratch arena of the calling thread, see tradeScratch
+  Pixel *newData = scratchBuffer(ctx, 0, (size_t) width * height);
+  if( newData == NULL ) return SED_ERROR_MEMORY;
+  #pragma omp parallel num_threads(threads) default(none) private(row, col, max, pixels) shared(a, newData, width, height, s)
+  {
+    TRACE_BEGIN(span);
+    pixels = 0;
+    #pragma omp for schedule(static) nowait
+    for(row = 0; row < height; row++){
+      pixels += width;
+      for(col = 0; col < width; col++){
+        max = MIN_PIX;
+        if( row + s.topOffset < height )
+          max = MAX(a[(size_t) (row + s.topOffset) * width + col], max);
+        if( row - s.bottomOffset >= 0 )
+          max = MAX(a[(size_t) (row - s.bottomOffset) * width + col], max);
+        if( col + s.leftOffset < width )
+          max = MAX(a[(size_t) row * width + col + s.leftOffset], max);
+        if( col - s.rightOffset >= 0 )
+          max = MAX(a[(size_t) row * width + col - s.rightOffset], max);
+        newData[(size_t) row * width + col] = max;
+      }
+    }
+    TRACE_END(span, "sparse dilation", pixels);
   }
-  free(im->data);
-  im->data = newData;
+  tradeScratch(ctx, im, (size_t) width * height);
+  return SED_OK;
 }
 
 /*
  * Function: erodeNaive 
  * --------------------
  *  
- *  erodes an image with sparse factor s using a naive approach
+ *  erodes an image with the four points of sparse factor s using a naive
+ *  approach: (-topOffset, 0), (bottomOffset, 0), (0, -leftOffset) and
+ *  (0, rightOffset) as (row, column) offsets. Points outside of the
+ *  image are ignored.
  * 
+ *  Images that do not fit in the memory budget twice go through sparseInPlace.
+ *
+ *  ctx: the context
  *  im: the image to be eroded
  *  s: the sparsefactor
  * 
+ *  returns: SED_OK or SED_ERROR_MEMORY
  */
 
-void erodeNaive(Image *im, SparseFactor s){
-  int size = im->width * im->height;
-  int width = im->width;
-  Pixel *newData = calloc(im->width * im->height + 2, sizeof(Pixel));
-  assert(newData != NULL);
-  int min, i;
-  for(i = 0; i < size; i++ ){
-    min = MAX_PIX;
-    if( i - s.topOffset * width >= 0 ) 
-      min = MIN(im->data[i - s.topOffset * width], min);
-    if( i + s.bottomOffset * width < size ) 
-      min = MIN(im->data[i + s.bottomOffset * width], min);
-    if( i - s.leftOffset >= 0 ) 
-      min = MIN(im->data[i - s.leftOffset], min);
-    if( i + s.rightOffset < size ) 
-      min = MIN(im->data[i + s.rightOffset], min);
-    newData[i] = min;
+int erodeNaive(SedContext *ctx, Image *im, SparseFactor s){
+  int width = im->width, height = im->height;
+  int row, col, min;
+  size_t pixels;
+  Pixel *a = im->data;
+  int threads = teamSize(ctx, (size_t) width * height);
+  if( ctx->memoryBudget > 0 && BUDGET_RESERVE + 2 * (size_t) width * height > ctx->memoryBudget )
+    return sparseInPlace(ctx, im, s.topOffset, s.bottomOffset, s.leftOffset, s.rightOffset, 0);
+  // the result goes to the scratch arena of the calling thread, see tradeScratch
+  Pixel *newData = scratchBuffer(ctx, 0, (size_t) width * height);
+  if( newData == NULL ) return SED_ERROR_MEMORY;
+  #pragma omp parallel num_threads(threads) default(none) private(row, col, min, pixels) shared(a, newData, width, height, s)
+  {
+    TRACE_BEGIN(span);
+    pixels = 0;
+    #pragma omp for schedule(static) nowait
+    for(row = 0; row < height; row++){
+      pixels += width;
+      for(col = 0; col < width; col++){
+        min = MAX_PIX;
+        if( row - s.topOffset >= 0 )
+          min = MIN(a[(size_t) (row - s.topOffset) * width + col], min);
+        if( row + s.bottomOffset < height )
+          min = MIN(a[(size_t) (row + s.bottomOffset) * width + col], min);
+        if( col - s.leftOffset >= 0 )
+          min = MIN(a[(size_t) row * width + col - s.leftOffset], min);
+        if( col + s.rightOffset < width )
+          min = MIN(a[(size_t) row * width + col + s.rightOffset], min);
+        newData[(size_t) row * width + col] = min;
+      }
+    }
+    TRACE_END(span, "sparse erosion", pixels);
   }
-  free(im->data);
-  im->data = newData;
+  tradeScratch(ctx, im, (size_t) width * height);
+  return SED_OK;
+}
+
+/*
+ * Function: countForeground 
+ * --------------------
+ *  returns: the amount of MAX_PIX pixels in an image
+ */
+
+static size_t countForeground(Image *im){
+  size_t i, count = 0, size = (size_t) im->width * im->height;
+  for(i = 0; i < size; i++)
+    if( im->data[i] == MAX_PIX ) count++;
+  return count;
 }
 
 /*
@@ -1157,24 +1766,28 @@ void erodeNaive(Image *im, SparseFactor s){
  * --------------------
  *  
  *  Decomposes a structuring element SE into a union of partitions and 
- *    enqueues each partition
+ *    enqueues each partition. A lone origin pixel needs no partition, the
+ *    opening by it is the identity.
  * 
+ *  ctx: the context, verbose contexts print every step
  *  SE: the structuring element to be decomposed
  *  qp: the queue in which the partitions are stored
  * 
+ *  returns: SED_OK, SED_ERROR_ARGUMENT for an empty SE or SED_ERROR_DECOMPOSITION
  */
 
-void decompose(Image *SE, Queue *qp){
+int decompose(SedContext *ctx, Image *SE, Queue *qp){
   Partition *p;
-  do{
+  int iterations = 0;
+  if( countForeground(SE) == 0 ) return SED_ERROR_ARGUMENT;
+  while( countForeground(SE) > 1 ){
+    if( iterations++ > SE->width ) return SED_ERROR_DECOMPOSITION;
     p = smallestMorphOpening(SE);
-    if( p == NULL ) {
-      fprintf(stderr, "Something went wrong while partitioning\n");
-      exit(-1);
-    }
+    if( p == NULL ) return SED_ERROR_DECOMPOSITION;
     enqueue(qp, p);
     removePartition(SE);
-    if(VERBOSE) printBinaryImage(SE);
+    if( ctx->verbose ) printBinaryImage(SE);
     if(p->sparseFactor.topOffset <= 1 && p->sparseFactor.leftOffset <= 1 ) break;
-  }while( p != NULL);
-}
\ No newline at end of file
+  }
+  return SED_OK;
+}
@@ -1,6 +1,14 @@
 #ifndef IMAGE
 #define IMAGE
 
+#include <stddef.h>
+#include <stdint.h>
+#include "imagewrite.h"
+
+/* the most bytes of pixeldata, so that offsets fit in a ptrdiff_t and the
+ * workspaces of up to four times the image in a size_t */
+#define IMAGE_MAX_BYTES ((size_t) (PTRDIFF_MAX / 4))
+
 typedef unsigned char Pixel;
 
 typedef struct Image {
@@ -9,6 +17,7 @@ typedef struct Image {
   int channels;
   int stride;
   Pixel *data;
+  int borrowed;   /* 1 when the pixels belong to someone else, see imageView */
 }Image;
 
 typedef struct Coordinate{
@@ -45,10 +54,18 @@ typedef struct Queue {
   unsigned int size;
 } Queue;
 
+struct SedContext;
+
 struct Image *createImage(Pixel*, int, int, int);
-struct Image *readImage(char*);
-struct Image *copyImage(struct Image*);
-void freeImage(struct Image*);
+int imageSize(int, int, int, size_t*);
+Image imageView(Pixel*, int, int, int);
+Pixel *exchangePixels(struct Image*, Pixel*);
+void replacePixels(struct SedContext*, struct Image*, Pixel*);
+int readImage(struct SedContext*, char*, struct Image**);
+int copyImage(struct SedContext*, struct Image*, struct Image**);
+int writeImage(struct SedContext*, struct Image*, char*);
+int writeImageWithOptions(struct SedContext*, struct Image*, char*, WriteOptions);
+void freeImage(struct SedContext*, struct Image*);
 Pixel getPixel(struct Image*, int, int);
 void setPixel(struct Image*, int , int, Pixel);
 int getWidth(struct Image*);
@@ -57,32 +74,37 @@ int getChannels(struct Image*);
 Pixel *getData(struct Image*);
 void dilateHorizontal(Pixel*, int, Pixel*, Pixel*, int);
 void dilateVertical(Pixel*, int, Pixel*, Pixel*, int, int);
-void dilate3Horizontal(Pixel*, int);
-void dilate3Vertical(Pixel*, int, int);
+void dilate3Horizontal(Pixel*, int, Pixel*);
+void dilate3Vertical(Pixel*, int, int, Pixel*);
 void erodeHorizontal(Pixel*, int, Pixel*, Pixel*, int);
 void erodeVertical(Pixel*, int, Pixel*, Pixel*, int, int);
-void erode3Horizontal(unsigned char*, int);
-void erode3Vertical(unsigned char*, int, int);
-void dilation(struct Image*, int, int);
-void erosion(struct Image*, int, int);
-void morphOpening(struct Image*, struct Partition);
-void morphClosing(struct Image*, struct Partition);
+void erode3Horizontal(Pixel*, int, Pixel*);
+void erode3Vertical(Pixel*, int, int, Pixel*);
+int dilation(struct SedContext*, struct Image*, int, int);
+int erosion(struct SedContext*, struct Image*, int, int);
+int sharedPrefixPasses(struct Partition*, int);
+int laneMorphology(struct SedContext*, Pixel*, int, int, int, struct Partition*, int, int, int, Pixel*);
+int partitionErosion(struct SedContext*, struct Image*, struct Partition*, int, int);
+int partitionDilation(struct SedContext*, struct Image*, struct Partition*, int, int);
+int morphOpening(struct SedContext*, struct Image*, struct Partition);
+int morphClosing(struct SedContext*, struct Image*, struct Partition);
 void grayscaleToBinary(struct Image*, int);
 void printBinaryImage(struct Image*);
-struct Image *computeBinaryDiscSE(int);
+struct Image *computeBinaryDiscSE(struct SedContext*, int);
 void imageUnion(struct Image*, int);
+void imageBinaryUnion(struct Image*, struct Image*);
 void imageIntersection(struct Image*, int);
-void rgbToGrayscale(struct Image*);
-void rgbaToGrayscale(struct Image*);
+int rgbToGrayscale(struct SedContext*, struct Image*);
+int rgbaToGrayscale(struct SedContext*, struct Image*);
 Queue *newQueue();
+int queueSize(struct Queue*);
+void freeQueue(struct Queue*);
 void enqueue(struct Queue*, struct Partition*);
 Partition *dequeue(Queue*);
-struct Image *computeCubicFactor(int, int);
-void removePartition(struct Image*);
-int isEmpty(struct Queue*);
-void dilateNaive(struct Image*, SparseFactor);
-void erodeNaive(struct Image*, SparseFactor);
+int isEmptyQueue(struct Queue*);
+int dilateNaive(struct SedContext*, struct Image*, SparseFactor);
+int erodeNaive(struct SedContext*, struct Image*, SparseFactor);
 Partition *smallestMorphOpening(struct Image*);
 void removePartition(struct Image *);
-void decompose(Image*, Queue*);
+int decompose(struct SedContext*, Image*, Queue*);
 #endif
\ No newline at end of file
@@ -0,0 +1,1071 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "context.h"
+#include "imagewrite.h"
+#include "trace.h"
+#include "omp.h"
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_STORED_MAX 65535
+
+#define ADLER_BASE 65521
+
+#ifndef MIN
+#define MAX(a,b)  (((a)>(b)) ? (a):(b))
+#define MIN(a,b)  (((a)<(b)) ? (a):(b))
+#endif
+
+#define PNG_MIN_STRIP_BYTES 65536
+#define PNG_STRIPS_PER_THREAD 2
+#define PNG_MAX_STRIP_BYTES (1 << 30)   /* keeps the match positions of deflateFixed and the IDAT lengths in range */
+#define PNG_STRIP_OVERHEAD 64           /* block headers and the sync flush of a deflated strip */
+
+/*
+ * The deflate encoder below only emits stored and fixed-Huffman blocks, the
+ * same block types stb_image_write uses. What it adds over stbiw__zlib_compress
+ * is the ability to end a strip on a byte boundary without finishing the stream
+ * (an empty stored block, the "sync flush" of zlib), so that strips compressed
+ * by different threads can be concatenated into a single valid zlib stream.
+ */
+
+static const int lengthBase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+  35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const int lengthExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,
+  3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const int distBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+  257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const int distExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,
+  7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+/* search effort per compression level, level 0 is stored */
+static const int levelChain[10] = {0, 1, 4, 8, 16, 32, 64, 128, 512, 4096};
+static const int levelNice[10] = {0, 8, 16, 32, 32, 64, 128, 258, 258, 258};
+
+static unsigned short literalCode[288];
+static unsigned char literalBits[288];
+static unsigned char lengthSymbol[DEFLATE_MAX_MATCH + 1];
+static unsigned char distanceSymbol[DEFLATE_WINDOW + 1];
+static unsigned int crcTable[256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+typedef struct BitWriter {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+  unsigned int bits;
+  int count;
+  int failed;     /* set when the buffer could not grow, the output is then incomplete */
+} BitWriter;
+
+typedef struct PngStrip {
+  unsigned char *deflated;
+  size_t deflatedLen;
+  size_t rawLen;
+  unsigned int adler;
+  unsigned int crc;   /* of the IDAT chunk so far, the adler32 of the last strip is added when known */
+  int failed;
+} PngStrip;
+
+typedef struct PngBuffer {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+} PngBuffer;
+
+typedef int (*PngSink)(void*, unsigned char*, size_t);  /* 1 on success */
+
+/*
+ * Function:  reverseBits
+ * --------------------
+ *  reverses the lowest n bits of code, deflate sends Huffman codes MSB first
+ */
+
+static unsigned int reverseBits(unsigned int code, int n){
+  unsigned int r = 0;
+  int i;
+  for(i = 0; i < n; i++){
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+/*
+ * Function:  initDeflateTables
+ * --------------------
+ *  fills the fixed Huffman, symbol lookup and crc tables, called once through
+ *  pthread_once so concurrent encoders in different caller threads are safe
+ */
+
+static void fillDeflateTables(){
+  int i, sym;
+  unsigned int c, k;
+  for(i = 0; i < 288; i++){
+    if( i < 144 ){
+      literalCode[i] = reverseBits(0x30 + i, 8);
+      literalBits[i] = 8;
+    }else if( i < 256 ){
+      literalCode[i] = reverseBits(0x190 + i - 144, 9);
+      literalBits[i] = 9;
+    }else if( i < 280 ){
+      literalCode[i] = reverseBits(i - 256, 7);
+      literalBits[i] = 7;
+    }else{
+      literalCode[i] = reverseBits(0xC0 + i - 280, 8);
+      literalBits[i] = 8;
+    }
+  }
+  for(sym = 0, i = DEFLATE_MIN_MATCH; i <= DEFLATE_MAX_MATCH; i++){
+    while( sym < 28 && lengthBase[sym + 1] <= i ) sym++;
+    lengthSymbol[i] = sym;
+  }
+  for(sym = 0, i = 1; i <= DEFLATE_WINDOW; i++){
+    while( sym < 29 && distBase[sym + 1] <= i ) sym++;
+    distanceSymbol[i] = sym;
+  }
+  for(i = 0; i < 256; i++){
+    c = i;
+    for(k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crcTable[i] = c;
+  }
+}
+
+static void initDeflateTables(){
+  pthread_once(&tablesOnce, fillDeflateTables);
+}
+
+/*
+ * Function:  reserveBytes
+ * --------------------
+ *  grows the buffer of the bit writer to hold extra more bytes. When that
+ *  fails the buffer is kept as it is and the writer marked failed.
+ *
+ *  returns: 1 on success, 0 when out of memory
+ */
+
+static int reserveBytes(BitWriter *bw, size_t extra){
+  size_t cap = bw->cap;
+  unsigned char *buf;
+  if( bw->len + extra <= bw->cap ) return 1;
+  if( bw->failed ) return 0;
+  while( bw->len + extra > cap )
+    cap = cap ? cap * 2 : 4096;
+  buf = realloc(bw->buf, cap);
+  if( buf == NULL ){
+    bw->failed = 1;
+    return 0;
+  }
+  bw->buf = buf;
+  bw->cap = cap;
+  return 1;
+}
+
+static void putBits(BitWriter *bw, unsigned int value, int n){
+  bw->bits |= value << bw->count;
+  bw->count += n;
+  while( bw->count >= 8 ){
+    if( !reserveBytes(bw, 1) ){
+      bw->count = 0;
+      return;
+    }
+    bw->buf[bw->len++] = bw->bits & 0xFF;
+    bw->bits >>= 8;
+    bw->count -= 8;
+  }
+}
+
+static void alignToByte(BitWriter *bw){
+  if( bw->count > 0 ) putBits(bw, 0, 8 - bw->count);
+}
+
+static void putBytes(BitWriter *bw, unsigned char *src, size_t n){
+  if( !reserveBytes(bw, n) ) return;
+  memcpy(bw->buf + bw->len, src, n);
+  bw->len += n;
+}
+
+static void putLiteral(BitWriter *bw, int sym){
+  putBits(bw, literalCode[sym], literalBits[sym]);
+}
+
+static void putMatch(BitWriter *bw, int length, int distance){
+  int sym = lengthSymbol[length];
+  putLiteral(bw, 257 + sym);
+  if( lengthExtra[sym] ) putBits(bw, length - lengthBase[sym], lengthExtra[sym]);
+  sym = distanceSymbol[distance];
+  putBits(bw, reverseBits(sym, 5), 5);
+  if( distExtra[sym] ) putBits(bw, distance - distBase[sym], distExtra[sym]);
+}
+
+/*
+ * Function:  deflateStored
+ * --------------------
+ *  writes data as stored deflate blocks, output stays byte aligned
+ *
+ *  bw: the bit writer
+ *  in: the bytes to be stored
+ *  n: the amount of bytes
+ *  final: whether the last block closes the stream
+ *
+ *  returns: 1 on success, 0 when out of memory
+ */
+
+static int deflateStored(BitWriter *bw, unsigned char *in, size_t n, int final){
+  size_t len;
+  unsigned char header[4];
+  do{
+    len = MIN(n, DEFLATE_STORED_MAX);
+    putBits(bw, final && len == n, 1);
+    putBits(bw, 0, 2);
+    alignToByte(bw);
+    header[0] = len & 0xFF;
+    header[1] = len >> 8;
+    header[2] = ~len & 0xFF;
+    header[3] = (~len >> 8) & 0xFF;
+    putBytes(bw, header, 4);
+    putBytes(bw, in, len);
+    in += len;
+    n -= len;
+  }while( n > 0 && !bw->failed );
+  return !bw->failed;
+}
+
+/*
+ * Function:  deflateFixed
+ * --------------------
+ *  compresses data into a single fixed-Huffman block with greedy LZ77 matching,
+ *  a non-final strip is closed with an empty stored block so the next strip
+ *  starts on a byte boundary
+ *
+ *  bw: the bit writer
+ *  in: the bytes to be compressed
+ *  n: the amount of bytes
+ *  level: the compression level (1..9)
+ *  final: whether this block closes the stream
+ *
+ *  returns: 1 on success, 0 when out of memory
+ */
+
+static int deflateFixed(BitWriter *bw, unsigned char *in, size_t n, int level, int final){
+  int *head = malloc(DEFLATE_HASH_SIZE * sizeof(int));
+  int *prev = malloc(DEFLATE_WINDOW * sizeof(int));
+  int maxChain = levelChain[level];
+  int nice = levelNice[level];
+  int i, j, h, cand, chain, best, bestDist, limit, len;
+  int size = (int) n;
+
+  if( head == NULL || prev == NULL ){
+    free(head);
+    free(prev);
+    bw->failed = 1;
+    return 0;
+  }
+  for(i = 0; i < DEFLATE_HASH_SIZE; i++) head[i] = -1;
+  putBits(bw, final, 1);
+  putBits(bw, 1, 2);
+
+  i = 0;
+  while( i < size && !bw->failed ){
+    best = 0;
+    bestDist = 0;
+    if( i + DEFLATE_MIN_MATCH <= size ){
+      h = ((in[i] << 10) ^ (in[i + 1] << 5) ^ in[i + 2]) & (DEFLATE_HASH_SIZE - 1);
+      limit = MIN(DEFLATE_MAX_MATCH, size - i);
+      cand = head[h];
+      for(chain = maxChain; cand >= 0 && chain > 0 && i - cand < DEFLATE_WINDOW; chain--){
+        if( best == limit ) break;
+        if( in[cand + best] == in[i + best] ){
+          for(len = 0; len < limit && in[cand + len] == in[i + len]; len++);
+          if( len > best ){
+            best = len;
+            bestDist = i - cand;
+            if( len >= nice ) break;
+          }
+        }
+        j = prev[cand & (DEFLATE_WINDOW - 1)];
+        if( j >= cand ) break;
+        cand = j;
+      }
+      prev[i & (DEFLATE_WINDOW - 1)] = head[h];
+      head[h] = i;
+    }
+    if( best >= DEFLATE_MIN_MATCH ){
+      putMatch(bw, best, bestDist);
+      for(j = i + 1; j < i + best && j + DEFLATE_MIN_MATCH <= size; j++){
+        h = ((in[j] << 10) ^ (in[j + 1] << 5) ^ in[j + 2]) & (DEFLATE_HASH_SIZE - 1);
+        prev[j & (DEFLATE_WINDOW - 1)] = head[h];
+        head[h] = j;
+      }
+      i += best;
+    }else{
+      putLiteral(bw, in[i]);
+      i++;
+    }
+  }
+  putLiteral(bw, 256);
+  if( !final ){
+    putBits(bw, 0, 3);
+    alignToByte(bw);
+    putBytes(bw, (unsigned char *) "\x00\x00\xFF\xFF", 4);
+  }
+  alignToByte(bw);
+  free(head);
+  free(prev);
+  return !bw->failed;
+}
+
+/*
+ * Function:  adler32
+ * --------------------
+ *  updates an Adler-32 checksum with n bytes, start from 1
+ */
+
+unsigned int adler32(unsigned int adler, unsigned char *data, size_t n){
+  unsigned int a = adler & 0xFFFF, b = adler >> 16;
+  size_t block;
+  while( n > 0 ){
+    block = MIN(n, 5552); // largest block that cannot overflow b
+    n -= block;
+    while( block-- ){
+      a += *data++;
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+  }
+  return (b << 16) | a;
+}
+
+/*
+ * Function:  adler32Combine
+ * --------------------
+ *  computes the Adler-32 of the concatenation of two blocks from their
+ *  separate checksums
+ *
+ *  adler1: the checksum of the first block
+ *  adler2: the checksum of the second block
+ *  len2: the length of the second block
+ *
+ *  returns: the checksum of both blocks
+ */
+
+unsigned int adler32Combine(unsigned int adler1, unsigned int adler2, size_t len2){
+  unsigned int rem = len2 % ADLER_BASE;
+  unsigned int sum1 = adler1 & 0xFFFF;
+  unsigned int sum2 = (rem * sum1) % ADLER_BASE;
+  sum1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+  if( sum1 >= ADLER_BASE ) sum1 -= ADLER_BASE;
+  if( sum1 >= ADLER_BASE ) sum1 -= ADLER_BASE;
+  if( sum2 >= (ADLER_BASE << 1) ) sum2 -= (ADLER_BASE << 1);
+  if( sum2 >= ADLER_BASE ) sum2 -= ADLER_BASE;
+  return sum1 | (sum2 << 16);
+}
+
+/*
+ * Function:  crc32Update
+ * --------------------
+ *  updates a PNG chunk crc with n bytes, start from 0
+ */
+
+unsigned int crc32Update(unsigned int crc, unsigned char *data, size_t n){
+  initDeflateTables();
+  crc = ~crc;
+  while( n-- )
+    crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static unsigned char paeth(int a, int b, int c){
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if( pa <= pb && pa <= pc ) return a;
+  if( pb <= pc ) return b;
+  return c;
+}
+
+/*
+ * Function:  filterRow
+ * --------------------
+ *  applies one PNG filter to a row, the row above the first one is all zeros
+ *
+ *  out: the filtered row, without the filter type byte
+ *  row: the current row
+ *  up: the previous row or NULL for the first row
+ *  n: the amount of bytes in a row
+ *  bpp: bytes per pixel
+ *  filter: the PNG filter type (0..4)
+ */
+
+static void filterRow(unsigned char *out, unsigned char *row, unsigned char *up, int n, int bpp, int filter){
+  int i;
+  bpp = MIN(bpp, n);
+  if( up == NULL ){ // the row above the image is all zeros
+    switch( filter ){
+      case PNG_FILTER_UP: filter = PNG_FILTER_NONE; break;
+      case PNG_FILTER_PAETH: filter = PNG_FILTER_SUB; break;
+      case PNG_FILTER_AVERAGE:
+        for(i = 0; i < bpp; i++) out[i] = row[i];
+        for(i = bpp; i < n; i++) out[i] = row[i] - (row[i - bpp] >> 1);
+        return;
+    }
+  }
+  switch( filter ){
+    case PNG_FILTER_NONE:
+      memcpy(out, row, n);
+      break;
+    case PNG_FILTER_SUB:
+      for(i = 0; i < bpp; i++) out[i] = row[i];
+      for(i = bpp; i < n; i++) out[i] = row[i] - row[i - bpp];
+      break;
+    case PNG_FILTER_UP:
+      for(i = 0; i < n; i++) out[i] = row[i] - up[i];
+      break;
+    case PNG_FILTER_AVERAGE:
+      for(i = 0; i < bpp; i++) out[i] = row[i] - (up[i] >> 1);
+      for(i = bpp; i < n; i++) out[i] = row[i] - ((row[i - bpp] + up[i]) >> 1);
+      break;
+    default:
+      for(i = 0; i < bpp; i++) out[i] = row[i] - up[i];
+      for(i = bpp; i < n; i++) out[i] = row[i] - paeth(row[i - bpp], up[i], up[i - bpp]);
+      break;
+  }
+}
+
+/*
+ * Function:  filterStrip
+ * --------------------
+ *  filters rows [first, last) into out, prefixing each row with its filter type.
+ *  With PNG_FILTER_ADAPTIVE every filter is tried and the one with the lowest
+ *  sum of absolute signed residuals is kept, the same heuristic stb uses.
+ */
+
+static void filterStrip(unsigned char *out, unsigned char *data, int rowBytes, int bpp,
+        int first, int last, int filter, unsigned char *scratch){
+  int y, f, i, bestFilter;
+  long cost, best;
+  unsigned char *row, *up;
+  for(y = first; y < last; y++){
+    row = data + (size_t) y * rowBytes;
+    up = y > 0 ? row - rowBytes : NULL;
+    *out++ = filter == PNG_FILTER_ADAPTIVE ? 0 : filter;
+    if( filter != PNG_FILTER_ADAPTIVE ){
+      filterRow(out, row, up, rowBytes, bpp, filter);
+    }else{
+      best = -1;
+      bestFilter = PNG_FILTER_NONE;
+      for(f = PNG_FILTER_NONE; f <= PNG_FILTER_PAETH; f++){
+        filterRow(scratch, row, up, rowBytes, bpp, f);
+        for(cost = 0, i = 0; i < rowBytes; i++)
+          cost += abs((signed char) scratch[i]);
+        if( best < 0 || cost < best ){
+          best = cost;
+          bestFilter = f;
+          memcpy(out, scratch, rowBytes);
+        }
+      }
+      out[-1] = bestFilter;
+    }
+    out += rowBytes;
+  }
+}
+
+/*
+ * Function:  defaultPngOptions
+ * --------------------
+ *  returns: the options used by writeImage when none are given
+ */
+
+PngOptions defaultPngOptions(){
+  PngOptions opt;
+  opt.level = PNG_DEFAULT_LEVEL;
+  opt.filter = PNG_FILTER_ADAPTIVE;
+  opt.threads = 0;
+  opt.stripRows = 0;
+  opt.memoryBudget = 0;
+  return opt;
+}
+
+/*
+ * Function:  parsePngFilter
+ * --------------------
+ *  maps a filter name (none, sub, up, average, paeth, adaptive) to its value
+ *
+ *  returns: the PNG_FILTER_* value or -1 for an unknown name
+ */
+
+int parsePngFilter(char *name){
+  static char *names[] = {"none", "sub", "up", "average", "paeth", "adaptive"};
+  int i;
+  for(i = 0; i <= PNG_FILTER_ADAPTIVE; i++)
+    if( strcmp(name, names[i]) == 0 ) return i;
+  return -1;
+}
+
+static void putUint32(unsigned char *p, unsigned int v){
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/*
+ * Function:  pngSupported
+ * --------------------
+ *  returns: whether encodePngParallel can encode the pixel data with these
+ *  options
+ */
+
+static int pngSupported(unsigned char *data, int width, int height, int channels, PngOptions opt){
+  if( data == NULL || width <= 0 || height <= 0 || channels < 1 || channels > 4 ) return 0;
+  if( opt.filter < PNG_FILTER_NONE || opt.filter > PNG_FILTER_ADAPTIVE ) return 0;
+  return width <= (PNG_MAX_STRIP_BYTES - 1) / channels;
+}
+
+/*
+ * Function:  planStrips
+ * --------------------
+ *  picks the rows per strip and the strips compressed at once. Without a
+ *  memory budget every strip is in flight, with one every thread holds its
+ *  filtered strip, a row of scratch and the hash chains of deflateFixed, and
+ *  every strip in flight its deflated output (at most 9/8 of the strip).
+ *  Threads are dropped until a strip of at least one row fits.
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY when not even a single row fits
+ */
+
+static int planStrips(int rowBytes, int height, int level, PngOptions opt, int threads, int *stripRows,
+                      int *inFlight){
+  size_t hash = level > 0 ? (DEFLATE_HASH_SIZE + DEFLATE_WINDOW) * sizeof(int) : 0;
+  size_t perRow = ((size_t) (rowBytes + 1) * 17 + 7) / 8, perThread, rows;
+  int t, numStrips;
+
+  *stripRows = opt.stripRows;
+  if( *stripRows <= 0 ){
+    *stripRows = (height + threads * PNG_STRIPS_PER_THREAD - 1) / (threads * PNG_STRIPS_PER_THREAD);
+    *stripRows = MAX(*stripRows, PNG_MIN_STRIP_BYTES / (rowBytes + 1) + 1);
+  }
+  *stripRows = MIN(*stripRows, PNG_MAX_STRIP_BYTES / (rowBytes + 1));
+  *stripRows = MIN(*stripRows, height);
+  numStrips = (height + *stripRows - 1) / *stripRows;
+  *inFlight = numStrips;
+  if( opt.memoryBudget == 0 ) return SED_OK;
+  for(t = MIN(threads, numStrips); t >= 1; t--){
+    perThread = opt.memoryBudget / t;
+    if( perThread <= rowBytes + hash + PNG_STRIP_OVERHEAD ) continue;
+    rows = (perThread - rowBytes - hash - PNG_STRIP_OVERHEAD) / perRow;
+    if( rows < 1 ) continue;
+    *stripRows = (int) MIN((size_t) *stripRows, rows);
+    *inFlight = t;
+    return SED_OK;
+  }
+  return SED_ERROR_MEMORY;
+}
+
+/*
+ * Function:  encodePng
+ * --------------------
+ *  encodes 8-bit pixel data as a PNG into a sink. The rows are split into
+ *  strips that are filtered and deflated independently by the OpenMP
+ *  threads, and every strip becomes its own IDAT chunk, whose crc is
+ *  computed by the same thread. The Adler-32 of the stream is combined from
+ *  the per-strip sums. The strips are compressed in rounds of at most
+ *  inFlight (see planStrips), and every round goes to the sink in order
+ *  before the next one starts, so only the strips of a round are held.
+ *
+ *  sink: receives the bytes of the file in order
+ *  arg: passed on to the sink
+ *
+ *  returns: SED_OK, SED_ERROR_MEMORY or SED_ERROR_IO when the sink fails
+ */
+
+static int encodePng(unsigned char *data, int width, int height, int channels, PngOptions opt, PngSink sink,
+                     void *arg){
+  static const int colorType[5] = {-1, 0, 4, 2, 6};
+  int rowBytes = width * channels;
+  int threads = opt.threads > 0 ? opt.threads : omp_get_max_threads();
+  int level = MIN(MAX(opt.level, 0), 9);
+  int stripRows, numStrips, inFlight, first, count, s, i, status;
+  unsigned int adler = 1;
+  unsigned char zlibHeader[2], header[33], chunk[8], *p;
+  PngStrip *strips;
+
+  initDeflateTables();
+  status = planStrips(rowBytes, height, level, opt, threads, &stripRows, &inFlight);
+  if( status != SED_OK ) return status;
+  numStrips = (height + stripRows - 1) / stripRows;
+  strips = calloc(inFlight, sizeof(PngStrip));
+  if( strips == NULL ) return SED_ERROR_MEMORY;
+  zlibHeader[0] = 0x78;
+  zlibHeader[1] = level == 0 ? 0x01 : (level < 6 ? 0x5E : (level == 6 ? 0x9C : 0xDA));
+
+  p = header;
+  memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+  p += 8;
+  putUint32(p, 13);
+  memcpy(p + 4, "IHDR", 4);
+  putUint32(p + 8, width);
+  putUint32(p + 12, height);
+  p[16] = 8;
+  p[17] = colorType[channels];
+  p[18] = 0;
+  p[19] = 0;
+  p[20] = 0;
+  putUint32(p + 21, crc32Update(0, p + 4, 17));
+  if( !sink(arg, header, sizeof(header)) ) status = SED_ERROR_IO;
+
+  for(first = 0; status == SED_OK && first < numStrips; first += count){
+    count = MIN(inFlight, numStrips - first);
+    #pragma omp parallel num_threads(MIN(threads, count)) default(none) shared(strips, data, zlibHeader) firstprivate(first, count, numStrips, stripRows, height, rowBytes, channels, level, opt)
+    {
+      unsigned char *raw = malloc((size_t) stripRows * (rowBytes + 1));
+      unsigned char *scratch = malloc(rowBytes);
+      int j;
+      #pragma omp for schedule(dynamic, 1)
+      for(j = 0; j < count; j++){
+        int top = (first + j) * stripRows;
+        int last = MIN(top + stripRows, height);
+        int final = first + j == numStrips - 1;
+        size_t n = (size_t) (last - top) * (rowBytes + 1);
+        BitWriter bw = {NULL, 0, 0, 0, 0, 0};
+        if( raw == NULL || scratch == NULL ){
+          strips[j].failed = 1;
+          continue;
+        }
+        TRACE_BEGIN(span);
+        filterStrip(raw, data, rowBytes, channels, top, last, opt.filter, scratch);
+        strips[j].rawLen = n;
+        strips[j].adler = adler32(1, raw, n);
+        // the largest output of either block type, so the buffer never doubles
+        reserveBytes(&bw, level == 0 ? n + 5 * (n / DEFLATE_STORED_MAX + 1) + 1 : n + n / 8 + PNG_STRIP_OVERHEAD);
+        if( level == 0 ) strips[j].failed = !deflateStored(&bw, raw, n, final);
+        else strips[j].failed = !deflateFixed(&bw, raw, n, level, final);
+        strips[j].deflated = bw.buf;
+        strips[j].deflatedLen = bw.len;
+        strips[j].crc = crc32Update(0, (unsigned char *) "IDAT", 4);
+        if( first + j == 0 ) strips[j].crc = crc32Update(strips[j].crc, zlibHeader, 2);
+        strips[j].crc = crc32Update(strips[j].crc, bw.buf, bw.len);
+        TRACE_END(span, "png strip", (n - (last - top)) / channels);
+      }
+      free(raw);
+      free(scratch);
+    }
+
+    for(i = 0; i < count; i++)
+      if( strips[i].failed ) status = SED_ERROR_MEMORY;
+    for(i = 0; status == SED_OK && i < count; i++){
+      s = first + i;
+      adler = adler32Combine(adler, strips[i].adler, strips[i].rawLen);
+      putUint32(chunk, strips[i].deflatedLen + (s == 0 ? 2 : 0) + (s == numStrips - 1 ? 4 : 0));
+      memcpy(chunk + 4, "IDAT", 4);
+      if( !sink(arg, chunk, 8) || (s == 0 && !sink(arg, zlibHeader, 2))
+          || !sink(arg, strips[i].deflated, strips[i].deflatedLen) ) status = SED_ERROR_IO;
+      if( status == SED_OK && s == numStrips - 1 ){
+        putUint32(chunk, adler);
+        strips[i].crc = crc32Update(strips[i].crc, chunk, 4);
+        if( !sink(arg, chunk, 4) ) status = SED_ERROR_IO;
+      }
+      putUint32(chunk, strips[i].crc);
+      if( status == SED_OK && !sink(arg, chunk, 4) ) status = SED_ERROR_IO;
+    }
+    for(i = 0; i < count; i++) free(strips[i].deflated);
+    memset(strips, 0, (size_t) inFlight * sizeof(PngStrip));
+  }
+
+  if( status == SED_OK ){
+    putUint32(chunk, 0);
+    memcpy(chunk + 4, "IEND", 4);
+    if( !sink(arg, chunk, 8) ) status = SED_ERROR_IO;
+    putUint32(chunk, crc32Update(0, chunk + 4, 4));
+    if( status == SED_OK && !sink(arg, chunk, 4) ) status = SED_ERROR_IO;
+  }
+  free(strips);
+  return status;
+}
+
+static int bufferSink(void *arg, unsigned char *bytes, size_t n){
+  PngBuffer *b = arg;
+  size_t cap = b->cap;
+  unsigned char *data;
+  if( b->len + n > cap ){
+    while( b->len + n > cap ) cap = cap ? cap * 2 : 65536;
+    data = realloc(b->data, cap);
+    if( data == NULL ) return 0;
+    b->data = data;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, bytes, n);
+  b->len += n;
+  return 1;
+}
+
+static int fileSink(void *arg, unsigned char *bytes, size_t n){
+  return fwrite(bytes, 1, n, (FILE *) arg) == n;
+}
+
+/*
+ * Function:  encodePngParallel
+ * --------------------
+ *  encodes 8-bit pixel data as a PNG in memory, see encodePng
+ *
+ *  data: the pixeldata
+ *  width: the width of the image
+ *  height: the height of the image
+ *  channels: 1 (gray), 2 (gray alpha), 3 (rgb) or 4 (rgba)
+ *  opt: compression level, filter strategy, threads, strip size and budget
+ *  outLen: set to the size of the encoded PNG
+ *
+ *  returns: a malloc'd buffer holding the PNG file or NULL on failure, when
+ *  pngSupported accepts the arguments only for lack of memory
+ */
+
+unsigned char *encodePngParallel(unsigned char *data, int width, int height, int channels,
+        PngOptions opt, size_t *outLen){
+  PngBuffer png = {NULL, 0, 0};
+  if( !pngSupported(data, width, height, channels, opt) ) return NULL;
+  if( encodePng(data, width, height, channels, opt, bufferSink, &png) != SED_OK ){
+    free(png.data);
+    return NULL;
+  }
+  *outLen = png.len;
+  return png.data;
+}
+
+/*
+ * Function:  writePngParallel
+ * --------------------
+ *  encodes pixel data with encodePng straight into a file, so besides the
+ *  pixels only the strips in flight are held. A failed file is removed.
+ *
+ *  name: the name of the file to be written
+ *
+ *  returns: SED_OK, SED_ERROR_MEMORY when the encoder runs out of memory or
+ *  its budget is too small, or SED_ERROR_IO
+ */
+
+int writePngParallel(char *name, unsigned char *data, int width, int height, int channels, PngOptions opt){
+  FILE *f;
+  int status;
+  if( !pngSupported(data, width, height, channels, opt) ) return SED_ERROR_IO;
+  f = fopen(name, "wb");
+  if( f == NULL ) return SED_ERROR_IO;
+  status = encodePng(data, width, height, channels, opt, fileSink, f);
+  if( fclose(f) != 0 && status == SED_OK ) status = SED_ERROR_IO;
+  if( status != SED_OK ) remove(name);
+  return status;
+}
+
+/*
+ * Function:  benchmarkPngEncoding
+ * --------------------
+ *  encodes the pixel data in memory at every compression level and filter
+ *  strategy and prints the throughput (megabytes of raw pixels per second of
+ *  wall-clock time) and the compression ratio to stdout
+ *
+ *  threads: the amount of threads, 0 lets OpenMP decide
+ */
+
+void benchmarkPngEncoding(unsigned char *data, int width, int height, int channels, int threads){
+  static char *names[] = {"none", "sub", "up", "average", "paeth", "adaptive"};
+  static const int levels[] = {0, 1, 3, 6, 9};
+  double rawMB = (double) width * height * channels / 1e6;
+  double begin, elapsed;
+  int l, f, reps, ok;
+  size_t len = 0;
+  unsigned char *png;
+  PngOptions opt = defaultPngOptions();
+  opt.threads = threads;
+
+  printf("%-6s %-9s %10s %10s %8s\n", "level", "filter", "MB/s", "bytes", "ratio");
+  for(l = 0; l < (int) (sizeof(levels) / sizeof(levels[0])); l++){
+    for(f = PNG_FILTER_NONE; f <= PNG_FILTER_ADAPTIVE; f++){
+      opt.level = levels[l];
+      opt.filter = f;
+      reps = 0;
+      begin = omp_get_wtime();
+      do{ // repeat short runs until at least a quarter second was measured
+        png = encodePngParallel(data, width, height, channels, opt, &len);
+        ok = png != NULL;
+        free(png);
+        reps++;
+        elapsed = omp_get_wtime() - begin;
+      }while( ok && elapsed < 0.25 );
+      if( !ok ){
+        fprintf(stderr, "Encoding at level %d with filter %s failed\n", levels[l], names[f]);
+        continue;
+      }
+      printf("%-6d %-9s %10.1f %10zu %8.3f\n", levels[l], names[f],
+             rawMB * reps / elapsed, len, (double) len / (width * height * channels));
+    }
+  }
+}
+
+/*
+ * Function:  defaultWriteOptions
+ * --------------------
+ *  returns: options that pick the format from the file extension and use the
+ *  default PNG settings
+ */
+
+WriteOptions defaultWriteOptions(){
+  WriteOptions opt;
+  opt.format = OUTPUT_FORMAT_AUTO;
+  opt.png = defaultPngOptions();
+  return opt;
+}
+
+/*
+ * Function:  parseOutputFormat
+ * --------------------
+ *  maps a format name (auto, png, png-stored, qoi, pnm, raw) to its value
+ *
+ *  returns: the OUTPUT_FORMAT_* value or -1 for an unknown name
+ */
+
+int parseOutputFormat(char *name){
+  static char *names[] = {"auto", "png", "png-stored", "qoi", "pnm", "raw"};
+  int i;
+  for(i = OUTPUT_FORMAT_AUTO; i <= OUTPUT_FORMAT_RAW; i++)
+    if( strcmp(name, names[i]) == 0 ) return i;
+  return -1;
+}
+
+/*
+ * Function:  outputFormatFromName
+ * --------------------
+ *  picks the output format from the extension of a file name, .qoi, .pgm/.ppm/.pnm
+ *  and .raw select their encoders, everything else is written as PNG
+ *
+ *  returns: the OUTPUT_FORMAT_* value
+ */
+
+int outputFormatFromName(char *name){
+  char *ext = strrchr(name, '.');
+  if( ext == NULL ) return OUTPUT_FORMAT_PNG;
+  if( strcmp(ext, ".qoi") == 0 ) return OUTPUT_FORMAT_QOI;
+  if( strcmp(ext, ".pgm") == 0 || strcmp(ext, ".ppm") == 0 || strcmp(ext, ".pnm") == 0 )
+    return OUTPUT_FORMAT_PNM;
+  if( strcmp(ext, ".raw") == 0 ) return OUTPUT_FORMAT_RAW;
+  return OUTPUT_FORMAT_PNG;
+}
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define QOI_MAX_RUN 62
+
+/*
+ * Function:  encodeQoi
+ * --------------------
+ *  encodes pixel data in the "Quite OK Image" format. QOI only knows rgb and
+ *  rgba, so grayscale is expanded to rgb and gray alpha to rgba on the fly.
+ *
+ *  data: the pixeldata
+ *  width: the width of the image
+ *  height: the height of the image
+ *  channels: 1, 2, 3 or 4
+ *  outLen: set to the size of the encoded file
+ *
+ *  returns: a malloc'd buffer holding the QOI file or NULL on failure
+ */
+
+unsigned char *encodeQoi(unsigned char *data, int width, int height, int channels, size_t *outLen){
+  size_t pixels = (size_t) width * height;
+  int outChannels = (channels == 2 || channels == 4) ? 4 : 3;
+  unsigned char *qoi, *p;
+  unsigned char index[64][4];
+  unsigned char px[4], prev[4] = {0, 0, 0, 255};
+  size_t i;
+  int run = 0, h, vr, vg, vb, vgr, vgb;
+
+  if( data == NULL || width <= 0 || height <= 0 || channels < 1 || channels > 4 ) return NULL;
+  qoi = malloc(14 + pixels * (outChannels + 1) + 8);
+  if( qoi == NULL ) return NULL;
+  memset(index, 0, sizeof(index));
+
+  p = qoi;
+  memcpy(p, "qoif", 4);
+  putUint32(p + 4, width);
+  putUint32(p + 8, height);
+  p[12] = outChannels;
+  p[13] = 0;
+  p += 14;
+
+  for(i = 0; i < pixels; i++, data += channels){
+    if( channels < 3 ){
+      px[0] = px[1] = px[2] = data[0];
+      px[3] = channels == 2 ? data[1] : 255;
+    }else{
+      px[0] = data[0];
+      px[1] = data[1];
+      px[2] = data[2];
+      px[3] = channels == 4 ? data[3] : 255;
+    }
+
+    if( memcmp(px, prev, 4) == 0 ){
+      run++;
+      if( run == QOI_MAX_RUN || i == pixels - 1 ){
+        *p++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+    if( run > 0 ){
+      *p++ = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+
+    h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+    if( memcmp(index[h], px, 4) == 0 ){
+      *p++ = QOI_OP_INDEX | h;
+    }else{
+      memcpy(index[h], px, 4);
+      if( px[3] == prev[3] ){
+        vr = (signed char) (px[0] - prev[0]);
+        vg = (signed char) (px[1] - prev[1]);
+        vb = (signed char) (px[2] - prev[2]);
+        vgr = vr - vg;
+        vgb = vb - vg;
+        if( vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2 ){
+          *p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        }else if( vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8 ){
+          *p++ = QOI_OP_LUMA | (vg + 32);
+          *p++ = (vgr + 8) << 4 | (vgb + 8);
+        }else{
+          *p++ = QOI_OP_RGB;
+          *p++ = px[0];
+          *p++ = px[1];
+          *p++ = px[2];
+        }
+      }else{
+        *p++ = QOI_OP_RGBA;
+        memcpy(p, px, 4);
+        p += 4;
+      }
+    }
+    memcpy(prev, px, 4);
+  }
+  memcpy(p, "\0\0\0\0\0\0\0\1", 8);
+  p += 8;
+  *outLen = p - qoi;
+  return qoi;
+}
+
+/*
+ * Function:  writeBuffer
+ * --------------------
+ *  writes an optional header followed by a block of bytes to a file
+ *
+ *  returns: 1 on success, 0 on failure
+ */
+
+static int writeBuffer(char *name, char *header, unsigned char *buf, size_t len){
+  FILE *f = fopen(name, "wb");
+  int ok;
+  if( f == NULL ) return 0;
+  ok = header == NULL || fputs(header, f) >= 0;
+  ok = ok && fwrite(buf, 1, len, f) == len;
+  ok = (fclose(f) == 0) && ok;
+  return ok;
+}
+
+/*
+ * Function:  writePixels
+ * --------------------
+ *  writes pixel data in the requested format. The fast formats trade size for
+ *  encode time: png-stored skips filtering and compression, qoi is a single
+ *  linear pass, pnm is a text header plus the raw bytes and raw is the bare
+ *  row-major pixel bytes (the dimensions are not stored).
+ *
+ *  name: the name of the file to be written
+ *  data: the pixeldata
+ *  width: the width of the image
+ *  height: the height of the image
+ *  channels: the amount of channels
+ *  opt: the format and PNG settings
+ *
+ *  returns: SED_OK, SED_ERROR_MEMORY when an encoder runs out of memory or
+ *  SED_ERROR_IO
+ */
+
+int writePixels(char *name, unsigned char *data, int width, int height, int channels, WriteOptions opt){
+  char header[64];
+  unsigned char *buf;
+  size_t len;
+  int ok;
+  int format = opt.format == OUTPUT_FORMAT_AUTO ? outputFormatFromName(name) : opt.format;
+
+  switch( format ){
+    case OUTPUT_FORMAT_PNG_STORED:
+      opt.png.level = 0;
+      opt.png.filter = PNG_FILTER_NONE;
+      return writePngParallel(name, data, width, height, channels, opt.png);
+    case OUTPUT_FORMAT_QOI:
+      if( data == NULL || width <= 0 || height <= 0 || channels < 1 || channels > 4 ) return SED_ERROR_IO;
+      buf = encodeQoi(data, width, height, channels, &len);
+      if( buf == NULL ) return SED_ERROR_MEMORY;
+      ok = writeBuffer(name, NULL, buf, len);
+      free(buf);
+      return ok ? SED_OK : SED_ERROR_IO;
+    case OUTPUT_FORMAT_PNM:
+      if( channels != 1 && channels != 3 ) return SED_ERROR_IO;
+      sprintf(header, "P%d\n%d %d\n255\n", channels == 1 ? 5 : 6, width, height);
+      return writeBuffer(name, header, data, (size_t) width * height * channels) ? SED_OK : SED_ERROR_IO;
+    case OUTPUT_FORMAT_RAW:
+      return writeBuffer(name, NULL, data, (size_t) width * height * channels) ? SED_OK : SED_ERROR_IO;
+    default:
+      return writePngParallel(name, data, width, height, channels, opt.png);
+  }
+}
+
+/*
+ * Function:  benchmarkImageWriting
+ * --------------------
+ *  writes the pixel data once in every output format to a scratch file in the
+ *  working directory and prints the end-to-end latency (encode, write, close)
+ *  and the file size of each
+ *
+ *  threads: the amount of threads for the PNG encoder, 0 lets OpenMP decide
+ */
+
+void benchmarkImageWriting(unsigned char *data, int width, int height, int channels, int threads){
+  static char *names[] = {"auto", "png", "png-stored", "qoi", "pnm", "raw"};
+  static char *scratch = "sedecomp_write_bench.tmp";
+  WriteOptions opt = defaultWriteOptions();
+  double begin, elapsed;
+  FILE *f;
+  long size;
+  int format;
+  opt.png.threads = threads;
+
+  printf("%-11s %12s %12s\n", "format", "latency (s)", "bytes");
+  for(format = OUTPUT_FORMAT_PNG; format <= OUTPUT_FORMAT_RAW; format++){
+    if( format == OUTPUT_FORMAT_PNM && channels != 1 && channels != 3 ) continue;
+    opt.format = format;
+    begin = omp_get_wtime();
+    if( writePixels(scratch, data, width, height, channels, opt) != SED_OK ){
+      fprintf(stderr, "Writing %s failed\n", names[format]);
+      continue;
+    }
+    elapsed = omp_get_wtime() - begin;
+    size = -1;
+    f = fopen(scratch, "rb");
+    if( f != NULL ){
+      fseek(f, 0, SEEK_END);
+      size = ftell(f);
+      fclose(f);
+    }
+    printf("%-11s %12.4f %12ld\n", names[format], elapsed, size);
+  }
+  remove(scratch);
+}
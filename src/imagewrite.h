@@ -0,0 +1,49 @@
+#ifndef IMAGEWRITE
+#define IMAGEWRITE
+
+#include <stddef.h>
+
+#define PNG_FILTER_NONE 0
+#define PNG_FILTER_SUB 1
+#define PNG_FILTER_UP 2
+#define PNG_FILTER_AVERAGE 3
+#define PNG_FILTER_PAETH 4
+#define PNG_FILTER_ADAPTIVE 5
+
+#define PNG_DEFAULT_LEVEL 6
+
+#define OUTPUT_FORMAT_AUTO 0
+#define OUTPUT_FORMAT_PNG 1
+#define OUTPUT_FORMAT_PNG_STORED 2
+#define OUTPUT_FORMAT_QOI 3
+#define OUTPUT_FORMAT_PNM 4
+#define OUTPUT_FORMAT_RAW 5
+
+typedef struct PngOptions {
+  int level;      /* 0 (stored) .. 9 (slowest, smallest) */
+  int filter;     /* one of the PNG_FILTER_* values */
+  int threads;    /* 0 lets OpenMP decide */
+  int stripRows;  /* rows per independently compressed strip, 0 for automatic */
+  size_t memoryBudget;  /* bytes the PNG encoder may hold besides the pixels, 0 for no limit */
+} PngOptions;
+
+typedef struct WriteOptions {
+  int format;     /* one of the OUTPUT_FORMAT_* values, AUTO picks it from the extension */
+  PngOptions png;
+} WriteOptions;
+
+PngOptions defaultPngOptions();
+int parsePngFilter(char*);
+unsigned char *encodePngParallel(unsigned char*, int, int, int, PngOptions, size_t*);
+int writePngParallel(char*, unsigned char*, int, int, int, PngOptions);
+unsigned int adler32(unsigned int, unsigned char*, size_t);
+unsigned int adler32Combine(unsigned int, unsigned int, size_t);
+unsigned int crc32Update(unsigned int, unsigned char*, size_t);
+void benchmarkPngEncoding(unsigned char*, int, int, int, int);
+WriteOptions defaultWriteOptions();
+int parseOutputFormat(char*);
+int outputFormatFromName(char*);
+unsigned char *encodeQoi(unsigned char*, int, int, int, size_t*);
+int writePixels(char*, unsigned char*, int, int, int, WriteOptions);
+void benchmarkImageWriting(unsigned char*, int, int, int, int);
+#endif
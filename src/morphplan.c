@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "context.h"
+#include "edt.h"
+#include "morphplan.h"
+#include "reference.h"
+#include "tile.h"
+#include "trace.h"
+#include "omp.h"
+
+/*
+ *  ----------------
+ *  Compiled plans. engineOpening picks the engine, looks up the disc plan and
+ *  builds the task graph with its buffers on every call. A MorphPlan does all
+ *  of that once for a size, radius, operation, pixel kind, thread count and
+ *  engine: it holds the chosen engine as a kernel function, a flat array of
+ *  the passes it runs with their predicted cost, the layers of the disc, the
+ *  built task graph with its buffers and the scratch arenas of the threads
+ *  grown to what the passes need. Small images (see isSmallImage) get no graph,
+ *  their plan runs serialMorphology on the calling thread. executeMorphPlan
+ *  then only runs the kernel, so the plan pays off for every further image
+ *  of the same kind.
+ *
+ *  explainMorphPlan prints the passes, e.g. for an opening with radius 5:
+ *
+ *  plan: opening radius 5, 1024x1024 grayscale, 4 threads, engine decomposed (auto)
+ *  predicted 1.2 ms (decomposed 1.2 ms, reference 38.1 ms), 2 KiB scratch per thread, 48 graph nodes
+ *  pass  stage     kernel                            Munits  predicted ms
+ *  0     erosion   origin                             1.05     0.23
+ *  1     erosion   layer 3x3, shift t1 b1 l1 r1       1.05     0.23
+ *  ..
+ */
+
+/*
+ * Function:  addPass
+ * --------------------
+ *  appends a pass to a plan
+ */
+
+static void addPass(MorphPlan *plan, int kind, int stage, Partition *layer, double units){
+  MorphPass *pass = &plan->passes[plan->passCount++];
+  memset(pass, 0, sizeof(MorphPass));
+  pass->kind = kind;
+  pass->stage = stage;
+  pass->maximum = stage == 0 ? plan->spec.closing : !plan->spec.closing;
+  if( layer != NULL ) pass->layer = *layer;
+  pass->units = units;
+}
+
+static int runIdentity(SedContext *ctx, MorphPlan *plan, Image *im){
+  (void) ctx;
+  (void) plan;
+  (void) im;
+  return SED_OK;
+}
+
+static int runGraph(SedContext *ctx, MorphPlan *plan, Image *im){
+  return runMorphologyGraph(ctx, &plan->graph, im, NULL);
+}
+
+static int runSerial(SedContext *ctx, MorphPlan *plan, Image *im){
+  return serialMorphology(ctx, im, plan->parts, plan->count, plan->spec.closing);
+}
+
+static int runStrips(SedContext *ctx, MorphPlan *plan, Image *im){
+  DiscPlan disc = {plan->parts, plan->count};
+  return stripMorphology(ctx, im, &disc, plan->spec.closing, &plan->budget);
+}
+
+static int runEdt(SedContext *ctx, MorphPlan *plan, Image *im){
+  return plan->spec.closing ? edtClosing(ctx, im, plan->spec.radius) : edtOpening(ctx, im, plan->spec.radius);
+}
+
+static int runReference(SedContext *ctx, MorphPlan *plan, Image *im){
+  return plan->spec.closing ? referenceClosing(ctx, im, plan->SE) : referenceOpening(ctx, im, plan->SE);
+}
+
+/*
+ * Function:  compilePasses
+ * --------------------
+ *  lays out the passes of the chosen engine and the buffers they need. The
+ *  work of the engine (see engineUnits) is spread evenly over its passes, so
+ *  their predictions add up to the one of the planner.
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int compilePasses(SedContext *ctx, MorphPlan *plan){
+  int engine = plan->choice.engine, passes = 2, stage, k, status;
+  size_t size = (size_t) plan->spec.width * plan->spec.height;
+  double units;
+  DiscPlan *disc;
+
+  status = engineUnits(ctx, engine, plan->spec.width, plan->spec.height, plan->spec.radius, &units);
+  if( status != SED_OK ) return status;
+  if( engine == ENGINE_DECOMPOSED ){
+    status = getDiscPlan(ctx, plan->spec.radius, &disc);
+    if( status != SED_OK ) return status;
+    plan->count = disc->count;
+    passes = disc->count > 0 ? 2 * (1 + disc->count) : 0;
+    plan->parts = contextAlloc(ctx, (size_t) (disc->count + 1) * sizeof(Partition));
+    if( plan->parts == NULL ) return SED_ERROR_MEMORY;
+    for(k = 0; k < disc->count; k++){
+      plan->parts[k] = disc->parts[k];
+      plan->parts[k].next = k + 1 < disc->count ? &plan->parts[k + 1] : NULL;
+    }
+  }
+  plan->passes = contextAlloc(ctx, (size_t) (passes + 1) * sizeof(MorphPass));
+  if( plan->passes == NULL ) return SED_ERROR_MEMORY;
+
+  for(stage = 0; stage < 2; stage++){
+    if( engine == ENGINE_DECOMPOSED && plan->count > 0 ){
+      addPass(plan, PASS_ORIGIN, stage, NULL, units / passes);
+      for(k = 0; k < plan->count; k++) addPass(plan, PASS_LAYER, stage, &plan->parts[k], units / passes);
+    }else if( engine == ENGINE_EDT ){
+      addPass(plan, PASS_EDT, stage, NULL, units / passes);
+    }else if( engine == ENGINE_REFERENCE ){
+      addPass(plan, PASS_REFERENCE, stage, NULL, units / passes);
+    }
+  }
+  // the disc of radius 1 is empty, so the reference passes have no units to share the cost by
+  for(k = 0; k < plan->passCount; k++)
+    plan->passes[k].cost = (ctx->model.fixed[engine] + ctx->model.perUnit[engine] * units / ctx->threads)
+                           * (units > 0 ? plan->passes[k].units / units : 1.0 / plan->passCount);
+
+  if( engine == ENGINE_DECOMPOSED && plan->count > 0 && ctx->memoryBudget > 0 ){
+    DiscPlan disc = {plan->parts, plan->count};
+    status = planBudget(ctx, plan->spec.width, plan->spec.height, &disc, &plan->budget);
+    if( status != SED_OK ) return status;
+  }
+  if( plan->budget.strips > 1 || plan->budget.threads < ctx->threads ){
+    // the image does not fit in the memory budget at once, see budget.c
+    plan->execute = runStrips;
+  }else if( engine == ENGINE_DECOMPOSED && plan->count > 0 && isSmallImage(ctx, size) ){
+    // small images skip the graph, see serialMorphology
+    plan->execute = runSerial;
+    plan->scratch = 2 * size + layerTileScratch(GRAPH_TILE, plan->parts, plan->count);
+  }else if( engine == ENGINE_DECOMPOSED ){
+    plan->execute = plan->count > 0 ? runGraph : runIdentity;
+    status = buildMorphologyGraph(ctx, &plan->graph, plan->spec.width, plan->spec.height, plan->parts,
+                                  plan->count, plan->spec.closing);
+    plan->scratch = plan->graph.graph.scratch;
+  }else if( engine == ENGINE_EDT ){
+    plan->execute = runEdt;
+  }else{
+    plan->execute = runReference;
+    plan->SE = computeBinaryDiscSE(ctx, plan->spec.radius);
+    if( plan->SE == NULL ) status = SED_ERROR_MEMORY;
+  }
+  return status;
+}
+
+/*
+ * Function:  compileMorphPlan
+ * --------------------
+ *  compiles a plan for the threads of the context: picks the engine, lays
+ *  out its passes, builds the task graph and grows the scratch arenas of the
+ *  threads, each from its own thread
+ *
+ *  ctx: the context
+ *  spec: what the plan is for
+ *  plan: set to the new plan
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the engine cannot process such
+ *  images, or another error code
+ */
+
+int compileMorphPlan(SedContext *ctx, MorphSpec *spec, MorphPlan **plan){
+  int status, failed = 0;
+  MorphPlan *p;
+
+  *plan = NULL;
+  if( spec->width <= 0 || spec->height <= 0 ) return SED_ERROR_ARGUMENT;
+  p = contextCalloc(ctx, 1, sizeof(MorphPlan));
+  if( p == NULL ) return SED_ERROR_MEMORY;
+  p->spec = *spec;
+  p->threads = ctx->threads;
+  p->budget.threads = ctx->threads;
+  p->budget.strips = 1;
+  status = chooseEngine(ctx, spec->width, spec->height, 1, spec->binary, spec->radius, spec->engine, &p->choice);
+  p->choice.density = -1;
+  if( status == SED_OK ) status = compilePasses(ctx, p);
+  if( status == SED_OK && p->scratch > 0 ){
+    // a serial plan only runs on the calling thread
+    #pragma omp parallel num_threads(p->execute == runSerial ? 1 : ctx->threads) default(none) shared(ctx, p) reduction(||:failed)
+    failed = scratchBuffer(ctx, omp_get_thread_num(), p->scratch) == NULL;
+    if( failed ) status = SED_ERROR_MEMORY;
+  }
+  if( status != SED_OK ){
+    freeMorphPlan(ctx, p);
+    return status;
+  }
+  *plan = p;
+  return SED_OK;
+}
+
+/*
+ * Function:  executeMorphPlan
+ * --------------------
+ *  opens or closes an image with a compiled plan
+ *
+ *  ctx: the context, with the thread count the plan was compiled for
+ *  plan: the plan
+ *  im: the image, modified in place
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the image or the threads do not
+ *  match the plan, or another error code
+ */
+
+int executeMorphPlan(SedContext *ctx, MorphPlan *plan, Image *im){
+  int status;
+  TRACE_BEGIN(span);
+  if( im->width != plan->spec.width || im->height != plan->spec.height || im->channels != 1
+      || ctx->threads != plan->threads )
+    return SED_ERROR_ARGUMENT;
+  status = plan->execute(ctx, plan, im);
+  TRACE_END(span, "compiled plan", (size_t) im->width * im->height);
+  return status;
+}
+
+/*
+ * Function:  describePass
+ * --------------------
+ *  formats the kernel of a pass, e.g. "layer 7x7, shift t7 b7 l0 r0"
+ */
+
+static void describePass(MorphPass *pass, int radius, char *buf, int len){
+  Partition *l = &pass->layer;
+  switch( pass->kind ){
+    case PASS_ORIGIN:
+      snprintf(buf, len, "origin");
+      break;
+    case PASS_LAYER:
+      snprintf(buf, len, "layer %dx%d, shift t%d b%d l%d r%d", l->cubicFactor.width, l->cubicFactor.height,
+               l->sparseFactor.topOffset, l->sparseFactor.bottomOffset, l->sparseFactor.leftOffset,
+               l->sparseFactor.rightOffset);
+      break;
+    case PASS_EDT:
+      snprintf(buf, len, "distance transform, threshold %d", (radius - 1) * (radius - 1));
+      break;
+    default:
+      snprintf(buf, len, "disc of radius %d", radius);
+  }
+}
+
+/*
+ * Function:  explainMorphPlan
+ * --------------------
+ *  prints the engine, the predictions and the passes of a plan
+ */
+
+void explainMorphPlan(MorphPlan *plan, FILE *out){
+  char kernel[PLAN_DESCRIPTION_SIZE];
+  int e, k, first = 1;
+  MorphPass *pass;
+
+  fprintf(out, "plan: %s radius %d, %dx%d %s, %d threads, engine %s (%s)\n", plan->spec.closing ? "closing" : "opening",
+          plan->spec.radius, plan->spec.width, plan->spec.height, plan->choice.binary ? "binary" : "grayscale",
+          plan->threads, engineNames[plan->choice.engine], plan->choice.forced ? "forced" : "auto");
+  fprintf(out, "predicted %.1f ms (", plan->choice.predicted[plan->choice.engine] * 1e3);
+  for(e = 0; e < SED_ENGINES; e++){
+    if( plan->choice.predicted[e] < 0 ) continue;
+    fprintf(out, "%s%s %.1f ms", first ? "" : ", ", engineNames[e], plan->choice.predicted[e] * 1e3);
+    first = 0;
+  }
+  fprintf(out, "), %zu KiB scratch per thread, ", (plan->scratch + 1023) / 1024);
+  if( plan->execute == runSerial ) fprintf(out, "serial on the calling thread\n");
+  else if( plan->execute == runStrips )
+    fprintf(out, "%d strips of %d rows on %d threads for the memory budget\n", plan->budget.strips,
+            plan->budget.stripRows, plan->budget.threads);
+  else if( plan->execute == runEdt )
+    fprintf(out, "kernel %s\n", plan->spec.closing ? "edtClosing" : "edtOpening");
+  else if( plan->execute == runReference )
+    fprintf(out, "kernel %s\n", plan->spec.closing ? "referenceClosing" : "referenceOpening");
+  else if( plan->execute == runIdentity ) fprintf(out, "no kernel\n");
+  else fprintf(out, "%d graph nodes\n", plan->graph.graph.nodes);
+  if( plan->passCount == 0 ){
+    fprintf(out, "no passes, the disc is the origin\n");
+    return;
+  }
+  fprintf(out, "%-5s %-9s %-32s %8s %13s\n", "pass", "stage", "kernel", "Munits", "predicted ms");
+  for(k = 0; k < plan->passCount; k++){
+    pass = &plan->passes[k];
+    describePass(pass, plan->spec.radius, kernel, sizeof(kernel));
+    fprintf(out, "%-5d %-9s %-32s %8.2f %13.2f\n", k, pass->maximum ? "dilation" : "erosion", kernel,
+            pass->units / 1e6, pass->cost * 1e3);
+  }
+}
+
+/*
+ * Function:  freeMorphPlan
+ * --------------------
+ *  frees a plan, the scratch arenas stay with the context
+ */
+
+void freeMorphPlan(SedContext *ctx, MorphPlan *plan){
+  if( plan == NULL ) return;
+  freeMorphologyGraph(ctx, &plan->graph);
+  freeImage(ctx, plan->SE);
+  contextFree(ctx, plan->passes);
+  contextFree(ctx, plan->parts);
+  contextFree(ctx, plan);
+}
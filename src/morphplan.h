@@ -0,0 +1,65 @@
+#ifndef MORPHPLAN
+#define MORPHPLAN
+
+#include <stdio.h>
+#include "budget.h"
+#include "image.h"
+#include "planner.h"
+#include "taskgraph.h"
+
+#define PASS_ORIGIN 0       /* copies the stage input, the origin of the disc */
+#define PASS_LAYER 1        /* folds a layer: HGW of the cubic factor, then the shifted extremum */
+#define PASS_EDT 2          /* a distance transform and a threshold */
+#define PASS_REFERENCE 3    /* the extremum over the whole disc */
+
+/*
+ * What a plan is compiled for. Every image it runs on has this size and a
+ * single channel, and only 0 and 255 pixels when binary is set.
+ */
+typedef struct MorphSpec {
+  int width;
+  int height;
+  int radius;
+  int closing;              /* 1 for the closing, 0 for the opening */
+  int binary;
+  int engine;               /* ENGINE_AUTO or one of the ENGINE_* values */
+} MorphSpec;
+
+typedef struct MorphPass {
+  int kind;                 /* one of the PASS_* values */
+  int stage;                /* 0 for the first stage, 1 for the second */
+  int maximum;              /* 1 when the pass dilates */
+  Partition layer;          /* the layer of a PASS_LAYER */
+  double units;             /* the work in engineUnits units */
+  double cost;              /* the predicted seconds */
+} MorphPass;
+
+struct MorphPlan;
+
+typedef int (*MorphKernel)(struct SedContext*, struct MorphPlan*, Image*);
+
+/*
+ * An opening or closing compiled for one MorphSpec and thread count, see
+ * morphplan.c: the engine, the passes, the buffers and the task graph are all
+ * set up once, so running it on an image does no planning.
+ */
+typedef struct MorphPlan {
+  MorphSpec spec;
+  int threads;
+  EnginePlan choice;        /* the engine and the predictions of the others */
+  int passCount;
+  MorphPass *passes;
+  Partition *parts;         /* the layers of the disc, read by the graph */
+  int count;
+  MorphologyGraph graph;    /* the decomposed engine */
+  Image *SE;                /* the reference engine */
+  BudgetPlan budget;        /* the strips when the memory budget is too small */
+  size_t scratch;           /* scratch bytes reserved per thread */
+  MorphKernel execute;
+} MorphPlan;
+
+int compileMorphPlan(struct SedContext*, MorphSpec*, MorphPlan**);
+int executeMorphPlan(struct SedContext*, MorphPlan*, Image*);
+void explainMorphPlan(MorphPlan*, FILE*);
+void freeMorphPlan(struct SedContext*, MorphPlan*);
+#endif
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "context.h"
+#include "pages.h"
+
+/*
+ *  ----------------
+ *  Huge page backed buffers. The vertical passes step a full row for every
+ *  pixel, so on large images almost every access touches another 4 KiB page
+ *  and the dTLB misses. setPageMode installs an allocator that backs the
+ *  blocks of at least HUGE_PAGE_MINIMUM bytes with huge pages:
+ *    thp         2 MiB aligned blocks marked with madvise(MADV_HUGEPAGE), for
+ *                transparent huge pages in the "madvise" or "always" mode
+ *    hugetlb     mmap(MAP_HUGETLB) from the reserved pool of 2 MiB pages
+ *                (/proc/sys/vm/nr_hugepages)
+ *    hugetlb-1g  the same from the pool of 1 GiB pages
+ *  When the pool is empty or the kernel lacks the feature the block falls
+ *  back to the next mode down, hugetlb to thp and thp to malloc, and the
+ *  failures are counted in ctx->pages. Only the hugetlb blocks are certainly
+ *  huge: madvise merely marks a thp block, so those are counted apart and
+ *  anonHugeBytes tells how much the kernel actually backs. Every block starts with a header that
+ *  records how it was obtained, so pageFree releases each the right way.
+ */
+
+#define BLOCK_MALLOC 0
+#define BLOCK_ALIGNED 1
+#define BLOCK_MAPPED 2
+
+#define BLOCK_HEADER 64     /* keeps the data 64 byte aligned */
+
+const char *pageModeNames[PAGE_MODES] = {"default", "thp", "hugetlb", "hugetlb-1g"};
+
+typedef struct PageBlock {
+  size_t length;            /* the bytes of the mapping or allocation */
+  int kind;                 /* one of the BLOCK_* values */
+  int advised;              /* 1 when madvise(MADV_HUGEPAGE) took the block */
+  int served;               /* 1 when it got what the mode asks for */
+} PageBlock;
+
+/*
+ * Function:  parsePageMode
+ * --------------------
+ *  returns: the PAGES_* value of a mode name or -1
+ */
+
+int parsePageMode(char *name){
+  int i;
+  for(i = 0; i < PAGE_MODES; i++)
+    if( strcmp(name, pageModeNames[i]) == 0 ) return i;
+  return -1;
+}
+
+/*
+ * Function:  mapHuge
+ * --------------------
+ *  maps length bytes, a multiple of the page size, from a hugetlb pool
+ *
+ *  returns: the mapping or NULL when the pool cannot serve it
+ */
+
+static void *mapHuge(size_t length, int mode){
+  void *p = MAP_FAILED;
+  (void) mode;
+#ifdef MAP_HUGETLB
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_1GB
+  if( mode == PAGES_HUGETLB_1G ) flags |= MAP_HUGE_1GB;
+#endif
+  p = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+#endif
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Function:  alignHuge
+ * --------------------
+ *  allocates length bytes aligned to HUGE_PAGE_SIZE and asks the kernel to
+ *  back them with transparent huge pages
+ *
+ *  advised: set to 1 when madvise accepted the advice, the kernel may still
+ *  back the block with small pages, e.g. when the memory is fragmented
+ *
+ *  returns: the block or NULL when out of memory
+ */
+
+static void *alignHuge(size_t length, int *advised){
+  void *p;
+  *advised = 0;
+  if( posix_memalign(&p, HUGE_PAGE_SIZE, length) != 0 ) return NULL;
+#ifdef MADV_HUGEPAGE
+  *advised = madvise(p, length, MADV_HUGEPAGE) == 0;
+#endif
+  return p;
+}
+
+/*
+ * Function:  pageAlloc
+ * --------------------
+ *  the SedAllocFunction of setPageMode
+ *
+ *  size: the bytes needed
+ *  user: the PageAllocator of the context
+ *
+ *  returns: the block or NULL when out of memory
+ */
+
+void *pageAlloc(size_t size, void *user){
+  PageAllocator *pages = user;
+  size_t page = pages->mode == PAGES_HUGETLB_1G ? GIANT_PAGE_SIZE : HUGE_PAGE_SIZE;
+  PageBlock block;
+  char *p = NULL;
+
+  block.advised = block.served = 0;
+  block.length = size + BLOCK_HEADER;
+  if( pages->mode == PAGES_DEFAULT || size < HUGE_PAGE_MINIMUM ){
+    block.kind = BLOCK_MALLOC;
+    p = malloc(block.length);
+  }else{
+    if( pages->mode == PAGES_HUGETLB || pages->mode == PAGES_HUGETLB_1G ){
+      block.length = (size + BLOCK_HEADER + page - 1) / page * page;
+      block.kind = BLOCK_MAPPED;
+      p = mapHuge(block.length, pages->mode);
+      block.served = p != NULL;
+    }
+    if( p == NULL ){
+      // thp, or the fallback of an empty hugetlb pool
+      block.length = (size + BLOCK_HEADER + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      block.kind = BLOCK_ALIGNED;
+      p = alignHuge(block.length, &block.advised);
+      block.served = block.advised && pages->mode == PAGES_THP;
+    }
+    if( p == NULL ) return NULL;
+    #pragma omp atomic
+    pages->hugeBytes += block.kind == BLOCK_MAPPED ? block.length : 0;
+    #pragma omp atomic
+    pages->advisedBytes += block.advised ? block.length : 0;
+    #pragma omp atomic
+    pages->fallbackBytes += block.served ? 0 : block.length;
+    #pragma omp atomic
+    pages->failures += !block.served;
+  }
+  if( p == NULL ) return NULL;
+  memcpy(p, &block, sizeof(PageBlock));
+  return p + BLOCK_HEADER;
+}
+
+/*
+ * Function:  pageFree
+ * --------------------
+ *  the SedFreeFunction of setPageMode, frees a block of pageAlloc
+ */
+
+void pageFree(void *ptr, void *user){
+  PageAllocator *pages = user;
+  char *p = (char*) ptr - BLOCK_HEADER;
+  PageBlock block;
+
+  memcpy(&block, p, sizeof(PageBlock));
+  if( block.kind != BLOCK_MALLOC ){
+    #pragma omp atomic
+    pages->hugeBytes -= block.kind == BLOCK_MAPPED ? block.length : 0;
+    #pragma omp atomic
+    pages->advisedBytes -= block.advised ? block.length : 0;
+    #pragma omp atomic
+    pages->fallbackBytes -= block.served ? 0 : block.length;
+  }
+  if( block.kind == BLOCK_MAPPED ) munmap(p, block.length);
+  else free(p);
+}
+
+/*
+ * Function:  setPageMode
+ * --------------------
+ *  makes a context allocate its pixel and scratch buffers with huge pages, or
+ *  with malloc again for PAGES_DEFAULT. The scratch arenas are released
+ *  first, they grow again on demand. Set it before any image is read or
+ *  allocated with this context, like setAllocator.
+ *
+ *  ctx: the context
+ *  mode: one of the PAGES_* values
+ *
+ *  returns: SED_OK or SED_ERROR_ARGUMENT for an unknown mode
+ */
+
+int setPageMode(SedContext *ctx, int mode){
+  int i;
+  if( mode < 0 || mode >= PAGE_MODES ) return SED_ERROR_ARGUMENT;
+  for(i = 0; i < ctx->scratchCount; i++){
+    contextFree(ctx, ctx->scratch[i].data);
+    ctx->scratch[i].data = NULL;
+    ctx->scratch[i].size = 0;
+  }
+  memset(&ctx->pages, 0, sizeof(PageAllocator));
+  ctx->pages.mode = mode;
+  if( mode == PAGES_DEFAULT ) setAllocator(ctx, NULL, NULL, NULL);
+  else setAllocator(ctx, pageAlloc, pageFree, &ctx->pages);
+  return SED_OK;
+}
+
+/*
+ * Function:  anonHugeBytes
+ * --------------------
+ *  returns: the anonymous memory of this process that the kernel currently
+ *  backs with transparent huge pages, from /proc/self/smaps_rollup, or 0
+ *  when it cannot be read
+ */
+
+size_t anonHugeBytes(void){
+  char line[256];
+  unsigned long kib = 0;
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if( f == NULL ) return 0;
+  while( fgets(line, sizeof(line), f) != NULL )
+    if( sscanf(line, "AnonHugePages: %lu kB", &kib) == 1 ) break;
+  fclose(f);
+  return (size_t) kib << 10;
+}
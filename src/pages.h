@@ -0,0 +1,37 @@
+#ifndef PAGES
+#define PAGES
+
+#include <stddef.h>
+
+#define PAGES_DEFAULT 0     /* malloc and free */
+#define PAGES_THP 1         /* 2 MiB aligned blocks with madvise(MADV_HUGEPAGE) */
+#define PAGES_HUGETLB 2     /* mmap(MAP_HUGETLB) from the 2 MiB pool */
+#define PAGES_HUGETLB_1G 3  /* mmap(MAP_HUGETLB) from the 1 GiB pool */
+#define PAGE_MODES 4
+
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#define GIANT_PAGE_SIZE ((size_t) 1 << 30)
+#define HUGE_PAGE_MINIMUM ((size_t) 1 << 20)  /* smaller blocks always come from malloc */
+
+/*
+ * The state of the huge page allocator of a context, see pages.c. The byte
+ * counts are of the blocks currently allocated.
+ */
+typedef struct PageAllocator {
+  int mode;                 /* one of the PAGES_* values */
+  size_t hugeBytes;         /* mapped from a hugetlb pool, certainly huge */
+  size_t advisedBytes;      /* marked MADV_HUGEPAGE, huge only where AnonHugePages says so */
+  size_t fallbackBytes;     /* did not get what the mode asks for */
+  int failures;             /* huge page requests that fell back */
+} PageAllocator;
+
+extern const char *pageModeNames[PAGE_MODES];
+
+struct SedContext;
+
+int parsePageMode(char*);
+int setPageMode(struct SedContext*, int);
+void *pageAlloc(size_t, void*);
+void pageFree(void*, void*);
+size_t anonHugeBytes(void);
+#endif
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "context.h"
+#include "placement.h"
+#include "omp.h"
+
+#define LOCALITY_BATCH 512  /* pages per move_pages call */
+
+/*
+ *  ----------------
+ *  Thread and memory placement for machines with several sockets. On those
+ *  a buffer lives on the NUMA node of the thread that first touched it, and
+ *  the image that stb decodes is touched only by the main thread, so the
+ *  workers of the other sockets read remote memory in every pass.
+ *
+ *  setPlacement pins thread t of the context to a cpu (compact, scatter or an
+ *  explicit list), and it stays pinned when setThreads changes the count.
+ *  With firstTouch, allocatePlaced hands every row of a new buffer to the
+ *  thread that owns it in the row parallel passes (schedule(static) over the
+ *  rows of the team of teamSize) and lets that thread write it first. With
+ *  interleave, the pages of the buffer are spread over the NUMA nodes
+ *  instead, which evens out the bandwidth when the ownership changes between
+ *  passes, e.g. from rows to columns. The task graph allocates its buffers the
+ *  same way and prefers to run a tile on the thread that owns its middle row
+ *  (rowOwner), so its tiles are local as well. measureLocality asks the kernel for the
+ *  node of every page with move_pages and compares it with the node of the
+ *  owning thread. Everything here goes through system calls, libnuma is not
+ *  needed.
+ */
+
+/*
+ * Function:  parseList
+ * --------------------
+ *  parses a cpu or node list like "0,2,4-7"
+ *
+ *  returns: the amount of values stored in out, or -1 when malformed or
+ *  longer than max
+ */
+
+static int parseList(const char *text, int *out, int max){
+  int count = 0, first, last, used;
+  while( *text != '\0' && *text != '\n' ){
+    if( sscanf(text, "%d%n", &first, &used) != 1 || first < 0 ) return -1;
+    text += used;
+    last = first;
+    if( *text == '-' ){
+      if( sscanf(text + 1, "%d%n", &last, &used) != 1 || last < first ) return -1;
+      text += used + 1;
+    }
+    for(; first <= last; first++){
+      if( count == max ) return -1;
+      out[count++] = first;
+    }
+    if( *text == ',' ) text++;
+    else if( *text != '\0' && *text != '\n' ) return -1;
+  }
+  return count;
+}
+
+/*
+ * Function:  parseAffinity
+ * --------------------
+ *  parses none, compact, scatter or a cpu list like "0,2,4-7" into the
+ *  affinity of a placement, the other fields stay as they are
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when malformed or SED_ERROR_MEMORY
+ */
+
+int parseAffinity(char *text, Placement *p){
+  int list[CPU_SETSIZE], count;
+  p->cpus = NULL;
+  p->cpuCount = 0;
+  if( strcmp(text, "none") == 0 ) p->affinity = AFFINITY_NONE;
+  else if( strcmp(text, "compact") == 0 ) p->affinity = AFFINITY_COMPACT;
+  else if( strcmp(text, "scatter") == 0 ) p->affinity = AFFINITY_SCATTER;
+  else{
+    count = parseList(text, list, CPU_SETSIZE);
+    if( count <= 0 ) return SED_ERROR_ARGUMENT;
+    p->cpus = malloc(count * sizeof(int));
+    if( p->cpus == NULL ) return SED_ERROR_MEMORY;
+    memcpy(p->cpus, list, count * sizeof(int));
+    p->cpuCount = count;
+    p->affinity = AFFINITY_LIST;
+  }
+  return SED_OK;
+}
+
+/*
+ * Function:  readTopology
+ * --------------------
+ *  returns: a value of /sys/devices/system/cpu/cpuN/topology, 0 when missing
+ */
+
+static int readTopology(int cpu, const char *name){
+  char path[128];
+  int value = 0;
+  FILE *f;
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  f = fopen(path, "r");
+  if( f == NULL ) return 0;
+  if( fscanf(f, "%d", &value) != 1 ) value = 0;
+  fclose(f);
+  return value;
+}
+
+/*
+ * Function:  orderCpus
+ * --------------------
+ *  lists the cpus this process may run on in the order of a compact or
+ *  scatter affinity. Every cpu gets a key of its socket, its core and its
+ *  rank among the hardware threads of that core. Compact sorts by socket,
+ *  core and rank, scatter by rank, core and socket.
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the allowed cpus are unknown or
+ *  SED_ERROR_MEMORY
+ */
+
+static int orderCpus(int affinity, int **cpus, int *count){
+  cpu_set_t allowed;
+  int *list, (*key)[3], k[3], cpu, n = 0, i, j, d, before;
+  *cpus = NULL;
+  *count = 0;
+  if( sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0 ) return SED_ERROR_ARGUMENT;
+  list = malloc(CPU_COUNT(&allowed) * sizeof(int));
+  key = malloc(CPU_COUNT(&allowed) * sizeof(*key));
+  if( list == NULL || key == NULL ){
+    free(list);
+    free(key);
+    return SED_ERROR_MEMORY;
+  }
+  for(cpu = 0; cpu < CPU_SETSIZE; cpu++){
+    if( !CPU_ISSET(cpu, &allowed) ) continue;
+    k[0] = readTopology(cpu, "physical_package_id");
+    k[1] = readTopology(cpu, "core_id");
+    k[2] = 0;
+    for(j = 0; j < n; j++)
+      if( (affinity == AFFINITY_COMPACT ? key[j][0] == k[0] && key[j][1] == k[1]
+                                        : key[j][2] == k[0] && key[j][1] == k[1]) ) k[2]++;
+    if( affinity == AFFINITY_SCATTER ){
+      d = k[0];
+      k[0] = k[2];
+      k[2] = d;
+    }
+    // insertion sort by the key
+    for(i = n; i > 0; i--){
+      before = key[i - 1][0] != k[0] ? key[i - 1][0] > k[0]
+             : key[i - 1][1] != k[1] ? key[i - 1][1] > k[1] : key[i - 1][2] > k[2];
+      if( !before ) break;
+      memcpy(key[i], key[i - 1], sizeof(*key));
+      list[i] = list[i - 1];
+    }
+    memcpy(key[i], k, sizeof(k));
+    list[i] = cpu;
+    n++;
+  }
+  free(key);
+  *cpus = list;
+  *count = n;
+  return SED_OK;
+}
+
+/*
+ * Function:  applyAffinity
+ * --------------------
+ *  pins every thread of the context to its cpu, setThreads calls it again
+ *  for a new thread count
+ *
+ *  returns: SED_OK or SED_ERROR_ARGUMENT when a cpu cannot be used
+ */
+
+int applyAffinity(SedContext *ctx){
+  Placement *p = &ctx->placement;
+  int failed = 0;
+  cpu_set_t set;
+  if( p->affinity == AFFINITY_NONE || p->cpuCount == 0 ) return SED_OK;
+  #pragma omp parallel num_threads(ctx->threads) default(none) private(set) shared(p) reduction(||:failed)
+  {
+    CPU_ZERO(&set);
+    CPU_SET(p->cpus[omp_get_thread_num() % p->cpuCount], &set);
+    failed = sched_setaffinity(0, sizeof(cpu_set_t), &set) != 0;
+  }
+  return failed ? SED_ERROR_ARGUMENT : SED_OK;
+}
+
+/*
+ * Function:  setPlacement
+ * --------------------
+ *  sets where the threads of a context run and how its new pixel buffers
+ *  are placed. The context takes over the cpus of an AFFINITY_LIST, compact
+ *  and scatter compute them from the cpus this process may use.
+ *
+ *  ctx: the context
+ *  p: the placement, see placement.h
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when a cpu cannot be used or
+ *  SED_ERROR_MEMORY
+ */
+
+int setPlacement(SedContext *ctx, Placement *p){
+  int status = SED_OK;
+  free(ctx->placement.cpus);
+  ctx->placement = *p;
+  if( p->affinity == AFFINITY_COMPACT || p->affinity == AFFINITY_SCATTER )
+    status = orderCpus(p->affinity, &ctx->placement.cpus, &ctx->placement.cpuCount);
+  if( status == SED_OK ) status = applyAffinity(ctx);
+  return status;
+}
+
+/*
+ * Function:  onlineNodes
+ * --------------------
+ *  returns: the mask of the online NUMA nodes, 0 when they are unknown
+ */
+
+static unsigned long onlineNodes(void){
+  char line[256];
+  int nodes[MAX_NUMA_NODES], count, i;
+  unsigned long mask = 0;
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  if( f == NULL ) return 0;
+  count = fgets(line, sizeof(line), f) != NULL ? parseList(line, nodes, MAX_NUMA_NODES) : -1;
+  fclose(f);
+  for(i = 0; i < count; i++) mask |= 1UL << nodes[i];
+  return mask;
+}
+
+/*
+ * Function:  interleavePages
+ * --------------------
+ *  spreads the pages of a buffer that is not touched yet over all online
+ *  NUMA nodes. Nothing happens on a machine with a single node or when the
+ *  kernel refuses, the buffer then stays where first touch puts it.
+ */
+
+static void interleavePages(Pixel *data, size_t size){
+  unsigned long mask = onlineNodes();
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  char *first = (char*) ((size_t) data / page * page);
+  if( mask == 0 || (mask & (mask - 1)) == 0 ) return;
+  syscall(SYS_mbind, first, (size_t) ((char*) data + size - first), MPOL_INTERLEAVE, &mask, MAX_NUMA_NODES + 1, 0);
+}
+
+/*
+ * Function:  rowOwner
+ * --------------------
+ *  the thread that gets a row in schedule(static) over the rows: the first
+ *  rows % threads threads take one row more than the others
+ *
+ *  row: the row
+ *  rows: the amount of rows
+ *  threads: the size of the team
+ *
+ *  returns: the thread number
+ */
+
+int rowOwner(int row, int rows, int threads){
+  int share = rows / threads, extra = rows % threads;
+  if( row < extra * (share + 1) ) return row / (share + 1);
+  return extra + (row - extra * (share + 1)) / share;
+}
+
+/*
+ * Function:  allocatePlaced
+ * --------------------
+ *  allocates a pixel buffer of rows rows with the allocator of the context
+ *  and fills it from source, or with zeros when source is NULL. With
+ *  firstTouch the rows are written by the threads that own them in the row
+ *  parallel passes, with interleave the pages are spread over the nodes
+ *  first.
+ *
+ *  ctx: the context
+ *  source: the pixels to copy or NULL
+ *  rowBytes: the bytes of a row
+ *  rows: the amount of rows
+ *
+ *  returns: the buffer or NULL when out of memory
+ */
+
+Pixel *allocatePlaced(SedContext *ctx, Pixel *source, size_t rowBytes, int rows){
+  size_t size = rowBytes * rows;
+  Pixel *data = contextAlloc(ctx, size);
+  int row;
+  if( data == NULL ) return NULL;
+  if( ctx->placement.interleave ) interleavePages(data, size);
+  if( !ctx->placement.firstTouch ){
+    if( source != NULL ) memcpy(data, source, size);
+    else memset(data, 0, size);
+    return data;
+  }
+  #pragma omp parallel for num_threads(teamSize(ctx, size)) default(none) shared(data, source, rowBytes, rows) schedule(static)
+  for(row = 0; row < rows; row++){
+    if( source != NULL ) memcpy(data + row * rowBytes, source + row * rowBytes, rowBytes);
+    else memset(data + row * rowBytes, 0, rowBytes);
+  }
+  return data;
+}
+
+/*
+ * Function:  countPages
+ * --------------------
+ *  asks the kernel for the nodes of a batch of pages and adds them to the
+ *  statistics, against the node of the calling thread
+ */
+
+static void countPages(void **pages, int count, int node, LocalityStats *stats){
+  int status[LOCALITY_BATCH], i;
+  if( syscall(SYS_move_pages, 0, (unsigned long) count, pages, NULL, status, 0) != 0 )
+    for(i = 0; i < count; i++) status[i] = -1;
+  for(i = 0; i < count; i++){
+    stats->pages++;
+    if( status[i] < 0 || status[i] >= MAX_NUMA_NODES || node < 0 ){
+      stats->unknown++;
+      continue;
+    }
+    stats->perNode[status[i]]++;
+    if( status[i] + 1 > stats->nodes ) stats->nodes = status[i] + 1;
+    if( status[i] == node ) stats->local++;
+    else stats->remote++;
+  }
+}
+
+/*
+ * Function:  measureLocality
+ * --------------------
+ *  finds the node of every page of a buffer and whether it is the node of
+ *  the thread that owns its row in the row parallel passes
+ *
+ *  ctx: the context
+ *  data: the buffer
+ *  rowBytes: the bytes of a row
+ *  rows: the amount of rows
+ *  stats: filled with the counts
+ *
+ *  returns: SED_OK
+ */
+
+int measureLocality(SedContext *ctx, Pixel *data, size_t rowBytes, int rows, LocalityStats *stats){
+  size_t page = (size_t) sysconf(_SC_PAGESIZE), size = rowBytes * rows;
+  memset(stats, 0, sizeof(LocalityStats));
+  #pragma omp parallel num_threads(teamSize(ctx, size)) default(none) shared(data, rowBytes, rows, page, stats)
+  {
+    LocalityStats own;
+    void *pages[LOCALITY_BATCH];
+    unsigned int cpu, node;
+    size_t last = (size_t) -1, p, end;
+    int row, count = 0, i, mine;
+
+    memset(&own, 0, sizeof(LocalityStats));
+    mine = syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int) node : -1;
+    #pragma omp for schedule(static)
+    for(row = 0; row < rows; row++){
+      end = ((size_t) (data + (row + 1) * rowBytes) - 1) / page;
+      for(p = (size_t) (data + row * rowBytes) / page; p <= end; p++){
+        if( p == last ) continue; // shared with the previous row
+        last = p;
+        pages[count++] = (void*) (p * page);
+        if( count == LOCALITY_BATCH ){
+          countPages(pages, count, mine, &own);
+          count = 0;
+        }
+      }
+    }
+    if( count > 0 ) countPages(pages, count, mine, &own);
+    #pragma omp critical
+    {
+      stats->pages += own.pages;
+      stats->local += own.local;
+      stats->remote += own.remote;
+      stats->unknown += own.unknown;
+      if( own.nodes > stats->nodes ) stats->nodes = own.nodes;
+      for(i = 0; i < own.nodes; i++) stats->perNode[i] += own.perNode[i];
+    }
+  }
+  return SED_OK;
+}
+
+/*
+ * Function:  printLocality
+ * --------------------
+ *  prints the statistics of measureLocality of a named buffer on one line
+ */
+
+void printLocality(LocalityStats *stats, const char *name, FILE *out){
+  int i;
+  double pages = stats->pages > 0 ? (double) stats->pages : 1;
+  fprintf(out, "Locality of the %s: %zu pages, %.1f%% local, %.1f%% remote, %.1f%% unknown", name, stats->pages,
+          100 * stats->local / pages, 100 * stats->remote / pages, 100 * stats->unknown / pages);
+  for(i = 0; i < stats->nodes; i++) fprintf(out, ", node %d %zu", i, stats->perNode[i]);
+  fprintf(out, "\n");
+}
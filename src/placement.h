@@ -0,0 +1,50 @@
+#ifndef PLACEMENT
+#define PLACEMENT
+
+#include <stddef.h>
+#include <stdio.h>
+#include "image.h"
+
+#define AFFINITY_NONE 0     /* threads float as the OS schedules them */
+#define AFFINITY_COMPACT 1  /* fill a socket, core by core, before the next one */
+#define AFFINITY_SCATTER 2  /* round robin over the sockets, one cpu per core first */
+#define AFFINITY_LIST 3     /* the cpus of an explicit list, in its order */
+
+#define MAX_NUMA_NODES 64
+
+/*
+ * Where the threads of a context run and where its pixel buffers live, see
+ * placement.c. Thread t runs on cpus[t % cpuCount].
+ */
+typedef struct Placement {
+  int affinity;             /* one of the AFFINITY_* values */
+  int *cpus;
+  int cpuCount;
+  int firstTouch;           /* 1 when the threads that own the rows first touch them */
+  int interleave;           /* 1 to interleave the pages over the NUMA nodes */
+} Placement;
+
+/*
+ * The NUMA nodes of the pages of a buffer, seen from the threads that own
+ * their rows. Pages that are not mapped yet or that the kernel cannot report
+ * count as unknown.
+ */
+typedef struct LocalityStats {
+  size_t pages;
+  size_t local;             /* on the node of the thread that owns them */
+  size_t remote;
+  size_t unknown;
+  int nodes;                /* 1 + the highest node seen */
+  size_t perNode[MAX_NUMA_NODES];
+} LocalityStats;
+
+struct SedContext;
+
+int parseAffinity(char*, Placement*);
+int setPlacement(struct SedContext*, Placement*);
+int applyAffinity(struct SedContext*);
+int rowOwner(int, int, int);
+Pixel *allocatePlaced(struct SedContext*, Pixel*, size_t, int);
+int measureLocality(struct SedContext*, Pixel*, size_t, int, LocalityStats*);
+void printLocality(LocalityStats*, const char*, FILE*);
+#endif
@@ -0,0 +1,501 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "edt.h"
+#include "reference.h"
+#include "stats.h"
+#include "synth.h"
+#include "taskgraph.h"
+#include "omp.h"
+
+#define MIN_PIX 0
+#define MAX_PIX 255
+#define FOREGROUND 128
+#define CALIBRATION_TRIALS 3
+#define SMALL_IMAGE_RADIUS 5   /* the disc calibrateSmallImage opens with */
+#define MODEL_FILE_NAME ".sedecomp.model"
+
+/*
+ *  ----------------
+ *  Engine planner: every exact engine gives the same result, so the planner
+ *  only has to predict which one is fastest for an image and a radius. It
+ *  inspects the image (binary or not, foreground density, size), counts the
+ *  work of every eligible engine in units and weighs them with a cost model
+ *  fitted on this machine by calibrateCostModel.
+ *
+ *  units per engine:
+ *    decomposed  pixels * (1 + layers of the disc plan)
+ *    edt         pixels, independent of the radius (binary images only)
+ *    reference   pixels * pixels of the disc
+ */
+
+const char *engineNames[SED_ENGINES] = {"decomposed", "edt", "reference"};
+
+/*
+ * Function:  parseEngine
+ * --------------------
+ *  returns: the ENGINE_* value of an engine name, ENGINE_AUTO for "auto" or -2
+ */
+
+int parseEngine(char *name){
+  int i;
+  if( strcmp(name, "auto") == 0 ) return ENGINE_AUTO;
+  for(i = 0; i < SED_ENGINES; i++)
+    if( strcmp(name, engineNames[i]) == 0 ) return i;
+  return -2;
+}
+
+/*
+ * Function:  defaultCostModel
+ * --------------------
+ *  returns: the model calibrated on the development machine, a starting point
+ *  until calibrateCostModel has run on the current one
+ */
+
+CostModel defaultCostModel(void){
+  CostModel model = {
+    {0, 0, 7.6e-6},
+    {4.4e-9, 3.8e-8, 5.7e-9},
+    SMALL_IMAGE_PIXELS,
+  };
+  return model;
+}
+
+/*
+ * Function:  loadCostModel
+ * --------------------
+ *  reads a model written by saveCostModel, lines of "engine fixed perUnit"
+ *  and "small-image pixels". Values missing from the file stay as they are.
+ *
+ *  name: the file name
+ *  model: the model to be updated
+ *
+ *  returns: SED_OK, SED_ERROR_IO or SED_ERROR_ARGUMENT when malformed
+ */
+
+int loadCostModel(char *name, CostModel *model){
+  char line[256], engine[64];
+  double fixed, perUnit;
+  int e, status = SED_OK;
+  FILE *f = fopen(name, "r");
+  if( f == NULL ) return SED_ERROR_IO;
+  while( status == SED_OK && fgets(line, sizeof(line), f) != NULL ){
+    if( line[0] == '#' || line[0] == '\n' ) continue;
+    if( sscanf(line, "small-image %lf", &fixed) == 1 && fixed >= 0 ){
+      model->smallImage = fixed;
+      continue;
+    }
+    if( sscanf(line, "%63s %lf %lf", engine, &fixed, &perUnit) != 3 || fixed < 0 || perUnit <= 0 ){
+      status = SED_ERROR_ARGUMENT;
+      break;
+    }
+    e = parseEngine(engine);
+    if( e < 0 ) continue;
+    model->fixed[e] = fixed;
+    model->perUnit[e] = perUnit;
+  }
+  fclose(f);
+  return status;
+}
+
+/*
+ * Function:  saveCostModel
+ * --------------------
+ *  writes a model in the format of loadCostModel
+ *
+ *  returns: SED_OK or SED_ERROR_IO
+ */
+
+int saveCostModel(char *name, CostModel *model){
+  int e;
+  FILE *f = fopen(name, "w");
+  if( f == NULL ) return SED_ERROR_IO;
+  fprintf(f, "# engine fixed_seconds seconds_per_unit, units as in planner.c\n");
+  for(e = 0; e < SED_ENGINES; e++)
+    fprintf(f, "%s %.6e %.6e\n", engineNames[e], model->fixed[e], model->perUnit[e]);
+  fprintf(f, "small-image %.0f\n", model->smallImage);
+  return fclose(f) == 0 ? SED_OK : SED_ERROR_IO;
+}
+
+/*
+ * Function:  defaultCostModelName
+ * --------------------
+ *  returns: $SEDECOMP_MODEL, else ~/.sedecomp.model, or NULL without a home
+ */
+
+char *defaultCostModelName(void){
+  static char name[1024];
+  char *env = getenv("SEDECOMP_MODEL"), *home = getenv("HOME");
+  if( env != NULL ) return env;
+  if( home == NULL ) return NULL;
+  snprintf(name, sizeof(name), "%s/%s", home, MODEL_FILE_NAME);
+  return name;
+}
+
+/*
+ * Function:  discArea
+ * --------------------
+ *  returns: the amount of pixels of the computeBinaryDiscSE disc
+ */
+
+static double discArea(int radius){
+  long long threshold = (long long) (radius - 1) * (radius - 1), area = 0;
+  int dy, dx;
+  for(dy = -radius; dy <= radius; dy++)
+    for(dx = -radius; dx <= radius; dx++)
+      area += (long long) dy * dy + (long long) dx * dx < threshold;
+  return (double) area;
+}
+
+/*
+ * Function:  engineUnits
+ * --------------------
+ *  counts the work of an engine for an image size and radius
+ *
+ *  ctx: the context, the disc plan is computed and cached for decomposed
+ *  engine: one of the ENGINE_* values
+ *  width: the width of the image
+ *  height: the height of the image
+ *  radius: the radius of the disc
+ *  units: set to the work
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int engineUnits(SedContext *ctx, int engine, int width, int height, int radius, double *units){
+  double pixels = (double) width * height;
+  DiscPlan *plan;
+  int status = SED_OK;
+  if( engine == ENGINE_DECOMPOSED ){
+    status = getDiscPlan(ctx, radius, &plan);
+    if( status == SED_OK ) *units = pixels * (1 + plan->count);
+  }else if( engine == ENGINE_EDT ){
+    *units = pixels;
+  }else if( engine == ENGINE_REFERENCE ){
+    *units = pixels * discArea(radius);
+  }else{
+    status = SED_ERROR_ARGUMENT;
+  }
+  return status;
+}
+
+/*
+ * Function:  profileImage
+ * --------------------
+ *  finds out whether an image is binary and which fraction is foreground
+ */
+
+static void profileImage(Image *im, int threads, int *binary, double *density){
+  size_t size = (size_t) im->width * im->height * im->channels, i, foreground = 0;
+  Pixel *a = im->data;
+  int other = 0;
+  #pragma omp parallel for num_threads(threads) default(none) shared(a, size) reduction(+:foreground) reduction(||:other) schedule(static)
+  for(i = 0; i < size; i++){
+    foreground += a[i] >= FOREGROUND;
+    other = other || (a[i] != MIN_PIX && a[i] != MAX_PIX);
+  }
+  *binary = im->channels == 1 && !other;
+  *density = size > 0 ? (double) foreground / size : 0;
+}
+
+/*
+ * Function:  chooseEngine
+ * --------------------
+ *  predicts the run time of every engine eligible for images of a kind with
+ *  the cost model of the context and picks the fastest one, unless the caller
+ *  forces an engine
+ *
+ *  ctx: the context
+ *  width: the width of the images
+ *  height: the height of the images
+ *  channels: the channels of the images
+ *  binary: 1 when the images only hold 0 and 255
+ *  radius: the radius of the disc
+ *  engine: ENGINE_AUTO or the engine to use
+ *  plan: filled with the choice and the predictions, the density is left alone
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the forced engine, or with
+ *  ENGINE_AUTO every engine, cannot process the images, or another error
+ *  code of engineUnits
+ */
+
+int chooseEngine(SedContext *ctx, int width, int height, int channels, int binary, int radius, int engine,
+                 EnginePlan *plan){
+  double units;
+  int e, status[SED_ENGINES];
+  if( engine < ENGINE_AUTO || engine >= SED_ENGINES || radius < 1 ) return SED_ERROR_ARGUMENT;
+  plan->binary = binary && channels == 1;
+  plan->engine = -1;
+  plan->forced = engine != ENGINE_AUTO;
+  for(e = 0; e < SED_ENGINES; e++){
+    plan->predicted[e] = -1;
+    status[e] = SED_ERROR_ARGUMENT;
+    if( e == ENGINE_EDT && !plan->binary ) continue;
+    if( e == ENGINE_REFERENCE && channels != 1 ) continue;
+    // an engine that cannot run, e.g. decomposed at radius 1, leaves the others eligible
+    status[e] = engineUnits(ctx, e, width, height, radius, &units);
+    if( status[e] != SED_OK ) continue;
+    plan->predicted[e] = ctx->model.fixed[e] + ctx->model.perUnit[e] * units / ctx->threads;
+    if( plan->engine < 0 || plan->predicted[e] < plan->predicted[plan->engine] ) plan->engine = e;
+  }
+  if( plan->forced ){
+    if( plan->predicted[engine] < 0 ) return status[engine];
+    plan->engine = engine;
+  }
+  if( plan->engine < 0 ){
+    for(e = 0; e < SED_ENGINES && status[e] == SED_ERROR_ARGUMENT; e++);
+    return e < SED_ENGINES ? status[e] : SED_ERROR_ARGUMENT;
+  }
+  return SED_OK;
+}
+
+/*
+ * Function:  planEngine
+ * --------------------
+ *  inspects an image and picks the engine for it with chooseEngine
+ *
+ *  ctx: the context
+ *  im: the image
+ *  radius: the radius of the disc
+ *  engine: ENGINE_AUTO or the engine to use
+ *  plan: filled with the choice and the predictions
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the forced engine cannot process
+ *  the image, or another error code
+ */
+
+int planEngine(SedContext *ctx, Image *im, int radius, int engine, EnginePlan *plan){
+  int binary;
+  if( engine < ENGINE_AUTO || engine >= SED_ENGINES || radius < 1 ) return SED_ERROR_ARGUMENT;
+  profileImage(im, ctx->threads, &binary, &plan->density);
+  return chooseEngine(ctx, im->width, im->height, im->channels, binary, radius, engine, plan);
+}
+
+/*
+ * Function:  describeEnginePlan
+ * --------------------
+ *  formats a plan for the log, e.g. "engine edt (auto): binary 1024x1024,
+ *  density 0.43, radius 15, 4 threads, predicted decomposed 80.1 ms, edt
+ *  12.0 ms, reference 9000.0 ms"
+ */
+
+void describeEnginePlan(EnginePlan *plan, Image *im, int radius, int threads, char *buf, int len){
+  int e, n;
+  n = snprintf(buf, len, "engine %s (%s): %s %dx%d, density %.2f, radius %d, %d threads, predicted",
+               engineNames[plan->engine], plan->forced ? "forced" : "auto", plan->binary ? "binary" : "grayscale",
+               im->width, im->height, plan->density, radius, threads);
+  for(e = 0; e < SED_ENGINES && n > 0 && n < len; e++){
+    if( plan->predicted[e] < 0 ) continue;
+    n += snprintf(buf + n, len - n, " %s %.1f ms%s", engineNames[e], plan->predicted[e] * 1e3,
+                  e + 1 < SED_ENGINES ? "," : "");
+  }
+  if( n > 0 && n < len && buf[n - 1] == ',' ) buf[n - 1] = '\0';
+}
+
+/*
+ * Function:  runEngine
+ * --------------------
+ *  plans, records the plan in the context and runs the chosen engine
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int runEngine(SedContext *ctx, Image *im, int radius, int engine, int closing){
+  char description[PLAN_DESCRIPTION_SIZE];
+  Image *SE;
+  int status = planEngine(ctx, im, radius, engine, &ctx->lastPlan);
+  if( status != SED_OK ) return status;
+  if( ctx->verbose ){
+    describeEnginePlan(&ctx->lastPlan, im, radius, ctx->threads, description, sizeof(description));
+    fprintf(stderr, "%s\n", description);
+  }
+  switch( ctx->lastPlan.engine ){
+    case ENGINE_EDT: return closing ? edtClosing(ctx, im, radius) : edtOpening(ctx, im, radius);
+    case ENGINE_REFERENCE:
+      SE = computeBinaryDiscSE(ctx, radius);
+      if( SE == NULL ) return SED_ERROR_MEMORY;
+      status = closing ? referenceClosing(ctx, im, SE) : referenceOpening(ctx, im, SE);
+      freeImage(ctx, SE);
+      return status;
+  }
+  return closing ? discClosing(ctx, im, radius) : discOpening(ctx, im, radius);
+}
+
+/*
+ * Function:  engineOpening
+ * --------------------
+ *  opens an image with the disc, through the fastest engine by the cost model
+ *  or the one given. The plan is kept in ctx->lastPlan and printed to stderr
+ *  when the context is verbose.
+ *
+ *  ctx: the context
+ *  im: the image, modified in place
+ *  radius: the radius of the disc
+ *  engine: ENGINE_AUTO or one of the ENGINE_* values
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int engineOpening(SedContext *ctx, Image *im, int radius, int engine){
+  return runEngine(ctx, im, radius, engine, 0);
+}
+
+/*
+ * Function:  engineClosing
+ * --------------------
+ *  closes an image with the disc, see engineOpening
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int engineClosing(SedContext *ctx, Image *im, int radius, int engine){
+  return runEngine(ctx, im, radius, engine, 1);
+}
+
+/*
+ * Function:  fitLine
+ * --------------------
+ *  fits t = fixed + perUnit * x minimizing the squared relative error, so
+ *  the small and the large measurements count the same (the planner compares
+ *  engines at every scale). Through the origin when the intercept would be
+ *  negative.
+ */
+
+static void fitLine(double *x, double *t, int n, double *fixed, double *perUnit){
+  double sw = 0, sx = 0, st = 0, sxx = 0, sxt = 0, w, det;
+  int i;
+  for(i = 0; i < n; i++){
+    w = 1 / (t[i] * t[i]);
+    sw += w;
+    sx += w * x[i];
+    st += w * t[i];
+    sxx += w * x[i] * x[i];
+    sxt += w * x[i] * t[i];
+  }
+  det = sw * sxx - sx * sx;
+  *perUnit = det > 0 ? (sw * sxt - sx * st) / det : 0;
+  *fixed = det > 0 ? (st - *perUnit * sx) / sw : -1;
+  if( *fixed < 0 || *perUnit <= 0 ){
+    *fixed = 0;
+    *perUnit = sxt / sxx;
+  }
+}
+
+/*
+ * Function:  timeDiscPlan
+ * --------------------
+ *  returns: the fastest of CALIBRATION_TRIALS openings of an image with a
+ *  disc plan, serial or as a task graph, or -1 on an error
+ */
+
+static double timeDiscPlan(SedContext *ctx, Image *source, Image *work, DiscPlan *plan, int serial){
+  double best = -1, elapsed;
+  int k, status = SED_OK;
+  for(k = 0; status == SED_OK && k <= CALIBRATION_TRIALS; k++){ // run 0 is a warmup
+    memcpy(work->data, source->data, (size_t) source->width * source->height);
+    elapsed = wallClock();
+    if( serial ) status = serialMorphology(ctx, work, plan->parts, plan->count, 0);
+    else status = graphMorphology(ctx, work, plan->parts, plan->count, 0, NULL);
+    elapsed = wallClock() - elapsed;
+    if( k > 0 && (best < 0 || elapsed < best) ) best = elapsed;
+  }
+  return status == SED_OK ? best : -1;
+}
+
+/*
+ * Function:  calibrateSmallImage
+ * --------------------
+ *  finds the largest square image, from 32x32 up to 1024x1024 pixels, for
+ *  which the serial disc opening is still as fast as the task graph with the
+ *  threads of the context, and stores its pixels in model->smallImage
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int calibrateSmallImage(SedContext *ctx, CostModel *model, int verbose){
+  double serial, graph;
+  int size, status;
+  SynthSpec spec = {SYNTH_BLOBS, 1, 1, 0, 0, 0};
+  Image *source = NULL, *work = NULL;
+  DiscPlan *plan;
+
+  status = getDiscPlan(ctx, SMALL_IMAGE_RADIUS, &plan);
+  model->smallImage = 0;
+  for(size = 32; status == SED_OK && size <= 1024; size *= 2){
+    spec.width = spec.height = size;
+    status = synthImage(ctx, &spec, &source);
+    if( status == SED_OK ) status = copyImage(ctx, source, &work);
+    if( status == SED_OK ){
+      serial = timeDiscPlan(ctx, source, work, plan, 1);
+      graph = timeDiscPlan(ctx, source, work, plan, 0);
+      if( serial < 0 || graph < 0 ) status = SED_ERROR_MEMORY;
+    }
+    freeImage(ctx, source);
+    freeImage(ctx, work);
+    source = work = NULL;
+    if( status != SED_OK ) break;
+    if( verbose )
+      fprintf(stderr, "calibrate small image %dx%d radius %d: serial %.3f ms, graph %.3f ms\n", size, size,
+              SMALL_IMAGE_RADIUS, serial * 1e3, graph * 1e3);
+    if( serial > graph ) break;
+    model->smallImage = (double) size * size;
+  }
+  return status;
+}
+
+/*
+ * Function:  calibrateCostModel
+ * --------------------
+ *  times every engine on synthetic binary blob images of a few sizes and
+ *  radii with the threads of the context and fits the model to the fastest
+ *  of CALIBRATION_TRIALS runs of each, then finds the small image threshold
+ *
+ *  ctx: the context
+ *  model: filled with the fitted coefficients
+ *  verbose: 1 to print every measurement to stderr
+ *
+ *  returns: SED_OK or an error code
+ */
+
+int calibrateCostModel(SedContext *ctx, CostModel *model, int verbose){
+  static const int sizes[SED_ENGINES][3] = {{256, 512, 1024}, {256, 512, 1024}, {64, 128, 192}};
+  static const int radii[SED_ENGINES][3] = {{3, 7, 15}, {3, 7, 15}, {3, 5, 9}};
+  double x[9], t[9], units, best, elapsed;
+  int e, i, j, k, n, status = SED_OK;
+  SynthSpec spec = {SYNTH_BLOBS, 1, 1, 0, 0, 0};
+  Image *source = NULL, *work = NULL;
+
+  *model = defaultCostModel();
+  for(e = 0; status == SED_OK && e < SED_ENGINES; e++){
+    n = 0;
+    for(i = 0; status == SED_OK && i < 3; i++){
+      spec.width = spec.height = sizes[e][i];
+      status = synthImage(ctx, &spec, &source);
+      if( status == SED_OK ) status = copyImage(ctx, source, &work);
+      for(j = 0; status == SED_OK && j < 3; j++){
+        status = engineUnits(ctx, e, source->width, source->height, radii[e][j], &units);
+        best = -1;
+        for(k = 0; status == SED_OK && k <= CALIBRATION_TRIALS; k++){ // run 0 is a warmup
+          memcpy(work->data, source->data, (size_t) source->width * source->height);
+          elapsed = wallClock();
+          status = engineOpening(ctx, work, radii[e][j], e);
+          elapsed = wallClock() - elapsed;
+          if( k > 0 && (best < 0 || elapsed < best) ) best = elapsed;
+        }
+        if( status != SED_OK ) break;
+        x[n] = units / ctx->threads;
+        t[n++] = best;
+        if( verbose )
+          fprintf(stderr, "calibrate %s %dx%d radius %d: %.3f ms\n", engineNames[e],
+                  source->width, source->height, radii[e][j], best * 1e3);
+      }
+      freeImage(ctx, source);
+      freeImage(ctx, work);
+      source = work = NULL;
+    }
+    if( status == SED_OK ) fitLine(x, t, n, &model->fixed[e], &model->perUnit[e]);
+  }
+  if( status == SED_OK ) status = calibrateSmallImage(ctx, model, verbose);
+  return status;
+}
@@ -0,0 +1,49 @@
+#ifndef PLANNER
+#define PLANNER
+
+#include "image.h"
+
+#define ENGINE_AUTO -1
+#define ENGINE_DECOMPOSED 0
+#define ENGINE_EDT 1
+#define ENGINE_REFERENCE 2
+#define SED_ENGINES 3
+
+#define PLAN_DESCRIPTION_SIZE 256
+#define SMALL_IMAGE_PIXELS 65536       /* up to here the disc plans run on the calling thread */
+
+/*
+ * The predicted run time of an engine is fixed + perUnit * units / threads
+ * seconds, units being the work of the engine for an image and radius (see
+ * engineUnits). Images of up to smallImage pixels skip the thread team. The
+ * coefficients and the threshold come from calibrateCostModel.
+ */
+typedef struct CostModel {
+  double fixed[SED_ENGINES];
+  double perUnit[SED_ENGINES];
+  double smallImage;
+} CostModel;
+
+typedef struct EnginePlan {
+  int engine;                        /* the chosen engine */
+  int forced;                        /* 1 when the caller picked it */
+  int binary;                        /* 1 when the image has only 0 and 255 */
+  double density;                    /* the fraction of pixels >= 128 */
+  double predicted[SED_ENGINES];     /* seconds, negative when not eligible */
+} EnginePlan;
+
+extern const char *engineNames[SED_ENGINES];
+
+int parseEngine(char*);
+CostModel defaultCostModel(void);
+int loadCostModel(char*, CostModel*);
+int saveCostModel(char*, CostModel*);
+char *defaultCostModelName(void);
+int engineUnits(struct SedContext*, int, int, int, int, double*);
+int chooseEngine(struct SedContext*, int, int, int, int, int, int, EnginePlan*);
+int planEngine(struct SedContext*, Image*, int, int, EnginePlan*);
+void describeEnginePlan(EnginePlan*, Image*, int, int, char*, int);
+int engineOpening(struct SedContext*, Image*, int, int);
+int engineClosing(struct SedContext*, Image*, int, int);
+int calibrateCostModel(struct SedContext*, CostModel*, int);
+#endif
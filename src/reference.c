@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "reference.h"
+#include "omp.h"
+
+#define MIN_PIX 0
+#define MAX_PIX 255
+
+/*
+ *  ----------------
+ *  Brute force reference morphology: every output pixel is the minimum or
+ *  maximum over every pixel of the structuring element bitmap. It is slow
+ *  (width * height * |SE| comparisons) but simple enough to be obviously
+ *  correct, the fast engines are checked against it by sedverify.
+ *
+ *  The structuring element is any single channel image with odd width and
+ *  height, nonzero pixels belong to it and its center is the origin. Pixels
+ *  outside of the image are ignored, as if the image was padded with MAX_PIX
+ *  for the erosion and MIN_PIX for the dilation. Volumes work the same way
+ *  with a volume as the structuring element.
+ */
+
+/*
+ * Function:  seOffsets
+ * --------------------
+ *  lists the (row, column) offsets of the pixels of a structuring element
+ *  relative to its center
+ *
+ *  SE: the structuring element
+ *  count: set to the amount of offsets
+ *
+ *  returns: 2 * count ints, row and column interleaved, or NULL
+ */
+
+static int *seOffsets(Image *SE, int *count){
+  int row, col, n = 0;
+  int *offsets = malloc(2 * (size_t) SE->width * SE->height * sizeof(int));
+  if( offsets == NULL ) return NULL;
+  for(row = 0; row < SE->height; row++){
+    for(col = 0; col < SE->width; col++){
+      if( SE->data[row * SE->width + col] == MIN_PIX ) continue;
+      offsets[2 * n] = row - SE->height / 2;
+      offsets[2 * n + 1] = col - SE->width / 2;
+      n++;
+    }
+  }
+  *count = n;
+  return offsets;
+}
+
+/*
+ * Function:  referenceMorphology
+ * --------------------
+ *  computes the erosion, out(x) = min f(x + b), or the dilation,
+ *  out(x) = max f(x - b), over all pixels b of the structuring element
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+static int referenceMorphology(SedContext *ctx, Image *im, Image *SE, int maximum){
+  int width = im->width, height = im->height, count, row, col, k, r, c, value;
+  int sign = maximum ? -1 : 1;
+  int *offsets;
+  Pixel *a = im->data, *out;
+
+  if( SE->channels != 1 || SE->width % 2 == 0 || SE->height % 2 == 0 ) return SED_ERROR_ARGUMENT;
+  offsets = seOffsets(SE, &count);
+  out = contextAlloc(ctx, (size_t) width * height);
+  if( offsets == NULL || out == NULL ){
+    free(offsets);
+    contextFree(ctx, out);
+    return SED_ERROR_MEMORY;
+  }
+
+  #pragma omp parallel for num_threads(ctx->threads) default(none) private(col, k, r, c, value) shared(a, out, offsets, count, width, height, sign, maximum) schedule(static)
+  for(row = 0; row < height; row++){
+    for(col = 0; col < width; col++){
+      value = maximum ? MIN_PIX : MAX_PIX;
+      for(k = 0; k < count; k++){
+        r = row + sign * offsets[2 * k];
+        c = col + sign * offsets[2 * k + 1];
+        if( r < 0 || r >= height || c < 0 || c >= width ) continue;
+        if( maximum ) value = a[(size_t) r * width + c] > value ? a[(size_t) r * width + c] : value;
+        else value = a[(size_t) r * width + c] < value ? a[(size_t) r * width + c] : value;
+      }
+      out[(size_t) row * width + col] = value;
+    }
+  }
+
+  free(offsets);
+  replacePixels(ctx, im, out);
+  return SED_OK;
+}
+
+/*
+ * Function:  referenceErosion
+ * --------------------
+ *  erodes an image with an arbitrary structuring element bitmap
+ *
+ *  ctx: the context
+ *  im: the image, single channel, its data is replaced
+ *  SE: the structuring element
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceErosion(SedContext *ctx, Image *im, Image *SE){
+  return referenceMorphology(ctx, im, SE, 0);
+}
+
+/*
+ * Function:  referenceDilation
+ * --------------------
+ *  dilates an image with the reflection of an arbitrary structuring element
+ *  bitmap
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceDilation(SedContext *ctx, Image *im, Image *SE){
+  return referenceMorphology(ctx, im, SE, 1);
+}
+
+/*
+ * Function:  referenceOpening
+ * --------------------
+ *  the erosion followed by the dilation with the same structuring element
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceOpening(SedContext *ctx, Image *im, Image *SE){
+  int status = referenceErosion(ctx, im, SE);
+  if( status == SED_OK ) status = referenceDilation(ctx, im, SE);
+  return status;
+}
+
+/*
+ * Function:  referenceClosing
+ * --------------------
+ *  the dilation followed by the erosion with the same structuring element
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceClosing(SedContext *ctx, Image *im, Image *SE){
+  int status = referenceDilation(ctx, im, SE);
+  if( status == SED_OK ) status = referenceErosion(ctx, im, SE);
+  return status;
+}
+
+/*
+ * Function:  referenceVolumeMorphology
+ * --------------------
+ *  the volume counterpart of referenceMorphology, the structuring element is
+ *  a volume with odd sides centered on its origin
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+static int referenceVolumeMorphology(SedContext *ctx, Volume *vol, Volume *SE, int maximum){
+  int width = vol->width, height = vol->height, depth = vol->depth, count = 0, slice, row, col, k, z, r, c, value;
+  int sign = maximum ? -1 : 1;
+  size_t i, seSize = (size_t) SE->width * SE->height * SE->depth;
+  int *offsets;
+  Pixel *a = vol->data, *out, v;
+
+  if( SE->width % 2 == 0 || SE->height % 2 == 0 || SE->depth % 2 == 0 ) return SED_ERROR_ARGUMENT;
+  offsets = malloc(3 * seSize * sizeof(int));
+  out = contextAlloc(ctx, (size_t) width * height * depth);
+  if( offsets == NULL || out == NULL ){
+    free(offsets);
+    contextFree(ctx, out);
+    return SED_ERROR_MEMORY;
+  }
+  for(i = 0; i < seSize; i++){
+    if( SE->data[i] == MIN_PIX ) continue;
+    offsets[3 * count] = (int) (i / SE->width / SE->height) - SE->depth / 2;
+    offsets[3 * count + 1] = (int) (i / SE->width % SE->height) - SE->height / 2;
+    offsets[3 * count + 2] = (int) (i % SE->width) - SE->width / 2;
+    count++;
+  }
+
+  #pragma omp parallel for num_threads(ctx->threads) default(none) private(row, col, k, z, r, c, value, v) shared(a, out, offsets, count, width, height, depth, sign, maximum) schedule(static)
+  for(slice = 0; slice < depth; slice++){
+    for(row = 0; row < height; row++){
+      for(col = 0; col < width; col++){
+        value = maximum ? MIN_PIX : MAX_PIX;
+        for(k = 0; k < count; k++){
+          z = slice + sign * offsets[3 * k];
+          r = row + sign * offsets[3 * k + 1];
+          c = col + sign * offsets[3 * k + 2];
+          if( z < 0 || z >= depth || r < 0 || r >= height || c < 0 || c >= width ) continue;
+          v = a[((size_t) z * height + r) * width + c];
+          if( maximum ) value = v > value ? v : value;
+          else value = v < value ? v : value;
+        }
+        out[((size_t) slice * height + row) * width + col] = value;
+      }
+    }
+  }
+
+  free(offsets);
+  contextFree(ctx, vol->data);
+  vol->data = out;
+  return SED_OK;
+}
+
+/*
+ * Function:  referenceVolumeErosion
+ * --------------------
+ *  erodes a volume with an arbitrary structuring element volume
+ *
+ *  ctx: the context
+ *  vol: the volume, its data is replaced
+ *  SE: the structuring element
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceVolumeErosion(SedContext *ctx, Volume *vol, Volume *SE){
+  return referenceVolumeMorphology(ctx, vol, SE, 0);
+}
+
+/*
+ * Function:  referenceVolumeDilation
+ * --------------------
+ *  dilates a volume with the reflection of an arbitrary structuring element
+ *  volume
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceVolumeDilation(SedContext *ctx, Volume *vol, Volume *SE){
+  return referenceVolumeMorphology(ctx, vol, SE, 1);
+}
+
+/*
+ * Function:  referenceVolumeOpening
+ * --------------------
+ *  the volume erosion followed by the volume dilation
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceVolumeOpening(SedContext *ctx, Volume *vol, Volume *SE){
+  int status = referenceVolumeErosion(ctx, vol, SE);
+  if( status == SED_OK ) status = referenceVolumeDilation(ctx, vol, SE);
+  return status;
+}
+
+/*
+ * Function:  referenceVolumeClosing
+ * --------------------
+ *  the volume dilation followed by the volume erosion
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int referenceVolumeClosing(SedContext *ctx, Volume *vol, Volume *SE){
+  int status = referenceVolumeDilation(ctx, vol, SE);
+  if( status == SED_OK ) status = referenceVolumeErosion(ctx, vol, SE);
+  return status;
+}
+
+/*
+ * Function:  partitionSE
+ * --------------------
+ *  rasterizes the union of the layers of a decomposition (see
+ *  partitionMorphology in image.c) into a structuring element bitmap, so a
+ *  decomposition can be compared with the SE it was computed from
+ *
+ *  ctx: the context
+ *  parts: the partitions
+ *  count: the amount of partitions
+ *  origin: 1 to include the origin
+ *
+ *  returns: the new structuring element or NULL when out of memory
+ */
+
+Image *partitionSE(SedContext *ctx, Partition *parts, int count, int origin){
+  int k, j, radius = 0, size, middle;
+  SparseFactor o;
+  Pixel *data;
+  Image *SE;
+
+  for(k = 0; k < count; k++){
+    o = parts[k].sparseFactor;
+    radius = o.topOffset > radius ? o.topOffset : radius;
+    radius = o.bottomOffset > radius ? o.bottomOffset : radius;
+    radius = o.leftOffset > radius ? o.leftOffset : radius;
+    radius = o.rightOffset > radius ? o.rightOffset : radius;
+    radius = parts[k].cubicFactor.width / 2 > radius ? parts[k].cubicFactor.width / 2 : radius;
+    radius = parts[k].cubicFactor.height / 2 > radius ? parts[k].cubicFactor.height / 2 : radius;
+  }
+  size = 2 * radius + 1;
+  middle = radius;
+  data = contextCalloc(ctx, (size_t) size * size, sizeof(Pixel));
+  SE = data != NULL ? createImage(data, size, size, 1) : NULL;
+  if( SE == NULL ){
+    contextFree(ctx, data);
+    return NULL;
+  }
+  if( origin ) data[middle * size + middle] = MAX_PIX;
+  for(k = 0; k < count; k++){
+    o = parts[k].sparseFactor;
+    for(j = -parts[k].cubicFactor.width / 2; j <= parts[k].cubicFactor.width / 2; j++){
+      data[(middle - o.topOffset) * size + middle + j] = MAX_PIX;
+      data[(middle + o.bottomOffset) * size + middle + j] = MAX_PIX;
+    }
+    for(j = -parts[k].cubicFactor.height / 2; j <= parts[k].cubicFactor.height / 2; j++){
+      data[(middle + j) * size + middle - o.leftOffset] = MAX_PIX;
+      data[(middle + j) * size + middle + o.rightOffset] = MAX_PIX;
+    }
+  }
+  return SE;
+}
@@ -0,0 +1,16 @@
+#ifndef REFERENCE
+#define REFERENCE
+
+#include "image.h"
+#include "volume.h"
+
+int referenceErosion(struct SedContext*, Image*, Image*);
+int referenceDilation(struct SedContext*, Image*, Image*);
+int referenceOpening(struct SedContext*, Image*, Image*);
+int referenceClosing(struct SedContext*, Image*, Image*);
+int referenceVolumeErosion(struct SedContext*, Volume*, Volume*);
+int referenceVolumeDilation(struct SedContext*, Volume*, Volume*);
+int referenceVolumeOpening(struct SedContext*, Volume*, Volume*);
+int referenceVolumeClosing(struct SedContext*, Volume*, Volume*);
+Image *partitionSE(struct SedContext*, Partition*, int, int);
+#endif
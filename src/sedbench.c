@@ -0,0 +1,779 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "batch.h"
+#include "edt.h"
+#include "morphplan.h"
+#include "reference.h"
+#include "stats.h"
+#include "synth.h"
+#include "volume.h"
+#include "omp.h"
+
+#define MAX_SWEEP 32
+#define DEFAULT_TRIALS 5
+#define DEFAULT_WARMUP 1
+#define DEFAULT_SEED 1
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV 2
+
+/*
+ *  ----------------
+ *  Benchmark of the disc openings and closings: sweeps image size, radius,
+ *  thread count and engine, times every configuration with the monotonic wall
+ *  clock over repeated trials and reports medians, percentiles and pixels per
+ *  second.
+ *  run as ./sedbench.out [options]
+ *
+ *  options:
+ *    --sizes LIST      image sizes, N for N x N or WxH, default 256,512,1024,2048
+ *                      (up to 32768 when there is memory for two copies)
+ *    --radii LIST      disc radii, default 3,5,9,15
+ *    --threads LIST    thread counts, default 1,2,4,.. up to the OpenMP default
+ *    --engines LIST    engines, default decomposed, reference and edt (edt only
+ *                      runs on binary images); auto lets the planner pick one,
+ *                      planned runs the engine of auto through a MorphPlan
+ *                      compiled once per configuration (in the warmup)
+ *    --op open|close   the operation, default open
+ *    --trials N        timed trials per configuration, default 5
+ *    --warmup N        untimed trials before those, default 1
+ *    --seed N          seed of the generated images, default 1
+ *    --pattern NAME    generated pattern: noise, blobs, strokes, sparse or flat,
+ *                      default blobs (see synth.c)
+ *    --gray            generate grayscale instead of binary images
+ *    --input FILE      benchmark an image from disk instead of generated ones
+ *    --format NAME     text, json or csv, default text
+ *    --out FILE        write the results to FILE instead of stdout
+ *    --calibrate       fit the cost model of the planner on this machine and
+ *                      save it instead of running the sweep
+ *    --model FILE      the model of the auto engine and where --calibrate saves
+ *                      it, default $SEDECOMP_MODEL or ~/.sedecomp.model
+ *    --thumbnails N    instead of the sweep, open N generated images of every
+ *                      size (default 128) one by one and in interleaved batches
+ *    --lanes LIST      images per batch for --thumbnails, default 16,32,64
+ *    --volumes LIST    instead of the sweep, open generated volumes of these
+ *                      sizes (N for N x N x N or WxHxD) with the ball, and
+ *                      slice by slice with the disc for comparison
+ *
+ *  LIST is a comma separated list, e.g. --radii 3,9,21
+ *
+ *  The text format ends with the crossover of every engine against the first
+ *  one: the smallest radius from which on it is faster, per size and threads.
+ */
+
+typedef int (*EngineFunction)(SedContext*, Image*, int, int);
+
+typedef struct Engine {
+  const char *name;
+  EngineFunction run;
+  int binary;        // 1 when the engine only accepts binary images
+} Engine;
+
+typedef struct Result {
+  const char *engine;
+  int width, height, radius, threads, trials;
+  double min, p10, median, p90, max, mean;
+} Result;
+
+/*
+ * Function:  runDecomposed
+ * --------------------
+ *  the disc opening/closing through the cached decomposition of the context
+ */
+
+static int runDecomposed(SedContext *ctx, Image *im, int radius, int closing){
+  return closing ? discClosing(ctx, im, radius) : discOpening(ctx, im, radius);
+}
+
+/*
+ * Function:  runReference
+ * --------------------
+ *  the brute force opening/closing with the full disc bitmap, the baseline
+ *  the decomposition has to beat
+ */
+
+static int runReference(SedContext *ctx, Image *im, int radius, int closing){
+  Image *SE = computeBinaryDiscSE(ctx, radius);
+  int status;
+  if( SE == NULL ) return SED_ERROR_MEMORY;
+  status = closing ? referenceClosing(ctx, im, SE) : referenceOpening(ctx, im, SE);
+  freeImage(ctx, SE);
+  return status;
+}
+
+/*
+ * Function:  runEdt
+ * --------------------
+ *  the binary opening/closing through the Euclidean distance transform,
+ *  linear in the amount of pixels for every radius
+ */
+
+static int runEdt(SedContext *ctx, Image *im, int radius, int closing){
+  return closing ? edtClosing(ctx, im, radius) : edtOpening(ctx, im, radius);
+}
+
+/*
+ * Function:  runAuto
+ * --------------------
+ *  the engine the planner predicts to be the fastest, so the sweep shows how
+ *  close its choices come to the best engine
+ */
+
+static int runAuto(SedContext *ctx, Image *im, int radius, int closing){
+  return closing ? engineClosing(ctx, im, radius, ENGINE_AUTO) : engineOpening(ctx, im, radius, ENGINE_AUTO);
+}
+
+static int isBinaryImage(Image*);
+
+/* the plan of the planned engine, compiled for the configuration of its first run */
+static MorphPlan *compiled;
+
+/*
+ * Function:  runPlanned
+ * --------------------
+ *  the engine of auto through a compiled plan, so the difference to auto is
+ *  the planning overhead of every call
+ */
+
+static int runPlanned(SedContext *ctx, Image *im, int radius, int closing){
+  MorphSpec spec = {im->width, im->height, radius, closing, 0, ENGINE_AUTO};
+  int status;
+  if( compiled == NULL || compiled->spec.width != im->width || compiled->spec.height != im->height
+      || compiled->spec.radius != radius || compiled->spec.closing != closing || compiled->threads != ctx->threads ){
+    freeMorphPlan(ctx, compiled);
+    spec.binary = isBinaryImage(im);
+    status = compileMorphPlan(ctx, &spec, &compiled);
+    if( status != SED_OK ) return status;
+  }
+  return executeMorphPlan(ctx, compiled, im);
+}
+
+static const Engine engines[] = {
+  {"decomposed", runDecomposed, 0},
+  {"reference", runReference, 0},
+  {"edt", runEdt, 1},
+  {"auto", runAuto, 0},
+  {"planned", runPlanned, 0},
+};
+
+#define DEFAULT_ENGINES 3
+
+#define ENGINE_COUNT ((int) (sizeof(engines) / sizeof(engines[0])))
+
+/*
+ * Function:  parseList
+ * --------------------
+ *  parses a comma separated list of positive integers
+ *
+ *  str: the list
+ *  values: filled with at most MAX_SWEEP values
+ *
+ *  returns: the amount of values or -1 when the list is malformed
+ */
+
+static int parseList(char *str, int *values){
+  int count = 0;
+  char *end;
+  while( *str != '\0' && count < MAX_SWEEP ){
+    values[count] = (int) strtol(str, &end, 10);
+    if( end == str || values[count] <= 0 ) return -1;
+    count++;
+    str = *end == ',' ? end + 1 : end;
+    if( *end != ',' && *end != '\0' ) return -1;
+  }
+  return count;
+}
+
+/*
+ * Function:  parseSizes
+ * --------------------
+ *  parses a comma separated list of image sizes, N for a square image or WxH
+ *
+ *  returns: the amount of sizes or -1 when the list is malformed
+ */
+
+static int parseSizes(char *str, int *widths, int *heights){
+  int count = 0;
+  char *end;
+  while( *str != '\0' && count < MAX_SWEEP ){
+    widths[count] = (int) strtol(str, &end, 10);
+    heights[count] = widths[count];
+    if( *end == 'x' ) heights[count] = (int) strtol(end + 1, &end, 10);
+    if( widths[count] <= 0 || heights[count] <= 0 ) return -1;
+    if( *end != ',' && *end != '\0' ) return -1;
+    count++;
+    str = *end == ',' ? end + 1 : end;
+  }
+  return count;
+}
+
+/*
+ * Function:  isBinaryImage
+ * --------------------
+ *  returns: 1 when every pixel is 0 or 255
+ */
+
+static int isBinaryImage(Image *im){
+  size_t size = (size_t) im->width * im->height, i;
+  for(i = 0; i < size; i++)
+    if( im->data[i] != 0 && im->data[i] != 255 ) return 0;
+  return 1;
+}
+
+/*
+ * Function:  loadImage
+ * --------------------
+ *  reads an image from disk and converts it to a single channel
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int loadImage(SedContext *ctx, char *name, Image **im){
+  int status = readImage(ctx, name, im);
+  if( status == SED_OK && (*im)->channels == 3 ) status = rgbToGrayscale(ctx, *im);
+  if( status == SED_OK && (*im)->channels == 4 ) status = rgbaToGrayscale(ctx, *im);
+  if( status == SED_OK && (*im)->channels != 1 ) status = SED_ERROR_ARGUMENT;
+  return status;
+}
+
+/*
+ * Function:  benchmarkConfiguration
+ * --------------------
+ *  times warmup + trials runs of one engine on a copy of the source image, the
+ *  copy is made outside of the timed region
+ *
+ *  returns: SED_OK or the error code of the engine
+ */
+
+static int benchmarkConfiguration(SedContext *ctx, const Engine *engine, Image *source, Image *work,
+                                  int radius, int closing, int trials, int warmup,
+                                  LatencyStats *ls, Result *result){
+  size_t size = (size_t) source->width * source->height;
+  double begin, elapsed, total = 0;
+  int i, status = SED_OK;
+
+  resetLatencyStats(ls);
+  for(i = 0; status == SED_OK && i < warmup + trials; i++){
+    memcpy(work->data, source->data, size);
+    begin = wallClock();
+    status = engine->run(ctx, work, radius, closing);
+    elapsed = wallClock() - begin;
+    if( i < warmup ) continue;
+    recordLatency(ls, elapsed);
+    total += elapsed;
+  }
+  if( status != SED_OK ) return status;
+
+  result->engine = engine->name;
+  result->width = source->width;
+  result->height = source->height;
+  result->radius = radius;
+  result->threads = ctx->threads;
+  result->trials = trials;
+  result->min = latencyPercentile(ls, 0);
+  result->p10 = latencyPercentile(ls, 10);
+  result->median = latencyPercentile(ls, 50);
+  result->p90 = latencyPercentile(ls, 90);
+  result->max = ls->max;
+  result->mean = total / trials;
+  return SED_OK;
+}
+
+static double pixelsPerSecond(Result *r){
+  return r->median > 0 ? (double) r->width * r->height / r->median : 0;
+}
+
+/*
+ * Function:  printCrossover
+ * --------------------
+ *  prints for every engine besides the first one, per size and thread count,
+ *  the smallest radius from which on it beats the first engine
+ */
+
+static void printCrossover(FILE *out, Result *results, int count, const Engine **selected, int engineCount){
+  Result *a, *b, *base;
+  int e, i, j, k, faster, seen;
+  for(e = 1; e < engineCount; e++){
+    for(i = 0; i < count; i++){
+      base = &results[i];
+      if( base->engine != selected[e]->name ) continue;
+      // only start at the first (smallest) radius of each size and thread count
+      for(j = 0; j < i; j++)
+        if( results[j].engine == base->engine && results[j].width == base->width
+            && results[j].height == base->height && results[j].threads == base->threads ) break;
+      if( j < i ) continue;
+      faster = -1;
+      seen = 0;
+      for(j = i; j < count; j++){
+        b = &results[j];
+        if( b->engine != base->engine || b->width != base->width || b->height != base->height
+            || b->threads != base->threads ) continue;
+        for(k = 0; k < count; k++){
+          a = &results[k];
+          if( a->engine == selected[0]->name && a->width == b->width && a->height == b->height
+              && a->threads == b->threads && a->radius == b->radius ) break;
+        }
+        if( k == count ) continue;
+        seen = 1;
+        if( b->median < a->median && faster < 0 ) faster = b->radius;
+        if( b->median >= a->median ) faster = -1;
+      }
+      if( !seen ) continue;
+      if( faster < 0 )
+        fprintf(out, "crossover %s vs %s, %dx%d, %d threads: never faster\n", base->engine,
+                selected[0]->name, base->width, base->height, base->threads);
+      else
+        fprintf(out, "crossover %s vs %s, %dx%d, %d threads: faster from radius %d\n", base->engine,
+                selected[0]->name, base->width, base->height, base->threads, faster);
+    }
+  }
+}
+
+/*
+ * Function:  printJsonString
+ * --------------------
+ *  writes a string as a quoted JSON string, with quotes, backslashes and
+ *  control characters escaped, e.g. for paths from the command line
+ */
+
+static void printJsonString(FILE *out, const char *text){
+  const unsigned char *c;
+  fputc('"', out);
+  for(c = (const unsigned char*) text; *c != '\0'; c++){
+    if( *c == '"' || *c == '\\' ) fprintf(out, "\\%c", *c);
+    else if( *c < 0x20 ) fprintf(out, "\\u%04x", *c);
+    else fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+/*
+ * Function:  printResults
+ * --------------------
+ *  writes all results as a table, as JSON (with the settings of the run, so
+ *  files from different releases can be compared) or as CSV
+ */
+
+static void printResults(FILE *out, int format, Result *results, int count, const char *op, SynthSpec *spec, char *input){
+  int i;
+  Result *r;
+  if( format == FORMAT_CSV ){
+    fprintf(out, "engine,op,width,height,radius,threads,trials,min_s,p10_s,median_s,p90_s,max_s,mean_s,pixels_per_s\n");
+    for(i = 0; i < count; i++){
+      r = &results[i];
+      fprintf(out, "%s,%s,%d,%d,%d,%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.0f\n",
+              r->engine, op, r->width, r->height, r->radius, r->threads, r->trials,
+              r->min, r->p10, r->median, r->p90, r->max, r->mean, pixelsPerSecond(r));
+    }
+  }else if( format == FORMAT_JSON ){
+    fprintf(out, "{\n  \"benchmark\": \"sedbench\",\n  \"compiler\": \"%s\",\n", __VERSION__);
+    fprintf(out, "  \"maxThreads\": %d,\n  \"op\": ", omp_get_max_threads());
+    printJsonString(out, op);
+    fprintf(out, ",\n");
+    if( input != NULL ){
+      fprintf(out, "  \"input\": ");
+      printJsonString(out, input);
+      fprintf(out, ",\n");
+    }else fprintf(out, "  \"pattern\": \"%s\",\n  \"binary\": %d,\n  \"seed\": %u,\n",
+                 synthPatternNames[spec->pattern], spec->binary, spec->seed);
+    fprintf(out, "  \"results\": [\n");
+    for(i = 0; i < count; i++){
+      r = &results[i];
+      fprintf(out, "    {\"engine\": \"%s\", \"width\": %d, \"height\": %d, \"radius\": %d, \"threads\": %d, "
+                   "\"trials\": %d, \"min\": %.9f, \"p10\": %.9f, \"median\": %.9f, \"p90\": %.9f, "
+                   "\"max\": %.9f, \"mean\": %.9f, \"pixelsPerSecond\": %.0f}%s\n",
+              r->engine, r->width, r->height, r->radius, r->threads, r->trials,
+              r->min, r->p10, r->median, r->p90, r->max, r->mean, pixelsPerSecond(r),
+              i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+  }else{
+    fprintf(out, "%-12s %-13s %6s %7s %10s %10s %10s %12s\n",
+            "engine", "size", "radius", "threads", "median ms", "p10 ms", "p90 ms", "Mpixels/s");
+    for(i = 0; i < count; i++){
+      r = &results[i];
+      fprintf(out, "%-12s %6dx%-6d %6d %7d %10.3f %10.3f %10.3f %12.1f\n",
+              r->engine, r->width, r->height, r->radius, r->threads,
+              r->median * 1e3, r->p10 * 1e3, r->p90 * 1e3, pixelsPerSecond(r) / 1e6);
+    }
+  }
+}
+
+/*
+ * Function:  timeThumbnails
+ * --------------------
+ *  the best time of trials runs over all thumbnails, one by one with
+ *  discOpening (discClosing) when lanes is 0 and with batchOpening
+ *  (batchClosing) otherwise. The thumbnails are restored from the sources
+ *  outside of the timed region.
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int timeThumbnails(SedContext *ctx, Image **sources, Image **work, int count, int radius, int closing,
+                          int lanes, int trials, double *best){
+  size_t size = (size_t) sources[0]->width * sources[0]->height;
+  int trial, i, status = SED_OK;
+  double begin, elapsed;
+  *best = -1;
+  for(trial = 0; status == SED_OK && trial <= trials; trial++){
+    for(i = 0; i < count; i++) memcpy(work[i]->data, sources[i]->data, size);
+    begin = wallClock();
+    if( lanes > 0 ){
+      status = closing ? batchClosing(ctx, work, count, radius, lanes) : batchOpening(ctx, work, count, radius, lanes);
+    }else{
+      for(i = 0; status == SED_OK && i < count; i++)
+        status = closing ? discClosing(ctx, work[i], radius) : discOpening(ctx, work[i], radius);
+    }
+    elapsed = wallClock() - begin;
+    // the first run is the warmup
+    if( trial > 0 && (*best < 0 || elapsed < *best) ) *best = elapsed;
+  }
+  return status;
+}
+
+/*
+ * Function:  benchmarkThumbnails
+ * --------------------
+ *  opens count generated images of every size, radius and thread count one
+ *  by one and in batches of every lane count, and prints the time per image
+ *  and the speedup of the batches
+ *
+ *  returns: 0 on success, -1 otherwise
+ */
+
+static int benchmarkThumbnails(SynthSpec spec, int *widths, int *heights, int sizeCount, int *radii, int radiusCount,
+                               int *threads, int threadCount, int *lanes, int laneCount, int count, int trials,
+                               int closing){
+  SedContext *ctx = createContext(0);
+  Image **sources = calloc(2 * (size_t) count, sizeof(Image*)), **work = sources + count;
+  int s, r, t, l, i, status = ctx == NULL || sources == NULL ? SED_ERROR_MEMORY : SED_OK;
+  unsigned int seed = spec.seed;
+  double single, batched;
+
+  if( status == SED_OK )
+    printf("%-13s %6s %7s %6s %14s %12s\n", "size", "radius", "threads", "lanes", "us per image", "speedup");
+  for(s = 0; status == SED_OK && s < sizeCount; s++){
+    spec.width = widths[s];
+    spec.height = heights[s];
+    for(i = 0; status == SED_OK && i < count; i++){
+      spec.seed = seed + i;
+      status = synthImage(ctx, &spec, &sources[i]);
+      if( status == SED_OK ) status = copyImage(ctx, sources[i], &work[i]);
+    }
+    for(r = 0; status == SED_OK && r < radiusCount; r++){
+      for(t = 0; status == SED_OK && t < threadCount; t++){
+        status = setThreads(ctx, threads[t]);
+        if( status == SED_OK ) status = timeThumbnails(ctx, sources, work, count, radii[r], closing, 0, trials, &single);
+        if( status == SED_OK )
+          printf("%6dx%-6d %6d %7d %6s %14.1f %12s\n", spec.width, spec.height, radii[r], threads[t], "1",
+                 single / count * 1e6, "");
+        for(l = 0; status == SED_OK && l < laneCount; l++){
+          status = timeThumbnails(ctx, sources, work, count, radii[r], closing, lanes[l], trials, &batched);
+          if( status == SED_OK )
+            printf("%6dx%-6d %6d %7d %6d %14.1f %11.1fx\n", spec.width, spec.height, radii[r], threads[t], lanes[l],
+                   batched / count * 1e6, single / batched);
+        }
+      }
+    }
+    for(i = 0; i < 2 * count; i++){
+      freeImage(ctx, sources[i]);
+      sources[i] = NULL;
+    }
+  }
+  if( status != SED_OK ) fprintf(stderr, "%s\n", errorString(status));
+  free(sources);
+  freeContext(ctx);
+  return status == SED_OK ? 0 : -1;
+}
+
+/*
+ * Function:  sliceMorphology
+ * --------------------
+ *  opens (closes) every slice of a volume on its own with the disc, what a
+ *  stack had to go through before there was a ball
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int sliceMorphology(SedContext *ctx, Volume *vol, int radius, int closing){
+  size_t slice = (size_t) vol->width * vol->height;
+  int z, status = SED_OK;
+  Image view;
+  for(z = 0; status == SED_OK && z < vol->depth; z++){
+    view = imageView(vol->data + z * slice, vol->width, vol->height, 1);
+    status = closing ? discClosing(ctx, &view, radius) : discOpening(ctx, &view, radius);
+  }
+  return status;
+}
+
+/*
+ * Function:  benchmarkVolumes
+ * --------------------
+ *  opens (closes) a generated volume of every size, radius and thread count
+ *  with the ball and slice by slice with the disc, and prints the best time
+ *  of trials runs of both and the share of the voxels where they differ
+ *
+ *  returns: 0 on success, -1 otherwise
+ */
+
+static int benchmarkVolumes(SynthSpec spec, int *widths, int *heights, int *depths, int sizeCount, int *radii,
+                            int radiusCount, int *threads, int threadCount, int trials, int closing){
+  SedContext *ctx = createContext(0);
+  Volume *source = NULL, *ball = NULL, *slices = NULL;
+  int s, r, t, trial, status = ctx == NULL ? SED_ERROR_MEMORY : SED_OK;
+  double begin, elapsed, ballBest, sliceBest, voxels;
+  size_t size, i, differ;
+
+  if( status == SED_OK )
+    printf("%-17s %6s %7s %10s %10s %12s %10s\n", "size", "radius", "threads", "ball ms", "slices ms", "Mvoxels/s",
+           "differ");
+  for(s = 0; status == SED_OK && s < sizeCount; s++){
+    spec.width = widths[s];
+    spec.height = heights[s];
+    spec.depth = depths[s];
+    status = synthVolume(ctx, &spec, &source);
+    if( status == SED_OK ) status = synthVolume(ctx, &spec, &ball);
+    if( status == SED_OK ) status = synthVolume(ctx, &spec, &slices);
+    size = (size_t) spec.width * spec.height * spec.depth;
+    voxels = (double) size;
+    for(r = 0; status == SED_OK && r < radiusCount; r++){
+      for(t = 0; status == SED_OK && t < threadCount; t++){
+        status = setThreads(ctx, threads[t]);
+        ballBest = sliceBest = -1;
+        // the first run of each is the warmup
+        for(trial = 0; status == SED_OK && trial <= trials; trial++){
+          memcpy(ball->data, source->data, size);
+          begin = wallClock();
+          status = closing ? ballClosing(ctx, ball, radii[r]) : ballOpening(ctx, ball, radii[r]);
+          elapsed = wallClock() - begin;
+          if( trial > 0 && (ballBest < 0 || elapsed < ballBest) ) ballBest = elapsed;
+          if( status != SED_OK ) break;
+          memcpy(slices->data, source->data, size);
+          begin = wallClock();
+          status = sliceMorphology(ctx, slices, radii[r], closing);
+          elapsed = wallClock() - begin;
+          if( trial > 0 && (sliceBest < 0 || elapsed < sliceBest) ) sliceBest = elapsed;
+        }
+        if( status != SED_OK ) break;
+        for(i = 0, differ = 0; i < size; i++) differ += ball->data[i] != slices->data[i];
+        printf("%5dx%5dx%-5d %6d %7d %10.1f %10.1f %12.1f %9.2f%%\n", spec.width, spec.height, spec.depth, radii[r],
+               threads[t], ballBest * 1e3, sliceBest * 1e3, voxels / ballBest / 1e6, 100.0 * differ / voxels);
+      }
+    }
+    freeVolume(ctx, source);
+    freeVolume(ctx, ball);
+    freeVolume(ctx, slices);
+    source = ball = slices = NULL;
+  }
+  if( status != SED_OK ) fprintf(stderr, "%s\n", errorString(status));
+  freeContext(ctx);
+  return status == SED_OK ? 0 : -1;
+}
+
+/*
+ * Function:  calibrateModel
+ * --------------------
+ *  fits the cost model of the planner on this machine and saves it, so that
+ *  sedecomp and the library pick their engines from measured costs
+ *
+ *  name: the model file, NULL for defaultCostModelName
+ *  threads: the amount of threads to calibrate with
+ *
+ *  returns: 0 on success, -1 otherwise
+ */
+
+static int calibrateModel(char *name, int threads){
+  SedContext *ctx = createContext(threads);
+  CostModel model;
+  int e, status;
+  if( ctx == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+  if( name == NULL ) name = defaultCostModelName();
+  status = calibrateCostModel(ctx, &model, 1);
+  if( status == SED_OK ){
+    for(e = 0; e < SED_ENGINES; e++)
+      printf("%-10s fixed %.3e s, %.3e s per unit\n", engineNames[e], model.fixed[e], model.perUnit[e]);
+    printf("%-10s up to %.0f pixels on the calling thread\n", "small", model.smallImage);
+    status = name == NULL ? SED_ERROR_ARGUMENT : saveCostModel(name, &model);
+  }
+  if( status == SED_OK ) printf("Saved the cost model to %s\n", name);
+  else fprintf(stderr, "%s\n", errorString(status));
+  freeContext(ctx);
+  return status == SED_OK ? 0 : -1;
+}
+
+int main(int argc, char *argv[]){
+  int widths[MAX_SWEEP] = {256, 512, 1024, 2048}, heights[MAX_SWEEP] = {256, 512, 1024, 2048};
+  int radii[MAX_SWEEP] = {3, 5, 9, 15}, threads[MAX_SWEEP];
+  int sizeCount = 4, radiusCount = 4, threadCount = 0, engineCount = DEFAULT_ENGINES;
+  int trials = DEFAULT_TRIALS, warmup = DEFAULT_WARMUP;
+  int format = FORMAT_TEXT, closing = 0, resultCount = 0, status = SED_OK, calibrate = 0;
+  int thumbnails = 0, lanes[MAX_SWEEP] = {16, 32, 64}, laneCount = 3, sizesGiven = 0, volumeCount = 0;
+  int depths[MAX_SWEEP];
+  int i, s, r, t, e, k;
+  const Engine *selected[MAX_SWEEP];
+  char *input = NULL, *outName = NULL, *modelName = NULL, *name;
+  Image *source = NULL, *work = NULL;
+  SynthSpec spec = {SYNTH_BLOBS, 1, DEFAULT_SEED, 0, 0, 0};
+  Result *results;
+  LatencyStats *ls;
+  SedContext *ctx;
+  FILE *out = stdout;
+
+  for(e = 0; e < ENGINE_COUNT; e++) selected[e] = &engines[e];
+  for(t = 1; t <= omp_get_max_threads() && threadCount < MAX_SWEEP; t *= 2) threads[threadCount++] = t;
+  if( threads[threadCount - 1] != omp_get_max_threads() && threadCount < MAX_SWEEP )
+    threads[threadCount++] = omp_get_max_threads();
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--sizes") == 0 && i + 1 < argc ){
+      sizeCount = parseSizes(argv[++i], widths, heights);
+      sizesGiven = 1;
+    }else if( strcmp(argv[i], "--radii") == 0 && i + 1 < argc ){
+      radiusCount = parseList(argv[++i], radii);
+    }else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ){
+      threadCount = parseList(argv[++i], threads);
+    }else if( strcmp(argv[i], "--engines") == 0 && i + 1 < argc ){
+      engineCount = 0;
+      for(name = strtok(argv[++i], ","); name != NULL && engineCount < MAX_SWEEP; name = strtok(NULL, ",")){
+        for(e = 0; e < ENGINE_COUNT && strcmp(engines[e].name, name) != 0; e++);
+        if( e == ENGINE_COUNT ){
+          fprintf(stderr, "Unknown engine: %s\n", name);
+          return -1;
+        }
+        selected[engineCount++] = &engines[e];
+      }
+    }else if( strcmp(argv[i], "--op") == 0 && i + 1 < argc ){
+      closing = strcmp(argv[++i], "close") == 0;
+    }else if( strcmp(argv[i], "--trials") == 0 && i + 1 < argc ){
+      trials = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--warmup") == 0 && i + 1 < argc ){
+      warmup = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc ){
+      spec.seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    }else if( strcmp(argv[i], "--pattern") == 0 && i + 1 < argc ){
+      spec.pattern = parseSynthPattern(argv[++i]);
+    }else if( strcmp(argv[i], "--gray") == 0 ){
+      spec.binary = 0;
+    }else if( strcmp(argv[i], "--input") == 0 && i + 1 < argc ){
+      input = argv[++i];
+    }else if( strcmp(argv[i], "--format") == 0 && i + 1 < argc ){
+      i++;
+      if( strcmp(argv[i], "json") == 0 ) format = FORMAT_JSON;
+      else if( strcmp(argv[i], "csv") == 0 ) format = FORMAT_CSV;
+      else format = FORMAT_TEXT;
+    }else if( strcmp(argv[i], "--out") == 0 && i + 1 < argc ){
+      outName = argv[++i];
+    }else if( strcmp(argv[i], "--thumbnails") == 0 && i + 1 < argc ){
+      thumbnails = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--lanes") == 0 && i + 1 < argc ){
+      laneCount = parseList(argv[++i], lanes);
+    }else if( strcmp(argv[i], "--volumes") == 0 && i + 1 < argc ){
+      for(name = strtok(argv[++i], ","); name != NULL && volumeCount < MAX_SWEEP; name = strtok(NULL, ",")){
+        if( parseVolumeSize(name, &widths[volumeCount], &heights[volumeCount], &depths[volumeCount]) != SED_OK ){
+          fprintf(stderr, "Malformed volume size: %s\n", name);
+          return -1;
+        }
+        volumeCount++;
+      }
+    }else if( strcmp(argv[i], "--calibrate") == 0 ){
+      calibrate = 1;
+    }else if( strcmp(argv[i], "--model") == 0 && i + 1 < argc ){
+      modelName = argv[++i];
+    }else{
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if( sizeCount <= 0 || radiusCount <= 0 || threadCount <= 0 || engineCount <= 0 || trials <= 0 || warmup < 0
+      || spec.pattern < 0 ){
+    fprintf(stderr, "Malformed sweep, see the options at the top of sedbench.c\n");
+    return -1;
+  }
+
+  if( calibrate ) return calibrateModel(modelName, threads[threadCount - 1]);
+  if( volumeCount > 0 )
+    return benchmarkVolumes(spec, widths, heights, depths, volumeCount, radii, radiusCount, threads, threadCount,
+                            trials, closing);
+  if( thumbnails > 0 ){
+    if( !sizesGiven ){
+      widths[0] = heights[0] = 128;
+      sizeCount = 1;
+    }
+    for(i = 0; i < laneCount; i++){
+      if( lanes[i] > MAX_BATCH_LANES ){
+        fprintf(stderr, "At most %d lanes per batch\n", MAX_BATCH_LANES);
+        return -1;
+      }
+    }
+    return benchmarkThumbnails(spec, widths, heights, sizeCount, radii, radiusCount, threads, threadCount, lanes,
+                               laneCount, thumbnails, trials, closing);
+  }
+
+  ctx = createContext(0);
+  results = malloc((size_t) sizeCount * radiusCount * threadCount * engineCount * sizeof(Result));
+  ls = malloc(sizeof(LatencyStats));
+  if( ctx == NULL || results == NULL || ls == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+  if( modelName == NULL ) modelName = defaultCostModelName();
+  if( modelName != NULL ) loadCostModel(modelName, &ctx->model);   // the auto engine plans with it
+  if( input != NULL ) sizeCount = 1;
+
+  for(s = 0; status == SED_OK && s < sizeCount; s++){
+    if( input != NULL ){
+      status = loadImage(ctx, input, &source);
+    }else{
+      spec.width = widths[s];
+      spec.height = heights[s];
+      status = synthImage(ctx, &spec, &source);
+    }
+    if( status == SED_OK ) status = copyImage(ctx, source, &work);
+    for(r = 0; status == SED_OK && r < radiusCount; r++){
+      for(t = 0; status == SED_OK && t < threadCount; t++){
+        status = setThreads(ctx, threads[t]);
+        for(e = 0; status == SED_OK && e < engineCount; e++){
+          if( selected[e]->binary && !isBinaryImage(source) ){
+            if( r == 0 && t == 0 ) fprintf(stderr, "%s skipped, the image is not binary\n", selected[e]->name);
+            continue;
+          }
+          k = resultCount;
+          status = benchmarkConfiguration(ctx, selected[e], source, work, radii[r], closing,
+                                          trials, warmup, ls, &results[k]);
+          if( status != SED_OK ) break;
+          resultCount++;
+          fprintf(stderr, "%s %dx%d radius %d threads %d: median %.3f ms\n", results[k].engine,
+                  results[k].width, results[k].height, results[k].radius, results[k].threads,
+                  results[k].median * 1e3);
+        }
+      }
+    }
+    freeImage(ctx, source);
+    freeImage(ctx, work);
+    source = work = NULL;
+  }
+  if( status != SED_OK ) fprintf(stderr, "%s\n", errorString(status));
+
+  if( outName != NULL ) out = fopen(outName, "w");
+  if( out == NULL ){
+    fprintf(stderr, "Cannot open %s\n", outName);
+    status = SED_ERROR_IO;
+  }else{
+    printResults(out, format, results, resultCount, closing ? "close" : "open", &spec, input);
+    if( format == FORMAT_TEXT ) printCrossover(out, results, resultCount, selected, engineCount);
+    if( out != stdout ) fclose(out);
+  }
+
+  free(results);
+  free(ls);
+  freeMorphPlan(ctx, compiled);
+  freeContext(ctx);
+  return status == SED_OK ? 0 : -1;
+}
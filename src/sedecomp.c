@@ -1,57 +1,313 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <assert.h>
-#include "image.c"
+#include <sys/resource.h>
+#include "budget.h"
+#include "context.h"
+#include "morphplan.h"
+#include "stats.h"
+#include "trace.h"
+#include "volume.h"
+#include "omp.h"
 
 #define SE_RADIUS 9
 #define GRAYSCALE_TO_BINARY_THRESHOLD 100
 #define FILENAME_BUFFER_SIZE 128
 
-/*  
+/*
  *  ----------------
- *  Example use of the image.c library: 
- *  run as ./sedecomp.out yourimagename.png 
+ *  Example use of the libsedecomp library:
+ *  run as ./sedecomp.out yourimagename.png [radius] [options]
+ *
+ *  options:
+ *    --output NAME   name of the output file, default morph_opened_<input>
+ *    --format NAME   output format: auto (from the extension), png, png-stored, qoi, pnm, raw
+ *    --level N       PNG compression level, 0 (stored) .. 9
+ *    --filter NAME   PNG row filter: none, sub, up, average, paeth, adaptive
+ *    --png-bench     print the PNG encoder throughput at every level and filter
+ *    --write-bench   print the end-to-end write latency of every output format
+ *    --threads N     amount of threads, default: the OpenMP default
+ *    --verbose       print every step of the decomposition
+ *    --engine NAME   auto (default), decomposed, edt or reference. auto lets the
+ *                    planner pick the fastest engine by its cost model and logs
+ *                    the choice; edt first thresholds the image to binary
+ *    --explain       compile the opening into a plan for the grayscale image,
+ *                    print its passes with their predicted cost and run it
+ *    --model FILE    the cost model of the planner, default $SEDECOMP_MODEL or
+ *                    ~/.sedecomp.model when it exists (see sedbench --calibrate)
+ *    --trace FILE    write a Chrome trace of every stage to FILE and print a
+ *                    per-stage summary, needs a build with make TRACE=1
+ *    --counters      with --trace, also read the hardware performance counters
+ *                    around every stage and print IPC and misses per pixel
+ *    --pages NAME    back the image and scratch buffers with huge pages: default,
+ *                    thp, hugetlb or hugetlb-1g (see pages.c), falling back
+ *                    when the kernel has none
+ *    --affinity SPEC pin the threads: none, compact, scatter or a cpu list
+ *                    like 0,2,4-7 (see placement.c)
+ *    --first-touch   let the threads that own the rows first touch the image
+ *    --interleave    spread the pages of the image over the NUMA nodes
+ *    --memory-budget SIZE  keep the opening within SIZE bytes (K, M or G
+ *                    suffixes), the image included: strips, threads and
+ *                    batches are sized to fit (see budget.c)
+ *    --locality      print on which nodes the pages of the input and of the
+ *                    result are, and how many are local to the thread that
+ *                    owns their row
+ *    --volume SIZE   the input is a raw volume of WxHxD (or N for NxNxN) 8 bit
+ *                    voxels: open it with the ball of the radius (see volume.c)
+ *                    and write the raw result
  *
  */
 
+/*
+ * Function:  openVolume
+ * --------------------
+ *  opens a raw volume with a ball and writes the raw result, the --volume
+ *  mode of main
+ *
+ *  returns: 0 on success, -1 otherwise
+ */
+
+static int openVolume(SedContext *ctx, char *name, char *output, int width, int height, int depth, int radius){
+  char fileNameOpened[FILENAME_BUFFER_SIZE] = "morph_opened_";
+  Volume *vol;
+  double begin;
+  int status = readRawVolume(ctx, name, width, height, depth, &vol);
+
+  if( status != SED_OK ){
+    fprintf(stderr, "Reading of volume failed: %s\n", errorString(status));
+    return -1;
+  }
+  begin = wallClock();
+  status = ballOpening(ctx, vol, radius);
+  if( status != SED_OK ){
+    fprintf(stderr, "%s\n", errorString(status));
+    freeVolume(ctx, vol);
+    return -1;
+  }
+  fprintf(stderr, "Time it took: %lf\n", wallClock() - begin);
+  if( output != NULL ){
+    snprintf(fileNameOpened, FILENAME_BUFFER_SIZE, "%s", output);
+  }else{
+    strncat(fileNameOpened, name, FILENAME_BUFFER_SIZE - strlen(fileNameOpened) - 1);
+  }
+  status = writeRawVolume(ctx, vol, fileNameOpened);
+  if( status != SED_OK )
+    fprintf(stderr, "Writing of volume with name: %s failed\n", fileNameOpened);
+  freeVolume(ctx, vol);
+  return status == SED_OK ? 0 : -1;
+}
+
 int main(int argc, char *argv[]){
-  if( argc <= 1 ) {
+  int seRadius = SE_RADIUS;
+  int pngBench = 0, writeBench = 0, threads = 0, verbose = 0, counters = 0, engine = ENGINE_AUTO, explain = 0;
+  int pages = PAGES_DEFAULT, locality = 0, volumeWidth = 0, volumeHeight = 0, volumeDepth = 0;
+  size_t memoryBudget = 0;
+  struct rusage usage;
+  Placement placement = {AFFINITY_NONE, NULL, 0, 0, 0};
+  LocalityStats localityStats;
+  int i, positional = 0, status;
+  char *name = NULL, *output = NULL, *traceName = NULL, *modelName = NULL;
+  char description[PLAN_DESCRIPTION_SIZE];
+  WriteOptions writeOptions = defaultWriteOptions();
+  MorphSpec spec;
+  MorphPlan *plan = NULL;
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--output") == 0 && i + 1 < argc ){
+      output = argv[++i];
+    }else if( strcmp(argv[i], "--format") == 0 && i + 1 < argc ){
+      writeOptions.format = parseOutputFormat(argv[++i]);
+      if( writeOptions.format < 0 ){
+        fprintf(stderr, "Unknown output format: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--level") == 0 && i + 1 < argc ){
+      writeOptions.png.level = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--filter") == 0 && i + 1 < argc ){
+      writeOptions.png.filter = parsePngFilter(argv[++i]);
+      if( writeOptions.png.filter < 0 ){
+        fprintf(stderr, "Unknown PNG filter: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--png-bench") == 0 ){
+      pngBench = 1;
+    }else if( strcmp(argv[i], "--write-bench") == 0 ){
+      writeBench = 1;
+    }else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ){
+      threads = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--trace") == 0 && i + 1 < argc ){
+      traceName = argv[++i];
+    }else if( strcmp(argv[i], "--counters") == 0 ){
+      counters = 1;
+    }else if( strcmp(argv[i], "--engine") == 0 && i + 1 < argc ){
+      engine = parseEngine(argv[++i]);
+      if( engine < ENGINE_AUTO ){
+        fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--pages") == 0 && i + 1 < argc ){
+      pages = parsePageMode(argv[++i]);
+      if( pages < 0 ){
+        fprintf(stderr, "Unknown page mode: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--affinity") == 0 && i + 1 < argc ){
+      free(placement.cpus);
+      if( parseAffinity(argv[++i], &placement) != SED_OK ){
+        fprintf(stderr, "Malformed affinity: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--first-touch") == 0 ){
+      placement.firstTouch = 1;
+    }else if( strcmp(argv[i], "--interleave") == 0 ){
+      placement.interleave = 1;
+    }else if( strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc ){
+      if( parseMemorySize(argv[++i], &memoryBudget) != SED_OK ){
+        fprintf(stderr, "Malformed memory size: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--volume") == 0 && i + 1 < argc ){
+      if( parseVolumeSize(argv[++i], &volumeWidth, &volumeHeight, &volumeDepth) != SED_OK ){
+        fprintf(stderr, "Malformed volume size: %s\n", argv[i]);
+        return -1;
+      }
+    }else if( strcmp(argv[i], "--locality") == 0 ){
+      locality = 1;
+    }else if( strcmp(argv[i], "--model") == 0 && i + 1 < argc ){
+      modelName = argv[++i];
+    }else if( strcmp(argv[i], "--explain") == 0 ){
+      explain = 1;
+    }else if( strcmp(argv[i], "--verbose") == 0 ){
+      verbose = 1;
+    }else if( positional == 0 ){
+      name = argv[i];
+      positional++;
+    }else if( positional == 1 ){
+      seRadius = atoi(argv[i]);
+      positional++;
+    }
+  }
+
+  if( name == NULL ) {
     printf("Image name not provided in command line, program will now exit.\n");
     return 0;
   }
 
-  int seRadius = SE_RADIUS;
-  if( argc >= 3)
-    seRadius = atoi(argv[2]);
-
-  char *name = argv[1];
-
-  Image *opening = readImage(name);
-  Image *CSE;
-  Partition *p;
-  Queue *qp = newQueue();
-  CSE = computeBinaryDiscSE(seRadius);
-  
-  printf("Initial SE: \n");
-  // printBinaryImage(CSE);
-  decompose(CSE, qp);
-
-  clock_t begin = clock();
-  while(queueSize(qp) > 0 ) {
-    p = dequeue(qp);
-    morphOpening(opening, *p);
-    free(p);
-  }
-
-  clock_t end = clock();
-  double timeExpired = ((double) (end - begin)) / CLOCKS_PER_SEC;
-  fprintf(stderr, "Time it took: %lf\n", timeExpired);
+  if( traceName != NULL && !traceAvailable() )
+    fprintf(stderr, "Tracing is compiled out, rebuild with make clean && make TRACE=1\n");
+  traceEnable(traceName != NULL);
+  if( traceName != NULL && counters && traceAvailable() && traceEnableCounters(1) < COUNTER_COUNT )
+    fprintf(stderr, "Some hardware counters are unavailable: %s\n", counterError());
+
+  SedContext *ctx = createContext(threads);
+  if( ctx == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+  ctx->verbose = verbose;
+  ctx->memoryBudget = memoryBudget;
+  setPageMode(ctx, pages);
+  if( setPlacement(ctx, &placement) != SED_OK )
+    fprintf(stderr, "Cannot pin the threads as asked, they may run anywhere\n");
+  if( modelName != NULL && loadCostModel(modelName, &ctx->model) != SED_OK )
+    fprintf(stderr, "Cannot read cost model %s, using the default one\n", modelName);
+  if( modelName == NULL && defaultCostModelName() != NULL )
+    loadCostModel(defaultCostModelName(), &ctx->model);
+
+  if( volumeDepth > 0 ){
+    status = openVolume(ctx, name, output, volumeWidth, volumeHeight, volumeDepth, seRadius);
+    if( traceName != NULL && traceAvailable() ){
+      if( !traceWriteChrome(traceName) ) fprintf(stderr, "Writing of trace %s failed\n", traceName);
+      tracePrintSummary(stderr);
+    }
+    freeContext(ctx);
+    return status;
+  }
+
+  Image *opening;
+  status = readImage(ctx, name, &opening);
+  if( status != SED_OK ){
+    fprintf(stderr, "Reading of image failed, program will now exit.\n");
+    freeContext(ctx);
+    return -1;
+  }
+  if( verbose ){
+    Image *CSE = computeBinaryDiscSE(ctx, seRadius);
+    printf("Initial SE: \n");
+    if( CSE != NULL ) printBinaryImage(CSE);
+    freeImage(ctx, CSE);
+  }
+
+  if( engine == ENGINE_EDT || explain ){
+    if( opening->channels == 3 ) status = rgbToGrayscale(ctx, opening);
+    if( opening->channels == 4 ) status = rgbaToGrayscale(ctx, opening);
+  }
+  if( engine == ENGINE_EDT ) grayscaleToBinary(opening, GRAYSCALE_TO_BINARY_THRESHOLD);
+  if( status == SED_OK && explain ){
+    // the plan only needs to know whether the image is binary
+    status = planEngine(ctx, opening, seRadius, engine, &ctx->lastPlan);
+    spec.width = opening->width;
+    spec.height = opening->height;
+    spec.radius = seRadius;
+    spec.closing = 0;
+    spec.binary = ctx->lastPlan.binary;
+    spec.engine = engine;
+    if( status == SED_OK ) status = compileMorphPlan(ctx, &spec, &plan);
+    if( status == SED_OK ) explainMorphPlan(plan, stdout);
+  }
+
+  if( locality ){
+    measureLocality(ctx, opening->data, (size_t) opening->width * opening->channels, opening->height, &localityStats);
+    printLocality(&localityStats, "input", stderr);
+  }
+  double begin = wallClock();
+  if( status == SED_OK && plan != NULL ) status = executeMorphPlan(ctx, plan, opening);
+  else if( status == SED_OK ) status = engineOpening(ctx, opening, seRadius, engine);
+  freeMorphPlan(ctx, plan);
+  if( status != SED_OK ){
+    fprintf(stderr, "%s\n", errorString(status));
+    freeImage(ctx, opening);
+    freeContext(ctx);
+    return -1;
+  }
+
+  fprintf(stderr, "Time it took: %lf\n", wallClock() - begin);
+  if( pages != PAGES_DEFAULT )
+    fprintf(stderr, "Pages %s: %.1f MiB hugetlb, %.1f MiB advised for THP, %.1f MiB fell back in %d blocks, "
+            "%.1f MiB of THP in the process\n", pageModeNames[pages], ctx->pages.hugeBytes / 1048576.0,
+            ctx->pages.advisedBytes / 1048576.0, ctx->pages.fallbackBytes / 1048576.0, ctx->pages.failures,
+            anonHugeBytes() / 1048576.0);
+  if( locality ){
+    measureLocality(ctx, opening->data, (size_t) opening->width * opening->channels, opening->height, &localityStats);
+    printLocality(&localityStats, "result", stderr);
+  }
+  if( !verbose && !explain ){
+    describeEnginePlan(&ctx->lastPlan, opening, seRadius, ctx->threads, description, sizeof(description));
+    fprintf(stderr, "%s\n", description);
+  }
+  if( pngBench )
+    benchmarkPngEncoding(opening->data, opening->width, opening->height, opening->channels, ctx->threads);
+  if( writeBench )
+    benchmarkImageWriting(opening->data, opening->width, opening->height, opening->channels, ctx->threads);
   char fileNameOpened[FILENAME_BUFFER_SIZE] = "morph_opened_";
-  strcat(fileNameOpened, name);
-  writeImage(opening, fileNameOpened);
-  freeImage(CSE);
-  freeQueue(qp);
-  return 0;
+  if( output != NULL ){
+    snprintf(fileNameOpened, FILENAME_BUFFER_SIZE, "%s", output);
+  }else{
+    strncat(fileNameOpened, name, FILENAME_BUFFER_SIZE - strlen(fileNameOpened) - 1);
+  }
+  double writeBegin = wallClock();
+  status = writeImageWithOptions(ctx, opening, fileNameOpened, writeOptions);
+  if( status != SED_OK )
+    fprintf(stderr, "Writing of image with name: %s failed\n", fileNameOpened);
+  fprintf(stderr, "Writing took: %lf\n", wallClock() - writeBegin);
+  // after the write, the encoder holds strips of its own
+  if( memoryBudget > 0 && getrusage(RUSAGE_SELF, &usage) == 0 )
+    fprintf(stderr, "Peak RSS: %.1f MiB of a %.1f MiB budget\n", usage.ru_maxrss / 1024.0, memoryBudget / 1048576.0);
+  if( traceName != NULL && traceAvailable() ){
+    if( !traceWriteChrome(traceName) ) fprintf(stderr, "Writing of trace %s failed\n", traceName);
+    tracePrintSummary(stderr);
+  }
+  freeImage(ctx, opening);
+  freeContext(ctx);
+  return status == SED_OK ? 0 : -1;
 }
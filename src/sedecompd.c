@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "context.h"
+#include "stats.h"
+#include "omp.h"
+
+#define SOCKET_PATH "/tmp/sedecomp.sock"
+#define MAX_CLIENTS 64
+#define MAX_CACHED_RADIUS 512
+#define MIN_RADIUS 2
+#define WARM_RADIUS 3
+#define REQUEST_BUFFER_SIZE 4096
+#define REPLY_BUFFER_SIZE 512
+#define SHM_PREFIX "shm:"
+
+/* freed buffers up to this size stay in the heap and are reused by the next job */
+#define BUFFER_POOL_THRESHOLD (32 << 20)
+
+/*
+ *  ----------------
+ *  Morphology daemon: keeps the OpenMP team, the SE decompositions and the
+ *  heap warm between jobs, which are sent as text lines over a Unix socket.
+ *  run as ./sedecompd.out [--socket PATH] [--warm MAXRADIUS] [--threads N]
+ *
+ *  requests (one per line):
+ *    open|close RADIUS INPUT OUTPUT          read INPUT, write the result to OUTPUT
+ *    open|close RADIUS shm:NAME W H CHANNELS process a POSIX shared memory image in place
+ *    stats                                   latency percentiles of the jobs so far
+ *    shutdown                                stop the daemon
+ *
+ *  replies: "OK <microseconds>", "STATS count=.. p50=.. p90=.. p99=.. max=.."
+ *  (microseconds) or "ERR <message>"
+ */
+
+typedef struct Client {
+  int fd;
+  int len;
+  char buf[REQUEST_BUFFER_SIZE];
+} Client;
+
+/* one context, so the plan cache and the scratch arenas outlive the jobs */
+static SedContext *ctx;
+static LatencyStats jobStats;
+static int running = 1;
+
+/*
+ * Function:  runJob
+ * --------------------
+ *  opens or closes an image with the cached decomposition of a disc
+ *
+ *  returns: NULL on success or an error message
+ */
+
+const char *runJob(Image *im, int radius, int closing){
+  int status = closing ? discClosing(ctx, im, radius) : discOpening(ctx, im, radius);
+  return status == SED_OK ? NULL : errorString(status);
+}
+
+/*
+ * Function:  runSharedJob
+ * --------------------
+ *  processes an image that lives in POSIX shared memory in place, through a
+ *  view of the mapping (see imageView). A failed job may leave the pixels
+ *  partly processed.
+ *
+ *  returns: NULL on success or an error message
+ */
+
+const char *runSharedJob(char *name, int width, int height, int channels, int radius, int closing){
+  size_t size = (size_t) width * height * channels;
+  int fd = shm_open(name, O_RDWR, 0);
+  Pixel *shared;
+  Image im;
+  const char *error;
+  struct stat st;
+  if( fd < 0 ) return "cannot open shared memory";
+  if( fstat(fd, &st) != 0 || (size_t) st.st_size < size ){
+    close(fd);
+    return "shared memory is smaller than the image";
+  }
+  shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if( shared == MAP_FAILED ) return "cannot map shared memory";
+  im = imageView(shared, width, height, channels);
+  error = runJob(&im, radius, closing);
+  munmap(shared, size);
+  return error;
+}
+
+/*
+ * Function:  runFileJob
+ * --------------------
+ *  reads an image, processes it and writes the result, the output format
+ *  follows the extension of the output name
+ *
+ *  returns: NULL on success or an error message
+ */
+
+const char *runFileJob(char *input, char *output, int radius, int closing){
+  Image *im;
+  const char *error;
+  int status = readImage(ctx, input, &im);
+  if( status != SED_OK ) return errorString(status);
+  error = runJob(im, radius, closing);
+  if( error == NULL ){
+    status = writeImage(ctx, im, output);
+    if( status != SED_OK ) error = errorString(status);
+  }
+  freeImage(ctx, im);
+  return error;
+}
+
+/*
+ * Function:  handleRequest
+ * --------------------
+ *  parses and executes one request line and formats the reply
+ *
+ *  line: the request, without the trailing newline
+ *  reply: the buffer for the reply, without the trailing newline
+ */
+
+void handleRequest(char *line, char *reply){
+  char op[16], source[1024], output[1024], stats[256];
+  const char *error;
+  int radius, width, height, channels, closing, fields;
+  double begin, elapsed;
+
+  fields = sscanf(line, "%15s %d %1023s %1023s %d %d", op, &radius, source, output, &height, &channels);
+  if( fields < 1 ){
+    snprintf(reply, REPLY_BUFFER_SIZE, "ERR empty request");
+    return;
+  }
+  if( strcmp(op, "stats") == 0 ){
+    formatLatencyStats(&jobStats, stats, sizeof(stats));
+    snprintf(reply, REPLY_BUFFER_SIZE, "STATS %s", stats);
+    return;
+  }
+  if( strcmp(op, "shutdown") == 0 ){
+    running = 0;
+    snprintf(reply, REPLY_BUFFER_SIZE, "OK 0");
+    return;
+  }
+  if( strcmp(op, "open") != 0 && strcmp(op, "close") != 0 ){
+    snprintf(reply, REPLY_BUFFER_SIZE, "ERR unknown operation %s", op);
+    return;
+  }
+  closing = strcmp(op, "close") == 0;
+  if( fields < 4 ){
+    snprintf(reply, REPLY_BUFFER_SIZE, "ERR expected: %s RADIUS INPUT OUTPUT", op);
+    return;
+  }
+  if( radius < MIN_RADIUS || radius > MAX_CACHED_RADIUS ){
+    snprintf(reply, REPLY_BUFFER_SIZE, "ERR radius has to be in [%d, %d]", MIN_RADIUS, MAX_CACHED_RADIUS);
+    return;
+  }
+
+  begin = omp_get_wtime();
+  if( strncmp(source, SHM_PREFIX, strlen(SHM_PREFIX)) == 0 ){
+    width = atoi(output);
+    if( fields < 6 || width <= 0 || height <= 0 || channels < 1 || channels > 4 ){
+      snprintf(reply, REPLY_BUFFER_SIZE, "ERR expected: %s RADIUS shm:NAME WIDTH HEIGHT CHANNELS", op);
+      return;
+    }
+    error = runSharedJob(source + strlen(SHM_PREFIX), width, height, channels, radius, closing);
+  }else{
+    error = runFileJob(source, output, radius, closing);
+  }
+  elapsed = omp_get_wtime() - begin;
+
+  if( error != NULL ){
+    snprintf(reply, REPLY_BUFFER_SIZE, "ERR %s", error);
+    return;
+  }
+  recordLatency(&jobStats, elapsed);
+  snprintf(reply, REPLY_BUFFER_SIZE, "OK %.0f", elapsed * 1e6);
+}
+
+/*
+ * Function:  serveClient
+ * --------------------
+ *  reads what is available on a client connection and answers every complete
+ *  request line
+ *
+ *  returns: 0 when the connection should be closed
+ */
+
+int serveClient(Client *c){
+  char reply[REPLY_BUFFER_SIZE + 1];
+  char *line, *newline;
+  ssize_t n = read(c->fd, c->buf + c->len, REQUEST_BUFFER_SIZE - 1 - c->len);
+  if( n <= 0 ) return 0;
+  c->len += n;
+  c->buf[c->len] = '\0';
+
+  line = c->buf;
+  while( running && (newline = strchr(line, '\n')) != NULL ){
+    *newline = '\0';
+    handleRequest(line, reply);
+    strcat(reply, "\n");
+    if( write(c->fd, reply, strlen(reply)) < 0 ) return 0;
+    line = newline + 1;
+  }
+  c->len -= line - c->buf;
+  memmove(c->buf, line, c->len);
+  return c->len < REQUEST_BUFFER_SIZE - 1; // drop clients sending overlong lines
+}
+
+/*
+ * Function:  warmUp
+ * --------------------
+ *  precomputes the decompositions up to maxRadius and runs one small opening
+ *  so the OpenMP team and the scratch arenas exist before the first job arrives
+ */
+
+void warmUp(int maxRadius){
+  int r;
+  DiscPlan *plan;
+  Pixel *data = contextCalloc(ctx, 64 * 64, sizeof(Pixel));
+  Image *im = data != NULL ? createImage(data, 64, 64, 1) : NULL;
+  for(r = WARM_RADIUS; r <= maxRadius && r <= MAX_CACHED_RADIUS; r++)
+    getDiscPlan(ctx, r, &plan);
+  if( im != NULL ) discOpening(ctx, im, WARM_RADIUS);
+  freeImage(ctx, im);
+}
+
+int main(int argc, char *argv[]){
+  char *path = SOCKET_PATH;
+  int warm = 0, threads = 0, i, n, listener, fd;
+  struct sockaddr_un addr;
+  struct pollfd fds[MAX_CLIENTS + 1];
+  Client *clients[MAX_CLIENTS + 1];
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--socket") == 0 && i + 1 < argc ) path = argv[++i];
+    else if( strcmp(argv[i], "--warm") == 0 && i + 1 < argc ) warm = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ) threads = atoi(argv[++i]);
+  }
+
+  ctx = createContext(threads);
+  if( ctx == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+
+  mallopt(M_MMAP_THRESHOLD, BUFFER_POOL_THRESHOLD);
+  mallopt(M_TRIM_THRESHOLD, -1);
+  signal(SIGPIPE, SIG_IGN);
+  resetLatencyStats(&jobStats);
+  if( warm ) warmUp(warm);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if( listener < 0 || strlen(path) >= sizeof(addr.sun_path) ){
+    fprintf(stderr, "Cannot create socket %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if( bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, MAX_CLIENTS) != 0 ){
+    fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(stderr, "Listening on %s\n", path);
+
+  fds[0].fd = listener;
+  fds[0].events = POLLIN;
+  n = 1;
+  while( running ){
+    if( poll(fds, n, -1) < 0 ){
+      if( errno == EINTR ) continue;
+      break;
+    }
+    for(i = n - 1; i >= 1; i--){
+      if( !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ) continue;
+      if( !serveClient(clients[i]) || !running ){
+        close(fds[i].fd);
+        free(clients[i]);
+        n--;
+        fds[i] = fds[n];
+        clients[i] = clients[n];
+      }
+    }
+    if( fds[0].revents & POLLIN ){
+      fd = accept(listener, NULL, NULL);
+      if( fd >= 0 && n <= MAX_CLIENTS ){
+        clients[n] = calloc(1, sizeof(Client));
+        assert(clients[n] != NULL);
+        clients[n]->fd = fd;
+        fds[n].fd = fd;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        n++;
+      }else if( fd >= 0 ){
+        close(fd);
+      }
+    }
+  }
+
+  for(i = 1; i < n; i++){
+    close(fds[i].fd);
+    free(clients[i]);
+  }
+  close(listener);
+  unlink(path);
+  freeContext(ctx);
+  return 0;
+}
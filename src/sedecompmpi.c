@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "context.h"
+#include "imagewrite.h"
+#include "synth.h"
+#include "omp.h"
+
+#define SE_RADIUS 9
+#define DEFAULT_SEED 1
+#define DEFAULT_WIDTH 8192
+#define DEFAULT_BAND_ROWS 1024
+#define DEFAULT_TRIALS 3
+#define HALO_TAG 1
+#define PGM_HEADER_SIZE 64
+
+#define MAX(a,b)  (((a)>(b)) ? (a):(b))
+#define MIN(a,b)  (((a)<(b)) ? (a):(b))
+
+/*
+ *  ----------------
+ *  The MPI version of sedecomp: every rank holds a horizontal band of the
+ *  image, so images larger than the memory (and faster than the memory
+ *  bandwidth) of one node can be opened. Within a rank the library runs on
+ *  the OpenMP threads as usual.
+ *
+ *  The erosion and dilation of a band need the rows within the reach of the
+ *  disc above and below it, the most any layer of the decomposition reads
+ *  (its vertical half size or its top/bottom offset). Before every stage
+ *  these halo rows are exchanged with the neighbouring ranks through
+ *  non-blocking sends and receives. Meanwhile the rank already computes its
+ *  band on its own: only the rows within the reach of its edges depend on
+ *  the halo, they are recomputed from a strip around each edge once the halo
+ *  is in.
+ *  build with make sedecompmpi (needs mpicc), run as
+ *  mpirun -n RANKS ./sedecompmpi.out [options] [image] [radius]
+ *
+ *  options:
+ *    --synth NAME     generate the image instead of reading it, every rank
+ *                     generates its own band (patterns as in synth.c)
+ *    --size N|WxH     the size of the generated image, default 8192x8192
+ *    --seed N         the seed of the generated image, default 1
+ *    --binary         generate 0/255 pixels instead of grayscale
+ *    --close          close instead of open
+ *    --threads N      OpenMP threads per rank, default the OpenMP default
+ *    --output FILE    write the result with MPI-IO, every rank its own rows,
+ *                     as PGM when FILE ends in .pgm and as raw pixels otherwise
+ *    --weak           weak scaling benchmark instead, see below
+ *    --band-rows N    rows per rank for --weak, default 1024
+ *    --width N        the width for --weak, default 8192
+ *    --trials N       timed trials per rank count for --weak, default 3
+ *
+ *  A read image is decoded on rank 0, converted to grayscale and scattered.
+ *  Every run prints the adler32 of the whole result, which is the one of
+ *  sedecomp for the same input.
+ *
+ *  --weak opens a generated image of band-rows rows per rank on 1, 2, 4, ..
+ *  and all ranks, so the work per rank stays the same, and prints the time,
+ *  the throughput, the efficiency against one rank and the time the ranks
+ *  waited for halos.
+ */
+
+typedef struct Band {
+  int width, height;          // the whole image
+  int first, rows;            // the rows of this rank
+  int halo;                   // the rows exchanged with each neighbour
+  Pixel *in, *out;            // (rows + 2 * halo) * width, row i is row first - halo + i
+  Image work;                 // where the library runs on a strip of in
+  MPI_Datatype row;           // one row of width pixels, the unit of all messages
+  double wait;                // seconds waited for halos
+} Band;
+
+/*
+ * Function:  bandRange
+ * --------------------
+ *  the rows of a rank when height rows are divided as evenly as possible
+ */
+
+static void bandRange(int rank, int ranks, int height, int *first, int *rows){
+  *first = (int) ((long long) height * rank / ranks);
+  *rows = (int) ((long long) height * (rank + 1) / ranks) - *first;
+}
+
+/*
+ * Function:  bandRow
+ * --------------------
+ *  returns: the pixels of image row row in a band buffer
+ */
+
+static Pixel *bandRow(Band *b, Pixel *buffer, int row){
+  return buffer + (size_t) (row - b->first + b->halo) * b->width;
+}
+
+/*
+ * Function:  runStrip
+ * --------------------
+ *  runs one stage on the rows [first, last) of the input and keeps the rows
+ *  of the band that do not depend on rows outside of the strip: the edges of
+ *  the strip that are not edges of the image lose halo rows
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int runStrip(SedContext *ctx, Band *b, DiscPlan *plan, int first, int last, int maximum){
+  int from = MAX(first + (first > 0 ? b->halo : 0), b->first);
+  int to = MIN(last - (last < b->height ? b->halo : 0), b->first + b->rows);
+  int status;
+  if( from >= to ) return SED_OK;
+  b->work.height = last - first;
+  memcpy(b->work.data, bandRow(b, b->in, first), (size_t) (last - first) * b->width);
+  status = maximum ? partitionDilation(ctx, &b->work, plan->parts, plan->count, 1)
+                   : partitionErosion(ctx, &b->work, plan->parts, plan->count, 1);
+  if( status == SED_OK )
+    memcpy(bandRow(b, b->out, from), b->work.data + (size_t) (from - first) * b->width, (size_t) (to - from) * b->width);
+  return status;
+}
+
+/*
+ * Function:  runStage
+ * --------------------
+ *  erodes or dilates the band: sends the rows of its edges to the
+ *  neighbours, computes the band on its own while they are in flight and
+ *  then recomputes the rows near the edges with the received halos. The
+ *  result becomes the input of the next stage.
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int runStage(SedContext *ctx, Band *b, DiscPlan *plan, int maximum, MPI_Comm comm){
+  int rank, end = b->first + b->rows, n = 0, status;
+  MPI_Request requests[4];
+  Pixel *swap;
+  double begin;
+
+  MPI_Comm_rank(comm, &rank);
+  if( b->first > 0 ){
+    MPI_Irecv(bandRow(b, b->in, b->first - b->halo), b->halo, b->row, rank - 1, HALO_TAG, comm, &requests[n++]);
+    MPI_Isend(bandRow(b, b->in, b->first), b->halo, b->row, rank - 1, HALO_TAG, comm, &requests[n++]);
+  }
+  if( end < b->height ){
+    MPI_Irecv(bandRow(b, b->in, end), b->halo, b->row, rank + 1, HALO_TAG, comm, &requests[n++]);
+    MPI_Isend(bandRow(b, b->in, end - b->halo), b->halo, b->row, rank + 1, HALO_TAG, comm, &requests[n++]);
+  }
+
+  status = runStrip(ctx, b, plan, b->first, end, maximum);
+  begin = MPI_Wtime();
+  MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+  b->wait += MPI_Wtime() - begin;
+  if( status == SED_OK && b->first > 0 )
+    status = runStrip(ctx, b, plan, b->first - b->halo, MIN(b->first + 2 * b->halo, end + (end < b->height ? b->halo : 0)), maximum);
+  if( status == SED_OK && end < b->height )
+    status = runStrip(ctx, b, plan, MAX(end - 2 * b->halo, b->first - (b->first > 0 ? b->halo : 0)), end + b->halo, maximum);
+
+  swap = b->in;
+  b->in = b->out;
+  b->out = swap;
+  return status;
+}
+
+/*
+ * Function:  openBand
+ * --------------------
+ *  opens (closes) the band, the result is in b->in
+ *
+ *  returns: SED_OK or an error code, the same on every rank
+ */
+
+static int openBand(SedContext *ctx, Band *b, DiscPlan *plan, int closing, MPI_Comm comm){
+  int status = SED_OK, worst;
+  if( plan->count > 0 ){
+    status = runStage(ctx, b, plan, closing, comm);
+    if( status == SED_OK ) status = runStage(ctx, b, plan, !closing, comm);
+  }
+  MPI_Allreduce(&status, &worst, 1, MPI_INT, MPI_MIN, comm);
+  return worst;
+}
+
+/*
+ * Function:  allocateBand
+ * --------------------
+ *  sizes a band for a rank and allocates its buffers
+ *
+ *  returns: SED_OK, SED_ERROR_MEMORY or SED_ERROR_ARGUMENT when the band is
+ *  thinner than the halo
+ */
+
+static int allocateBand(SedContext *ctx, Band *b, int width, int height, int halo, MPI_Comm comm){
+  int rank, ranks, status = SED_OK, worst;
+  size_t size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &ranks);
+  memset(b, 0, sizeof(Band));
+  b->row = MPI_DATATYPE_NULL;
+  b->width = width;
+  b->height = height;
+  b->halo = halo;
+  bandRange(rank, ranks, height, &b->first, &b->rows);
+  if( b->rows < halo || b->rows == 0 ) status = SED_ERROR_ARGUMENT;
+  size = (size_t) (b->rows + 2 * halo) * width;
+  b->in = contextAlloc(ctx, size);
+  b->out = contextAlloc(ctx, size);
+  b->work.data = contextAlloc(ctx, size);
+  b->work.width = width;
+  b->work.channels = 1;
+  MPI_Type_contiguous(width, MPI_UNSIGNED_CHAR, &b->row);
+  MPI_Type_commit(&b->row);
+  if( status == SED_OK && (b->in == NULL || b->out == NULL || b->work.data == NULL) ) status = SED_ERROR_MEMORY;
+  MPI_Allreduce(&status, &worst, 1, MPI_INT, MPI_MIN, comm);
+  return worst;
+}
+
+static void freeBand(SedContext *ctx, Band *b){
+  contextFree(ctx, b->in);
+  contextFree(ctx, b->out);
+  contextFree(ctx, b->work.data);
+  if( b->row != MPI_DATATYPE_NULL ) MPI_Type_free(&b->row);
+}
+
+/*
+ * Function:  scatterImage
+ * --------------------
+ *  reads an image on rank 0, converts it to grayscale and sends every rank
+ *  its band
+ *
+ *  returns: SED_OK or an error code, the same on every rank
+ */
+
+static int scatterImage(SedContext *ctx, char *name, Band *b, int halo, MPI_Comm comm){
+  int rank, ranks, r, first, rows, status = SED_OK, size[3] = {0, 0, 0};
+  int *counts = NULL, *offsets = NULL;
+  Image *im = NULL;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &ranks);
+  if( rank == 0 ){
+    status = readImage(ctx, name, &im);
+    if( status == SED_OK && im->channels == 3 ) status = rgbToGrayscale(ctx, im);
+    if( status == SED_OK && im->channels == 4 ) status = rgbaToGrayscale(ctx, im);
+    size[0] = status;
+    if( status == SED_OK ){
+      size[1] = im->width;
+      size[2] = im->height;
+    }
+  }
+  MPI_Bcast(size, 3, MPI_INT, 0, comm);
+  if( size[0] != SED_OK ){
+    freeImage(ctx, im);
+    return size[0];
+  }
+  status = allocateBand(ctx, b, size[1], size[2], halo, comm);
+  if( status == SED_OK && rank == 0 ){
+    counts = malloc(ranks * sizeof(int));
+    offsets = malloc(ranks * sizeof(int));
+    if( counts == NULL || offsets == NULL ) MPI_Abort(comm, SED_ERROR_MEMORY);
+    for(r = 0; r < ranks; r++){
+      bandRange(r, ranks, size[2], &first, &rows);
+      counts[r] = rows;
+      offsets[r] = first;
+    }
+  }
+  if( status == SED_OK )
+    MPI_Scatterv(rank == 0 ? im->data : NULL, counts, offsets, b->row, bandRow(b, b->in, b->first), b->rows, b->row, 0,
+                 comm);
+  free(counts);
+  free(offsets);
+  freeImage(ctx, im);
+  return status;
+}
+
+/*
+ * Function:  writeBand
+ * --------------------
+ *  writes the bands of all ranks into one file with MPI-IO, every rank at
+ *  the offset of its rows
+ *
+ *  returns: SED_OK or SED_ERROR_IO, the same on every rank
+ */
+
+static int writeBand(Band *b, char *name, MPI_Comm comm){
+  char header[PGM_HEADER_SIZE] = "";
+  int rank, length = 0, pgm = strlen(name) > 4 && strcmp(name + strlen(name) - 4, ".pgm") == 0;
+  int status = SED_OK, worst;
+  MPI_File file;
+  MPI_Comm_rank(comm, &rank);
+  if( pgm ) length = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", b->width, b->height);
+  if( MPI_File_open(comm, name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS )
+    return SED_ERROR_IO;
+  MPI_File_set_size(file, 0);
+  if( rank == 0 && length > 0
+      && MPI_File_write_at(file, 0, header, length, MPI_CHAR, MPI_STATUS_IGNORE) != MPI_SUCCESS )
+    status = SED_ERROR_IO;
+  if( MPI_File_write_at_all(file, length + (MPI_Offset) b->first * b->width, bandRow(b, b->in, b->first),
+                            b->rows, b->row, MPI_STATUS_IGNORE) != MPI_SUCCESS )
+    status = SED_ERROR_IO;
+  if( MPI_File_close(&file) != MPI_SUCCESS ) status = SED_ERROR_IO;
+  MPI_Allreduce(&status, &worst, 1, MPI_INT, MPI_MIN, comm);
+  return worst;
+}
+
+/*
+ * Function:  checksumBands
+ * --------------------
+ *  returns: on rank 0 the adler32 of the whole image, combined from the
+ *  checksums of the bands
+ */
+
+static unsigned int checksumBands(Band *b, MPI_Comm comm){
+  unsigned int sum = adler32(1, bandRow(b, b->in, b->first), (size_t) b->rows * b->width), *sums = NULL;
+  int rank, ranks, r, first, rows;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &ranks);
+  if( rank == 0 ) sums = malloc(ranks * sizeof(unsigned int));
+  if( rank == 0 && sums == NULL ) MPI_Abort(comm, SED_ERROR_MEMORY);
+  MPI_Gather(&sum, 1, MPI_UNSIGNED, sums, 1, MPI_UNSIGNED, 0, comm);
+  if( rank != 0 ) return 0;
+  sum = sums[0];
+  for(r = 1; r < ranks; r++){
+    bandRange(r, ranks, b->height, &first, &rows);
+    sum = adler32Combine(sum, sums[r], (size_t) rows * b->width);
+  }
+  free(sums);
+  return sum;
+}
+
+/*
+ * Function:  weakScaling
+ * --------------------
+ *  opens a generated image of bandRows rows per rank on 1, 2, 4, .. and all
+ *  ranks and prints the best time of every rank count on rank 0
+ *
+ *  returns: SED_OK or an error code
+ */
+
+static int weakScaling(SedContext *ctx, SynthSpec spec, DiscPlan *plan, int radius, int bandRows, int trials){
+  int rank, ranks, n, trial, status = SED_OK;
+  double begin, elapsed, best, wait, single = 0;
+  MPI_Comm comm;
+  Band b;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+  if( rank == 0 )
+    printf("%-6s %-14s %10s %12s %11s %10s\n", "ranks", "size", "best s", "Mpixels/s", "efficiency", "halo wait");
+  for(n = 1; status == SED_OK; n = MIN(2 * n, ranks)){
+    MPI_Comm_split(MPI_COMM_WORLD, rank < n ? 0 : MPI_UNDEFINED, rank, &comm);
+    if( comm != MPI_COMM_NULL ){
+      spec.height = bandRows * n;
+      status = allocateBand(ctx, &b, spec.width, spec.height, discPlanReach(plan), comm);
+      best = wait = -1;
+      for(trial = 0; status == SED_OK && trial < trials; trial++){
+        synthRows(&spec, b.first, b.rows, bandRow(&b, b.in, b.first), ctx->threads);
+        b.wait = 0;
+        MPI_Barrier(comm);
+        begin = MPI_Wtime();
+        status = openBand(ctx, &b, plan, 0, comm);
+        elapsed = MPI_Wtime() - begin;
+        MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, comm);
+        MPI_Allreduce(MPI_IN_PLACE, &b.wait, 1, MPI_DOUBLE, MPI_MAX, comm);
+        if( best < 0 || elapsed < best ){
+          best = elapsed;
+          wait = b.wait;
+        }
+      }
+      if( n == 1 ) single = best;
+      if( rank == 0 && status == SED_OK )
+        printf("%-6d %6dx%-7d %10.3f %12.1f %10.0f%% %9.3fs\n", n, spec.width, spec.height, best,
+               (double) spec.width * spec.height / best / 1e6, 100 * single / best, wait);
+      freeBand(ctx, &b);
+      MPI_Comm_free(&comm);
+    }
+    MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if( n == ranks ) break;
+  }
+  if( rank == 0 && status != SED_OK ) fprintf(stderr, "%s (radius %d)\n", errorString(status), radius);
+  return status;
+}
+
+int main(int argc, char *argv[]){
+  SynthSpec spec = {SYNTH_BLOBS, 0, DEFAULT_SEED, DEFAULT_WIDTH, DEFAULT_WIDTH, 0};
+  int radius = SE_RADIUS, threads = 0, closing = 0, synth = 0, weak = 0, positional = 0;
+  int bandRows = DEFAULT_BAND_ROWS, trials = DEFAULT_TRIALS, rank, ranks, i, status;
+  char *name = NULL, *output = NULL, *end;
+  unsigned int checksum;
+  double begin, elapsed;
+  DiscPlan *plan;
+  SedContext *ctx;
+  Band b;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--synth") == 0 && i + 1 < argc ){
+      spec.pattern = parseSynthPattern(argv[++i]);
+      synth = 1;
+    }else if( strcmp(argv[i], "--size") == 0 && i + 1 < argc ){
+      spec.width = spec.height = (int) strtol(argv[++i], &end, 10);
+      if( *end == 'x' ) spec.height = (int) strtol(end + 1, NULL, 10);
+    }else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc ){
+      spec.seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    }else if( strcmp(argv[i], "--binary") == 0 ){
+      spec.binary = 1;
+    }else if( strcmp(argv[i], "--close") == 0 ){
+      closing = 1;
+    }else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ){
+      threads = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--output") == 0 && i + 1 < argc ){
+      output = argv[++i];
+    }else if( strcmp(argv[i], "--weak") == 0 ){
+      weak = 1;
+    }else if( strcmp(argv[i], "--band-rows") == 0 && i + 1 < argc ){
+      bandRows = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--width") == 0 && i + 1 < argc ){
+      spec.width = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--trials") == 0 && i + 1 < argc ){
+      trials = atoi(argv[++i]);
+    }else if( positional == 0 && !synth && !weak && argv[i][0] != '-' ){
+      name = argv[i];
+      positional++;
+    }else if( argv[i][0] != '-' ){
+      radius = atoi(argv[i]);
+    }else{
+      if( rank == 0 ) fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      MPI_Finalize();
+      return -1;
+    }
+  }
+  if( spec.pattern < 0 || spec.width <= 0 || spec.height <= 0 || radius < 1 || bandRows <= 0 || trials <= 0
+      || (!synth && !weak && name == NULL) ){
+    if( rank == 0 ) fprintf(stderr, "Malformed options, see the top of sedecompmpi.c\n");
+    MPI_Finalize();
+    return -1;
+  }
+
+  ctx = createContext(threads);
+  status = ctx == NULL ? SED_ERROR_MEMORY : getDiscPlan(ctx, radius, &plan);
+  if( status != SED_OK ){
+    fprintf(stderr, "%s\n", errorString(status));
+    MPI_Abort(MPI_COMM_WORLD, status);
+  }
+
+  if( weak ){
+    status = weakScaling(ctx, spec, plan, radius, bandRows, trials);
+    freeContext(ctx);
+    MPI_Finalize();
+    return status == SED_OK ? 0 : -1;
+  }
+
+  // freed below also when the image cannot be read
+  memset(&b, 0, sizeof(Band));
+  b.row = MPI_DATATYPE_NULL;
+  if( synth ){
+    status = allocateBand(ctx, &b, spec.width, spec.height, discPlanReach(plan), MPI_COMM_WORLD);
+    if( status == SED_OK ) synthRows(&spec, b.first, b.rows, bandRow(&b, b.in, b.first), ctx->threads);
+  }else{
+    status = scatterImage(ctx, name, &b, discPlanReach(plan), MPI_COMM_WORLD);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  begin = MPI_Wtime();
+  if( status == SED_OK ) status = openBand(ctx, &b, plan, closing, MPI_COMM_WORLD);
+  elapsed = MPI_Wtime() - begin;
+  MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, &b.wait, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  if( status == SED_OK ){
+    checksum = checksumBands(&b, MPI_COMM_WORLD);
+    if( rank == 0 )
+      fprintf(stderr, "%dx%d on %d ranks, %d threads each: %.3f s (%.3f s waiting for halos), adler32 %08x\n",
+              b.width, b.height, ranks, ctx->threads, elapsed, b.wait, checksum);
+  }
+  if( status == SED_OK && output != NULL ){
+    begin = MPI_Wtime();
+    status = writeBand(&b, output, MPI_COMM_WORLD);
+    if( rank == 0 && status == SED_OK ) fprintf(stderr, "Writing took: %lf\n", MPI_Wtime() - begin);
+  }
+  if( status != SED_OK && rank == 0 ) fprintf(stderr, "%s\n", errorString(status));
+  if( status == SED_ERROR_ARGUMENT && rank == 0 )
+    fprintf(stderr, "Every rank needs at least %d rows for radius %d\n", discPlanReach(plan), radius);
+  freeBand(ctx, &b);
+  freeContext(ctx);
+  MPI_Finalize();
+  return status == SED_OK ? 0 : -1;
+}
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "context.h"
+#include "counters.h"
+#include "stats.h"
+#include "tile.h"
+#include "omp.h"
+
+#define DEFAULT_TRIALS 5
+#define DEFAULT_CACHE_SIZE 256
+#define DEFAULT_DRAM_SIZE 8192
+#define DEFAULT_STREAM_ELEMENTS (1 << 24)
+#define CACHE_STREAM_ELEMENTS (1 << 12)
+#define HGW_SIZE 15
+#define SPARSE_OFFSET 4
+#define UNION_IMAGES 2
+#define TRIAL_BYTES (256 << 20)
+#define STREAM_SCALAR 3.0
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 2
+
+#define HORIZONTAL 0
+#define VERTICAL 1
+
+#define CACHE_RESIDENT 0
+#define DRAM_RESIDENT 1
+
+/*
+ *  ----------------
+ *  Microbenchmark of the kernels in isolation against a memory bandwidth
+ *  roofline. It first measures the STREAM copy, scale, add and triad
+ *  bandwidth of this machine, once on arrays that fit in the cache and once on
+ *  arrays that do not, and then times every kernel on a cache resident and a
+ *  DRAM resident image. The bandwidth of a kernel counts the bytes it has to
+ *  read and write at least (like STREAM, without write allocate traffic), the
+ *  roofline is the best STREAM bandwidth of the same residency and thread
+ *  count. STREAM runs on one thread and, with --threads above 1, again on all
+ *  of them, since one core cannot draw the bandwidth of the whole socket and
+ *  the serial kernels would look poor against the roof of the team.
+ *  run as ./sedkernels.out [options]
+ *
+ *  options:
+ *    --threads N         threads for the parallel kernels and their STREAM
+ *                        roof, default 1
+ *    --cache-size N      the side of the cache resident image, default 256
+ *    --dram-size N       the side of the DRAM resident image, default 8192
+ *    --stream-elements N doubles per STREAM array for DRAM, default 2^24
+ *    --trials N          timed trials, the best one is reported, default 5
+ *    --ghz F             the clock for bytes/cycle, default the cpu MHz of
+ *                        /proc/cpuinfo
+ *    --format NAME       text or csv, default text
+ *    --pages NAME        allocate the images and scratch with default, thp,
+ *                        hugetlb or hugetlb-1g pages (see pages.c)
+ *
+ *  imageUnion and rgbToGrayscale are serial, they always run on one thread.
+ *  When the hardware counters can be opened, the dTLB load misses of the
+ *  calling thread per 1000 pixels are printed as well. Comparing a run with
+ *  --pages default against one with --pages thp shows what huge pages do for
+ *  the vertical kernels, which touch a new page on every pixel of a column.
+ */
+
+typedef struct Bench {
+  SedContext *ctx;
+  CounterSet counters;   // of the calling thread, see openCounters
+  Image *im;             // the single channel image the kernels work on
+  Image ims[UNION_IMAGES];
+  Pixel *source;         // the pristine pixels, 3 channels for rgbToGrayscale
+  int width, height;
+} Bench;
+
+typedef struct Kernel {
+  const char *name;
+  double bytesPerPixel;  // compulsory traffic per output pixel
+  int parallel;
+  int (*setup)(Bench*);  // untimed, restores the input
+  int (*run)(Bench*);
+} Kernel;
+
+typedef struct StreamResult {
+  double copy, scale, add, triad;
+} StreamResult;
+
+static int setupGray(Bench *b){
+  memcpy(b->im->data, b->source, (size_t) b->width * b->height);
+  return SED_OK;
+}
+
+static int setupRgb(Bench *b){
+  size_t size = (size_t) b->width * b->height * 3;
+  Pixel *data = contextAlloc(b->ctx, size);
+  if( data == NULL ) return SED_ERROR_MEMORY;
+  memcpy(data, b->source, size);
+  replacePixels(b->ctx, b->im, data);
+  b->im->channels = 3;
+  return SED_OK;
+}
+
+static int runDilateHorizontal(Bench *b){ return dilation(b->ctx, b->im, HGW_SIZE, HORIZONTAL); }
+static int runDilateVertical(Bench *b){ return dilation(b->ctx, b->im, HGW_SIZE, VERTICAL); }
+static int runErodeHorizontal(Bench *b){ return erosion(b->ctx, b->im, HGW_SIZE, HORIZONTAL); }
+static int runErodeVertical(Bench *b){ return erosion(b->ctx, b->im, HGW_SIZE, VERTICAL); }
+static int runDilate3Horizontal(Bench *b){ return dilation(b->ctx, b->im, 3, HORIZONTAL); }
+static int runDilate3Vertical(Bench *b){ return dilation(b->ctx, b->im, 3, VERTICAL); }
+static int runErode3Horizontal(Bench *b){ return erosion(b->ctx, b->im, 3, HORIZONTAL); }
+static int runErode3Vertical(Bench *b){ return erosion(b->ctx, b->im, 3, VERTICAL); }
+
+// the tiled passes write into ims[0], the source stays unchanged
+static int runTiledDilateHorizontal(Bench *b){
+  return tiledDilation(b->ctx, b->im->data, b->ims[0].data, b->width, b->height, HGW_SIZE, HORIZONTAL);
+}
+
+static int runTiledDilateVertical(Bench *b){
+  return tiledDilation(b->ctx, b->im->data, b->ims[0].data, b->width, b->height, HGW_SIZE, VERTICAL);
+}
+
+static int runTiledErodeHorizontal(Bench *b){
+  return tiledErosion(b->ctx, b->im->data, b->ims[0].data, b->width, b->height, HGW_SIZE, HORIZONTAL);
+}
+
+static int runTiledErodeVertical(Bench *b){
+  return tiledErosion(b->ctx, b->im->data, b->ims[0].data, b->width, b->height, HGW_SIZE, VERTICAL);
+}
+
+static int runDilateNaive(Bench *b){
+  SparseFactor s = {SPARSE_OFFSET, SPARSE_OFFSET, SPARSE_OFFSET, SPARSE_OFFSET};
+  return dilateNaive(b->ctx, b->im, s);
+}
+
+static int runErodeNaive(Bench *b){
+  SparseFactor s = {SPARSE_OFFSET, SPARSE_OFFSET, SPARSE_OFFSET, SPARSE_OFFSET};
+  return erodeNaive(b->ctx, b->im, s);
+}
+
+static int runImageUnion(Bench *b){
+  imageUnion(b->ims, UNION_IMAGES);
+  return SED_OK;
+}
+
+static int runRgbToGrayscale(Bench *b){
+  return rgbToGrayscale(b->ctx, b->im);
+}
+
+static const Kernel kernels[] = {
+  {"dilateHorizontal", 2, 1, setupGray, runDilateHorizontal},
+  {"dilateVertical", 2, 1, setupGray, runDilateVertical},
+  {"erodeHorizontal", 2, 1, setupGray, runErodeHorizontal},
+  {"erodeVertical", 2, 1, setupGray, runErodeVertical},
+  {"dilate3Horizontal", 2, 1, setupGray, runDilate3Horizontal},
+  {"dilate3Vertical", 2, 1, setupGray, runDilate3Vertical},
+  {"erode3Horizontal", 2, 1, setupGray, runErode3Horizontal},
+  {"erode3Vertical", 2, 1, setupGray, runErode3Vertical},
+  {"tiledDilateHorizontal", 2, 1, setupGray, runTiledDilateHorizontal},
+  {"tiledDilateVertical", 2, 1, setupGray, runTiledDilateVertical},
+  {"tiledErodeHorizontal", 2, 1, setupGray, runTiledErodeHorizontal},
+  {"tiledErodeVertical", 2, 1, setupGray, runTiledErodeVertical},
+  {"dilateNaive", 2, 1, setupGray, runDilateNaive},
+  {"erodeNaive", 2, 1, setupGray, runErodeNaive},
+  {"imageUnion", UNION_IMAGES + 1, 0, setupGray, runImageUnion},
+  {"rgbToGrayscale", 4, 0, setupRgb, runRgbToGrayscale},
+};
+
+#define KERNEL_COUNT ((int) (sizeof(kernels) / sizeof(kernels[0])))
+
+/*
+ * Function:  streamBandwidth
+ * --------------------
+ *  measures the STREAM copy, scale, add and triad kernels, the best of the
+ *  trials in bytes per second as STREAM counts them (16 or 24 bytes per
+ *  element)
+ *
+ *  n: the amount of doubles per array
+ *  threads: the amount of threads
+ *  trials: the amount of timed trials
+ *  result: filled with the bandwidths
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+static int streamBandwidth(long n, int threads, int trials, StreamResult *result){
+  double *a = malloc(n * sizeof(double)), *b = malloc(n * sizeof(double)), *c = malloc(n * sizeof(double));
+  double t, q = STREAM_SCALAR, bytes2 = 2.0 * n * sizeof(double), bytes3 = 3.0 * n * sizeof(double);
+  long i, reps, r;
+  int k;
+
+  if( a == NULL || b == NULL || c == NULL ){
+    free(a);
+    free(b);
+    free(c);
+    return SED_ERROR_MEMORY;
+  }
+  #pragma omp parallel for num_threads(threads) default(none) shared(a, b, c, n) schedule(static)
+  for(i = 0; i < n; i++){
+    a[i] = 1.0;
+    b[i] = 2.0;
+    c[i] = 0.0;
+  }
+  reps = TRIAL_BYTES / bytes3 > 1 ? (long) (TRIAL_BYTES / bytes3) : 1;
+  memset(result, 0, sizeof(StreamResult));
+
+  for(k = 0; k <= trials; k++){ // trial 0 is a warmup
+    t = wallClock();
+    for(r = 0; r < reps; r++){
+      #pragma omp parallel for num_threads(threads) default(none) shared(a, c, n) schedule(static)
+      for(i = 0; i < n; i++) c[i] = a[i];
+    }
+    t = wallClock() - t;
+    if( k > 0 && bytes2 * reps / t > result->copy ) result->copy = bytes2 * reps / t;
+
+    t = wallClock();
+    for(r = 0; r < reps; r++){
+      #pragma omp parallel for num_threads(threads) default(none) shared(b, c, n, q) schedule(static)
+      for(i = 0; i < n; i++) b[i] = q * c[i];
+    }
+    t = wallClock() - t;
+    if( k > 0 && bytes2 * reps / t > result->scale ) result->scale = bytes2 * reps / t;
+
+    t = wallClock();
+    for(r = 0; r < reps; r++){
+      #pragma omp parallel for num_threads(threads) default(none) shared(a, b, c, n) schedule(static)
+      for(i = 0; i < n; i++) c[i] = a[i] + b[i];
+    }
+    t = wallClock() - t;
+    if( k > 0 && bytes3 * reps / t > result->add ) result->add = bytes3 * reps / t;
+
+    t = wallClock();
+    for(r = 0; r < reps; r++){
+      #pragma omp parallel for num_threads(threads) default(none) shared(a, b, c, n, q) schedule(static)
+      for(i = 0; i < n; i++) a[i] = b[i] + q * c[i];
+    }
+    t = wallClock() - t;
+    if( k > 0 && bytes3 * reps / t > result->triad ) result->triad = bytes3 * reps / t;
+  }
+
+  free(a);
+  free(b);
+  free(c);
+  return SED_OK;
+}
+
+static double streamRoof(StreamResult *s){
+  double roof = s->copy;
+  roof = s->scale > roof ? s->scale : roof;
+  roof = s->add > roof ? s->add : roof;
+  return s->triad > roof ? s->triad : roof;
+}
+
+/*
+ * Function:  clockHz
+ * --------------------
+ *  returns: the clock of the first cpu in /proc/cpuinfo in Hz, or 0
+ */
+
+static double clockHz(void){
+  char line[256];
+  double mhz = 0;
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if( f == NULL ) return 0;
+  while( mhz == 0 && fgets(line, sizeof(line), f) != NULL )
+    if( strncmp(line, "cpu MHz", 7) == 0 ) sscanf(strchr(line, ':') + 1, "%lf", &mhz);
+  fclose(f);
+  return mhz * 1e6;
+}
+
+/*
+ * Function:  createBench
+ * --------------------
+ *  allocates the images of one residency and fills the pristine pixels with a
+ *  deterministic pattern
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+static int createBench(SedContext *ctx, int size, Bench *b){
+  size_t pixels = (size_t) size * size, i;
+  Pixel *data;
+  int k;
+  CounterSet counters = b->counters; // opened once in main
+  memset(b, 0, sizeof(Bench));
+  b->counters = counters;
+  b->ctx = ctx;
+  b->width = b->height = size;
+  b->source = contextAlloc(ctx, 3 * pixels);
+  data = contextAlloc(ctx, pixels);
+  b->im = data != NULL ? createImage(data, size, size, 1) : NULL;
+  if( b->im == NULL ) contextFree(ctx, data);
+  if( b->source == NULL || b->im == NULL ) return SED_ERROR_MEMORY;
+  for(k = 0; k < UNION_IMAGES; k++){
+    b->ims[k].width = b->ims[k].height = b->ims[k].stride = size;
+    b->ims[k].channels = 1;
+    b->ims[k].data = contextAlloc(ctx, pixels);
+    if( b->ims[k].data == NULL ) return SED_ERROR_MEMORY;
+  }
+  for(i = 0; i < 3 * pixels; i++)
+    b->source[i] = (Pixel) ((i * 0x9E3779B1u) >> 24);
+  for(k = 0; k < UNION_IMAGES; k++)
+    memcpy(b->ims[k].data, b->source + k * pixels, pixels);
+  return setupGray(b);
+}
+
+static void freeBench(Bench *b){
+  int k;
+  for(k = 0; k < UNION_IMAGES; k++) contextFree(b->ctx, b->ims[k].data);
+  contextFree(b->ctx, b->source);
+  freeImage(b->ctx, b->im);
+}
+
+/*
+ * Function:  kernelBandwidth
+ * --------------------
+ *  times a kernel over enough repetitions to move TRIAL_BYTES per trial, only
+ *  the run is timed, not the setup
+ *
+ *  tlb: set to the dTLB misses per 1000 pixels of the timed runs, -1 when
+ *    the counter is unavailable
+ *
+ *  returns: the best bandwidth in bytes per second, or -1 on an error
+ */
+
+static double kernelBandwidth(Bench *b, const Kernel *kernel, int trials, double *tlb){
+  double bytes = kernel->bytesPerPixel * b->width * b->height, best = 0, total, t, pixels = 0, misses = 0;
+  long reps = TRIAL_BYTES / bytes > 1 ? (long) (TRIAL_BYTES / bytes) : 1, r;
+  unsigned long long before[COUNTER_COUNT], after[COUNTER_COUNT];
+  int k, status = SED_OK;
+  for(k = 0; status == SED_OK && k <= trials; k++){ // trial 0 is a warmup
+    total = 0;
+    for(r = 0; status == SED_OK && r < reps; r++){
+      status = kernel->setup(b);
+      readCounters(&b->counters, before);
+      t = wallClock();
+      if( status == SED_OK ) status = kernel->run(b);
+      total += wallClock() - t;
+      readCounters(&b->counters, after);
+      misses += after[COUNTER_DTLB_MISSES] - before[COUNTER_DTLB_MISSES];
+      pixels += (double) b->width * b->height;
+    }
+    if( k > 0 && bytes * reps / total > best ) best = bytes * reps / total;
+  }
+  *tlb = b->counters.fds[COUNTER_DTLB_MISSES] >= 0 ? 1000 * misses / pixels : -1;
+  b->im->channels = 1;
+  return status == SED_OK ? best : -1;
+}
+
+int main(int argc, char *argv[]){
+  int threads = 1, trials = DEFAULT_TRIALS, format = FORMAT_TEXT, status = SED_OK, i, k, residency, team;
+  int pages = PAGES_DEFAULT;
+  int sizes[2] = {DEFAULT_CACHE_SIZE, DEFAULT_DRAM_SIZE};
+  long streamElements[2] = {CACHE_STREAM_ELEMENTS, DEFAULT_STREAM_ELEMENTS}, llc;
+  const char *residencyNames[2] = {"cache", "dram"};
+  double hz = 0, bandwidth, roof[2][2], tlb;  // [residency][0 for one thread, 1 for the team]
+  StreamResult stream[2][2];
+  SedContext *ctx;
+  Bench b;
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ) threads = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc ) sizes[CACHE_RESIDENT] = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--dram-size") == 0 && i + 1 < argc ) sizes[DRAM_RESIDENT] = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--stream-elements") == 0 && i + 1 < argc ) streamElements[DRAM_RESIDENT] = atol(argv[++i]);
+    else if( strcmp(argv[i], "--trials") == 0 && i + 1 < argc ) trials = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--ghz") == 0 && i + 1 < argc ) hz = atof(argv[++i]) * 1e9;
+    else if( strcmp(argv[i], "--format") == 0 && i + 1 < argc ) format = strcmp(argv[++i], "csv") == 0 ? FORMAT_CSV : FORMAT_TEXT;
+    else if( strcmp(argv[i], "--pages") == 0 && i + 1 < argc ) pages = parsePageMode(argv[++i]);
+    else{
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if( threads <= 0 || trials <= 0 || sizes[0] < 3 || sizes[1] < 3 || streamElements[1] <= 0 || pages < 0 ){
+    fprintf(stderr, "Malformed options, see the top of sedkernels.c\n");
+    return -1;
+  }
+  if( hz == 0 ) hz = clockHz();
+
+  llc = sysconf(_SC_LEVEL3_CACHE_SIZE) > 0 ? sysconf(_SC_LEVEL3_CACHE_SIZE) : sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if( llc > 0 && (3 * streamElements[DRAM_RESIDENT] * (long) sizeof(double) < 4 * llc
+                  || 2 * (long) sizes[DRAM_RESIDENT] * sizes[DRAM_RESIDENT] < 4 * llc) )
+    fprintf(stderr, "Warning: the DRAM working sets are less than 4x the %ld KiB last level cache\n", llc >> 10);
+
+  ctx = createContext(threads);
+  if( ctx == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+  setPageMode(ctx, pages);
+  openCounters(&b.counters);
+
+  for(residency = 0; status == SED_OK && residency < 2; residency++){
+    status = streamBandwidth(streamElements[residency], 1, trials, &stream[residency][0]);
+    if( status == SED_OK && threads > 1 )
+      status = streamBandwidth(streamElements[residency], threads, trials, &stream[residency][1]);
+    else stream[residency][1] = stream[residency][0];
+    roof[residency][0] = streamRoof(&stream[residency][0]);
+    roof[residency][1] = streamRoof(&stream[residency][1]);
+  }
+  if( status == SED_OK && format == FORMAT_CSV ){
+    printf("kernel,residency,size,threads,pages,bytes_per_s,bytes_per_cycle,percent_of_roof,dtlb_misses_per_kpixel\n");
+  }else if( status == SED_OK ){
+    printf("STREAM (GB/s)  %7s %10s %10s %10s %10s\n", "threads", "copy", "scale", "add", "triad");
+    for(residency = 0; residency < 2; residency++){
+      for(team = 0; team < (threads > 1 ? 2 : 1); team++)
+        printf("%-14s %7d %10.2f %10.2f %10.2f %10.2f\n", residencyNames[residency], team ? threads : 1,
+               stream[residency][team].copy / 1e9, stream[residency][team].scale / 1e9,
+               stream[residency][team].add / 1e9, stream[residency][team].triad / 1e9);
+    }
+    printf("\n%-18s %-6s %6s %7s %-10s %8s %11s %7s %10s\n", "kernel", "where", "size", "threads", "pages", "GB/s",
+           "bytes/cycle", "% roof", "dTLB/kpx");
+  }
+
+  for(residency = 0; status == SED_OK && residency < 2; residency++){
+    status = createBench(ctx, sizes[residency], &b);
+    for(k = 0; status == SED_OK && k < KERNEL_COUNT; k++){
+      bandwidth = kernelBandwidth(&b, &kernels[k], trials, &tlb);
+      team = kernels[k].parallel;
+      if( bandwidth < 0 ){
+        status = SED_ERROR_MEMORY;
+        break;
+      }
+      if( format == FORMAT_CSV ){
+        printf("%s,%s,%d,%d,%s,%.0f,%.4f,%.1f,%.3f\n", kernels[k].name, residencyNames[residency], sizes[residency],
+               kernels[k].parallel ? threads : 1, pageModeNames[pages], bandwidth, hz > 0 ? bandwidth / hz : 0,
+               100 * bandwidth / roof[residency][team], tlb);
+      }else{
+        printf("%-18s %-6s %6d %7d %-10s %8.2f %11.3f %6.1f%% ", kernels[k].name, residencyNames[residency],
+               sizes[residency], kernels[k].parallel ? threads : 1, pageModeNames[pages], bandwidth / 1e9,
+               hz > 0 ? bandwidth / hz : 0, 100 * bandwidth / roof[residency][team]);
+        if( tlb < 0 ) printf("%10s\n", "-");
+        else printf("%10.3f\n", tlb);
+      }
+    }
+    freeBench(&b);
+  }
+  if( status != SED_OK ) fprintf(stderr, "%s\n", errorString(status));
+
+  closeCounters(&b.counters);
+  freeContext(ctx);
+  return status == SED_OK ? 0 : -1;
+}
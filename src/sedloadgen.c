@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "omp.h"
+#include "stats.h"
+#include "stb_image.h"
+
+#define SOCKET_PATH "/tmp/sedecomp.sock"
+#define LINE_BUFFER_SIZE 4096
+#define PATH_BUFFER_SIZE 1024
+
+/*
+ *  ----------------
+ *  Load generator for sedecompd: every client thread keeps one connection open
+ *  and sends its share of the requests back to back.
+ *  run as ./sedloadgen.out [options] INPUT [OUTPUT]
+ *
+ *  options:
+ *    --socket PATH      the daemon socket, default /tmp/sedecomp.sock
+ *    --requests N       the total amount of requests, default 100
+ *    --concurrency N    the amount of client threads, default 1
+ *    --radius N         the radius of the disc, default 9
+ *    --op open|close    the operation, default open
+ *    --shm              load INPUT once into POSIX shared memory per client
+ *                       and send shared buffer jobs instead of file jobs
+ *
+ *  OUTPUT may contain %d, which is replaced by the client number so clients
+ *  do not overwrite each other's results. It defaults to /tmp/sedloadgen_%d.raw
+ */
+
+/*
+ * Function:  connectDaemon
+ * --------------------
+ *  returns: a connected socket or -1
+ */
+
+int connectDaemon(char *path){
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if( fd < 0 ) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if( connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Function:  request
+ * --------------------
+ *  sends one request line and reads the reply line, reply is a terminated
+ *  string whatever happens
+ *
+ *  returns: 1 on success, 0 when the connection broke
+ */
+
+int request(int fd, char *line, char *reply, int len){
+  int n = 0;
+  reply[0] = '\0';
+  if( write(fd, line, strlen(line)) < 0 ) return 0;
+  while( n < len - 1 ){
+    if( read(fd, reply + n, 1) != 1 ){
+      reply[n] = '\0';
+      return 0;
+    }
+    if( reply[n] == '\n' ) break;
+    n++;
+  }
+  reply[n] = '\0';
+  return 1;
+}
+
+int main(int argc, char *argv[]){
+  char *path = SOCKET_PATH, *op = "open", *input = NULL, *output = "/tmp/sedloadgen_%d.raw";
+  int requests = 100, concurrency = 1, radius = 9, shm = 0, positional = 0, i;
+  int width = 0, height = 0, channels = 0, failures = 0;
+  unsigned char *pixels = NULL;
+  double *latencies, begin, wall;
+  char reply[LINE_BUFFER_SIZE], stats[256];
+  LatencyStats *clientStats;
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--socket") == 0 && i + 1 < argc ) path = argv[++i];
+    else if( strcmp(argv[i], "--requests") == 0 && i + 1 < argc ) requests = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc ) concurrency = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--radius") == 0 && i + 1 < argc ) radius = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--op") == 0 && i + 1 < argc ) op = argv[++i];
+    else if( strcmp(argv[i], "--shm") == 0 ) shm = 1;
+    else if( positional++ == 0 ) input = argv[i];
+    else output = argv[i];
+  }
+  if( input == NULL || requests <= 0 || concurrency <= 0 ){
+    fprintf(stderr, "usage: %s [--socket PATH] [--requests N] [--concurrency N] [--radius N] "
+                    "[--op open|close] [--shm] INPUT [OUTPUT]\n", argv[0]);
+    return -1;
+  }
+  if( shm ){
+    pixels = stbi_load(input, &width, &height, &channels, 0);
+    if( pixels == NULL ){
+      fprintf(stderr, "Reading of image failed\n");
+      return -1;
+    }
+  }
+
+  latencies = calloc(requests, sizeof(double));
+  clientStats = malloc(sizeof(LatencyStats));
+  assert(latencies != NULL && clientStats != NULL);
+  resetLatencyStats(clientStats);
+
+  begin = omp_get_wtime();
+  #pragma omp parallel num_threads(concurrency) default(none) shared(path, op, input, output, requests, radius, shm, pixels, width, height, channels, latencies, stderr) reduction(+:failures)
+  {
+    int id = omp_get_thread_num(), r, fd = connectDaemon(path), shmFd, sent;
+    size_t size = (size_t) width * height * channels;
+    char line[LINE_BUFFER_SIZE], target[PATH_BUFFER_SIZE], answer[LINE_BUFFER_SIZE], shmName[64];
+    unsigned char *shared = NULL;
+    double t;
+
+    snprintf(target, sizeof(target), output, id);
+    if( shm && fd >= 0 ){
+      snprintf(shmName, sizeof(shmName), "/sedloadgen.%d.%d", (int) getpid(), id);
+      shmFd = shm_open(shmName, O_CREAT | O_RDWR, 0600);
+      if( shmFd >= 0 && ftruncate(shmFd, size) == 0 )
+        shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+      if( shmFd >= 0 ) close(shmFd);
+      if( shared == MAP_FAILED ) shared = NULL;
+    }
+
+    #pragma omp for schedule(dynamic, 1)
+    for(r = 0; r < requests; r++){
+      if( fd < 0 || (shm && shared == NULL) ){
+        failures++;
+        latencies[r] = -1;
+        continue;
+      }
+      if( shm ){
+        memcpy(shared, pixels, size);
+        snprintf(line, sizeof(line), "%s %d shm:%s %d %d %d\n", op, radius, shmName, width, height, channels);
+      }else{
+        snprintf(line, sizeof(line), "%s %d %s %s\n", op, radius, input, target);
+      }
+      answer[0] = '\0';
+      t = omp_get_wtime();
+      sent = request(fd, line, answer, sizeof(answer));
+      if( !sent || strncmp(answer, "OK", 2) != 0 ){
+        if( r == 0 || failures == 0 ) fprintf(stderr, "client %d: %s\n", id, sent ? answer : "connection lost");
+        failures++;
+        latencies[r] = -1;
+        continue;
+      }
+      latencies[r] = omp_get_wtime() - t;
+    }
+
+    if( shared != NULL ){
+      munmap(shared, size);
+      shm_unlink(shmName);
+    }
+    if( fd >= 0 ) close(fd);
+  }
+  wall = omp_get_wtime() - begin;
+
+  for(i = 0; i < requests; i++)
+    if( latencies[i] >= 0 ) recordLatency(clientStats, latencies[i]);
+  formatLatencyStats(clientStats, stats, sizeof(stats));
+  printf("requests=%d failures=%d wall=%.3fs throughput=%.1f/s\n", requests, failures, wall, requests / wall);
+  printf("client latency (us): %s\n", stats);
+
+  i = connectDaemon(path);
+  if( i >= 0 && request(i, "stats\n", reply, sizeof(reply)) )
+    printf("daemon: %s\n", reply);
+  if( i >= 0 ) close(i);
+
+  free(latencies);
+  free(clientStats);
+  if( pixels != NULL ) stbi_image_free(pixels);
+  return failures > 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "context.h"
+#include "synth.h"
+#include "stats.h"
+#include "omp.h"
+
+#define DEFAULT_SIZE 1024
+#define DEFAULT_SEED 1
+#define BAND_BYTES (64 << 20)
+
+/*
+ *  ----------------
+ *  Streams a synthetic image (see synth.c) band by band, the whole image is
+ *  never in memory, so 16 gigapixel inputs need no more than one band.
+ *  run as ./sedsynth.out [options]
+ *
+ *  options:
+ *    --pattern NAME   noise, blobs, strokes, sparse or flat, default blobs
+ *    --binary         0/255 pixels instead of grayscale
+ *    --seed N         the seed, default 1
+ *    --size N|WxH     the size, default 1024
+ *    --megapixels F   a square image of about F megapixels, e.g. 16000 for 16 GP
+ *    --band-rows N    rows per band, default about 64 MiB worth
+ *    --threads N      generator threads, default the OpenMP default
+ *    --out FILE       write the image, as PGM when FILE ends in .pgm and as raw
+ *                     pixels otherwise
+ *
+ *  Without --out the pixels are only generated. The run always prints the
+ *  adler32 checksum of the pixels and the foreground fraction, so a stream can
+ *  be compared with the same spec generated in memory by the benchmarks.
+ */
+
+int main(int argc, char *argv[]){
+  SynthSpec spec = {SYNTH_BLOBS, 0, DEFAULT_SEED, DEFAULT_SIZE, DEFAULT_SIZE, 0};
+  int threads = omp_get_max_threads(), bandRows = 0, rows, first, i, status = 0;
+  unsigned int checksum = 1;
+  unsigned long long foreground = 0;
+  size_t band, pixels, k;
+  double megapixels, begin;
+  char *outName = NULL, *end;
+  Pixel *data;
+  FILE *out = NULL;
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--pattern") == 0 && i + 1 < argc ){
+      spec.pattern = parseSynthPattern(argv[++i]);
+    }else if( strcmp(argv[i], "--binary") == 0 ){
+      spec.binary = 1;
+    }else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc ){
+      spec.seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    }else if( strcmp(argv[i], "--size") == 0 && i + 1 < argc ){
+      spec.width = spec.height = (int) strtol(argv[++i], &end, 10);
+      if( *end == 'x' ) spec.height = (int) strtol(end + 1, NULL, 10);
+    }else if( strcmp(argv[i], "--megapixels") == 0 && i + 1 < argc ){
+      megapixels = atof(argv[++i]);
+      spec.width = spec.height = (int) ceil(sqrt(megapixels * 1e6));
+    }else if( strcmp(argv[i], "--band-rows") == 0 && i + 1 < argc ){
+      bandRows = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ){
+      threads = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "--out") == 0 && i + 1 < argc ){
+      outName = argv[++i];
+    }else{
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if( spec.pattern < 0 || spec.width <= 0 || spec.height <= 0 || threads <= 0 || bandRows < 0 ){
+    fprintf(stderr, "Malformed options, see the top of sedsynth.c\n");
+    return -1;
+  }
+  if( bandRows == 0 ) bandRows = BAND_BYTES / spec.width > 0 ? BAND_BYTES / spec.width : 1;
+  if( bandRows > spec.height ) bandRows = spec.height;
+
+  band = (size_t) bandRows * spec.width;
+  data = malloc(band);
+  if( data == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+  if( outName != NULL ){
+    out = fopen(outName, "wb");
+    if( out == NULL ){
+      fprintf(stderr, "Cannot open %s\n", outName);
+      free(data);
+      return -1;
+    }
+    if( strlen(outName) > 4 && strcmp(outName + strlen(outName) - 4, ".pgm") == 0 )
+      fprintf(out, "P5\n%d %d\n255\n", spec.width, spec.height);
+  }
+
+  begin = wallClock();
+  for(first = 0; status == 0 && first < spec.height; first += rows){
+    rows = spec.height - first < bandRows ? spec.height - first : bandRows;
+    pixels = (size_t) rows * spec.width;
+    synthRows(&spec, first, rows, data, threads);
+    checksum = adler32(checksum, data, pixels);
+    #pragma omp parallel for num_threads(threads) default(none) shared(data, pixels) reduction(+:foreground) schedule(static)
+    for(k = 0; k < pixels; k++) foreground += data[k] >= 128;
+    if( out != NULL && fwrite(data, 1, pixels, out) != pixels ) status = -1;
+  }
+  if( out != NULL && fclose(out) != 0 ) status = -1;
+  if( status != 0 ) fprintf(stderr, "Writing %s failed\n", outName);
+
+  pixels = (size_t) spec.width * spec.height;
+  printf("%s%s %dx%d seed %u: adler32 %08x, foreground %.4f, %.1f Mpixels/s\n",
+         synthPatternNames[spec.pattern], spec.binary ? " binary" : "", spec.width, spec.height, spec.seed,
+         checksum, (double) foreground / pixels, pixels / (wallClock() - begin) / 1e6);
+  free(data);
+  return status;
+}
@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "batch.h"
+#include "budget.h"
+#include "edt.h"
+#include "morphplan.h"
+#include "reference.h"
+#include "synth.h"
+#include "tile.h"
+#include "volume.h"
+#include "omp.h"
+
+#define DEFAULT_CASES 100
+#define DEFAULT_SEED 1
+#define DEFAULT_MAX_SIZE 200
+#define DEFAULT_MAX_RADIUS 12
+#define DEFAULT_MAX_THREADS 4
+#define TINY_SIZE 8
+#define VOLUME_MAX_SIZE 24
+#define VOLUME_MAX_RADIUS 7
+#define BINARY_THRESHOLD 128
+#define TILED_WIDTH 600    /* the fixed cases span several GRAPH_TILE tiles */
+#define TILED_HEIGHT 530
+
+#define HORIZONTAL 0
+#define VERTICAL 1
+
+#define REFERENCE_EROSION 0
+#define REFERENCE_DILATION 1
+#define REFERENCE_OPENING 2
+#define REFERENCE_CLOSING 3
+
+/*
+ *  ----------------
+ *  Randomized differential test of every engine against the brute force
+ *  reference in reference.c. Every case draws an image size (non-square and
+ *  tiny ones included), a thread count, a synthetic image (any pattern of
+ *  synth.c, binary or grayscale) and structuring element parameters, runs each check on
+ *  a copy of the image and compares the result pixel by pixel with the
+ *  reference using the equivalent structuring element bitmap. The ball
+ *  checks do the same with small synthetic volumes (up to VOLUME_MAX_SIZE
+ *  voxels on a side) and balls up to VOLUME_MAX_RADIUS. The random sizes stay
+ *  below GRAPH_TILE, so every run ends with the fixed cases of tiledCases:
+ *  TILED_WIDTH x TILED_HEIGHT images that cross the tiles of the task graph
+ *  and its halos, with random images and threads.
+ *  run as ./sedverify.out [options]
+ *
+ *  options:
+ *    --cases N          the amount of random cases, default 100
+ *    --seed N           the seed of the first case, default 1
+ *    --max-size N       the largest width and height, default 200
+ *    --max-radius N     the largest radius and line half size, default 12
+ *    --max-threads N    the largest thread count, default 4
+ *    --check NAME       run only the checks whose name starts with NAME
+ *
+ *  Failures print the case seed, rerun with --seed SEED --cases 1 to
+ *  reproduce one. The exit status is 1 when any check failed.
+ */
+
+typedef struct Case {
+  unsigned int seed;
+  int width, height, threads;
+  SynthSpec image;
+  int size;        // line size for the 1D kernels, odd
+  int radius;      // disc radius, >= 2
+  Partition layer; // a random layer, also used for the 4-point sparse factor
+} Case;
+
+typedef int (*EngineFunction)(SedContext*, Case*, Image*);
+typedef Image *(*SEFunction)(SedContext*, Case*);
+
+typedef struct Check {
+  const char *name;
+  EngineFunction run;
+  SEFunction se;
+  int reference;
+  int binary;      // 1 when the engine needs a binary image, gray inputs are thresholded
+  int failures;
+} Check;
+
+static unsigned int nextRandom(unsigned int *state){
+  unsigned int x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static int randomInt(unsigned int *state, int low, int high){
+  return low + (int) (nextRandom(state) % (unsigned int) (high - low + 1));
+}
+
+/*
+ * Function:  lineSE
+ * --------------------
+ *  a horizontal or vertical line of size pixels, as a partition so that
+ *  partitionSE can rasterize it
+ */
+
+static Image *lineSE(SedContext *ctx, int size, int direction){
+  Partition p;
+  memset(&p, 0, sizeof(p));
+  p.cubicFactor.width = direction == HORIZONTAL ? size : 1;
+  p.cubicFactor.height = direction == HORIZONTAL ? 1 : size;
+  return partitionSE(ctx, &p, 1, 0);
+}
+
+static Image *horizontalLineSE(SedContext *ctx, Case *c){ return lineSE(ctx, c->size, HORIZONTAL); }
+static Image *verticalLineSE(SedContext *ctx, Case *c){ return lineSE(ctx, c->size, VERTICAL); }
+static Image *horizontal3SE(SedContext *ctx, Case *c){ (void) c; return lineSE(ctx, 3, HORIZONTAL); }
+static Image *vertical3SE(SedContext *ctx, Case *c){ (void) c; return lineSE(ctx, 3, VERTICAL); }
+
+static Image *sparseSE(SedContext *ctx, Case *c){
+  Partition p = c->layer;
+  p.cubicFactor.width = 1;
+  p.cubicFactor.height = 1;
+  return partitionSE(ctx, &p, 1, 0);
+}
+
+static Image *layerSE(SedContext *ctx, Case *c){ return partitionSE(ctx, &c->layer, 1, 0); }
+static Image *discSE(SedContext *ctx, Case *c){ return computeBinaryDiscSE(ctx, c->radius); }
+
+static int hgwErodeHorizontal(SedContext *ctx, Case *c, Image *im){ return erosion(ctx, im, c->size, HORIZONTAL); }
+static int hgwErodeVertical(SedContext *ctx, Case *c, Image *im){ return erosion(ctx, im, c->size, VERTICAL); }
+static int hgwDilateHorizontal(SedContext *ctx, Case *c, Image *im){ return dilation(ctx, im, c->size, HORIZONTAL); }
+static int hgwDilateVertical(SedContext *ctx, Case *c, Image *im){ return dilation(ctx, im, c->size, VERTICAL); }
+static int tapErodeHorizontal(SedContext *ctx, Case *c, Image *im){ (void) c; return erosion(ctx, im, 3, HORIZONTAL); }
+static int tapErodeVertical(SedContext *ctx, Case *c, Image *im){ (void) c; return erosion(ctx, im, 3, VERTICAL); }
+static int tapDilateHorizontal(SedContext *ctx, Case *c, Image *im){ (void) c; return dilation(ctx, im, 3, HORIZONTAL); }
+static int tapDilateVertical(SedContext *ctx, Case *c, Image *im){ (void) c; return dilation(ctx, im, 3, VERTICAL); }
+static int sparseErode(SedContext *ctx, Case *c, Image *im){ return erodeNaive(ctx, im, c->layer.sparseFactor); }
+static int sparseDilate(SedContext *ctx, Case *c, Image *im){ return dilateNaive(ctx, im, c->layer.sparseFactor); }
+static int layerOpen(SedContext *ctx, Case *c, Image *im){ return morphOpening(ctx, im, c->layer); }
+static int layerClose(SedContext *ctx, Case *c, Image *im){ return morphClosing(ctx, im, c->layer); }
+static int discOpen(SedContext *ctx, Case *c, Image *im){ return discOpening(ctx, im, c->radius); }
+static int discClose(SedContext *ctx, Case *c, Image *im){ return discClosing(ctx, im, c->radius); }
+
+/*
+ * Function:  tiledPass
+ * --------------------
+ *  runs a tiled pass from a copy of the image into the image itself
+ */
+
+static int tiledPass(SedContext *ctx, Case *c, Image *im, int direction, int maximum){
+  size_t size = (size_t) im->width * im->height;
+  Pixel *source = contextAlloc(ctx, size);
+  int status;
+  if( source == NULL ) return SED_ERROR_MEMORY;
+  memcpy(source, im->data, size);
+  status = tiledFilter(ctx, source, im->data, im->width, im->height, c->size, direction, maximum);
+  contextFree(ctx, source);
+  return status;
+}
+
+static int tiledErodeHorizontal(SedContext *ctx, Case *c, Image *im){ return tiledPass(ctx, c, im, HORIZONTAL, 0); }
+static int tiledErodeVertical(SedContext *ctx, Case *c, Image *im){ return tiledPass(ctx, c, im, VERTICAL, 0); }
+static int tiledDilateHorizontal(SedContext *ctx, Case *c, Image *im){ return tiledPass(ctx, c, im, HORIZONTAL, 1); }
+static int tiledDilateVertical(SedContext *ctx, Case *c, Image *im){ return tiledPass(ctx, c, im, VERTICAL, 1); }
+
+static int edtErode(SedContext *ctx, Case *c, Image *im){ return edtErosion(ctx, im, c->radius); }
+static int edtDilate(SedContext *ctx, Case *c, Image *im){ return edtDilation(ctx, im, c->radius); }
+static int edtOpen(SedContext *ctx, Case *c, Image *im){ return edtOpening(ctx, im, c->radius); }
+static int edtClose(SedContext *ctx, Case *c, Image *im){ return edtClosing(ctx, im, c->radius); }
+
+/*
+ * Function:  partitionOpenClose
+ * --------------------
+ *  the disc opening/closing through the barrier passes of partitionErosion
+ *  and partitionDilation, which share the prefixes of the nested layers
+ */
+
+static int partitionOpenClose(SedContext *ctx, Case *c, Image *im, int closing){
+  DiscPlan *plan;
+  int status = getDiscPlan(ctx, c->radius, &plan);
+  if( status == SED_OK ) status = closing ? partitionDilation(ctx, im, plan->parts, plan->count, 1)
+                                          : partitionErosion(ctx, im, plan->parts, plan->count, 1);
+  if( status == SED_OK ) status = closing ? partitionErosion(ctx, im, plan->parts, plan->count, 1)
+                                          : partitionDilation(ctx, im, plan->parts, plan->count, 1);
+  return status;
+}
+
+static int partitionOpen(SedContext *ctx, Case *c, Image *im){ return partitionOpenClose(ctx, c, im, 0); }
+static int partitionClose(SedContext *ctx, Case *c, Image *im){ return partitionOpenClose(ctx, c, im, 1); }
+
+/*
+ * Function:  discMorphology
+ * --------------------
+ *  the disc opening/closing on the calling thread or as a task graph, so
+ *  both are checked whatever runDiscPlan picks for the image size
+ */
+
+static int discMorphology(SedContext *ctx, Case *c, Image *im, int closing, int serial){
+  DiscPlan *plan;
+  int status = getDiscPlan(ctx, c->radius, &plan);
+  if( status != SED_OK ) return status;
+  return serial ? serialMorphology(ctx, im, plan->parts, plan->count, closing)
+                : graphMorphology(ctx, im, plan->parts, plan->count, closing, NULL);
+}
+
+static int serialOpen(SedContext *ctx, Case *c, Image *im){ return discMorphology(ctx, c, im, 0, 1); }
+static int serialClose(SedContext *ctx, Case *c, Image *im){ return discMorphology(ctx, c, im, 1, 1); }
+static int graphOpen(SedContext *ctx, Case *c, Image *im){ return discMorphology(ctx, c, im, 0, 0); }
+static int graphClose(SedContext *ctx, Case *c, Image *im){ return discMorphology(ctx, c, im, 1, 0); }
+
+/*
+ * Function:  placedMorphology
+ * --------------------
+ *  the task graph with firstTouch, so the tiles run from the queues of the
+ *  threads that own their rows and the others steal them
+ */
+
+static int placedMorphology(SedContext *ctx, Case *c, Image *im, int closing){
+  int status;
+  ctx->placement.firstTouch = 1;
+  status = discMorphology(ctx, c, im, closing, 0);
+  ctx->placement.firstTouch = 0;
+  return status;
+}
+
+static int placedOpen(SedContext *ctx, Case *c, Image *im){ return placedMorphology(ctx, c, im, 0); }
+static int placedClose(SedContext *ctx, Case *c, Image *im){ return placedMorphology(ctx, c, im, 1); }
+
+/*
+ * Function:  viewMorphology
+ * --------------------
+ *  the task graph on a view of the pixels, which cannot hand its pixels over
+ *  and takes the copying path of runMorphologyGraph
+ */
+
+static int viewMorphology(SedContext *ctx, Case *c, Image *im, int closing){
+  Image view = imageView(im->data, im->width, im->height, 1);
+  int status = discMorphology(ctx, c, &view, closing, 0);
+  return status == SED_OK && view.data != im->data ? SED_ERROR_ARGUMENT : status;
+}
+
+static int viewOpen(SedContext *ctx, Case *c, Image *im){ return viewMorphology(ctx, c, im, 0); }
+static int viewClose(SedContext *ctx, Case *c, Image *im){ return viewMorphology(ctx, c, im, 1); }
+
+/*
+ * Function:  budgetMorphology
+ * --------------------
+ *  the disc opening/closing under about the smallest memory budget it fits
+ *  in, plus up to 64 rows by the case seed, so it runs in strips of a few
+ *  rows
+ */
+
+static int budgetMorphology(SedContext *ctx, Case *c, Image *im, int closing){
+  size_t size = (size_t) im->width * im->height;
+  BudgetPlan budget;
+  DiscPlan *plan;
+  int status = getDiscPlan(ctx, c->radius, &plan);
+  if( status != SED_OK ) return status;
+  ctx->memoryBudget = BUDGET_RESERVE + size;
+  while( planBudget(ctx, im->width, im->height, plan, &budget) != SED_OK ) ctx->memoryBudget += 4 * im->width;
+  ctx->memoryBudget += (size_t) 16 * im->width * (c->seed % 5);
+  status = closing ? discClosing(ctx, im, c->radius) : discOpening(ctx, im, c->radius);
+  ctx->memoryBudget = 0;
+  return status;
+}
+
+static int budgetOpen(SedContext *ctx, Case *c, Image *im){ return budgetMorphology(ctx, c, im, 0); }
+static int budgetClose(SedContext *ctx, Case *c, Image *im){ return budgetMorphology(ctx, c, im, 1); }
+
+/*
+ * Function:  budgetSparse
+ * --------------------
+ *  the sparse passes under a budget below two images, so they run in place
+ */
+
+static int budgetSparse(SedContext *ctx, Case *c, Image *im, int maximum){
+  int status;
+  ctx->memoryBudget = (size_t) im->width * im->height * 3 / 2;
+  status = maximum ? dilateNaive(ctx, im, c->layer.sparseFactor) : erodeNaive(ctx, im, c->layer.sparseFactor);
+  ctx->memoryBudget = 0;
+  return status;
+}
+
+static int budgetErode(SedContext *ctx, Case *c, Image *im){ return budgetSparse(ctx, c, im, 0); }
+static int budgetDilate(SedContext *ctx, Case *c, Image *im){ return budgetSparse(ctx, c, im, 1); }
+
+/*
+ * Function:  batchMorphology
+ * --------------------
+ *  runs the image in a batch with inverted copies of itself, in a lane and
+ *  with a batch width drawn from the case seed, so pixels that leak between
+ *  the lanes change the result
+ */
+
+static int batchMorphology(SedContext *ctx, Case *c, Image *im, int closing){
+  int lanes = 1 + c->seed % 7, count = lanes + 1 + c->seed % 3, self = c->seed % count, i, status = SED_OK;
+  size_t size = (size_t) im->width * im->height, j;
+  Image *images[MAX_BATCH_LANES];
+  for(i = 0; i < count; i++){
+    images[i] = im;
+    if( i == self ) continue;
+    status = copyImage(ctx, im, &images[i]);
+    if( status != SED_OK ){
+      count = i;
+      break;
+    }
+    for(j = 0; j < size; j++) images[i]->data[j] = 255 - im->data[j];
+  }
+  if( status == SED_OK )
+    status = closing ? batchClosing(ctx, images, count, c->radius, lanes) : batchOpening(ctx, images, count, c->radius, lanes);
+  for(i = 0; i < count; i++)
+    if( i != self ) freeImage(ctx, images[i]);
+  return status;
+}
+
+static int batchOpen(SedContext *ctx, Case *c, Image *im){ return batchMorphology(ctx, c, im, 0); }
+static int batchClose(SedContext *ctx, Case *c, Image *im){ return batchMorphology(ctx, c, im, 1); }
+
+/*
+ * Function:  plannedMorphology
+ * --------------------
+ *  runs a compiled plan twice on the image: openings and closings are
+ *  idempotent, so the second run checks that the plan can be reused
+ */
+
+static int plannedMorphology(SedContext *ctx, Case *c, Image *im, int closing){
+  MorphSpec spec = {im->width, im->height, c->radius, closing, 0, ENGINE_AUTO};
+  MorphPlan *plan;
+  int status = compileMorphPlan(ctx, &spec, &plan);
+  if( status == SED_OK ) status = executeMorphPlan(ctx, plan, im);
+  if( status == SED_OK ) status = executeMorphPlan(ctx, plan, im);
+  freeMorphPlan(ctx, plan);
+  return status;
+}
+
+static int plannedOpen(SedContext *ctx, Case *c, Image *im){ return plannedMorphology(ctx, c, im, 0); }
+static int plannedClose(SedContext *ctx, Case *c, Image *im){ return plannedMorphology(ctx, c, im, 1); }
+
+static Check checks[] = {
+  {"hgw-erode-horizontal", hgwErodeHorizontal, horizontalLineSE, REFERENCE_EROSION, 0, 0},
+  {"hgw-erode-vertical", hgwErodeVertical, verticalLineSE, REFERENCE_EROSION, 0, 0},
+  {"hgw-dilate-horizontal", hgwDilateHorizontal, horizontalLineSE, REFERENCE_DILATION, 0, 0},
+  {"hgw-dilate-vertical", hgwDilateVertical, verticalLineSE, REFERENCE_DILATION, 0, 0},
+  {"3tap-erode-horizontal", tapErodeHorizontal, horizontal3SE, REFERENCE_EROSION, 0, 0},
+  {"3tap-erode-vertical", tapErodeVertical, vertical3SE, REFERENCE_EROSION, 0, 0},
+  {"3tap-dilate-horizontal", tapDilateHorizontal, horizontal3SE, REFERENCE_DILATION, 0, 0},
+  {"3tap-dilate-vertical", tapDilateVertical, vertical3SE, REFERENCE_DILATION, 0, 0},
+  {"tiled-erode-horizontal", tiledErodeHorizontal, horizontalLineSE, REFERENCE_EROSION, 0, 0},
+  {"tiled-erode-vertical", tiledErodeVertical, verticalLineSE, REFERENCE_EROSION, 0, 0},
+  {"tiled-dilate-horizontal", tiledDilateHorizontal, horizontalLineSE, REFERENCE_DILATION, 0, 0},
+  {"tiled-dilate-vertical", tiledDilateVertical, verticalLineSE, REFERENCE_DILATION, 0, 0},
+  {"sparse-erode", sparseErode, sparseSE, REFERENCE_EROSION, 0, 0},
+  {"sparse-dilate", sparseDilate, sparseSE, REFERENCE_DILATION, 0, 0},
+  {"layer-open", layerOpen, layerSE, REFERENCE_OPENING, 0, 0},
+  {"layer-close", layerClose, layerSE, REFERENCE_CLOSING, 0, 0},
+  {"disc-open", discOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"disc-close", discClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"serial-open", serialOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"serial-close", serialClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"graph-open", graphOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"graph-close", graphClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"placed-open", placedOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"placed-close", placedClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"view-open", viewOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"view-close", viewClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"budget-open", budgetOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"budget-close", budgetClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"budget-sparse-erode", budgetErode, sparseSE, REFERENCE_EROSION, 0, 0},
+  {"budget-sparse-dilate", budgetDilate, sparseSE, REFERENCE_DILATION, 0, 0},
+  {"partition-open", partitionOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"partition-close", partitionClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"edt-erode", edtErode, discSE, REFERENCE_EROSION, 1, 0},
+  {"edt-dilate", edtDilate, discSE, REFERENCE_DILATION, 1, 0},
+  {"edt-open", edtOpen, discSE, REFERENCE_OPENING, 1, 0},
+  {"edt-close", edtClose, discSE, REFERENCE_CLOSING, 1, 0},
+  {"batch-open", batchOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"batch-close", batchClose, discSE, REFERENCE_CLOSING, 0, 0},
+  {"planned-open", plannedOpen, discSE, REFERENCE_OPENING, 0, 0},
+  {"planned-close", plannedClose, discSE, REFERENCE_CLOSING, 0, 0},
+};
+
+#define CHECK_COUNT ((int) (sizeof(checks) / sizeof(checks[0])))
+
+typedef int (*VolumeFunction)(SedContext*, Volume*, int);
+
+typedef struct VolumeCheck {
+  const char *name;
+  VolumeFunction run;
+  int reference;
+  int failures;
+} VolumeCheck;
+
+static VolumeCheck volumeChecks[] = {
+  {"ball-erode", ballErosion, REFERENCE_EROSION, 0},
+  {"ball-dilate", ballDilation, REFERENCE_DILATION, 0},
+  {"ball-open", ballOpening, REFERENCE_OPENING, 0},
+  {"ball-close", ballClosing, REFERENCE_CLOSING, 0},
+};
+
+#define VOLUME_CHECK_COUNT ((int) (sizeof(volumeChecks) / sizeof(volumeChecks[0])))
+
+/*
+ * Function:  randomCase
+ * --------------------
+ *  draws the parameters of one case from its seed
+ */
+
+static Case randomCase(unsigned int seed, int maxSize, int maxRadius, int maxThreads){
+  Case c;
+  unsigned int state = seed * 2654435761u + 1;
+  int tiny = randomInt(&state, 0, 4) == 0;
+  memset(&c, 0, sizeof(c));
+  c.seed = seed;
+  c.width = randomInt(&state, 1, tiny ? TINY_SIZE : maxSize);
+  c.height = randomInt(&state, 1, tiny ? TINY_SIZE : maxSize);
+  c.threads = randomInt(&state, 1, maxThreads);
+  c.image.pattern = randomInt(&state, 0, SYNTH_PATTERNS - 1);
+  c.image.binary = randomInt(&state, 0, 1);
+  c.image.seed = seed;
+  c.image.width = c.width;
+  c.image.height = c.height;
+  c.size = 2 * randomInt(&state, 1, maxRadius) + 1;
+  c.radius = randomInt(&state, 2, maxRadius);
+  c.layer.cubicFactor.width = 2 * randomInt(&state, 0, maxRadius) + 1;
+  c.layer.cubicFactor.height = 2 * randomInt(&state, 0, maxRadius) + 1;
+  c.layer.sparseFactor.topOffset = randomInt(&state, 0, maxRadius);
+  c.layer.sparseFactor.bottomOffset = randomInt(&state, 0, maxRadius);
+  c.layer.sparseFactor.leftOffset = randomInt(&state, 0, maxRadius);
+  c.layer.sparseFactor.rightOffset = randomInt(&state, 0, maxRadius);
+  return c;
+}
+
+/* the radii of the fixed multi-tile cases, 21 beyond the default --max-radius */
+static const int tiledCases[] = {9, 21};
+#define TILED_CASE_COUNT ((int) (sizeof(tiledCases) / sizeof(tiledCases[0])))
+
+/*
+ * Function:  runReference
+ * --------------------
+ *  runs the reference operation of a check
+ */
+
+static int runReference(SedContext *ctx, int reference, Image *im, Image *SE){
+  switch( reference ){
+    case REFERENCE_EROSION: return referenceErosion(ctx, im, SE);
+    case REFERENCE_DILATION: return referenceDilation(ctx, im, SE);
+    case REFERENCE_OPENING: return referenceOpening(ctx, im, SE);
+  }
+  return referenceClosing(ctx, im, SE);
+}
+
+/*
+ * Function:  runCheck
+ * --------------------
+ *  runs one check on one case and compares the engine with the reference
+ *
+ *  returns: 1 when they agree, 0 otherwise (the first difference is printed)
+ */
+
+static int runCheck(SedContext *ctx, Check *check, Case *c, Image *input){
+  Image *fast = NULL, *expected = NULL, *SE = check->se(ctx, c);
+  int status, refStatus, i, size = c->width * c->height, ok = 1;
+
+  status = SE != NULL ? copyImage(ctx, input, &fast) : SED_ERROR_MEMORY;
+  if( status == SED_OK ) status = copyImage(ctx, input, &expected);
+  if( status == SED_OK && check->binary ){
+    grayscaleToBinary(fast, BINARY_THRESHOLD);
+    grayscaleToBinary(expected, BINARY_THRESHOLD);
+  }
+  if( status == SED_OK ){
+    refStatus = runReference(ctx, check->reference, expected, SE);
+    status = check->run(ctx, c, fast);
+    if( refStatus != SED_OK ) status = refStatus;
+  }
+  if( status != SED_OK ){
+    printf("FAIL %s seed %u: %s\n", check->name, c->seed, errorString(status));
+    ok = 0;
+  }
+  for(i = 0; ok && i < size; i++){
+    if( fast->data[i] == expected->data[i] ) continue;
+    printf("FAIL %s seed %u: %dx%d threads %d %s%s size %d radius %d layer %dx%d t%d b%d l%d r%d: "
+           "pixel (%d, %d) is %d, expected %d\n",
+           check->name, c->seed, c->width, c->height, c->threads, c->image.binary ? "binary " : "",
+           synthPatternNames[c->image.pattern], c->size, c->radius,
+           c->layer.cubicFactor.width, c->layer.cubicFactor.height,
+           c->layer.sparseFactor.topOffset, c->layer.sparseFactor.bottomOffset,
+           c->layer.sparseFactor.leftOffset, c->layer.sparseFactor.rightOffset,
+           i / c->width, i % c->width, fast->data[i], expected->data[i]);
+    ok = 0;
+  }
+  freeImage(ctx, fast);
+  freeImage(ctx, expected);
+  freeImage(ctx, SE);
+  return ok;
+}
+
+/*
+ * Function:  verifyDiscPlans
+ * --------------------
+ *  checks that the origin together with the layers of the decomposition of
+ *  every disc up to maxRadius is exactly the disc
+ *
+ *  returns: the amount of radii for which that does not hold
+ */
+
+static int verifyDiscPlans(SedContext *ctx, int maxRadius){
+  int radius, row, col, r, c, failures = 0, status, bad;
+  DiscPlan *plan;
+  Image *disc, *layers;
+  for(radius = 2; radius <= maxRadius; radius++){
+    status = getDiscPlan(ctx, radius, &plan);
+    disc = computeBinaryDiscSE(ctx, radius);
+    layers = status == SED_OK ? partitionSE(ctx, plan->parts, plan->count, 1) : NULL;
+    if( disc == NULL || layers == NULL ){
+      printf("FAIL disc-plan radius %d: %s\n", radius, errorString(status == SED_OK ? SED_ERROR_MEMORY : status));
+      failures++;
+      freeImage(ctx, disc);
+      freeImage(ctx, layers);
+      continue;
+    }
+    // both are centered on their origin, pixels outside of the smaller one are background
+    bad = 0;
+    for(row = 0; row < disc->height; row++){
+      for(col = 0; col < disc->width; col++){
+        r = row - disc->height / 2 + layers->height / 2;
+        c = col - disc->width / 2 + layers->width / 2;
+        if( r < 0 || r >= layers->height || c < 0 || c >= layers->width ) bad += disc->data[row * disc->width + col] != 0;
+        else bad += disc->data[row * disc->width + col] != layers->data[r * layers->width + c];
+      }
+    }
+    if( bad || layers->width > disc->width ){
+      printf("FAIL disc-plan radius %d: %d pixels differ\n", radius, bad);
+      failures++;
+    }
+    freeImage(ctx, disc);
+    freeImage(ctx, layers);
+  }
+  return failures;
+}
+
+/*
+ * Function:  verifyBallPlans
+ * --------------------
+ *  checks that the union of the boxes of the decomposition of every ball up
+ *  to maxRadius is exactly the ball
+ *
+ *  returns: the amount of radii for which that does not hold
+ */
+
+static int verifyBallPlans(SedContext *ctx, int maxRadius){
+  int radius, size, k, x, y, z, inside, failures = 0, bad;
+  BallPlan plan;
+  Volume *ball;
+  CuboidFactor *c;
+  for(radius = 2; radius <= maxRadius; radius++){
+    ball = computeBinaryBallSE(ctx, radius);
+    if( ball == NULL || decomposeBall(ctx, radius, &plan) != SED_OK ){
+      printf("FAIL ball-plan radius %d: %s\n", radius, errorString(SED_ERROR_MEMORY));
+      failures++;
+      freeVolume(ctx, ball);
+      continue;
+    }
+    size = ball->width;
+    bad = 0;
+    for(z = -radius; z <= radius; z++){
+      for(y = -radius; y <= radius; y++){
+        for(x = -radius; x <= radius; x++){
+          inside = 0;
+          for(k = 0; k < plan.count; k++){
+            c = &plan.cuboids[k];
+            inside |= abs(x) <= c->width / 2 && abs(y) <= c->height / 2 && abs(z) <= c->depth / 2;
+          }
+          bad += inside != (ball->data[((size_t) (z + radius) * size + y + radius) * size + x + radius] != 0);
+        }
+      }
+    }
+    if( bad ){
+      printf("FAIL ball-plan radius %d: %d voxels differ\n", radius, bad);
+      failures++;
+    }
+    freeBallPlan(&plan);
+    freeVolume(ctx, ball);
+  }
+  return failures;
+}
+
+/*
+ * Function:  runVolumeCheck
+ * --------------------
+ *  runs one ball check on a volume drawn from a case seed and compares it
+ *  with the brute force reference
+ *
+ *  returns: 1 when they agree, 0 otherwise (the first difference is printed)
+ */
+
+static int runVolumeCheck(SedContext *ctx, VolumeCheck *check, unsigned int seed, int maxRadius, int maxThreads){
+  unsigned int state = seed * 2654435761u + 7;
+  SynthSpec spec = {SYNTH_BLOBS, 0, seed, 0, 0, 0};
+  Volume *fast = NULL, *expected = NULL, *SE;
+  int radius, status, ok = 1;
+  size_t i, size;
+
+  spec.width = randomInt(&state, 1, VOLUME_MAX_SIZE);
+  spec.height = randomInt(&state, 1, VOLUME_MAX_SIZE);
+  spec.depth = randomInt(&state, 1, VOLUME_MAX_SIZE);
+  spec.pattern = randomInt(&state, 0, SYNTH_PATTERNS - 1);
+  spec.binary = randomInt(&state, 0, 1);
+  radius = randomInt(&state, 2, maxRadius < VOLUME_MAX_RADIUS ? maxRadius : VOLUME_MAX_RADIUS);
+  size = (size_t) spec.width * spec.height * spec.depth;
+  SE = computeBinaryBallSE(ctx, radius);
+  status = setThreads(ctx, randomInt(&state, 1, maxThreads));
+  if( status == SED_OK ) status = SE != NULL ? synthVolume(ctx, &spec, &fast) : SED_ERROR_MEMORY;
+  if( status == SED_OK ) status = synthVolume(ctx, &spec, &expected);
+  if( status == SED_OK ){
+    switch( check->reference ){
+      case REFERENCE_EROSION: status = referenceVolumeErosion(ctx, expected, SE); break;
+      case REFERENCE_DILATION: status = referenceVolumeDilation(ctx, expected, SE); break;
+      case REFERENCE_OPENING: status = referenceVolumeOpening(ctx, expected, SE); break;
+      default: status = referenceVolumeClosing(ctx, expected, SE); break;
+    }
+  }
+  if( status == SED_OK ) status = check->run(ctx, fast, radius);
+  if( status != SED_OK ){
+    printf("FAIL %s seed %u: %s\n", check->name, seed, errorString(status));
+    ok = 0;
+  }
+  for(i = 0; ok && i < size; i++){
+    if( fast->data[i] == expected->data[i] ) continue;
+    printf("FAIL %s seed %u: %dx%dx%d threads %d %s%s radius %d: voxel (%zu, %zu, %zu) is %d, expected %d\n",
+           check->name, seed, spec.width, spec.height, spec.depth, ctx->threads, spec.binary ? "binary " : "",
+           synthPatternNames[spec.pattern], radius, i / spec.width / spec.height, i / spec.width % spec.height,
+           i % spec.width, fast->data[i], expected->data[i]);
+    ok = 0;
+  }
+  freeVolume(ctx, fast);
+  freeVolume(ctx, expected);
+  freeVolume(ctx, SE);
+  return ok;
+}
+
+/*
+ * Function:  runImageChecks
+ * --------------------
+ *  runs every image check whose name starts with only (all when NULL) on
+ *  one case
+ *
+ *  returns: the amount of failed checks, -1 when out of memory
+ */
+
+static int runImageChecks(SedContext *ctx, Case *c, char *only, int *runs){
+  Pixel *data = contextAlloc(ctx, (size_t) c->width * c->height);
+  Image *input = data != NULL ? createImage(data, c->width, c->height, 1) : NULL;
+  int i, failures = 0;
+
+  if( input == NULL || setThreads(ctx, c->threads) != SED_OK ){
+    if( input == NULL ) contextFree(ctx, data);
+    freeImage(ctx, input);
+    return -1;
+  }
+  synthRows(&c->image, 0, c->height, data, 1);
+  for(i = 0; i < CHECK_COUNT; i++){
+    if( only != NULL && strncmp(checks[i].name, only, strlen(only)) != 0 ) continue;
+    (*runs)++;
+    if( !runCheck(ctx, &checks[i], c, input) ){
+      checks[i].failures++;
+      failures++;
+    }
+  }
+  freeImage(ctx, input);
+  return failures;
+}
+
+int main(int argc, char *argv[]){
+  int cases = DEFAULT_CASES, maxSize = DEFAULT_MAX_SIZE, maxRadius = DEFAULT_MAX_RADIUS;
+  int maxThreads = DEFAULT_MAX_THREADS, failures = 0, runs = 0, i, k, failed;
+  unsigned int seed = DEFAULT_SEED;
+  char *only = NULL;
+  SedContext *ctx;
+  Case c;
+
+  for(i = 1; i < argc; i++){
+    if( strcmp(argv[i], "--cases") == 0 && i + 1 < argc ) cases = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc ) seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if( strcmp(argv[i], "--max-size") == 0 && i + 1 < argc ) maxSize = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--max-radius") == 0 && i + 1 < argc ) maxRadius = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc ) maxThreads = atoi(argv[++i]);
+    else if( strcmp(argv[i], "--check") == 0 && i + 1 < argc ) only = argv[++i];
+    else{
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if( cases <= 0 || maxSize <= 0 || maxRadius < 2 || maxThreads <= 0 ){
+    fprintf(stderr, "Malformed options, see the top of sedverify.c\n");
+    return -1;
+  }
+
+  ctx = createContext(1);
+  if( ctx == NULL ){
+    fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+    return -1;
+  }
+  if( only == NULL || strncmp("disc-plan", only, strlen(only)) == 0 )
+    failures += verifyDiscPlans(ctx, maxRadius);
+  if( only == NULL || strncmp("ball-plan", only, strlen(only)) == 0 )
+    failures += verifyBallPlans(ctx, maxRadius);
+
+  for(k = 0; k < cases; k++){
+    c = randomCase(seed + k, maxSize, maxRadius, maxThreads);
+    failed = runImageChecks(ctx, &c, only, &runs);
+    if( failed < 0 ){
+      fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+      return -1;
+    }
+    failures += failed;
+    for(i = 0; i < VOLUME_CHECK_COUNT; i++){
+      if( only != NULL && strncmp(volumeChecks[i].name, only, strlen(only)) != 0 ) continue;
+      runs++;
+      if( !runVolumeCheck(ctx, &volumeChecks[i], seed + k, maxRadius, maxThreads) ){
+        volumeChecks[i].failures++;
+        failures++;
+      }
+    }
+  }
+  for(k = 0; k < TILED_CASE_COUNT; k++){
+    // a random case of its own seed, grown to several tiles of the graph
+    c = randomCase(seed + cases + k, maxSize, maxRadius, maxThreads);
+    c.width = c.image.width = TILED_WIDTH;
+    c.height = c.image.height = TILED_HEIGHT;
+    c.radius = tiledCases[k];
+    c.threads = maxThreads;
+    failed = runImageChecks(ctx, &c, only, &runs);
+    if( failed < 0 ){
+      fprintf(stderr, "%s\n", errorString(SED_ERROR_MEMORY));
+      return -1;
+    }
+    failures += failed;
+  }
+
+  for(i = 0; i < CHECK_COUNT; i++){
+    if( only != NULL && strncmp(checks[i].name, only, strlen(only)) != 0 ) continue;
+    printf("%-24s %s (%d of %d cases failed)\n", checks[i].name,
+           checks[i].failures ? "FAILED" : "ok", checks[i].failures, cases + TILED_CASE_COUNT);
+  }
+  for(i = 0; i < VOLUME_CHECK_COUNT; i++){
+    if( only != NULL && strncmp(volumeChecks[i].name, only, strlen(only)) != 0 ) continue;
+    printf("%-24s %s (%d of %d cases failed)\n", volumeChecks[i].name,
+           volumeChecks[i].failures ? "FAILED" : "ok", volumeChecks[i].failures, cases);
+  }
+  printf("%d checks, %d failures\n", runs, failures);
+  freeContext(ctx);
+  return failures > 0;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+/*
+ * Function:  resetLatencyStats
+ * --------------------
+ *  clears all recorded samples
+ *
+ *  ls: a pointer to the statistics
+ */
+
+void resetLatencyStats(LatencyStats *ls){
+  ls->count = 0;
+  ls->max = 0;
+}
+
+/*
+ * Function:  recordLatency
+ * --------------------
+ *  records a latency sample, only the last LATENCY_WINDOW samples are kept for
+ *  the percentiles while the maximum covers every sample
+ *
+ *  ls: a pointer to the statistics
+ *  seconds: the latency
+ */
+
+void recordLatency(LatencyStats *ls, double seconds){
+  ls->samples[ls->count % LATENCY_WINDOW] = seconds;
+  ls->count++;
+  if( seconds > ls->max ) ls->max = seconds;
+}
+
+static int compareDoubles(const void *a, const void *b){
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Function:  latencyPercentile
+ * --------------------
+ *  computes a percentile of the recorded samples (nearest rank)
+ *
+ *  ls: a pointer to the statistics
+ *  p: the percentile, between 0 and 100
+ *
+ *  returns: the latency at percentile p or 0 when nothing was recorded
+ */
+
+double latencyPercentile(LatencyStats *ls, double p){
+  int n = ls->count < LATENCY_WINDOW ? ls->count : LATENCY_WINDOW;
+  int rank;
+  double result, *sorted;
+  if( n == 0 ) return 0;
+  sorted = malloc(n * sizeof(double));
+  if( sorted == NULL ) return 0;
+  memcpy(sorted, ls->samples, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compareDoubles);
+  rank = (int) (p / 100.0 * n + 0.5) - 1;
+  if( rank < 0 ) rank = 0;
+  if( rank >= n ) rank = n - 1;
+  result = sorted[rank];
+  free(sorted);
+  return result;
+}
+
+/*
+ * Function:  formatLatencyStats
+ * --------------------
+ *  writes the sample count and the p50/p90/p99/max latencies in microseconds
+ *  as key=value pairs to str
+ *
+ *  ls: a pointer to the statistics
+ *  str: the output buffer
+ *  len: the size of the output buffer
+ */
+
+void formatLatencyStats(LatencyStats *ls, char *str, int len){
+  snprintf(str, len, "count=%lu p50=%.0f p90=%.0f p99=%.0f max=%.0f",
+           ls->count,
+           latencyPercentile(ls, 50) * 1e6,
+           latencyPercentile(ls, 90) * 1e6,
+           latencyPercentile(ls, 99) * 1e6,
+           ls->max * 1e6);
+}
+
+/*
+ * Function:  wallClock
+ * --------------------
+ *  reads the monotonic clock. Unlike clock(), which adds up the CPU time of
+ *  every thread of the process, differences of wallClock() are elapsed time,
+ *  so parallel speedups show up as such.
+ *
+ *  returns: the time in seconds since an arbitrary fixed point
+ */
+
+double wallClock(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
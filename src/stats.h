@@ -0,0 +1,17 @@
+#ifndef STATS
+#define STATS
+
+#define LATENCY_WINDOW 65536
+
+typedef struct LatencyStats {
+  double samples[LATENCY_WINDOW];
+  unsigned long count;
+  double max;
+} LatencyStats;
+
+void resetLatencyStats(LatencyStats*);
+void recordLatency(LatencyStats*, double);
+double latencyPercentile(LatencyStats*, double);
+void formatLatencyStats(LatencyStats*, char*, int);
+double wallClock(void);
+#endif
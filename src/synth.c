@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "synth.h"
+#include "omp.h"
+
+#define MIN_PIX 0
+#define MAX_PIX 255
+#define FOREGROUND 128 // foreground pixels are >= FOREGROUND, background ones below
+
+#define BACKGROUND 32
+#define BLOB_CELL 32
+#define BLOB_MIN_RADIUS 4
+#define BLOB_RADIUS_RANGE 20
+#define GLYPH_WIDTH 10
+#define GLYPH_HEIGHT 16
+#define LINE_HEIGHT 20
+#define SPARSE_CELL 16
+#define FLAT_CELL 256
+
+/*
+ *  ----------------
+ *  Deterministic synthetic workloads: every pixel is a pure function of the
+ *  seed and its coordinates, so any band of rows can be generated on its own,
+ *  in any order and on any thread, and the same spec gives the same pixels on
+ *  every machine. That makes images far larger than memory (up to 16
+ *  gigapixels) possible as streams of bands.
+ *
+ *  patterns:
+ *    noise    independent uniform pixels
+ *    blobs    discs of radius 4..23 on a jittered 32 pixel grid, shaded
+ *    strokes  text-like lines of seven segment glyphs with word and line gaps
+ *    sparse   isolated dots, about 0.5% foreground
+ *    flat     one background value with rare rectangles
+ *
+ *  In the grayscale images foreground pixels are >= 128 and background pixels
+ *  below, the binary images threshold them to MAX_PIX and MIN_PIX.
+ *
+ *  Volumes (synthVolume) are generated the same way, slice by slice. Their
+ *  blobs are balls on a jittered 32 voxel grid and their noise is independent
+ *  voxels, the other patterns are extruded through slabs of 32 slices with a
+ *  seed of their own.
+ */
+
+const char *synthPatternNames[SYNTH_PATTERNS] = {"noise", "blobs", "strokes", "sparse", "flat"};
+
+static unsigned int mix(unsigned int h){
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+static unsigned int cellHash(unsigned int seed, int a, int b){
+  return mix(mix(seed * 0x9E3779B9u ^ (unsigned int) a * 0x85EBCA6Bu) ^ (unsigned int) b * 0xC2B2AE35u);
+}
+
+/*
+ * Function:  parseSynthPattern
+ * --------------------
+ *  returns: the SYNTH_* value of a pattern name or -1
+ */
+
+int parseSynthPattern(char *name){
+  int i;
+  for(i = 0; i < SYNTH_PATTERNS; i++)
+    if( strcmp(name, synthPatternNames[i]) == 0 ) return i;
+  return -1;
+}
+
+static Pixel blobPixel(unsigned int seed, int row, int col){
+  int cy = row / BLOB_CELL, cx = col / BLOB_CELL, dy, dx, y, x, radius, value = BACKGROUND, v;
+  unsigned int h;
+  for(dy = -1; dy <= 1; dy++){
+    for(dx = -1; dx <= 1; dx++){
+      h = cellHash(seed, cy + dy, cx + dx);
+      if( (h & 3) == 0 ) continue; // a quarter of the cells is empty
+      y = row - ((cy + dy) * BLOB_CELL + (int) ((h >> 8) % BLOB_CELL));
+      x = col - ((cx + dx) * BLOB_CELL + (int) ((h >> 16) % BLOB_CELL));
+      radius = BLOB_MIN_RADIUS + (int) ((h >> 24) % BLOB_RADIUS_RANGE);
+      if( y * y + x * x > radius * radius ) continue;
+      v = MAX_PIX - (int) (mix(h) & 63) - 3 * (abs(y) + abs(x)) / 2;
+      v = v < FOREGROUND ? FOREGROUND : v;
+      value = v > value ? v : value;
+    }
+  }
+  return value;
+}
+
+static Pixel ballVoxel(unsigned int seed, int slice, int row, int col){
+  int cz = slice / BLOB_CELL, cy = row / BLOB_CELL, cx = col / BLOB_CELL, dz, dy, dx, z, y, x, radius;
+  int value = BACKGROUND, v;
+  unsigned int h;
+  for(dz = -1; dz <= 1; dz++){
+    for(dy = -1; dy <= 1; dy++){
+      for(dx = -1; dx <= 1; dx++){
+        h = mix(cellHash(seed, cy + dy, cx + dx) ^ (unsigned int) (cz + dz) * 0x27D4EB2Du);
+        if( (h & 3) == 0 ) continue; // a quarter of the cells is empty
+        z = slice - ((cz + dz) * BLOB_CELL + (int) ((h >> 2) % BLOB_CELL));
+        y = row - ((cy + dy) * BLOB_CELL + (int) ((h >> 8) % BLOB_CELL));
+        x = col - ((cx + dx) * BLOB_CELL + (int) ((h >> 16) % BLOB_CELL));
+        radius = BLOB_MIN_RADIUS + (int) ((h >> 24) % BLOB_RADIUS_RANGE);
+        if( z * z + y * y + x * x > radius * radius ) continue;
+        v = MAX_PIX - (int) (mix(h) & 63) - (abs(z) + abs(y) + abs(x));
+        v = v < FOREGROUND ? FOREGROUND : v;
+        value = v > value ? v : value;
+      }
+    }
+  }
+  return value;
+}
+
+static Pixel strokePixel(unsigned int seed, int row, int col){
+  int line = row / LINE_HEIGHT, y = row % LINE_HEIGHT, glyph = col / GLYPH_WIDTH, x = col % GLYPH_WIDTH;
+  unsigned int h;
+  if( y >= GLYPH_HEIGHT - 1 || y < 1 || x < 1 || x > GLYPH_WIDTH - 2 ) return BACKGROUND;
+  if( cellHash(seed, line, -1) % 8 == 0 ) return BACKGROUND;  // an empty line
+  h = cellHash(seed, line, glyph);
+  if( h % 6 == 0 ) return BACKGROUND;                          // a word gap
+  h = (h >> 3) | 1 << (h % 7);                                 // at least one segment
+  if( (h & 1) && y <= 2 ) return MAX_PIX;                      // top
+  if( (h & 2) && (y == 7 || y == 8) ) return MAX_PIX;          // middle
+  if( (h & 4) && y >= GLYPH_HEIGHT - 3 ) return MAX_PIX;       // bottom
+  if( (h & 8) && x <= 2 && y <= 8 ) return MAX_PIX;            // upper left
+  if( (h & 16) && x >= GLYPH_WIDTH - 3 && y <= 8 ) return MAX_PIX;  // upper right
+  if( (h & 32) && x <= 2 && y >= 7 ) return MAX_PIX;           // lower left
+  if( (h & 64) && x >= GLYPH_WIDTH - 3 && y >= 7 ) return MAX_PIX;  // lower right
+  if( (h & 128) && abs(x - 1 - (y - 1) * 7 / 13) <= 1 ) return MAX_PIX; // diagonal
+  return BACKGROUND;
+}
+
+static Pixel sparsePixel(unsigned int seed, int row, int col){
+  unsigned int h = cellHash(seed, row / SPARSE_CELL, col / SPARSE_CELL);
+  int y = row % SPARSE_CELL - (int) ((h >> 8) % (SPARSE_CELL - 2));
+  int x = col % SPARSE_CELL - (int) ((h >> 12) % (SPARSE_CELL - 2));
+  int size = 1 + (int) ((h >> 16) % 3);
+  if( h % 4 != 0 || y < 0 || x < 0 || y >= size || x >= size ) return MIN_PIX;
+  return FOREGROUND + ((h >> 20) & 127);
+}
+
+static Pixel flatPixel(unsigned int seed, int row, int col){
+  unsigned int h = cellHash(seed, row / FLAT_CELL, col / FLAT_CELL);
+  int y = row % FLAT_CELL - (int) ((h >> 8) % 192), x = col % FLAT_CELL - (int) ((h >> 16) % 192);
+  int size = 8 + (int) ((h >> 24) % 56);
+  if( h % 16 != 0 || y < 0 || x < 0 || y >= size || x >= size ) return FOREGROUND / 2 + mix(seed) % (FOREGROUND / 2);
+  return FOREGROUND + (mix(h) & 127);
+}
+
+/*
+ * Function:  synthPixel
+ * --------------------
+ *  computes one pixel of a synthetic image
+ *
+ *  spec: the pattern, seed and size
+ *  row: the row of the pixel
+ *  col: the column of the pixel
+ *
+ *  returns: the pixel
+ */
+
+Pixel synthPixel(SynthSpec *spec, int row, int col){
+  Pixel value;
+  switch( spec->pattern ){
+    case SYNTH_NOISE: value = cellHash(spec->seed, row, col) & 0xFF; break;
+    case SYNTH_BLOBS: value = blobPixel(spec->seed, row, col); break;
+    case SYNTH_STROKES: value = strokePixel(spec->seed, row, col); break;
+    case SYNTH_SPARSE: value = sparsePixel(spec->seed, row, col); break;
+    default: value = flatPixel(spec->seed, row, col); break;
+  }
+  if( spec->binary ) value = value >= FOREGROUND ? MAX_PIX : MIN_PIX;
+  return value;
+}
+
+/*
+ * Function:  synthRows
+ * --------------------
+ *  generates a band of rows of a synthetic image, the band does not have to
+ *  start at the top so an image can be produced one band at a time
+ *
+ *  spec: the pattern, seed and size
+ *  firstRow: the first row of the band
+ *  rows: the amount of rows in the band
+ *  out: rows * spec->width pixels
+ *  threads: the amount of threads
+ */
+
+void synthRows(SynthSpec *spec, int firstRow, int rows, Pixel *out, int threads){
+  int width = spec->width, row, col;
+  #pragma omp parallel for num_threads(threads) default(none) private(col) shared(spec, out, width, firstRow, rows) schedule(static)
+  for(row = 0; row < rows; row++){
+    for(col = 0; col < width; col++)
+      out[(size_t) row * width + col] = synthPixel(spec, firstRow + row, col);
+  }
+}
+
+/*
+ * Function:  synthImage
+ * --------------------
+ *  generates a whole synthetic image in memory, single channel
+ *
+ *  ctx: the context, its allocator owns the pixels
+ *  spec: the pattern, seed and size
+ *  im: set to the new image
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int synthImage(SedContext *ctx, SynthSpec *spec, Image **im){
+  Pixel *data;
+  size_t size;
+  *im = NULL;
+  if( spec->pattern < 0 || spec->pattern >= SYNTH_PATTERNS || imageSize(spec->width, spec->height, 1, &size) != SED_OK )
+    return SED_ERROR_ARGUMENT;
+  data = contextAlloc(ctx, size);
+  *im = data != NULL ? createImage(data, spec->width, spec->height, 1) : NULL;
+  if( *im == NULL ){
+    contextFree(ctx, data);
+    return SED_ERROR_MEMORY;
+  }
+  synthRows(spec, 0, spec->height, data, ctx->threads);
+  return SED_OK;
+}
+
+/*
+ * Function:  synthVoxel
+ * --------------------
+ *  computes one voxel of a synthetic volume
+ *
+ *  spec: the pattern, seed and size
+ *  slice: the slice of the voxel
+ *  row: the row of the voxel
+ *  col: the column of the voxel
+ *
+ *  returns: the voxel
+ */
+
+Pixel synthVoxel(SynthSpec *spec, int slice, int row, int col){
+  SynthSpec slab = *spec;
+  Pixel value;
+  if( spec->pattern == SYNTH_NOISE ){
+    value = cellHash(mix(spec->seed) ^ (unsigned int) slice, row, col) & 0xFF;
+  }else if( spec->pattern == SYNTH_BLOBS ){
+    value = ballVoxel(spec->seed, slice, row, col);
+  }else{
+    slab.seed = mix(spec->seed ^ (unsigned int) (slice / BLOB_CELL) * 0x9E3779B9u);
+    slab.binary = 0;
+    value = synthPixel(&slab, row, col);
+  }
+  if( spec->binary ) value = value >= FOREGROUND ? MAX_PIX : MIN_PIX;
+  return value;
+}
+
+/*
+ * Function:  synthSlices
+ * --------------------
+ *  generates a band of slices of a synthetic volume, see synthRows
+ *
+ *  spec: the pattern, seed and size
+ *  firstSlice: the first slice of the band
+ *  slices: the amount of slices in the band
+ *  out: slices * spec->width * spec->height voxels
+ *  threads: the amount of threads
+ */
+
+void synthSlices(SynthSpec *spec, int firstSlice, int slices, Pixel *out, int threads){
+  int width = spec->width, height = spec->height, slice, row, col;
+  Pixel *line;
+  #pragma omp parallel for num_threads(threads) default(none) private(row, col, line) shared(spec, out, width, height, firstSlice, slices) schedule(static) collapse(2)
+  for(slice = 0; slice < slices; slice++){
+    for(row = 0; row < height; row++){
+      line = out + ((size_t) slice * height + row) * width;
+      for(col = 0; col < width; col++) line[col] = synthVoxel(spec, firstSlice + slice, row, col);
+    }
+  }
+}
+
+/*
+ * Function:  synthVolume
+ * --------------------
+ *  generates a whole synthetic volume in memory, spec->depth slices
+ *
+ *  ctx: the context, its allocator owns the voxels
+ *  spec: the pattern, seed and size
+ *  vol: set to the new volume
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int synthVolume(SedContext *ctx, SynthSpec *spec, Volume **vol){
+  Pixel *data;
+  size_t size;
+  *vol = NULL;
+  if( spec->pattern < 0 || spec->pattern >= SYNTH_PATTERNS || volumeSize(spec->width, spec->height, spec->depth, &size) != SED_OK )
+    return SED_ERROR_ARGUMENT;
+  data = contextAlloc(ctx, size);
+  *vol = data != NULL ? createVolume(data, spec->width, spec->height, spec->depth) : NULL;
+  if( *vol == NULL ){
+    contextFree(ctx, data);
+    return SED_ERROR_MEMORY;
+  }
+  synthSlices(spec, 0, spec->depth, data, ctx->threads);
+  return SED_OK;
+}
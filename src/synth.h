@@ -0,0 +1,32 @@
+#ifndef SYNTH
+#define SYNTH
+
+#include "image.h"
+#include "volume.h"
+
+#define SYNTH_NOISE 0
+#define SYNTH_BLOBS 1
+#define SYNTH_STROKES 2
+#define SYNTH_SPARSE 3
+#define SYNTH_FLAT 4
+#define SYNTH_PATTERNS 5
+
+typedef struct SynthSpec {
+  int pattern;        /* one of the SYNTH_* values */
+  int binary;         /* 1 for 0/255 pixels, 0 for grayscale */
+  unsigned int seed;
+  int width;
+  int height;
+  int depth;          /* the slices of a volume, see synthVolume */
+} SynthSpec;
+
+extern const char *synthPatternNames[SYNTH_PATTERNS];
+
+int parseSynthPattern(char*);
+Pixel synthPixel(SynthSpec*, int, int);
+void synthRows(SynthSpec*, int, int, Pixel*, int);
+int synthImage(struct SedContext*, SynthSpec*, Image**);
+Pixel synthVoxel(SynthSpec*, int, int, int);
+void synthSlices(SynthSpec*, int, int, Pixel*, int);
+int synthVolume(struct SedContext*, SynthSpec*, Volume**);
+#endif
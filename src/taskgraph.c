@@ -0,0 +1,438 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "context.h"
+#include "stats.h"
+#include "taskgraph.h"
+#include "tile.h"
+#include "trace.h"
+#include "omp.h"
+
+#define MAX(a,b)  (((a)>(b)) ? (a):(b))
+#define MIN(a,b)  (((a)<(b)) ? (a):(b))
+
+#define NO_TASK -1
+
+/*
+ *  ----------------
+ *  Dependency graph execution. The passes in image.c and tile.c end with a
+ *  barrier, so every thread waits for the slowest one after each full image
+ *  pass. Here every unit of work is a node that only waits for the nodes it
+ *  reads from. Nodes whose dependencies are done go into a ready queue: an
+ *  array with one slot per node, since every node is queued exactly once, and
+ *  two counters that producers and consumers advance with atomics, so no
+ *  locks are taken. A thread that finishes a node runs the first successor it
+ *  made ready itself and queues the others, so a tile goes on to its next
+ *  stage while it is still in the cache. A graph with a home function has a
+ *  queue per thread instead: nodes go to the queue of their home thread, a
+ *  thread only runs successors that are at home with it and takes from the
+ *  queues of the others when its own is empty.
+ *
+ *  graphMorphology builds the graph of an opening or closing with a disc
+ *  plan: a node per (stage, partition, tile). The nodes of a tile run its
+ *  partitions one after the other. The first partition of the second stage
+ *  waits for the last partition of the first stage of the tile and of its
+ *  neighbours within the reach of the structuring element, nothing else.
+ *  With firstTouch (see placement.c) the home of a tile is the thread that
+ *  owns its middle row, which first touched the rows of the buffers.
+ */
+
+typedef struct ReadyQueue {
+  int *slots;
+  int head;
+  int tail;
+} ReadyQueue;
+
+/*
+ * Function:  pushReady
+ * --------------------
+ *  queues a node whose dependencies are done
+ */
+
+static void pushReady(ReadyQueue *q, int node){
+  int slot = __atomic_fetch_add(&q->tail, 1, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&q->slots[slot], node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function:  popReady
+ * --------------------
+ *  returns: the oldest queued node, or NO_TASK when the queue is empty
+ */
+
+static int popReady(ReadyQueue *q){
+  int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE), node;
+  while( head < __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) ){
+    if( __atomic_compare_exchange_n(&q->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+      // the slot is claimed, its producer may still be storing the node
+      while( (node = __atomic_load_n(&q->slots[head], __ATOMIC_ACQUIRE)) == NO_TASK );
+      return node;
+    }
+  }
+  return NO_TASK;
+}
+
+/*
+ * Function:  runTaskGraph
+ * --------------------
+ *  runs all nodes of a graph on the threads of the context
+ *
+ *  ctx: the context
+ *  graph: the graph, its pending counts are used up
+ *  stats: filled with the run time and the idle time, may be NULL
+ *
+ *  returns: SED_OK or SED_ERROR_MEMORY
+ */
+
+int runTaskGraph(SedContext *ctx, TaskGraph *graph, GraphStats *stats){
+  ReadyQueue *queues;
+  int *slots, *homes, threads = ctx->threads, done = 0, n, t, used;
+  double begin = wallClock(), idle = 0;
+
+  queues = contextCalloc(ctx, threads, sizeof(ReadyQueue));
+  slots = contextAlloc(ctx, (size_t) MAX(graph->nodes, 1) * sizeof(int));
+  homes = contextCalloc(ctx, MAX(graph->nodes, 1), sizeof(int));
+  if( queues == NULL || slots == NULL || homes == NULL ){
+    contextFree(ctx, queues);
+    contextFree(ctx, slots);
+    contextFree(ctx, homes);
+    return SED_ERROR_MEMORY;
+  }
+  // every node is queued once, at its home, so a queue needs a slot per node there
+  for(n = 0; n < graph->nodes; n++){
+    if( graph->home != NULL ) homes[n] = graph->home(graph->user, n, threads);
+    slots[n] = NO_TASK;
+    queues[homes[n]].tail++;
+  }
+  for(t = 0, used = 0; t < threads; t++){
+    queues[t].slots = slots + used;
+    used += queues[t].tail;
+    queues[t].tail = 0;
+  }
+  for(n = 0; n < graph->nodes; n++)
+    if( graph->pending[n] == 0 ) pushReady(&queues[homes[n]], n);
+
+  #pragma omp parallel num_threads(threads) default(none) shared(ctx, graph, queues, homes, threads, done) reduction(+:idle)
+  {
+    TRACE_BEGIN(span);
+    int self = omp_get_thread_num(), node = NO_TASK, next, e, successor, t;
+    Pixel *scratch = scratchBuffer(ctx, self, MAX(graph->scratch, 1));
+    size_t pixels = 0;
+    double wait;
+    while( scratch != NULL ){
+      // the own queue first, then the others
+      for(t = 0; t < threads && node == NO_TASK; t++) node = popReady(&queues[(self + t) % threads]);
+      if( node == NO_TASK ){
+        if( __atomic_load_n(&done, __ATOMIC_ACQUIRE) == graph->nodes ) break;
+        wait = wallClock();
+        sched_yield();
+        idle += wallClock() - wait;
+        continue;
+      }
+      pixels += graph->run(graph->user, node, scratch);
+      next = NO_TASK;
+      for(e = graph->offsets[node]; e < graph->offsets[node + 1]; e++){
+        successor = graph->successors[e];
+        if( __atomic_sub_fetch(&graph->pending[successor], 1, __ATOMIC_ACQ_REL) != 0 ) continue;
+        if( next == NO_TASK && (graph->home == NULL || homes[successor] == self) ) next = successor;
+        else pushReady(&queues[homes[successor]], successor);
+      }
+      __atomic_add_fetch(&done, 1, __ATOMIC_ACQ_REL);
+      node = next;
+    }
+    TRACE_END(span, "task graph", pixels);
+  }
+  contextFree(ctx, queues);
+  contextFree(ctx, slots);
+  contextFree(ctx, homes);
+  if( stats != NULL ){
+    stats->nodes = graph->nodes;
+    stats->elapsed = wallClock() - begin;
+    stats->idle = idle;
+  }
+  // threads without scratch take no nodes, the others finish the graph
+  return done == graph->nodes ? SED_OK : SED_ERROR_MEMORY;
+}
+
+/*
+ * Function:  morphologyHome
+ * --------------------
+ *  the home of a node of a morphology graph: the thread that owns the middle
+ *  row of its tile in schedule(static) over the rows of the image
+ */
+
+static int morphologyHome(void *user, int node, int threads){
+  MorphologyGraph *m = user;
+  int firstRow = node % m->tiles / m->across * GRAPH_TILE;
+  return rowOwner(firstRow + MIN(GRAPH_TILE, m->height - firstRow) / 2, m->height, threads);
+}
+
+/*
+ * Function:  morphologyNode
+ * --------------------
+ *  node (stage * count + k) * tiles + tile: folds partition k into the tile of
+ *  the stage output, the first partition starts it from the stage input. Every
+ *  node is a span of its stage in the trace.
+ *
+ *  returns: the pixels of the tile
+ */
+
+static size_t morphologyNode(void *user, int node, Pixel *scratch){
+  MorphologyGraph *m = user;
+  int tile = node % m->tiles, k = node / m->tiles % m->count, stage = node / m->tiles / m->count;
+  int maximum = stage == 0 ? m->closing : !m->closing, row;
+  Pixel *src = stage == 0 ? m->source : m->middle, *acc = stage == 0 ? m->middle : m->output;
+  Tile t;
+  TRACE_BEGIN(span);
+
+  t.firstRow = tile / m->across * GRAPH_TILE;
+  t.firstColumn = tile % m->across * GRAPH_TILE;
+  t.rows = MIN(GRAPH_TILE, m->height - t.firstRow);
+  t.columns = MIN(GRAPH_TILE, m->width - t.firstColumn);
+  if( k == 0 ){
+    // the origin belongs to the disc
+    for(row = t.firstRow; row < t.firstRow + t.rows; row++)
+      memcpy(acc + (size_t) row * m->width + t.firstColumn, src + (size_t) row * m->width + t.firstColumn, t.columns);
+  }
+  layerTile(src, acc, m->width, m->height, t, &m->parts[k], maximum, scratch);
+  TRACE_END(span, maximum ? "dilation tile" : "erosion tile", (size_t) t.rows * t.columns);
+  return (size_t) t.rows * t.columns;
+}
+
+/*
+ * Function:  countTiles
+ * --------------------
+ *  sets the tiles of a morphology graph of an image of a size. The node
+ *  numbers are ints, so the 2 * count * tiles nodes have to fit in one.
+ *
+ *  returns: SED_OK or SED_ERROR_ARGUMENT when they do not
+ */
+
+static int countTiles(MorphologyGraph *m, int width, int height, int count){
+  long long across = (width + GRAPH_TILE - 1) / GRAPH_TILE, down = (height + GRAPH_TILE - 1) / GRAPH_TILE;
+  if( across * down > INT_MAX / 2 / MAX(count, 1) ) return SED_ERROR_ARGUMENT;
+  m->across = (int) across;
+  m->tiles = (int) (across * down);
+  return SED_OK;
+}
+
+/*
+ * Function:  buildMorphologyGraph
+ * --------------------
+ *  builds the graph of an opening or closing of images of a size with the
+ *  origin together with the layers of a decomposition, with its buffers, so
+ *  it can run on many images
+ *
+ *  ctx: the context
+ *  m: filled with the graph
+ *  width: the width of the images
+ *  height: the height of the images
+ *  parts: the partitions, used until the graph is freed
+ *  count: the amount of partitions
+ *  closing: 1 for the closing, 0 for the opening
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the image has too many tiles for
+ *  the int node numbers or SED_ERROR_MEMORY
+ */
+
+int buildMorphologyGraph(SedContext *ctx, MorphologyGraph *m, int width, int height, Partition *parts, int count,
+                         int closing){
+  size_t size = (size_t) width * height;
+  int down = (height + GRAPH_TILE - 1) / GRAPH_TILE, reachRows = 0, reachColumns = 0;
+  int tr, tc, r, c, k, n, tile, edges;
+  TaskGraph *graph = &m->graph;
+
+  memset(m, 0, sizeof(MorphologyGraph));
+  m->width = width;
+  m->height = height;
+  m->parts = parts;
+  m->count = count;
+  m->closing = closing;
+  if( count == 0 || size == 0 ) return SED_OK;
+  if( countTiles(m, width, height, count) != SED_OK ) return SED_ERROR_ARGUMENT;
+  // how far the second stage of a tile reads around it, in tiles
+  for(k = 0; k < count; k++){
+    reachRows = MAX(reachRows, MAX(parts[k].cubicFactor.height / 2,
+                    MAX(parts[k].sparseFactor.topOffset, parts[k].sparseFactor.bottomOffset)));
+    reachColumns = MAX(reachColumns, MAX(parts[k].cubicFactor.width / 2,
+                       MAX(parts[k].sparseFactor.leftOffset, parts[k].sparseFactor.rightOffset)));
+  }
+  reachRows = (reachRows + GRAPH_TILE - 1) / GRAPH_TILE;
+  reachColumns = (reachColumns + GRAPH_TILE - 1) / GRAPH_TILE;
+
+  graph->nodes = 2 * count * m->tiles;
+  if( (long long) m->tiles * (2 * reachRows + 1) * (2 * reachColumns + 1) > INT_MAX - graph->nodes )
+    return SED_ERROR_ARGUMENT;
+  graph->run = morphologyNode;
+  if( ctx->placement.firstTouch ) graph->home = morphologyHome;
+  graph->scratch = layerTileScratch(GRAPH_TILE, parts, count);
+  edges = graph->nodes + m->tiles * (2 * reachRows + 1) * (2 * reachColumns + 1);
+  m->initial = contextCalloc(ctx, graph->nodes, sizeof(int));
+  graph->pending = contextAlloc(ctx, (size_t) graph->nodes * sizeof(int));
+  graph->offsets = contextAlloc(ctx, ((size_t) graph->nodes + 1) * sizeof(int));
+  graph->successors = contextAlloc(ctx, (size_t) edges * sizeof(int));
+  // with firstTouch the rows are zeroed by the threads that run their tiles, see morphologyHome
+  m->source = ctx->placement.firstTouch ? allocatePlaced(ctx, NULL, width, height) : contextAlloc(ctx, size);
+  m->middle = ctx->placement.firstTouch ? allocatePlaced(ctx, NULL, width, height) : contextAlloc(ctx, size);
+  if( m->initial == NULL || graph->pending == NULL || graph->offsets == NULL || graph->successors == NULL
+      || m->source == NULL || m->middle == NULL ){
+    freeMorphologyGraph(ctx, m);
+    return SED_ERROR_MEMORY;
+  }
+
+  edges = 0;
+  for(n = 0; n < graph->nodes; n++){
+    graph->offsets[n] = edges;
+    tile = n % m->tiles;
+    k = n / m->tiles % count;
+    if( k < count - 1 ){
+      graph->successors[edges++] = n + m->tiles;     // the next partition of the tile
+      m->initial[n + m->tiles]++;
+    }else if( n < count * m->tiles ){
+      // the end of the first stage releases the second stage of the neighbours
+      tr = tile / m->across;
+      tc = tile % m->across;
+      for(r = MAX(0, tr - reachRows); r <= MIN(down - 1, tr + reachRows); r++){
+        for(c = MAX(0, tc - reachColumns); c <= MIN(m->across - 1, tc + reachColumns); c++){
+          graph->successors[edges++] = count * m->tiles + r * m->across + c;
+          m->initial[count * m->tiles + r * m->across + c]++;
+        }
+      }
+    }
+  }
+  graph->offsets[graph->nodes] = edges;
+  return SED_OK;
+}
+
+/*
+ * Function:  runMorphologyGraph
+ * --------------------
+ *  runs a built graph on an image of its size. A single channel image that
+ *  owns its pixels is not copied: the result is written into the spare buffer of the graph,
+ *  which the image then takes over in exchange for its old pixels.
+ *
+ *  ctx: the context
+ *  m: the graph
+ *  im: the single channel image, the result replaces its pixels
+ *  stats: filled with the statistics of the run, may be NULL
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT when the size differs or
+ *  SED_ERROR_MEMORY
+ */
+
+int runMorphologyGraph(SedContext *ctx, MorphologyGraph *m, Image *im, GraphStats *stats){
+  int status, handOver;
+  if( stats != NULL ) memset(stats, 0, sizeof(GraphStats));
+  if( im->width != m->width || im->height != m->height ) return SED_ERROR_ARGUMENT;
+  if( m->graph.nodes == 0 ) return SED_OK;
+  memcpy(m->graph.pending, m->initial, (size_t) m->graph.nodes * sizeof(int));
+  // the graph only covers the first width * height pixels of several channels
+  handOver = !im->borrowed && im->channels == 1;
+  if( !handOver ){
+    memcpy(m->source, im->data, (size_t) m->width * m->height);
+    m->output = im->data;
+  }else{
+    // the input stays in place and the output goes to the spare buffer, which
+    // the image takes over afterwards in exchange for its old pixels
+    m->output = m->source;
+    m->source = im->data;
+  }
+  m->graph.user = m;
+  status = runTaskGraph(ctx, &m->graph, stats);
+  if( handOver ) m->source = status == SED_OK ? exchangePixels(im, m->output) : m->output;
+  if( status == SED_OK && ctx->verbose && stats != NULL )
+    printf("task graph: %d nodes on %d tiles, %.1f%% of the thread time idle\n", stats->nodes, m->tiles,
+           100 * stats->idle / (stats->elapsed * ctx->threads));
+  return status;
+}
+
+/*
+ * Function:  freeMorphologyGraph
+ * --------------------
+ *  frees the buffers of a built graph
+ */
+
+void freeMorphologyGraph(SedContext *ctx, MorphologyGraph *m){
+  contextFree(ctx, m->initial);
+  contextFree(ctx, m->graph.pending);
+  contextFree(ctx, m->graph.offsets);
+  contextFree(ctx, m->graph.successors);
+  contextFree(ctx, m->source);
+  contextFree(ctx, m->middle);
+  m->initial = m->graph.pending = m->graph.offsets = m->graph.successors = NULL;
+  m->source = m->middle = NULL;
+}
+
+/*
+ * Function:  serialMorphology
+ * --------------------
+ *  opens or closes an image like graphMorphology, on the calling thread and
+ *  without building a graph: the nodes run tile by tile, all partitions of a
+ *  tile one after the other, so the tile stays in the cache. The copy of the
+ *  input and the middle buffer live in the scratch arena of thread 0. For
+ *  small images the thread team, the graph and the allocations cost more
+ *  than the passes themselves.
+ *
+ *  ctx: the context, used from outside of parallel regions
+ *  im: the single channel image, modified in place
+ *  parts: the partitions
+ *  count: the amount of partitions
+ *  closing: 1 for the closing, 0 for the opening
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT (see countTiles) or SED_ERROR_MEMORY
+ */
+
+int serialMorphology(SedContext *ctx, Image *im, Partition *parts, int count, int closing){
+  size_t size = (size_t) im->width * im->height, scratch = layerTileScratch(GRAPH_TILE, parts, count);
+  int stage, tile, k;
+  MorphologyGraph m;
+  Pixel *arena;
+
+  if( count == 0 || size == 0 ) return SED_OK;
+  memset(&m, 0, sizeof(MorphologyGraph));
+  if( countTiles(&m, im->width, im->height, count) != SED_OK ) return SED_ERROR_ARGUMENT;
+  arena = scratchBuffer(ctx, 0, 2 * size + scratch);
+  if( arena == NULL ) return SED_ERROR_MEMORY;
+  TRACE_BEGIN(span);
+  m.width = im->width;
+  m.height = im->height;
+  m.parts = parts;
+  m.count = count;
+  m.closing = closing;
+  m.source = arena;
+  m.middle = arena + size;
+  m.output = im->data;
+  memcpy(m.source, im->data, size);
+  for(stage = 0; stage < 2; stage++)
+    for(tile = 0; tile < m.tiles; tile++)
+      for(k = 0; k < count; k++) morphologyNode(&m, (stage * count + k) * m.tiles + tile, arena + 2 * size);
+  TRACE_END(span, "serial morphology", size);
+  return SED_OK;
+}
+
+/*
+ * Function:  graphMorphology
+ * --------------------
+ *  opens or closes an image with the origin together with the layers of a
+ *  decomposition, the same result as partitionErosion followed by
+ *  partitionDilation (or the other way around), as one task graph
+ *
+ *  ctx: the context
+ *  im: the single channel image, modified in place
+ *  parts: the partitions
+ *  count: the amount of partitions
+ *  closing: 1 for the closing, 0 for the opening
+ *  stats: filled with the statistics of the run, may be NULL
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT (see countTiles) or SED_ERROR_MEMORY
+ */
+
+int graphMorphology(SedContext *ctx, Image *im, Partition *parts, int count, int closing, GraphStats *stats){
+  MorphologyGraph m;
+  int status = buildMorphologyGraph(ctx, &m, im->width, im->height, parts, count, closing);
+  if( status == SED_OK ) status = runMorphologyGraph(ctx, &m, im, stats);
+  freeMorphologyGraph(ctx, &m);
+  return status;
+}
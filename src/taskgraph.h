@@ -0,0 +1,57 @@
+#ifndef TASKGRAPH
+#define TASKGRAPH
+
+#include <stddef.h>
+#include "image.h"
+
+#define GRAPH_TILE 256      /* the side of the tiles of graphMorphology */
+
+typedef size_t (*TaskFunction)(void*, int, Pixel*);  /* returns the pixels the node processed */
+typedef int (*TaskHome)(void*, int, int);             /* the thread of a team that should run a node */
+
+/*
+ * A dependency graph of tasks: node n may run once all nodes that list it as
+ * a successor have finished. The successors of n are
+ * successors[offsets[n]] .. successors[offsets[n + 1] - 1].
+ */
+typedef struct TaskGraph {
+  int nodes;
+  int *pending;           /* unfinished dependencies per node */
+  int *offsets;           /* nodes + 1 entries */
+  int *successors;
+  TaskFunction run;       /* runs a node with the scratch of its thread */
+  TaskHome home;          /* NULL when any thread will do */
+  void *user;
+  size_t scratch;         /* scratch bytes per thread */
+} TaskGraph;
+
+typedef struct GraphStats {
+  int nodes;
+  double elapsed;         /* seconds */
+  double idle;            /* seconds all threads together waited for work */
+} GraphStats;
+
+/*
+ * The graph of an opening or closing of images of one size, see taskgraph.c.
+ * Every run starts from the dependency counts in initial.
+ */
+typedef struct MorphologyGraph {
+  TaskGraph graph;
+  int *initial;           /* the pending counts before a run */
+  Pixel *source;          /* the input, read by the first stage, the spare buffer between runs */
+  Pixel *middle;          /* written by the first stage, read by the second */
+  Pixel *output;          /* written by the second stage */
+  int width, height;
+  int across, tiles;      /* tiles per row of tiles, tiles */
+  Partition *parts;
+  int count;
+  int closing;            /* 1 when the first stage dilates */
+} MorphologyGraph;
+
+int runTaskGraph(struct SedContext*, TaskGraph*, GraphStats*);
+int buildMorphologyGraph(struct SedContext*, MorphologyGraph*, int, int, Partition*, int, int);
+int runMorphologyGraph(struct SedContext*, MorphologyGraph*, Image*, GraphStats*);
+void freeMorphologyGraph(struct SedContext*, MorphologyGraph*);
+int serialMorphology(struct SedContext*, Image*, Partition*, int, int);
+int graphMorphology(struct SedContext*, Image*, Partition*, int, int, GraphStats*);
+#endif
@@ -0,0 +1,610 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "tile.h"
+#include "trace.h"
+#include "omp.h"
+
+#define MIN_PIX 0
+#define MAX_PIX 255
+
+#define HORIZONTAL 0
+#define VERTICAL 1
+
+#define MAX(a,b)  (((a)>(b)) ? (a):(b))
+#define MIN(a,b)  (((a)<(b)) ? (a):(b))
+
+#define RANGE(begin, end) (((unsigned long long) (end) << 32) | (unsigned int) (begin))
+#define RANGE_BEGIN(range) ((unsigned int) ((range) & 0xFFFFFFFFu))
+#define RANGE_END(range) ((unsigned int) ((range) >> 32))
+
+/*
+ *  ----------------
+ *  Tiled execution of the HGW line passes. The banded passes in image.c give
+ *  every thread whole rows or whole columns, so a vertical pass walks down
+ *  columns one pixel per cache line and a cheap region cannot hand work to a
+ *  busy thread. Here the image is cut into 2D tiles of TILE_LANES lines of
+ *  TILE_LINE pixels (longer for large structuring elements, so the halo stays
+ *  small). A tile reads its lines together with a halo of s / 2 pixels on both
+ *  ends from the source, filters them in a small buffer that stays in the
+ *  cache, and writes the result into the same rectangle of the destination.
+ *  The columns of a vertical tile are the lanes of the inner loops, so the
+ *  vertical pass reads whole rows of the tile instead of one pixel per cache
+ *  line.
+ *
+ *  The tiles are numbered row-major and every thread starts with a contiguous
+ *  range of them. A thread that runs out steals the back half of the range of
+ *  another one, so threads that drew cheap tiles help the others.
+ */
+
+/*
+ * Function:  tileView
+ * --------------------
+ *  returns: the view of a tile of the image with the pixeldata a
+ */
+
+static TileView tileView(Pixel *a, int width, Tile t){
+  TileView view;
+  view.data = a + (size_t) t.firstRow * width + t.firstColumn;
+  view.rows = t.rows;
+  view.columns = t.columns;
+  view.stride = width;
+  return view;
+}
+
+/*
+ * Function:  hgwBlocks
+ * --------------------
+ *  the van Herk/Gil-Werman running maxima (minima) of lanes padded lines at
+ *  once, see maxFilterLine in image.c (one line when lanes is 1). h holds the padded lines, pixel j of
+ *  lane k at h[j * lanes + k]; afterwards h holds the running extrema to the
+ *  end and g those from the start of every block of s pixels.
+ *
+ *  g: len * lanes pixels
+ *  h: len * lanes pixels
+ *  len: the padded length of the lines
+ *  lanes: the amount of lines
+ *  s: the size of the structuring element
+ *  maximum: 1 for the maxima, 0 for the minima
+ */
+
+static void hgwBlocks(Pixel *g, Pixel *h, int len, int lanes, int s, int maximum){
+  int i, j, k, end;
+  Pixel *gj, *hj, *prev;
+  if( lanes == 1 ){
+    for(i = 0; i < len; i += s){
+      end = MIN(i + s, len);
+      g[i] = h[i];
+      if( maximum ){
+        for(j = i + 1; j < end; j++) g[j] = MAX(g[j - 1], h[j]);
+        for(j = end - 2; j >= i; j--) h[j] = MAX(h[j + 1], h[j]);
+      }else{
+        for(j = i + 1; j < end; j++) g[j] = MIN(g[j - 1], h[j]);
+        for(j = end - 2; j >= i; j--) h[j] = MIN(h[j + 1], h[j]);
+      }
+    }
+    return;
+  }
+  for(i = 0; i < len; i += s){
+    end = MIN(i + s, len);
+    memcpy(&g[(size_t) i * lanes], &h[(size_t) i * lanes], lanes);
+    for(j = i + 1; j < end; j++){
+      gj = &g[(size_t) j * lanes];
+      hj = &h[(size_t) j * lanes];
+      prev = gj - lanes;
+      if( maximum ){
+        #pragma omp simd
+        for(k = 0; k < lanes; k++) gj[k] = MAX(prev[k], hj[k]);
+      }else{
+        #pragma omp simd
+        for(k = 0; k < lanes; k++) gj[k] = MIN(prev[k], hj[k]);
+      }
+    }
+    for(j = end - 2; j >= i; j--){
+      hj = &h[(size_t) j * lanes];
+      prev = hj + lanes;
+      if( maximum ){
+        #pragma omp simd
+        for(k = 0; k < lanes; k++) hj[k] = MAX(prev[k], hj[k]);
+      }else{
+        #pragma omp simd
+        for(k = 0; k < lanes; k++) hj[k] = MIN(prev[k], hj[k]);
+      }
+    }
+  }
+}
+
+/*
+ * Function:  storeExtrema
+ * --------------------
+ *  writes n results of hgwBlocks, out[i] the maximum (minimum) of h[i] and
+ *  g[i], or with fold set the maximum (minimum) of that and out[i] itself
+ */
+
+static void storeExtrema(Pixel *out, Pixel *h, Pixel *g, int n, int maximum, int fold){
+  int i;
+  if( maximum && fold ){
+    #pragma omp simd
+    for(i = 0; i < n; i++) out[i] = MAX(out[i], MAX(h[i], g[i]));
+  }else if( maximum ){
+    #pragma omp simd
+    for(i = 0; i < n; i++) out[i] = MAX(h[i], g[i]);
+  }else if( fold ){
+    #pragma omp simd
+    for(i = 0; i < n; i++) out[i] = MIN(out[i], MIN(h[i], g[i]));
+  }else{
+    #pragma omp simd
+    for(i = 0; i < n; i++) out[i] = MIN(h[i], g[i]);
+  }
+}
+
+/*
+ * Function:  filterTile
+ * --------------------
+ *  filters the lines of one tile with a line structuring element of size s.
+ *  Pixels of the halo outside of the image are padded with the neutral value,
+ *  as in maxFilterLine.
+ *
+ *  src: the pixeldata of the source image
+ *  dst: the pixeldata of the destination image, only the tile is written
+ *  width: the width of the images
+ *  height: the height of the images
+ *  t: the tile
+ *  s: the size of the structuring element, odd
+ *  direction: HORIZONTAL or VERTICAL
+ *  maximum: 1 for the dilation, 0 for the erosion
+ *  fold: 1 to fold the result into dst, see storeExtrema
+ *  g: (the lines of the tile) * (n + s - 1) pixels, n the length of the tile lines
+ *  h: as large as g
+ */
+
+static void filterTile(Pixel *src, Pixel *dst, int width, int height, Tile t, int s, int direction,
+                       int maximum, int fold, Pixel *g, Pixel *h){
+  Pixel neutral = maximum ? MIN_PIX : MAX_PIX;
+  TileView in, out = tileView(dst, width, t);
+  int l = s / 2, vertical = direction == VERTICAL;
+  int n = vertical ? t.rows : t.columns, lanes = vertical ? t.columns : t.rows;
+  int first = (vertical ? t.firstRow : t.firstColumn) - l, limit = vertical ? height : width;
+  int len = n + s - 1, i, j, k, p, pad, inside;
+
+  // the source view includes the halo, clipped to the image
+  t.firstRow -= vertical ? MIN(l, t.firstRow) : 0;
+  t.firstColumn -= vertical ? 0 : MIN(l, t.firstColumn);
+  in = tileView(src, width, t);
+  if( !vertical ){
+    pad = MAX(0, -first);
+    inside = MIN(first + len, limit) - MAX(first, 0);
+    // the rows are contiguous already, so they are filtered one at a time
+    for(k = 0; k < lanes; k++){
+      memset(h, neutral, len);
+      memcpy(h + pad, in.data + (size_t) k * in.stride, inside);
+      hgwBlocks(g, h, len, 1, s, maximum);
+      storeExtrema(out.data + (size_t) k * out.stride, h, g + s - 1, n, maximum, fold);
+    }
+    return;
+  }
+
+  for(j = 0; j < len; j++){
+    p = first + j;
+    if( p < 0 || p >= limit ) memset(&h[(size_t) j * lanes], neutral, lanes);
+    else memcpy(&h[(size_t) j * lanes], in.data + (size_t) (p - MAX(first, 0)) * in.stride, lanes);
+  }
+  hgwBlocks(g, h, len, lanes, s, maximum);
+  for(i = 0; i < n; i++)
+    storeExtrema(out.data + (size_t) i * out.stride, h + (size_t) i * lanes, g + (size_t) (i + s - 1) * lanes, lanes,
+                 maximum, fold);
+}
+
+/*
+ * Function:  takeTile
+ * --------------------
+ *  takes the next tile of a thread: the front of its own range, or else the
+ *  back half of the range of another thread, of which the rest becomes its
+ *  own range
+ *
+ *  queues: one queue per thread
+ *  self: the thread number
+ *  threads: the amount of threads
+ *  tile: receives the tile number
+ *
+ *  returns: 1 when a tile was taken, 0 when all of them are done
+ */
+
+static int takeTile(TileQueue *queues, int self, int threads, int *tile){
+  unsigned long long range = __atomic_load_n(&queues[self].range, __ATOMIC_ACQUIRE);
+  unsigned int begin, end, half;
+  int i, victim;
+  while( RANGE_BEGIN(range) < RANGE_END(range) ){
+    begin = RANGE_BEGIN(range);
+    if( __atomic_compare_exchange_n(&queues[self].range, &range, RANGE(begin + 1, RANGE_END(range)), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+      *tile = (int) begin;
+      return 1;
+    }
+  }
+  for(i = 1; i < threads; i++){
+    victim = (self + i) % threads;
+    range = __atomic_load_n(&queues[victim].range, __ATOMIC_ACQUIRE);
+    while( RANGE_BEGIN(range) < RANGE_END(range) ){
+      begin = RANGE_BEGIN(range);
+      end = RANGE_END(range);
+      half = (end - begin + 1) / 2;
+      if( __atomic_compare_exchange_n(&queues[victim].range, &range, RANGE(begin, end - half), 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+        // the own queue is empty, so no thief can be changing it
+        __atomic_store_n(&queues[self].range, RANGE(end - half + 1, end), __ATOMIC_RELEASE);
+        *tile = (int) (end - half);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Function:  tiledFilter
+ * --------------------
+ *  dilates or erodes every line of an image in one direction with a line
+ *  structuring element of size s, from src into dst, on the tiles of the
+ *  work-stealing pool. The result is the one of dilation and erosion in
+ *  image.c, which filter in place.
+ *
+ *  ctx: the context
+ *  src: the pixeldata of the source image, width * height pixels
+ *  dst: the pixeldata of the destination, not overlapping src
+ *  width: the width of the images
+ *  height: the height of the images
+ *  s: the size of the structuring element, odd
+ *  direction: HORIZONTAL or VERTICAL
+ *  maximum: 1 for the dilation, 0 for the erosion
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int tiledFilter(SedContext *ctx, Pixel *src, Pixel *dst, int width, int height, int s, int direction,
+                int maximum){
+  return tiledPlaneFilter(ctx, src, dst, width, height, 1, TILE_LANES, s, direction, maximum, 0);
+}
+
+/*
+ * Function:  tiledPlaneFilter
+ * --------------------
+ *  the pass of tiledFilter on planes images of the same size stored one
+ *  after the other, such as the slices of a volume (see volume.c). The tiles
+ *  of all planes share one work-stealing pool, so thin planes still keep
+ *  every thread busy. Lines never cross from one plane into the next.
+ *
+ *  ctx: the context
+ *  src: the pixeldata of the source planes, width * height * planes pixels
+ *  dst: the pixeldata of the destination, not overlapping src
+ *  width: the width of the planes
+ *  height: the height of the planes
+ *  planes: the amount of planes
+ *  lanes: the lines per tile, TILE_LANES for tiledFilter. Vertical tiles of
+ *    more lanes run longer vector loops, at the cost of more scratch.
+ *  s: the size of the structuring element, odd
+ *  direction: HORIZONTAL or VERTICAL
+ *  maximum: 1 for the dilation, 0 for the erosion
+ *  fold: 1 to take the maximum (minimum) of the result and dst instead of
+ *    overwriting dst
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int tiledPlaneFilter(SedContext *ctx, Pixel *src, Pixel *dst, int width, int height, int planes, int lanes, int s,
+                     int direction, int maximum, int fold){
+  int segment = MAX(TILE_LINE, 4 * s), vertical = direction == VERTICAL;
+  int tileRows = vertical ? segment : lanes, tileColumns = vertical ? lanes : segment;
+  int across = (width + tileColumns - 1) / tileColumns, down = (height + tileRows - 1) / tileRows;
+  int tiles, threads = ctx->threads, failed = 0, i;
+  size_t len = (size_t) segment + s - 1, plane = (size_t) width * height;
+  TileQueue *queues;
+
+  if( s < 1 || s % 2 == 0 || width <= 0 || height <= 0 || planes <= 0 || lanes <= 0 ) return SED_ERROR_ARGUMENT;
+  // the tile numbers are ints
+  if( (long long) across * down * planes > INT_MAX ) return SED_ERROR_ARGUMENT;
+  tiles = across * down * planes;
+  if( s == 1 && !fold ){
+    memcpy(dst, src, plane * planes);
+    return SED_OK;
+  }
+  queues = contextAlloc(ctx, (size_t) threads * sizeof(TileQueue));
+  if( queues == NULL ) return SED_ERROR_MEMORY;
+  for(i = 0; i < threads; i++)
+    queues[i].range = RANGE((long long) tiles * i / threads, (long long) tiles * (i + 1) / threads);
+
+  #pragma omp parallel num_threads(threads) default(none) shared(ctx, queues, src, dst, width, height, s, direction, maximum, fold, threads, across, down, tileRows, tileColumns, len, plane, lanes) reduction(||:failed)
+  {
+    TRACE_BEGIN(span);
+    int self = omp_get_thread_num(), index, p;
+    size_t pixels = 0;
+    Pixel *g = scratchBuffer(ctx, self, 2 * len * lanes);
+    Tile t;
+    failed = g == NULL;
+    while( !failed && takeTile(queues, self, threads, &index) ){
+      p = index / (across * down);
+      index %= across * down;
+      t.firstRow = index / across * tileRows;
+      t.firstColumn = index % across * tileColumns;
+      t.rows = MIN(tileRows, height - t.firstRow);
+      t.columns = MIN(tileColumns, width - t.firstColumn);
+      filterTile(src + p * plane, dst + p * plane, width, height, t, s, direction, maximum, fold, g, g + len * lanes);
+      pixels += (size_t) t.rows * t.columns;
+    }
+    if( maximum ){
+      TRACE_END(span, direction == HORIZONTAL ? "tiled dilation horizontal" : "tiled dilation vertical", pixels);
+    }else{
+      TRACE_END(span, direction == HORIZONTAL ? "tiled erosion horizontal" : "tiled erosion vertical", pixels);
+    }
+  }
+  contextFree(ctx, queues);
+  return failed ? SED_ERROR_MEMORY : SED_OK;
+}
+
+/*
+ * Function:  tiledDilation
+ * --------------------
+ *  the tiled counterpart of dilation, from src into dst
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int tiledDilation(SedContext *ctx, Pixel *src, Pixel *dst, int width, int height, int s, int direction){
+  return tiledFilter(ctx, src, dst, width, height, s, direction, 1);
+}
+
+/*
+ * Function:  tiledErosion
+ * --------------------
+ *  the tiled counterpart of erosion, from src into dst
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int tiledErosion(SedContext *ctx, Pixel *src, Pixel *dst, int width, int height, int s, int direction){
+  return tiledFilter(ctx, src, dst, width, height, s, direction, 0);
+}
+
+/*
+ * Function:  laneFilter
+ * --------------------
+ *  dilates or erodes the rows of lanes interleaved images with a horizontal
+ *  line of size s, from src into dst. Pixel (row, column) of image k is at
+ *  (row * width + column) * lanes + k, so the images are the lanes of
+ *  hgwBlocks and every step of the running extrema handles all of them. The
+ *  vertical passes need no counterpart: to tiledFilter the interleaved images
+ *  are one image of width * lanes columns.
+ *
+ *  ctx: the context
+ *  src: the interleaved source, width * height * lanes pixels
+ *  dst: the interleaved destination, not overlapping src
+ *  width: the width of the images
+ *  height: the height of the images
+ *  lanes: the amount of images
+ *  s: the size of the structuring element, odd
+ *  maximum: 1 for the dilation, 0 for the erosion
+ *
+ *  returns: SED_OK, SED_ERROR_ARGUMENT or SED_ERROR_MEMORY
+ */
+
+int laneFilter(SedContext *ctx, Pixel *src, Pixel *dst, int width, int height, int lanes, int s, int maximum){
+  size_t len = (size_t) width + s - 1, rowSize = (size_t) width * lanes;
+  Pixel neutral = maximum ? MIN_PIX : MAX_PIX;
+  int failed = 0, row;
+
+  if( s < 1 || s % 2 == 0 || width <= 0 || height <= 0 || lanes <= 0 ) return SED_ERROR_ARGUMENT;
+  if( s == 1 ){
+    memcpy(dst, src, rowSize * height);
+    return SED_OK;
+  }
+  #pragma omp parallel num_threads(ctx->threads) default(none) private(row) shared(ctx, src, dst, width, height, lanes, s, maximum, len, rowSize, neutral) reduction(||:failed)
+  {
+    TRACE_BEGIN(span);
+    Pixel *g = scratchBuffer(ctx, omp_get_thread_num(), 2 * len * lanes), *h = g + len * lanes, *out;
+    size_t pad = (size_t) (s / 2) * lanes, i, n = rowSize, pixels = 0;
+    failed = g == NULL;
+    #pragma omp for schedule(static)
+    for(row = 0; row < height; row++){
+      if( failed ) continue;
+      memset(h, neutral, pad);
+      memcpy(h + pad, src + (size_t) row * rowSize, rowSize);
+      memset(h + pad + rowSize, neutral, pad);
+      hgwBlocks(g, h, (int) len, lanes, s, maximum);
+      out = dst + (size_t) row * rowSize;
+      if( maximum ){
+        #pragma omp simd
+        for(i = 0; i < n; i++) out[i] = MAX(h[i], g[i + (size_t) (s - 1) * lanes]);
+      }else{
+        #pragma omp simd
+        for(i = 0; i < n; i++) out[i] = MIN(h[i], g[i + (size_t) (s - 1) * lanes]);
+      }
+      pixels += n;
+    }
+    TRACE_END(span, maximum ? "lane dilation" : "lane erosion", pixels);
+  }
+  return failed ? SED_ERROR_MEMORY : SED_OK;
+}
+
+/*
+ * Function:  horizontalRows
+ * --------------------
+ *  filters the columns [firstColumn, firstColumn + columns) of the rows
+ *  [rowLo, rowHi) of src with a horizontal line of w pixels
+ *
+ *  out: (rowHi - rowLo) * columns pixels
+ *  g: a buffer of columns + w - 1 pixels
+ *  h: as large as g
+ */
+
+static void horizontalRows(Pixel *src, int width, int rowLo, int rowHi, int firstColumn, int columns,
+                           int w, int maximum, Pixel *out, Pixel *g, Pixel *h){
+  Pixel neutral = maximum ? MIN_PIX : MAX_PIX;
+  int first = firstColumn - w / 2, len = columns + w - 1;
+  int pad = MAX(0, -first), inside = MIN(first + len, width) - MAX(first, 0), q, i;
+  Pixel *line;
+  for(q = rowLo; q < rowHi; q++){
+    memset(h, neutral, len);
+    memcpy(h + pad, src + (size_t) q * width + MAX(first, 0), inside);
+    hgwBlocks(g, h, len, 1, w, maximum);
+    line = out + (size_t) (q - rowLo) * columns;
+    if( maximum ){
+      #pragma omp simd
+      for(i = 0; i < columns; i++) line[i] = MAX(h[i], g[i + w - 1]);
+    }else{
+      #pragma omp simd
+      for(i = 0; i < columns; i++) line[i] = MIN(h[i], g[i + w - 1]);
+    }
+  }
+}
+
+/*
+ * Function:  verticalColumns
+ * --------------------
+ *  filters the columns [colLo, colHi) of the rows [firstRow, firstRow + rows)
+ *  of src with a vertical line of v pixels, all columns at once as the lanes
+ *  of hgwBlocks
+ *
+ *  out: rows * (colHi - colLo) pixels
+ *  g: a buffer of (rows + v - 1) * (colHi - colLo) pixels
+ *  h: as large as g
+ */
+
+static void verticalColumns(Pixel *src, int width, int height, int firstRow, int rows, int colLo, int colHi,
+                            int v, int maximum, Pixel *out, Pixel *g, Pixel *h){
+  Pixel neutral = maximum ? MIN_PIX : MAX_PIX;
+  int lanes = colHi - colLo, first = firstRow - v / 2, len = rows + v - 1, i, j, k, p;
+  for(j = 0; j < len; j++){
+    p = first + j;
+    if( p < 0 || p >= height ) memset(&h[(size_t) j * lanes], neutral, lanes);
+    else memcpy(&h[(size_t) j * lanes], src + (size_t) p * width + colLo, lanes);
+  }
+  hgwBlocks(g, h, len, lanes, v, maximum);
+  for(i = 0; i < rows; i++){
+    if( maximum ){
+      #pragma omp simd
+      for(k = 0; k < lanes; k++) out[(size_t) i * lanes + k] = MAX(h[(size_t) i * lanes + k], g[(size_t) (i + v - 1) * lanes + k]);
+    }else{
+      #pragma omp simd
+      for(k = 0; k < lanes; k++) out[(size_t) i * lanes + k] = MIN(h[(size_t) i * lanes + k], g[(size_t) (i + v - 1) * lanes + k]);
+    }
+  }
+}
+
+/*
+ * Function:  foldShifted
+ * --------------------
+ *  folds a shifted window into a tile: acc(row, col) becomes the minimum
+ *  (maximum) of itself and in(row + dy, col + dx), for the positions where
+ *  that lies in the window, like combineShifted in image.c
+ *
+ *  acc: the pixeldata of the accumulated image
+ *  width: the width of the image
+ *  t: the tile of acc
+ *  in: the window, its pixel (rowLo, colLo) first
+ *  stride: the distance between two rows of the window
+ *  rowLo, rowHi, colLo, colHi: the rows and columns of the window
+ *  dy, dx: the shift
+ *  maximum: 1 to take the maximum, 0 to take the minimum
+ */
+
+static void foldShifted(Pixel *acc, int width, Tile t, Pixel *in, size_t stride, int rowLo, int rowHi,
+                        int colLo, int colHi, int dy, int dx, int maximum){
+  int first = MAX(t.firstColumn, colLo - dx), last = MIN(t.firstColumn + t.columns, colHi - dx);
+  int row, col;
+  Pixel *a, *b;
+  for(row = MAX(t.firstRow, rowLo - dy); row < MIN(t.firstRow + t.rows, rowHi - dy); row++){
+    a = acc + (size_t) row * width;
+    b = in + (size_t) (row + dy - rowLo) * stride + dx - colLo;
+    if( maximum ){
+      #pragma omp simd
+      for(col = first; col < last; col++) a[col] = MAX(a[col], b[col]);
+    }else{
+      #pragma omp simd
+      for(col = first; col < last; col++) a[col] = MIN(a[col], b[col]);
+    }
+  }
+}
+
+/*
+ * Function:  layerTileScratch
+ * --------------------
+ *  returns: the bytes of scratch layerTile needs for tiles of at most size x
+ *  size pixels and the layers of a decomposition
+ */
+
+size_t layerTileScratch(int size, Partition *parts, int count){
+  int w = 1, v = 1, k;
+  for(k = 0; k < count; k++){
+    w = MAX(w, parts[k].cubicFactor.width);
+    v = MAX(v, parts[k].cubicFactor.height);
+  }
+  return (size_t) 4 * size * size + 2 * ((size_t) size + w - 1)
+         + (size_t) 4 * (size + v - 1) * 2 * size;
+}
+
+/*
+ * Function:  layerTile
+ * --------------------
+ *  folds one layer of a decomposition (see partitionMorphology in image.c)
+ *  into one tile: the horizontal line filtered rows shifted by the top and
+ *  bottom offsets, the vertical line filtered columns shifted by the left and
+ *  right offsets. Only the rows and columns the tile needs are filtered, the
+ *  two shifts share them when they overlap, so the tile stays in the cache
+ *  for all of it. The filters read src around the tile, only the tile of acc
+ *  is written.
+ *
+ *  src: the pixeldata of the source image
+ *  acc: the pixeldata of the accumulated image, not overlapping src
+ *  width: the width of the images
+ *  height: the height of the images
+ *  t: the tile, at most size x size pixels for the size given to
+ *    layerTileScratch
+ *  p: the layer
+ *  maximum: 1 for the dilation, 0 for the erosion
+ *  scratch: layerTileScratch bytes
+ */
+
+void layerTile(Pixel *src, Pixel *acc, int width, int height, Tile t, Partition *p, int maximum,
+               Pixel *scratch){
+  int sign = maximum ? -1 : 1, size = MAX(t.rows, t.columns), d, lo, hi, lo2, hi2;
+  int w = p->cubicFactor.width, v = p->cubicFactor.height;
+  int dy[2] = {-sign * p->sparseFactor.topOffset, sign * p->sparseFactor.bottomOffset};
+  int dx[2] = {-sign * p->sparseFactor.leftOffset, sign * p->sparseFactor.rightOffset};
+  Pixel *window = scratch, *g = scratch + (size_t) 4 * size * size;
+  Pixel *h = g + (size_t) 4 * (size + v - 1) * size;
+
+  for(d = 0; d < 2; d++){
+    if( w <= 1 ){
+      foldShifted(acc, width, t, src + t.firstColumn, width, 0, height, t.firstColumn,
+                  t.firstColumn + t.columns, dy[d], 0, maximum);
+      continue;
+    }
+    // one window for both shifts when they overlap, else one per shift
+    lo = t.firstRow + (MAX(dy[0], dy[1]) - MIN(dy[0], dy[1]) < t.rows ? MIN(dy[0], dy[1]) : dy[d]);
+    hi = t.firstRow + t.rows + (MAX(dy[0], dy[1]) - MIN(dy[0], dy[1]) < t.rows ? MAX(dy[0], dy[1]) : dy[d]);
+    lo = MAX(lo, 0);
+    hi = MIN(hi, height);
+    if( lo >= hi ) continue;
+    if( d == 0 || MAX(dy[0], dy[1]) - MIN(dy[0], dy[1]) >= t.rows )
+      horizontalRows(src, width, lo, hi, t.firstColumn, t.columns, w, maximum, window, g, h);
+    foldShifted(acc, width, t, window, t.columns, lo, hi, t.firstColumn, t.firstColumn + t.columns,
+                dy[d], 0, maximum);
+  }
+
+  for(d = 0; d < 2; d++){
+    if( v <= 1 ){
+      foldShifted(acc, width, t, src + (size_t) t.firstRow * width, width, t.firstRow, t.firstRow + t.rows,
+                  0, width, 0, dx[d], maximum);
+      continue;
+    }
+    lo2 = t.firstColumn + (MAX(dx[0], dx[1]) - MIN(dx[0], dx[1]) < t.columns ? MIN(dx[0], dx[1]) : dx[d]);
+    hi2 = t.firstColumn + t.columns + (MAX(dx[0], dx[1]) - MIN(dx[0], dx[1]) < t.columns ? MAX(dx[0], dx[1]) : dx[d]);
+    lo2 = MAX(lo2, 0);
+    hi2 = MIN(hi2, width);
+    if( lo2 >= hi2 ) continue;
+    if( d == 0 || MAX(dx[0], dx[1]) - MIN(dx[0], dx[1]) >= t.columns )
+      verticalColumns(src, width, height, t.firstRow, t.rows, lo2, hi2, v, maximum, window, g, h);
+    foldShifted(acc, width, t, window, hi2 - lo2, t.firstRow, t.firstRow + t.rows, lo2, hi2, 0, dx[d], maximum);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef TILE
+#define TILE
+
+#include <stddef.h>
+#include "image.h"
+
+#define TILE_LINE 256       /* pixels along the filtered direction */
+#define TILE_LANES 64       /* parallel lines per tile */
+
+typedef struct Tile {
+  int firstRow, rows, firstColumn, columns;
+} Tile;
+
+/*
+ * A rectangle of an image: the pixel (row, column) of the view is
+ * data[row * stride + column].
+ */
+typedef struct TileView {
+  Pixel *data;
+  int rows;
+  int columns;
+  size_t stride;
+} TileView;
+
+/*
+ * A queue of the work-stealing pool: the owner takes tiles from the front of
+ * its range, thieves take the back half. Both ends share one word, so either
+ * side claims tiles with a single compare and swap.
+ */
+typedef struct TileQueue {
+  unsigned long long range;          /* begin in the low, end in the high half */
+  char padding[56];                  /* one queue per cache line */
+} TileQueue;
+
+int tiledFilter(struct SedContext*, Pixel*, Pixel*, int, int, int, int, int);
+int tiledPlaneFilter(struct SedContext*, Pixel*, Pixel*, int, int, int, int, int, int, int, int);
+int tiledDilation(struct SedContext*, Pixel*, Pixel*, int, int, int, int);
+int tiledErosion(struct SedContext*, Pixel*, Pixel*, int, int, int, int);
+int laneFilter(struct SedContext*, Pixel*, Pixel*, int, int, int, int, int);
+size_t layerTileScratch(int, Partition*, int);
+void layerTile(Pixel*, Pixel*, int, int, Tile, Partition*, int, Pixel*);
+#endif
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_MAX_STAGES 64
+
+/*
+ * The trace is process wide, unlike everything else in the library: the
+ * buffers of all threads form a list that is only ever prepended to (with a
+ * compare and swap), and each thread finds its own buffer through a thread
+ * local pointer. The buffers live until the process exits.
+ */
+static TraceBuffer *buffers;
+static int threadCount;
+static int enabled;
+static int counting;
+static _Thread_local TraceBuffer *localBuffer;
+
+typedef struct TraceStage {
+  const char *name;
+  unsigned long count;
+  double total;
+  double *perThread;
+  size_t pixels;
+  unsigned long long counters[COUNTER_COUNT];
+  unsigned int measured; // bit i: counter i was read on some thread
+} TraceStage;
+
+/*
+ * Function:  traceAvailable
+ * --------------------
+ *  returns: 1 when the library was built with SED_TRACE, 0 when the spans
+ *  are compiled out
+ */
+
+int traceAvailable(void){
+#ifdef SED_TRACE
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Function:  traceEnable
+ * --------------------
+ *  starts or stops keeping spans
+ *
+ *  on: 1 to start, 0 to stop
+ */
+
+void traceEnable(int on){
+  __atomic_store_n(&enabled, on, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function:  traceReset
+ * --------------------
+ *  forgets all recorded spans, no thread may be recording at the same time
+ */
+
+void traceReset(void){
+  TraceBuffer *b;
+  for(b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next){
+    b->count = 0;
+    b->dropped = 0;
+  }
+}
+
+/*
+ * Function:  traceClock
+ * --------------------
+ *  returns: the monotonic clock in nanoseconds
+ */
+
+unsigned long long traceClock(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Function:  threadBuffer
+ * --------------------
+ *  returns: the buffer of the calling thread, created and added to the list
+ *  on first use, or NULL when out of memory
+ */
+
+static TraceBuffer *threadBuffer(void){
+  TraceBuffer *b = localBuffer;
+  if( b != NULL ) return b;
+  b = malloc(sizeof(TraceBuffer));
+  if( b == NULL ) return NULL;
+  b->count = 0;
+  b->dropped = 0;
+  b->counting = 0;
+  b->thread = __atomic_fetch_add(&threadCount, 1, __ATOMIC_RELAXED);
+  b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+  while( !__atomic_compare_exchange_n(&buffers, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+  localBuffer = b;
+  return b;
+}
+
+/*
+ * Function:  traceEnableCounters
+ * --------------------
+ *  starts or stops reading the hardware counters around every span. Each
+ *  thread opens its counters at its first span, they stay open for the life
+ *  of the thread.
+ *
+ *  on: 1 to start, 0 to stop
+ *
+ *  returns: the amount of counters that could be opened on the calling thread,
+ *  counterError() tells why the others are missing
+ */
+
+int traceEnableCounters(int on){
+  TraceBuffer *b;
+  __atomic_store_n(&counting, on, __ATOMIC_RELAXED);
+  if( !on || (b = threadBuffer()) == NULL ) return 0;
+  if( !b->counting ){
+    openCounters(&b->counterSet);
+    b->counting = 1;
+  }
+  return b->counterSet.available;
+}
+
+/*
+ * Function:  countingBuffer
+ * --------------------
+ *  returns: the buffer of the calling thread when its counters are to be
+ *  read, with the counters opened on first use, otherwise NULL
+ */
+
+static TraceBuffer *countingBuffer(void){
+  TraceBuffer *b;
+  if( !__atomic_load_n(&counting, __ATOMIC_RELAXED) || (b = threadBuffer()) == NULL ) return NULL;
+  if( !b->counting ){
+    openCounters(&b->counterSet);
+    b->counting = 1;
+  }
+  return b->counterSet.available > 0 ? b : NULL;
+}
+
+/*
+ * Function:  traceBegin
+ * --------------------
+ *  starts a span on the calling thread
+ *
+ *  span: the span, lives on the stack of the caller
+ */
+
+void traceBegin(TraceSpan *span){
+  TraceBuffer *b;
+  span->begin = 0;
+  if( !__atomic_load_n(&enabled, __ATOMIC_RELAXED) ) return;
+  b = countingBuffer();
+  if( b != NULL ) readCounters(&b->counterSet, span->counters);
+  span->begin = traceClock();
+}
+
+/*
+ * Function:  traceEnd
+ * --------------------
+ *  appends a span that ends now to the buffer of the calling thread. Spans
+ *  that do not fit any more are counted as dropped.
+ *
+ *  span: the span started by traceBegin
+ *  name: the name of the stage
+ *  pixels: the amount of pixels the span processed
+ */
+
+void traceEnd(TraceSpan *span, const char *name, size_t pixels){
+  unsigned long long end = traceClock(), now[COUNTER_COUNT];
+  TraceBuffer *b, *counted;
+  TraceEvent *e;
+  int i;
+  if( span->begin == 0 || !__atomic_load_n(&enabled, __ATOMIC_RELAXED) ) return;
+  counted = countingBuffer();
+  if( counted != NULL ) readCounters(&counted->counterSet, now);
+  b = threadBuffer();
+  if( b == NULL ) return;
+  if( b->count == TRACE_CAPACITY ){
+    b->dropped++;
+    return;
+  }
+  e = &b->events[b->count];
+  e->name = name;
+  e->begin = span->begin;
+  e->end = end;
+  e->pixels = pixels;
+  for(i = 0; i < COUNTER_COUNT; i++)
+    e->counters[i] = counted != NULL && counted->counterSet.fds[i] >= 0 ? now[i] - span->counters[i] : 0;
+  __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned long long firstTimestamp(void){
+  unsigned long long first = 0;
+  TraceBuffer *b;
+  int i;
+  for(b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+    for(i = 0; i < b->count; i++)
+      if( first == 0 || b->events[i].begin < first ) first = b->events[i].begin;
+  return first;
+}
+
+/*
+ * Function:  traceWriteChrome
+ * --------------------
+ *  writes all spans in the Chrome trace event format (complete events with
+ *  microsecond timestamps), which chrome://tracing and ui.perfetto.dev open
+ *
+ *  name: the name of the JSON file
+ *
+ *  returns: 1 on success, 0 when the file cannot be written
+ */
+
+int traceWriteChrome(char *name){
+  FILE *f = fopen(name, "w");
+  unsigned long long first = firstTimestamp();
+  const char *separator = "\n";
+  TraceBuffer *b;
+  TraceEvent *e;
+  int i, k;
+  if( f == NULL ) return 0;
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for(b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next){
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            separator, b->thread, b->thread);
+    separator = ",\n";
+    for(i = 0; i < b->count; i++){
+      e = &b->events[i];
+      fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                 "\"args\": {\"pixels\": %lu",
+              e->name, b->thread, (e->begin - first) / 1e3, (e->end - e->begin) / 1e3, (unsigned long) e->pixels);
+      for(k = 0; k < COUNTER_COUNT; k++)
+        if( b->counting && b->counterSet.fds[k] >= 0 ) fprintf(f, ", \"%s\": %llu", counterNames[k], e->counters[k]);
+      fprintf(f, "}}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+/*
+ * Function:  printCounterTable
+ * --------------------
+ *  prints the instructions per cycle and the per pixel counts of every stage,
+ *  n/a for counters that were not read or stages without pixels
+ */
+
+static void printCounterTable(FILE *out, TraceStage *stages, int count){
+  int k, j;
+  double pixels;
+  fprintf(out, "\n%-24s %8s %12s", "stage", "IPC", "cycles/px");
+  for(j = COUNTER_LLC_MISSES; j < COUNTER_COUNT; j++) fprintf(out, " %16s", counterNames[j]);
+  fprintf(out, "\n");
+  for(k = 0; k < count; k++){
+    pixels = (double) stages[k].pixels;
+    fprintf(out, "%-24s", stages[k].name);
+    if( (stages[k].measured & 3u) == 3u && stages[k].counters[COUNTER_CYCLES] > 0 )
+      fprintf(out, " %8.2f", (double) stages[k].counters[COUNTER_INSTRUCTIONS] / stages[k].counters[COUNTER_CYCLES]);
+    else
+      fprintf(out, " %8s", "n/a");
+    if( (stages[k].measured & 1u) && pixels > 0 )
+      fprintf(out, " %12.3f", stages[k].counters[COUNTER_CYCLES] / pixels);
+    else
+      fprintf(out, " %12s", "n/a");
+    for(j = COUNTER_LLC_MISSES; j < COUNTER_COUNT; j++){
+      if( (stages[k].measured & (1u << j)) && pixels > 0 )
+        fprintf(out, " %12.5f/px", stages[k].counters[j] / pixels);
+      else
+        fprintf(out, " %16s", "n/a");
+    }
+    fprintf(out, "\n");
+  }
+}
+
+/*
+ * Function:  tracePrintSummary
+ * --------------------
+ *  prints per stage the amount of spans, the total time over all threads, the
+ *  time of the busiest thread and the imbalance: the busiest thread divided by
+ *  the mean over the threads that ran the stage (1.00 is perfectly balanced).
+ *  When counters were read, a second table gives per stage the instructions
+ *  per cycle and the cycles and misses per pixel.
+ *
+ *  out: the stream to print to
+ */
+
+void tracePrintSummary(FILE *out){
+  TraceStage stages[TRACE_MAX_STAGES];
+  int stageCount = 0, threads = 0, i, k, active;
+  unsigned long dropped = 0;
+  unsigned int measured = 0;
+  double busiest, duration;
+  TraceBuffer *first = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE), *b;
+  TraceEvent *e;
+  int j;
+
+  // size the per thread times by the ids of the buffers that are read, not by
+  // threadCount, which grows when another thread starts tracing meanwhile
+  for(b = first; b != NULL; b = b->next)
+    if( b->thread >= threads ) threads = b->thread + 1;
+  for(b = first; b != NULL; b = b->next){
+    dropped += b->dropped;
+    for(i = 0; i < b->count; i++){
+      e = &b->events[i];
+      for(k = 0; k < stageCount && strcmp(stages[k].name, e->name) != 0; k++);
+      if( k == stageCount ){
+        if( stageCount == TRACE_MAX_STAGES ) continue;
+        stages[k].name = e->name;
+        stages[k].count = 0;
+        stages[k].total = 0;
+        stages[k].pixels = 0;
+        stages[k].measured = 0;
+        memset(stages[k].counters, 0, sizeof(stages[k].counters));
+        stages[k].perThread = calloc(threads, sizeof(double));
+        if( stages[k].perThread == NULL ) continue;
+        stageCount++;
+      }
+      duration = (e->end - e->begin) / 1e6;
+      stages[k].count++;
+      stages[k].total += duration;
+      stages[k].perThread[b->thread] += duration;
+      stages[k].pixels += e->pixels;
+      for(j = 0; b->counting && j < COUNTER_COUNT; j++){
+        if( b->counterSet.fds[j] < 0 ) continue;
+        stages[k].counters[j] += e->counters[j];
+        stages[k].measured |= 1u << j;
+      }
+      measured |= stages[k].measured;
+    }
+  }
+
+  fprintf(out, "%-24s %8s %12s %12s %8s %10s\n", "stage", "spans", "total ms", "busiest ms", "threads", "imbalance");
+  for(k = 0; k < stageCount; k++){
+    busiest = 0;
+    active = 0;
+    for(i = 0; i < threads; i++){
+      if( stages[k].perThread[i] > 0 ) active++;
+      if( stages[k].perThread[i] > busiest ) busiest = stages[k].perThread[i];
+    }
+    fprintf(out, "%-24s %8lu %12.3f %12.3f %8d %10.2f\n", stages[k].name, stages[k].count, stages[k].total,
+            busiest, active, active > 0 && stages[k].total > 0 ? busiest / (stages[k].total / active) : 0);
+  }
+  if( measured ) printCounterTable(out, stages, stageCount);
+  for(k = 0; k < stageCount; k++)
+    free(stages[k].perThread);
+  if( dropped > 0 ) fprintf(out, "%lu spans were dropped, the per thread buffers hold %d\n", dropped, TRACE_CAPACITY);
+}
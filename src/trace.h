@@ -0,0 +1,65 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdio.h>
+#include <stddef.h>
+#include "counters.h"
+
+#define TRACE_CAPACITY 16384
+
+/*
+ * Span tracing of the hot paths. Every thread appends completed spans to its
+ * own buffer, so recording takes no locks. Builds without SED_TRACE (the
+ * default, make TRACE=1 defines it) compile TRACE_BEGIN and TRACE_END to
+ * nothing. With it, spans are only kept after traceEnable(1), and after
+ * traceEnableCounters(1) every span also carries the hardware counter deltas
+ * of its thread (see counters.c).
+ *
+ *   TRACE_BEGIN(span);
+ *   ...
+ *   TRACE_END(span, "erosion horizontal", pixels);
+ *
+ * The name has to be a string literal, or otherwise outlive the trace. pixels
+ * is the amount of pixels the span processed, for the per pixel counts.
+ */
+#ifdef SED_TRACE
+#define TRACE_BEGIN(span) TraceSpan span; traceBegin(&span)
+#define TRACE_END(span, name, pixels) traceEnd(&span, name, pixels)
+#else
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name, pixels) (void) (pixels)
+#endif
+
+typedef struct TraceSpan {
+  unsigned long long begin;
+  unsigned long long counters[COUNTER_COUNT];
+} TraceSpan;
+
+typedef struct TraceEvent {
+  const char *name;
+  unsigned long long begin;
+  unsigned long long end;
+  size_t pixels;
+  unsigned long long counters[COUNTER_COUNT];
+} TraceEvent;
+
+typedef struct TraceBuffer {
+  TraceEvent events[TRACE_CAPACITY];
+  int count;
+  int thread;
+  unsigned long dropped;
+  int counting;
+  CounterSet counterSet;
+  struct TraceBuffer *next;
+} TraceBuffer;
+
+int traceAvailable(void);
+void traceEnable(int);
+void traceReset(void);
+unsigned long long traceClock(void);
+int traceEnableCounters(int);
+void traceBegin(TraceSpan*);
+void traceEnd(TraceSpan*, const char*, size_t);
+int traceWriteChrome(char*);
+void tracePrintSummary(FILE*);
+#endif
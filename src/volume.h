@@ -0,0 +1,46 @@
+#ifndef VOLUME
+#define VOLUME
+
+#include <stddef.h>
+#include "image.h"
+
+/*
+ * A stack of depth single channel slices of width x height voxels, voxel
+ * (slice, row, column) at data[(slice * height + row) * width + column].
+ */
+typedef struct Volume {
+  int width;
+  int height;
+  int depth;
+  Pixel *data;
+} Volume;
+
+/* a box of width x height x depth voxels around the origin, all three odd */
+typedef struct CuboidFactor {
+  int width;
+  int height;
+  int depth;
+} CuboidFactor;
+
+/* the ball of a radius as the union of its maximal cuboids, see volume.c */
+typedef struct BallPlan {
+  CuboidFactor *cuboids;
+  int count;
+} BallPlan;
+
+struct SedContext;
+
+int volumeSize(int, int, int, size_t*);
+int parseVolumeSize(char*, int*, int*, int*);
+Volume *createVolume(Pixel*, int, int, int);
+void freeVolume(struct SedContext*, Volume*);
+int readRawVolume(struct SedContext*, char*, int, int, int, Volume**);
+int writeRawVolume(struct SedContext*, Volume*, char*);
+Volume *computeBinaryBallSE(struct SedContext*, int);
+int decomposeBall(struct SedContext*, int, BallPlan*);
+void freeBallPlan(BallPlan*);
+int ballErosion(struct SedContext*, Volume*, int);
+int ballDilation(struct SedContext*, Volume*, int);
+int ballOpening(struct SedContext*, Volume*, int);
+int ballClosing(struct SedContext*, Volume*, int);
+#endif